@@ -3,6 +3,10 @@
 #include"../Packet/PacketHook.h"
 #include"../Packet/PacketLogging.h"
 #include"../Packet/PacketQueue.h"
+#include"../Packet/PacketSender.h"
+#include"../Packet/PacketSubscribers.h"
+#include"../Packet/PacketCapture.h"
+#include"../Packet/PacketRecorder.h"
 #include"PacketDefs.h"
 
 
@@ -66,6 +70,88 @@ bool LoadPacketConfig(HINSTANCE hinstDLL) {
 	} else {
 		g_TCPPort = 8275;  // Default
 	}
+
+	// Global injection ceiling in packets per second (default: unlimited)
+	std::wstring wInjectMaxPps, wInjectBurst;
+	if (conf.Read(DLL_NAME, L"INJECT_MAX_PPS", wInjectMaxPps) && _wtoi(wInjectMaxPps.c_str()) > 0) {
+		DWORD burst = 0;
+		if (conf.Read(DLL_NAME, L"INJECT_BURST", wInjectBurst)) {
+			burst = _wtoi(wInjectBurst.c_str());
+		}
+		SetGlobalInjectionRate(_wtoi(wInjectMaxPps.c_str()), burst);
+	}
+	// Per-client capture ring (messages) and how long a client may overflow it before being disconnected
+	std::wstring wRingSize, wMaxLag;
+	DWORD ring_size = DEFAULT_SUBSCRIBER_RING_SIZE, max_lag_ms = DEFAULT_SUBSCRIBER_MAX_LAG_MS;
+	if (conf.Read(DLL_NAME, L"SUBSCRIBER_RING_SIZE", wRingSize)) {
+		ring_size = _wtoi(wRingSize.c_str());
+	}
+	if (conf.Read(DLL_NAME, L"SUBSCRIBER_MAX_LAG_MS", wMaxLag)) {
+		max_lag_ms = _wtoi(wMaxLag.c_str());
+	}
+	SetSubscriberLimits(ring_size, max_lag_ms);
+	// Overflow files of lossless (FLOW_CONTROL_SPILL) clients
+	std::wstring wSpillDir, wSpillMB;
+	conf.Read(DLL_NAME, L"SUBSCRIBER_SPILL_DIR", wSpillDir);
+	if (conf.Read(DLL_NAME, L"SUBSCRIBER_SPILL_MB", wSpillMB) || !wSpillDir.empty()) {
+		SetSubscriberSpill(wSpillDir, _wtoi(wSpillMB.c_str()));
+	}
+	// Capture stream kept in memory for clients resuming after a disconnect
+	std::wstring wStreamRetainMB;
+	if (conf.Read(DLL_NAME, L"STREAM_RETAIN_MB", wStreamRetainMB)) {
+		SetStreamRetention(_wtoi(wStreamRetainMB.c_str()));
+	}
+	// Recording of every captured message into rotating segment files (off without CAPTURE_DIR)
+	std::wstring wCaptureDir, wCaptureSegmentMB, wCaptureMaxSegments, wCaptureFlushMs, wCaptureTraces;
+	if (conf.Read(DLL_NAME, L"CAPTURE_DIR", wCaptureDir) && !wCaptureDir.empty()) {
+		DWORD segment_mb = DEFAULT_CAPTURE_SEGMENT_MB, max_segments = DEFAULT_CAPTURE_MAX_SEGMENTS, flush_ms = DEFAULT_CAPTURE_FLUSH_MS;
+		bool traces = true;
+		if (conf.Read(DLL_NAME, L"CAPTURE_SEGMENT_MB", wCaptureSegmentMB)) {
+			segment_mb = _wtoi(wCaptureSegmentMB.c_str());
+		}
+		if (conf.Read(DLL_NAME, L"CAPTURE_MAX_SEGMENTS", wCaptureMaxSegments)) {
+			max_segments = _wtoi(wCaptureMaxSegments.c_str());
+		}
+		if (conf.Read(DLL_NAME, L"CAPTURE_FLUSH_MS", wCaptureFlushMs)) {
+			flush_ms = _wtoi(wCaptureFlushMs.c_str());
+		}
+		if (conf.Read(DLL_NAME, L"CAPTURE_TRACES", wCaptureTraces)) {
+			traces = _wtoi(wCaptureTraces.c_str()) != 0;
+		}
+		SetCaptureConfig(wCaptureDir, segment_mb, max_segments, flush_ms, traces);
+	}
+
+	// Flight recorder: the last RECORDER_MB of captured messages in memory, dumped on a trigger (off without RECORDER_MB)
+	std::wstring wRecorderMB, wRecorderSeconds, wRecorderPostSeconds, wRecorderDir, wRecorderTraces, wRecorderCrashDump;
+	std::wstring wRecorderTriggerSend, wRecorderTriggerRecv, wRecorderTriggerPattern;
+	if (conf.Read(DLL_NAME, L"RECORDER_MB", wRecorderMB) && _wtoi(wRecorderMB.c_str()) > 0) {
+		DWORD seconds = DEFAULT_RECORDER_SECONDS, post_seconds = DEFAULT_RECORDER_POST_SECONDS;
+		bool traces = true, crash_dump = true;
+		if (conf.Read(DLL_NAME, L"RECORDER_SECONDS", wRecorderSeconds)) {
+			seconds = _wtoi(wRecorderSeconds.c_str());
+		}
+		if (conf.Read(DLL_NAME, L"RECORDER_POST_SECONDS", wRecorderPostSeconds)) {
+			post_seconds = _wtoi(wRecorderPostSeconds.c_str());
+		}
+		if (!conf.Read(DLL_NAME, L"RECORDER_DIR", wRecorderDir) || wRecorderDir.empty()) {
+			// Next to Packet.dll
+			WCHAR module_path[MAX_PATH] = {};
+			GetModuleFileNameW(hinstDLL, module_path, MAX_PATH);
+			wRecorderDir = module_path;
+			wRecorderDir = wRecorderDir.substr(0, wRecorderDir.find_last_of(L"\\/") + 1) + L"flight";
+		}
+		if (conf.Read(DLL_NAME, L"RECORDER_TRACES", wRecorderTraces)) {
+			traces = _wtoi(wRecorderTraces.c_str()) != 0;
+		}
+		if (conf.Read(DLL_NAME, L"RECORDER_CRASH_DUMP", wRecorderCrashDump)) {
+			crash_dump = _wtoi(wRecorderCrashDump.c_str()) != 0;
+		}
+		conf.Read(DLL_NAME, L"RECORDER_TRIGGER_SEND", wRecorderTriggerSend);
+		conf.Read(DLL_NAME, L"RECORDER_TRIGGER_RECV", wRecorderTriggerRecv);
+		conf.Read(DLL_NAME, L"RECORDER_TRIGGER_PATTERN", wRecorderTriggerPattern);
+		SetRecorderConfig(_wtoi(wRecorderMB.c_str()), seconds, post_seconds, wRecorderDir, traces, crash_dump);
+		SetRecorderTriggers(wRecorderTriggerSend, wRecorderTriggerRecv, wRecorderTriggerPattern);
+	}
 	// high version mode (CInPacket), TODO
 	std::wstring wHighVersionMode;
 	if (conf.Read(DLL_NAME, L"HIGH_VERSION_MODE", wHighVersionMode) && _wtoi(wHighVersionMode.c_str())) {
@@ -166,6 +252,10 @@ bool RunPacketLogger(HookSettings &hs) {
 bool PacketLoggerStartup(HookSettings &hs) {
 	target_pid = GetCurrentProcessId();
 
+	// Recording starts before the worker so nothing captured is missed
+	StartCaptureWriter();
+	StartFlightRecorder();
+
 	// Initialize async packet queue system
 	if (!InitializePacketQueue()) {
 		return false;
@@ -234,6 +324,8 @@ BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved) {
 		DEBUGLOG(L"========== DLL PROCESS DETACH ==========");
 		// Clean shutdown of async queue
 		ShutdownPacketQueue();
+		StopCaptureWriter();
+		StopFlightRecorder();
 	}
 	return TRUE;
 }
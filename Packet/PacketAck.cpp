@@ -0,0 +1,163 @@
+﻿// PacketAck.cpp - Injection acknowledgements and latency histograms
+// Must include SimpleTCP.h BEFORE Windows.h
+
+#include"../Share/Simple/SimpleTCP.h"
+#include"../Share/Simple/DebugLog.h"
+#include"PacketAck.h"
+#include <map>
+#include <set>
+#include <vector>
+
+struct PendingAck {
+	DWORD client_id;
+	InjectAckMessage ack;
+};
+
+// Acks waiting for the writer thread and clients that want them (guarded by ack_pending_cs)
+std::vector<PendingAck> pending_acks;
+std::set<DWORD> ack_enabled_clients;
+InjectStatsMessage inject_stats;
+CRITICAL_SECTION ack_pending_cs;
+
+// Connections acks are written to (guarded by ack_clients_cs, held while sending)
+std::map<DWORD, TCPServerThread *> ack_clients;
+CRITICAL_SECTION ack_clients_cs;
+
+HANDLE ack_event = NULL;
+HANDLE ack_thread = NULL;
+LARGE_INTEGER qpc_frequency;
+
+// Called from StartTCPClient before any client can connect, later calls are no-ops
+void InitPacketAcks() {
+	static bool initialized = false;
+	if (!initialized) {
+		InitializeCriticalSection(&ack_pending_cs);
+		InitializeCriticalSection(&ack_clients_cs);
+		QueryPerformanceFrequency(&qpc_frequency);
+		memset(&inject_stats, 0, sizeof(inject_stats));
+		inject_stats.header = INJECT_STATS;
+		initialized = true;
+	}
+}
+
+ULONGLONG GetInjectTimeUs() {
+	InitPacketAcks();
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return (ULONGLONG)(counter.QuadPart / qpc_frequency.QuadPart) * 1000000 +
+		(ULONGLONG)(counter.QuadPart % qpc_frequency.QuadPart) * 1000000 / qpc_frequency.QuadPart;
+}
+
+DWORD LatencyBucket(ULONGLONG from_us, ULONGLONG to_us) {
+	ULONGLONG value = (to_us > from_us) ? to_us - from_us : 0;
+	DWORD bucket = 0;
+	while (value > 1 && bucket < INJECT_LATENCY_BUCKETS - 1) {
+		value >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+// Sends queued acks so the main thread never touches a socket
+DWORD WINAPI AckWriterThread(LPVOID) {
+	std::vector<PendingAck> batch;
+	while (WaitForSingleObject(ack_event, INFINITE) == WAIT_OBJECT_0) {
+		EnterCriticalSection(&ack_pending_cs);
+		batch.swap(pending_acks);
+		LeaveCriticalSection(&ack_pending_cs);
+
+		EnterCriticalSection(&ack_clients_cs);
+		for (auto &pending : batch) {
+			auto client_it = ack_clients.find(pending.client_id);
+			if (client_it != ack_clients.end()) {
+				client_it->second->Send((BYTE *)&pending.ack, sizeof(pending.ack));
+			}
+		}
+		LeaveCriticalSection(&ack_clients_cs);
+
+		batch.clear();
+	}
+	return 0;
+}
+
+void RegisterAckClient(DWORD client_id, TCPServerThread *client) {
+	InitPacketAcks();
+	EnterCriticalSection(&ack_clients_cs);
+	ack_clients[client_id] = client;
+	LeaveCriticalSection(&ack_clients_cs);
+}
+
+void UnregisterAckClient(DWORD client_id) {
+	InitPacketAcks();
+	EnterCriticalSection(&ack_pending_cs);
+	ack_enabled_clients.erase(client_id);
+	LeaveCriticalSection(&ack_pending_cs);
+
+	// Waits for an ack being written to this client
+	EnterCriticalSection(&ack_clients_cs);
+	ack_clients.erase(client_id);
+	LeaveCriticalSection(&ack_clients_cs);
+}
+
+void SetAcksEnabled(DWORD client_id, bool enabled) {
+	InitPacketAcks();
+	EnterCriticalSection(&ack_pending_cs);
+	if (enabled && !ack_thread) {
+		ack_event = CreateEventW(NULL, FALSE, FALSE, NULL);
+		ack_thread = CreateThread(NULL, 0, AckWriterThread, NULL, 0, NULL);
+		if (!ack_thread) {
+			LeaveCriticalSection(&ack_pending_cs);
+			DEBUGLOG(L"[ACK] ERROR: Failed to start ack writer thread");
+			return;
+		}
+	}
+	if (enabled) {
+		ack_enabled_clients.insert(client_id);
+	} else {
+		ack_enabled_clients.erase(client_id);
+	}
+	LeaveCriticalSection(&ack_pending_cs);
+
+	DEBUGLOG(L"[ACK] Acks " + std::wstring(enabled ? L"enabled" : L"disabled") + L" for client " + std::to_wstring(client_id));
+}
+
+void ReportInjection(DWORD client_id, DWORD id, const std::string &queue_name, InjectResult result,
+	ULONGLONG received_us, ULONGLONG scheduled_us, ULONGLONG executed_us) {
+	InitPacketAcks();
+	EnterCriticalSection(&ack_pending_cs);
+
+	inject_stats.results[result]++;
+	if (result == INJECT_OK) {
+		inject_stats.queue_wait_us[LatencyBucket(received_us, scheduled_us)]++;
+		inject_stats.exec_us[LatencyBucket(scheduled_us, executed_us)]++;
+	}
+
+	bool notify = false;
+	if (ack_enabled_clients.count(client_id)) {
+		PendingAck pending;
+		memset(&pending, 0, sizeof(pending));
+		pending.client_id = client_id;
+		pending.ack.header = INJECT_ACK;
+		pending.ack.id = id;
+		pending.ack.result = result;
+		memcpy(pending.ack.queue_name, queue_name.c_str(), min(queue_name.length(), (size_t)MAX_QUEUE_NAME_LENGTH));
+		pending.ack.received_us = received_us;
+		pending.ack.scheduled_us = scheduled_us;
+		pending.ack.executed_us = executed_us;
+		pending_acks.push_back(pending);
+		notify = true;
+	}
+
+	LeaveCriticalSection(&ack_pending_cs);
+
+	if (notify) {
+		SetEvent(ack_event);
+	}
+}
+
+void GetInjectStats(InjectStatsMessage &stats) {
+	InitPacketAcks();
+	EnterCriticalSection(&ack_pending_cs);
+	stats = inject_stats;
+	LeaveCriticalSection(&ack_pending_cs);
+}
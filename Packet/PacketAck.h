@@ -0,0 +1,28 @@
+﻿#ifndef __PACKET_ACK_H__
+#define __PACKET_ACK_H__
+
+#include<Windows.h>
+#include<string>
+#include"PacketDefs.h"
+
+class TCPServerThread;
+
+void InitPacketAcks();
+
+// Monotonic clock used for ack timestamps (microseconds)
+ULONGLONG GetInjectTimeUs();
+
+// Connections that can receive acks (called from the TCP thread)
+void RegisterAckClient(DWORD client_id, TCPServerThread *client);
+void UnregisterAckClient(DWORD client_id);
+void SetAcksEnabled(DWORD client_id, bool enabled);
+
+// Record the outcome of one injection request, queues an INJECT_ACK if the client asked for it
+// Never blocks on the network, safe to call from the game's main thread
+void ReportInjection(DWORD client_id, DWORD id, const std::string &queue_name, InjectResult result,
+	ULONGLONG received_us, ULONGLONG scheduled_us, ULONGLONG executed_us);
+
+// Snapshot of result counters and latency histograms
+void GetInjectStats(InjectStatsMessage &stats);
+
+#endif
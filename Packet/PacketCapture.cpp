@@ -0,0 +1,520 @@
+﻿// PacketCapture.cpp - Append-only recording of the capture stream into memory-mapped segment files
+// The worker copies each message straight into the mapped view; a flush thread writes dirty pages out,
+// indexes closed segments, prepares the next segment ahead of rotation and deletes segments past the retention limit
+
+#include"../Share/Simple/Simple.h"
+#include"../Share/Simple/DebugLog.h"
+#include"PacketCapture.h"
+#include<memory>
+#include<vector>
+#include<map>
+
+struct CaptureSegment {
+	DWORD sequence;
+	std::wstring path;
+	HANDLE file;
+	HANDLE mapping;
+	BYTE *view;
+	size_t size;
+
+	// Only changed by the worker under capture_cs
+	size_t write_offset;
+	ULONGLONG record_count;
+
+	// Time base of the records, set when the segment becomes active
+	LARGE_INTEGER base_qpc;
+	ULONGLONG base_time_us;
+
+	CaptureSegment() : sequence(0), file(INVALID_HANDLE_VALUE), mapping(NULL), view(NULL), size(0), write_offset(0), record_count(0), base_time_us(0) {
+		base_qpc.QuadPart = 0;
+	}
+	~CaptureSegment() {
+		if (view) {
+			UnmapViewOfFile(view);
+		}
+		if (mapping) {
+			CloseHandle(mapping);
+		}
+		if (file != INVALID_HANDLE_VALUE) {
+			CloseHandle(file);
+		}
+	}
+
+	CaptureSegmentHeader *header() const { return (CaptureSegmentHeader *)view; }
+};
+
+// Configuration (LoadPacketConfig)
+std::wstring capture_dir;
+DWORD capture_segment_size = DEFAULT_CAPTURE_SEGMENT_MB << 20;
+DWORD capture_max_segments = DEFAULT_CAPTURE_MAX_SEGMENTS;
+DWORD capture_flush_ms = DEFAULT_CAPTURE_FLUSH_MS;
+bool capture_traces = true;
+
+// Segments (guarded by capture_cs): the one being written, the next one, closed ones waiting for their last flush
+std::shared_ptr<CaptureSegment> capture_current;
+std::shared_ptr<CaptureSegment> capture_spare;
+std::vector<std::shared_ptr<CaptureSegment>> capture_closed;
+DWORD capture_next_sequence = 0;
+bool capture_retention_due = false;
+CRITICAL_SECTION capture_cs;
+
+volatile bool capture_running = false;
+volatile bool capture_stopping = false;
+HANDLE capture_thread = NULL;
+HANDLE capture_wake_event = NULL;
+LARGE_INTEGER capture_qpc_frequency;
+
+// Counters (guarded by capture_cs)
+ULONGLONG capture_records = 0;
+ULONGLONG capture_bytes = 0;
+ULONGLONG capture_dropped = 0;
+DWORD capture_last_open_failure_ms = 0;
+
+void SetCaptureConfig(const std::wstring &dir, DWORD segment_mb, DWORD max_segments, DWORD flush_ms, bool traces) {
+	capture_dir = dir;
+	while (!capture_dir.empty() && (capture_dir.back() == L'\\' || capture_dir.back() == L'/')) {
+		capture_dir.pop_back();
+	}
+	if (segment_mb == 0) {
+		segment_mb = DEFAULT_CAPTURE_SEGMENT_MB;
+	}
+	if (segment_mb > MAX_CAPTURE_SEGMENT_MB) {
+		segment_mb = MAX_CAPTURE_SEGMENT_MB;
+	}
+	capture_segment_size = segment_mb << 20;
+	capture_max_segments = max_segments ? max_segments : DEFAULT_CAPTURE_MAX_SEGMENTS;
+	capture_flush_ms = flush_ms ? flush_ms : DEFAULT_CAPTURE_FLUSH_MS;
+	capture_traces = traces;
+}
+
+bool CaptureWantsTraces() {
+	return capture_running && capture_traces;
+}
+
+std::wstring CaptureSegmentPath(DWORD sequence) {
+	WCHAR name[32];
+	swprintf_s(name, L"\\capture-%08u.rpc", sequence);
+	return capture_dir + name;
+}
+
+std::wstring CaptureIndexPath(DWORD sequence) {
+	WCHAR name[32];
+	swprintf_s(name, L"\\capture-%08u.rpx", sequence);
+	return capture_dir + name;
+}
+
+// Sequence of a segment file name, false for anything else in the directory
+bool ParseCaptureSegmentName(const WCHAR *name, DWORD &sequence) {
+	unsigned int value = 0;
+	WCHAR extension[8] = {};
+	if (swscanf_s(name, L"capture-%8u.%3s", &value, extension, (unsigned)_countof(extension)) != 2 || _wcsicmp(extension, L"rpc") != 0) {
+		return false;
+	}
+	sequence = value;
+	return true;
+}
+
+ULONGLONG GetCaptureUnixTimeUs() {
+	FILETIME ft;
+	GetSystemTimeAsFileTime(&ft);
+	ULONGLONG filetime = ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+	return filetime / 10 - 11644473600000000ULL;
+}
+
+// Preallocated and mapped segment file with its header written, NULL on failure
+std::shared_ptr<CaptureSegment> CreateCaptureSegment(DWORD sequence) {
+	std::shared_ptr<CaptureSegment> segment = std::make_shared<CaptureSegment>();
+	segment->sequence = sequence;
+	segment->path = CaptureSegmentPath(sequence);
+	segment->size = capture_segment_size;
+
+	// Readers may open live segments, retention may delete them while a reader still has one open
+	segment->file = CreateFileW(segment->path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (segment->file == INVALID_HANDLE_VALUE) {
+		DEBUGLOG(L"[CAPTURE] Failed to create " + segment->path + L" (error " + std::to_wstring(GetLastError()) + L")");
+		return NULL;
+	}
+	// Mapping past the end of the file extends it, the new bytes read as zero
+	segment->mapping = CreateFileMappingW(segment->file, NULL, PAGE_READWRITE, 0, capture_segment_size, NULL);
+	if (segment->mapping) {
+		segment->view = (BYTE *)MapViewOfFile(segment->mapping, FILE_MAP_WRITE, 0, 0, capture_segment_size);
+	}
+	if (!segment->view) {
+		DEBUGLOG(L"[CAPTURE] Failed to map " + segment->path + L" (error " + std::to_wstring(GetLastError()) + L")");
+		segment.reset();
+		DeleteFileW(CaptureSegmentPath(sequence).c_str());
+		return NULL;
+	}
+
+	CaptureSegmentHeader *header = segment->header();
+	header->magic = CAPTURE_SEGMENT_MAGIC;
+	header->version = CAPTURE_FORMAT_VERSION;
+	header->header_size = sizeof(CaptureSegmentHeader);
+	header->segment_size = capture_segment_size;
+	header->sequence = sequence;
+	header->process_id = GetCurrentProcessId();
+	header->flags = 0;
+	header->end_offset = sizeof(CaptureSegmentHeader);
+	header->record_count = 0;
+	segment->write_offset = sizeof(CaptureSegmentHeader);
+	return segment;
+}
+
+// Must be called with capture_cs held
+void ActivateCaptureSegment(const std::shared_ptr<CaptureSegment> &segment) {
+	QueryPerformanceCounter(&segment->base_qpc);
+	segment->base_time_us = GetCaptureUnixTimeUs();
+	segment->header()->start_time_us = segment->base_time_us;
+	capture_current = segment;
+	capture_retention_due = true;
+	DEBUGLOG(L"[CAPTURE] Recording to " + segment->path);
+}
+
+// Must be called with capture_cs held, the flush thread writes its pages out and releases it
+void CloseCaptureSegment() {
+	CaptureSegmentHeader *header = capture_current->header();
+	header->end_offset = capture_current->write_offset;
+	header->record_count = capture_current->record_count;
+	header->flags |= CAPTURE_SEGMENT_CLOSED;
+	capture_closed.push_back(capture_current);
+	capture_current.reset();
+}
+
+// Must be called with capture_cs held, moves on to the spare segment (or a new one), false if none could be opened
+bool RotateCaptureSegment() {
+	if (capture_current) {
+		CloseCaptureSegment();
+	}
+
+	std::shared_ptr<CaptureSegment> segment;
+	segment.swap(capture_spare);
+	if (!segment) {
+		// Don't retry a failing disk for every message
+		DWORD now = GetTickCount();
+		if (capture_last_open_failure_ms && now - capture_last_open_failure_ms < 1000) {
+			return false;
+		}
+		segment = CreateCaptureSegment(capture_next_sequence++);
+		if (!segment) {
+			capture_last_open_failure_ms = now ? now : 1;
+			return false;
+		}
+		capture_last_open_failure_ms = 0;
+	}
+	ActivateCaptureSegment(segment);
+	SetEvent(capture_wake_event);
+	return true;
+}
+
+void WriteCaptureRecord(const BYTE *data, size_t length, const LARGE_INTEGER &captured) {
+	if (!capture_running) {
+		return;
+	}
+
+	size_t record_size = (offsetof(CaptureRecord, message) + length + 7) & ~(size_t)7;
+	if (record_size > capture_segment_size - sizeof(CaptureSegmentHeader)) {
+		DEBUGLOG(L"[CAPTURE] Message of " + std::to_wstring(length) + L" bytes doesn't fit in a segment, not recorded");
+		EnterCriticalSection(&capture_cs);
+		capture_dropped++;
+		LeaveCriticalSection(&capture_cs);
+		return;
+	}
+
+	EnterCriticalSection(&capture_cs);
+	if (!capture_running) {
+		LeaveCriticalSection(&capture_cs);
+		return;
+	}
+	if (!capture_current || capture_current->write_offset + record_size > capture_current->size) {
+		if (!RotateCaptureSegment()) {
+			if (capture_dropped++ % 1000 == 0) {
+				DEBUGLOG(L"[CAPTURE] No segment to record to, " + std::to_wstring(capture_dropped) + L" messages lost");
+			}
+			LeaveCriticalSection(&capture_cs);
+			return;
+		}
+	}
+
+	// Split so long-lived segments don't overflow the conversion
+	CaptureSegment *segment = capture_current.get();
+	LONGLONG ticks = captured.QuadPart - segment->base_qpc.QuadPart;
+	LONGLONG offset_us = (ticks / capture_qpc_frequency.QuadPart) * 1000000 + (ticks % capture_qpc_frequency.QuadPart) * 1000000 / capture_qpc_frequency.QuadPart;
+
+	CaptureRecord *record = (CaptureRecord *)(segment->view + segment->write_offset);
+	record->message_length = (DWORD)length;
+	record->time_us = segment->base_time_us + offset_us;
+	memcpy(record->message, data, length);
+	MemoryBarrier();
+	record->length = (DWORD)record_size;
+
+	segment->write_offset += record_size;
+	segment->record_count++;
+	capture_records++;
+	capture_bytes += record_size;
+	LeaveCriticalSection(&capture_cs);
+}
+
+// Index a closed segment: opcode bitmaps, a sparse time index and the record offsets of every opcode
+bool WriteCaptureIndex(const CaptureSegment &segment) {
+	CaptureIndexHeader header = {};
+	header.magic = CAPTURE_INDEX_MAGIC;
+	header.version = CAPTURE_INDEX_VERSION;
+	header.header_size = sizeof(CaptureIndexHeader);
+	header.sequence = segment.sequence;
+	header.end_offset = segment.write_offset;
+	header.time_step = CAPTURE_INDEX_TIME_STEP;
+
+	std::vector<BYTE> bitmaps(2 * CAPTURE_OPCODE_BITMAP_SIZE);
+	std::vector<CaptureTimeEntry> times;
+	std::map<DWORD, std::vector<DWORD>> opcode_offsets;  // (direction << 16) | opcode
+
+	size_t offset = sizeof(CaptureSegmentHeader);
+	while (offset + offsetof(CaptureRecord, message) <= segment.write_offset) {
+		const CaptureRecord *record = (const CaptureRecord *)(segment.view + offset);
+		if (record->length == 0 || offset + record->length > segment.write_offset) {
+			break;
+		}
+		if (header.record_count % CAPTURE_INDEX_TIME_STEP == 0) {
+			CaptureTimeEntry entry = { record->time_us, (DWORD)offset, header.record_count };
+			times.push_back(entry);
+		}
+		if (header.record_count == 0) {
+			header.first_time_us = record->time_us;
+		}
+		header.last_time_us = record->time_us;
+		header.record_count++;
+
+		const PacketEditorMessage *message = (const PacketEditorMessage *)record->message;
+		if (record->message_length >= offsetof(PacketEditorMessage, Binary.packet) + sizeof(WORD) &&
+			(message->header == SENDPACKET || message->header == RECVPACKET) && message->Binary.length >= sizeof(WORD)) {
+			WORD opcode = *(WORD *)message->Binary.packet;
+			bitmaps[message->header * CAPTURE_OPCODE_BITMAP_SIZE + (opcode >> 3)] |= 1 << (opcode & 7);
+			opcode_offsets[((DWORD)message->header << 16) | opcode].push_back((DWORD)offset);
+		}
+		offset += record->length;
+	}
+
+	std::vector<CaptureOpcodeEntry> opcodes;
+	for (auto &kv : opcode_offsets) {
+		CaptureOpcodeEntry entry = { (WORD)(kv.first >> 16), (WORD)kv.first, header.offset_count, (DWORD)kv.second.size() };
+		opcodes.push_back(entry);
+		header.offset_count += (DWORD)kv.second.size();
+	}
+	header.time_entry_count = (DWORD)times.size();
+	header.opcode_entry_count = (DWORD)opcodes.size();
+
+	std::vector<BYTE> index(sizeof(header) + bitmaps.size() + times.size() * sizeof(CaptureTimeEntry) +
+		opcodes.size() * sizeof(CaptureOpcodeEntry) + header.offset_count * sizeof(DWORD));
+	BYTE *p = &index[0];
+	memcpy(p, &header, sizeof(header));
+	p += sizeof(header);
+	memcpy(p, &bitmaps[0], bitmaps.size());
+	p += bitmaps.size();
+	if (!times.empty()) {
+		memcpy(p, &times[0], times.size() * sizeof(CaptureTimeEntry));
+		p += times.size() * sizeof(CaptureTimeEntry);
+	}
+	if (!opcodes.empty()) {
+		memcpy(p, &opcodes[0], opcodes.size() * sizeof(CaptureOpcodeEntry));
+		p += opcodes.size() * sizeof(CaptureOpcodeEntry);
+	}
+	for (auto &kv : opcode_offsets) {
+		memcpy(p, &kv.second[0], kv.second.size() * sizeof(DWORD));
+		p += kv.second.size() * sizeof(DWORD);
+	}
+
+	// Readers never see a partial index
+	std::wstring path = CaptureIndexPath(segment.sequence);
+	std::wstring temp_path = path + L".tmp";
+	HANDLE file = CreateFileW(temp_path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		DEBUGLOG(L"[CAPTURE] Failed to create " + temp_path + L" (error " + std::to_wstring(GetLastError()) + L")");
+		return false;
+	}
+	DWORD written = 0;
+	BOOL ok = WriteFile(file, &index[0], (DWORD)index.size(), &written, NULL) && written == index.size();
+	CloseHandle(file);
+	if (!ok || !MoveFileExW(temp_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+		DEBUGLOG(L"[CAPTURE] Failed to write " + path + L" (error " + std::to_wstring(GetLastError()) + L")");
+		DeleteFileW(temp_path.c_str());
+		return false;
+	}
+	return true;
+}
+
+// Delete the oldest segments so at most capture_max_segments are kept (the spare doesn't count)
+void ApplyCaptureRetention(DWORD current_sequence) {
+	WIN32_FIND_DATAW fd;
+	HANDLE find = FindFirstFileW((capture_dir + L"\\capture-*.rpc").c_str(), &fd);
+	if (find == INVALID_HANDLE_VALUE) {
+		return;
+	}
+	do {
+		DWORD sequence;
+		if (ParseCaptureSegmentName(fd.cFileName, sequence) && sequence < current_sequence && current_sequence - sequence >= capture_max_segments) {
+			if (!DeleteFileW(CaptureSegmentPath(sequence).c_str())) {
+				DEBUGLOG(L"[CAPTURE] Failed to delete old segment " + std::to_wstring(sequence) + L" (error " + std::to_wstring(GetLastError()) + L")");
+			}
+			DeleteFileW(CaptureIndexPath(sequence).c_str());
+		}
+	} while (FindNextFileW(find, &fd));
+	FindClose(find);
+}
+
+// Write dirty pages out, finish closed segments, prepare the spare and apply retention
+void CaptureFlushPass(bool prepare_spare) {
+	std::shared_ptr<CaptureSegment> current;
+	std::vector<std::shared_ptr<CaptureSegment>> closed;
+	bool retention_due = false;
+	DWORD retention_sequence = 0;
+	DWORD spare_sequence = 0;
+	bool need_spare = false;
+
+	EnterCriticalSection(&capture_cs);
+	current = capture_current;
+	closed.swap(capture_closed);
+	if (current) {
+		current->header()->end_offset = current->write_offset;
+		current->header()->record_count = current->record_count;
+	}
+	if (prepare_spare && !capture_spare) {
+		need_spare = true;
+		spare_sequence = capture_next_sequence++;
+	}
+	// After StopCaptureWriter only the closed segment is left to count from
+	if (current || !closed.empty()) {
+		retention_due = capture_retention_due;
+		retention_sequence = current ? current->sequence : closed.back()->sequence;
+		capture_retention_due = false;
+	}
+	LeaveCriticalSection(&capture_cs);
+
+	// The worker keeps writing meanwhile, references keep the views mapped
+	for (auto &segment : closed) {
+		FlushViewOfFile(segment->view, 0);
+		FlushFileBuffers(segment->file);
+		WriteCaptureIndex(*segment);
+	}
+	closed.clear();
+	if (current) {
+		FlushViewOfFile(current->view, 0);
+		FlushFileBuffers(current->file);
+	}
+
+	if (need_spare) {
+		std::shared_ptr<CaptureSegment> spare = CreateCaptureSegment(spare_sequence);
+		if (spare) {
+			// The worker rotated into a segment of its own meanwhile, this one would be out of order
+			EnterCriticalSection(&capture_cs);
+			bool usable = !capture_spare && (!capture_current || capture_current->sequence < spare->sequence);
+			if (usable) {
+				capture_spare = spare;
+			}
+			LeaveCriticalSection(&capture_cs);
+			if (!usable) {
+				spare.reset();
+				DeleteFileW(CaptureSegmentPath(spare_sequence).c_str());
+			}
+		}
+	}
+
+	if (retention_due) {
+		ApplyCaptureRetention(retention_sequence);
+	}
+}
+
+DWORD WINAPI CaptureFlushThreadProc(LPVOID) {
+	while (!capture_stopping) {
+		WaitForSingleObject(capture_wake_event, capture_flush_ms);
+		if (capture_stopping) {
+			break;
+		}
+		CaptureFlushPass(true);
+	}
+	return 0;
+}
+
+bool StartCaptureWriter() {
+	if (capture_dir.empty() || capture_running) {
+		return false;
+	}
+
+	InitializeCriticalSection(&capture_cs);
+	QueryPerformanceFrequency(&capture_qpc_frequency);
+
+	if (!CreateDirectoryW(capture_dir.c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+		DEBUGLOG(L"[CAPTURE] Can't create " + capture_dir + L" (error " + std::to_wstring(GetLastError()) + L"), recording disabled");
+		DeleteCriticalSection(&capture_cs);
+		return false;
+	}
+
+	// Continue after the segments of earlier runs
+	capture_next_sequence = 0;
+	WIN32_FIND_DATAW fd;
+	HANDLE find = FindFirstFileW((capture_dir + L"\\capture-*.rpc").c_str(), &fd);
+	if (find != INVALID_HANDLE_VALUE) {
+		do {
+			DWORD sequence;
+			if (ParseCaptureSegmentName(fd.cFileName, sequence) && sequence >= capture_next_sequence) {
+				capture_next_sequence = sequence + 1;
+			}
+		} while (FindNextFileW(find, &fd));
+		FindClose(find);
+	}
+
+	std::shared_ptr<CaptureSegment> segment = CreateCaptureSegment(capture_next_sequence++);
+	if (!segment) {
+		DEBUGLOG(L"[CAPTURE] Recording disabled");
+		DeleteCriticalSection(&capture_cs);
+		return false;
+	}
+
+	capture_wake_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+	EnterCriticalSection(&capture_cs);
+	ActivateCaptureSegment(segment);
+	LeaveCriticalSection(&capture_cs);
+
+	capture_stopping = false;
+	capture_running = true;
+	capture_thread = CreateThread(NULL, 0, CaptureFlushThreadProc, NULL, 0, NULL);
+	DEBUGLOG(L"[CAPTURE] Segments of " + std::to_wstring(capture_segment_size >> 20) + L" MB, keeping " +
+		std::to_wstring(capture_max_segments) + L", flushed every " + std::to_wstring(capture_flush_ms) + L" ms");
+	return true;
+}
+
+void StopCaptureWriter() {
+	if (!capture_running) {
+		return;
+	}
+
+	capture_stopping = true;
+	SetEvent(capture_wake_event);
+	if (capture_thread) {
+		WaitForSingleObject(capture_thread, 5000);
+		CloseHandle(capture_thread);
+		capture_thread = NULL;
+	}
+	CloseHandle(capture_wake_event);
+	capture_wake_event = NULL;
+
+	// Whatever the worker still writes afterwards is not recorded
+	std::shared_ptr<CaptureSegment> spare;
+	EnterCriticalSection(&capture_cs);
+	capture_running = false;
+	if (capture_current) {
+		CloseCaptureSegment();
+	}
+	spare.swap(capture_spare);
+	LeaveCriticalSection(&capture_cs);
+
+	if (spare) {
+		DWORD sequence = spare->sequence;
+		spare.reset();
+		DeleteFileW(CaptureSegmentPath(sequence).c_str());
+	}
+	CaptureFlushPass(false);
+
+	DEBUGLOG(L"[CAPTURE] Stopped after " + std::to_wstring(capture_records) + L" records (" + std::to_wstring(capture_bytes) + L" bytes, " +
+		std::to_wstring(capture_dropped) + L" lost)");
+	DeleteCriticalSection(&capture_cs);
+}
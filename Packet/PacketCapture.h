@@ -0,0 +1,104 @@
+﻿#ifndef __PACKET_CAPTURE_H__
+#define __PACKET_CAPTURE_H__
+
+#include<Windows.h>
+#include<string>
+#include"PacketDefs.h"
+
+// Defaults of the capture recorder (CAPTURE_* in RirePE.ini)
+#define DEFAULT_CAPTURE_SEGMENT_MB 32
+#define MAX_CAPTURE_SEGMENT_MB 256
+#define DEFAULT_CAPTURE_MAX_SEGMENTS 32
+#define DEFAULT_CAPTURE_FLUSH_MS 1000
+
+// Segment files are <dir>\capture-<sequence, 8 digits>.rpc
+#define CAPTURE_SEGMENT_MAGIC 0x53455052     // "RPES"
+#define CAPTURE_FORMAT_VERSION 1
+
+// CaptureSegmentHeader.flags
+#define CAPTURE_SEGMENT_CLOSED 0x01          // The writer moved on, end_offset and record_count are final
+
+// Closed segments get an index next to them, <dir>\capture-<sequence>.rpx
+#define CAPTURE_INDEX_MAGIC 0x49455052       // "RPEI"
+#define CAPTURE_INDEX_VERSION 1
+#define CAPTURE_INDEX_TIME_STEP 64           // Records between two entries of the time index
+#define CAPTURE_OPCODE_BITMAP_SIZE (0x10000 / 8)
+
+#pragma pack(push, 1)
+// Start of every segment file, records follow at header_size
+typedef struct {
+	DWORD magic;                              // CAPTURE_SEGMENT_MAGIC
+	WORD version;                             // CAPTURE_FORMAT_VERSION
+	WORD header_size;                         // Offset of the first record
+	DWORD segment_size;                       // File size (fixed, the unused tail is zero)
+	DWORD sequence;                           // Increases across rotations and restarts
+	ULONGLONG start_time_us;                  // Unix time (microseconds) the segment became active
+	DWORD process_id;
+	DWORD flags;                              // CAPTURE_SEGMENT_* flags
+	ULONGLONG end_offset;                     // End of the last record, updated at every flush
+	ULONGLONG record_count;                   // Records before end_offset
+	BYTE reserved[16];
+} CaptureSegmentHeader;
+
+// One captured message, 8-byte aligned. length is written last, readers stop at a zero length
+typedef struct {
+	DWORD length;                             // Record size including this header and the alignment
+	DWORD message_length;                     // Size of message
+	ULONGLONG time_us;                        // Unix time (microseconds) the hook captured the message
+	BYTE message[1];                          // PacketEditorMessage as sent to TCP clients (SEND/RECV or trace)
+} CaptureRecord;
+
+// Start of an index file, followed by:
+//   BYTE opcodes[2][CAPTURE_OPCODE_BITMAP_SIZE]     SEND and RECV opcodes present in the segment
+//   CaptureTimeEntry times[time_entry_count]        Every CAPTURE_INDEX_TIME_STEP-th record
+//   CaptureOpcodeEntry opcodes[opcode_entry_count]  Sorted by direction, then opcode
+//   DWORD offsets[offset_count]                     Record offsets, ascending within each opcode
+typedef struct {
+	DWORD magic;                              // CAPTURE_INDEX_MAGIC
+	WORD version;                             // CAPTURE_INDEX_VERSION
+	WORD header_size;                         // Offset of the opcode bitmaps
+	DWORD sequence;                           // Segment indexed
+	DWORD record_count;                       // Records indexed (traces included)
+	ULONGLONG first_time_us;                  // Time of the first record (0 if none)
+	ULONGLONG last_time_us;                   // Time of the last record
+	ULONGLONG end_offset;                     // Segment end_offset the index was built from
+	DWORD time_step;                          // CAPTURE_INDEX_TIME_STEP
+	DWORD time_entry_count;
+	DWORD opcode_entry_count;
+	DWORD offset_count;
+	BYTE reserved[16];
+} CaptureIndexHeader;
+
+typedef struct {
+	ULONGLONG time_us;                        // Time of the record
+	DWORD offset;                             // Record offset in the segment
+	DWORD record;                             // Record number
+} CaptureTimeEntry;
+
+// SEND/RECV packets of one opcode
+typedef struct {
+	WORD direction;                           // SENDPACKET or RECVPACKET
+	WORD opcode;
+	DWORD first;                              // First entry in offsets
+	DWORD count;
+} CaptureOpcodeEntry;
+#pragma pack(pop)
+
+// Set from the INI before StartCaptureWriter, an empty dir keeps the recorder off
+void SetCaptureConfig(const std::wstring &dir, DWORD segment_mb, DWORD max_segments, DWORD flush_ms, bool traces);
+
+// Open the first segment and start the flush thread, false if recording is off or the directory is unusable
+bool StartCaptureWriter();
+// Close the current segment (final flush), called after the capture worker has stopped
+void StopCaptureWriter();
+
+// Format traces are produced while this is true even without trace subscribers
+bool CaptureWantsTraces();
+
+// Current Unix time in microseconds, the time base of capture records
+ULONGLONG GetCaptureUnixTimeUs();
+
+// Append a message, called by the capture worker only. captured is the QueryPerformanceCounter value taken by the hook
+void WriteCaptureRecord(const BYTE *data, size_t length, const LARGE_INTEGER &captured);
+
+#endif
@@ -0,0 +1,232 @@
+﻿// PacketCompress.cpp - Capture stream codecs: LZ4 block compression (greedy, single hash table) and packet deltas
+
+#include"PacketCompress.h"
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5              // The block always ends with at least this many literals
+#define LZ4_MATCH_LIMIT 12               // No match may start in the last 12 bytes
+#define LZ4_MAX_OFFSET 0xFFFF
+#define LZ4_HASH_BITS 12
+
+static inline DWORD Read32(const BYTE *p) {
+	DWORD value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static inline DWORD HashSequence(DWORD sequence) {
+	return (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+// Lengths of 15 and more continue in extra bytes of 255 until a smaller one
+static inline BYTE *WriteLength(BYTE *op, size_t length) {
+	while (length >= 255) {
+		*op++ = 255;
+		length -= 255;
+	}
+	*op++ = (BYTE)length;
+	return op;
+}
+
+static BYTE *WriteSequence(BYTE *op, const BYTE *literals, size_t literal_length, size_t offset, size_t match_length) {
+	BYTE *token = op++;
+	*token = (BYTE)(((literal_length < 15) ? literal_length : 15) << 4);
+	if (literal_length >= 15) {
+		op = WriteLength(op, literal_length - 15);
+	}
+	if (literal_length) {
+		memcpy(op, literals, literal_length);
+		op += literal_length;
+	}
+
+	if (match_length) {
+		*op++ = (BYTE)(offset & 0xFF);
+		*op++ = (BYTE)(offset >> 8);
+		size_t length = match_length - LZ4_MIN_MATCH;
+		*token |= (BYTE)((length < 15) ? length : 15);
+		if (length >= 15) {
+			op = WriteLength(op, length - 15);
+		}
+	}
+	return op;
+}
+
+size_t LZ4CompressBound(size_t length) {
+	return length + length / 255 + 16;
+}
+
+size_t LZ4CompressBlock(const BYTE *src, size_t length, BYTE *dst, size_t capacity) {
+	if (capacity < LZ4CompressBound(length)) {
+		return 0;
+	}
+
+	BYTE *op = dst;
+	size_t anchor = 0;
+	if (length > LZ4_MATCH_LIMIT) {
+		DWORD table[1 << LZ4_HASH_BITS] = {};
+		size_t ip = 1;
+		table[HashSequence(Read32(src))] = 0;
+
+		while (ip + LZ4_MATCH_LIMIT <= length) {
+			DWORD sequence = Read32(&src[ip]);
+			DWORD hash = HashSequence(sequence);
+			size_t ref = table[hash];
+			table[hash] = (DWORD)ip;
+
+			if (ip - ref > LZ4_MAX_OFFSET || Read32(&src[ref]) != sequence) {
+				// Skip faster through data that doesn't compress
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+
+			size_t match_length = LZ4_MIN_MATCH;
+			while (ip + match_length < length - LZ4_LAST_LITERALS && src[ref + match_length] == src[ip + match_length]) {
+				match_length++;
+			}
+			while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+				ip--;
+				ref--;
+				match_length++;
+			}
+
+			op = WriteSequence(op, &src[anchor], ip - anchor, ip - ref, match_length);
+			ip += match_length;
+			anchor = ip;
+		}
+	}
+
+	op = WriteSequence(op, &src[anchor], length - anchor, 0, 0);
+	return op - dst;
+}
+
+bool LZ4DecompressBlock(const BYTE *src, size_t length, BYTE *dst, size_t raw_length) {
+	size_t ip = 0;
+	size_t op = 0;
+	while (ip < length) {
+		BYTE token = src[ip++];
+
+		size_t literal_length = token >> 4;
+		if (literal_length == 15) {
+			BYTE extra;
+			do {
+				if (ip >= length) {
+					return false;
+				}
+				extra = src[ip++];
+				literal_length += extra;
+			} while (extra == 255);
+		}
+		if (literal_length > length - ip || literal_length > raw_length - op) {
+			return false;
+		}
+		memcpy(&dst[op], &src[ip], literal_length);
+		ip += literal_length;
+		op += literal_length;
+
+		// Last sequence
+		if (ip == length) {
+			break;
+		}
+
+		if (length - ip < 2) {
+			return false;
+		}
+		size_t offset = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > op) {
+			return false;
+		}
+
+		size_t match_length = token & 15;
+		if (match_length == 15) {
+			BYTE extra;
+			do {
+				if (ip >= length) {
+					return false;
+				}
+				extra = src[ip++];
+				match_length += extra;
+			} while (extra == 255);
+		}
+		match_length += LZ4_MIN_MATCH;
+		if (match_length > raw_length - op) {
+			return false;
+		}
+
+		// Byte by byte, the match may overlap the bytes it produces
+		for (size_t i = 0; i < match_length; i++) {
+			dst[op + i] = dst[op - offset + i];
+		}
+		op += match_length;
+	}
+	return op == raw_length;
+}
+
+#define DELTA_MAX_RUN 128
+
+static inline BYTE DeltaByte(const BYTE *base, size_t base_length, const BYTE *packet, size_t index) {
+	return packet[index] ^ ((index < base_length) ? base[index] : 0);
+}
+
+// Every run costs a control byte and covers at least one byte (alternating 1-byte skips and changes cost 1.5x)
+size_t DeltaEncodeBound(size_t length) {
+	return length * 2;
+}
+
+size_t DeltaEncode(const BYTE *base, size_t base_length, const BYTE *packet, size_t length, BYTE *dst) {
+	size_t end = length;
+	while (end && DeltaByte(base, base_length, packet, end - 1) == 0) {
+		end--;
+	}
+
+	size_t op = 0;
+	size_t i = 0;
+	while (i < end) {
+		size_t run = 0;
+		if (DeltaByte(base, base_length, packet, i) == 0) {
+			while (i + run < end && run < DELTA_MAX_RUN && DeltaByte(base, base_length, packet, i + run) == 0) {
+				run++;
+			}
+			dst[op++] = (BYTE)(run - 1);
+		}
+		else {
+			while (i + run < end && run < DELTA_MAX_RUN && DeltaByte(base, base_length, packet, i + run) != 0) {
+				run++;
+			}
+			dst[op++] = (BYTE)(0x80 | (run - 1));
+			for (size_t j = 0; j < run; j++) {
+				dst[op++] = DeltaByte(base, base_length, packet, i + j);
+			}
+		}
+		i += run;
+	}
+	return op;
+}
+
+bool DeltaDecode(const BYTE *base, size_t base_length, const BYTE *delta, size_t delta_length, BYTE *packet, size_t length) {
+	// Start from the base, runs only touch the bytes that changed
+	for (size_t i = 0; i < length; i++) {
+		packet[i] = (i < base_length) ? base[i] : 0;
+	}
+
+	size_t ip = 0;
+	size_t op = 0;
+	while (ip < delta_length) {
+		BYTE control = delta[ip++];
+		size_t run = (control & 0x7F) + 1;
+		if (run > length - op) {
+			return false;
+		}
+		if (control & 0x80) {
+			if (run > delta_length - ip) {
+				return false;
+			}
+			for (size_t j = 0; j < run; j++) {
+				packet[op + j] ^= delta[ip + j];
+			}
+			ip += run;
+		}
+		op += run;
+	}
+	return true;
+}
@@ -0,0 +1,32 @@
+﻿#ifndef __PACKET_COMPRESS_H__
+#define __PACKET_COMPRESS_H__
+
+#include<Windows.h>
+
+// LZ4 block format codec used for COMPRESSED_BATCH (self-contained, no frame format or checksum)
+// Sequences are: token (literal length << 4 | match length - 4), extra literal length bytes,
+// literals, 2-byte little-endian offset, extra match length bytes; the last sequence has literals only
+
+// Largest compressed size of length bytes
+size_t LZ4CompressBound(size_t length);
+
+// Compress length bytes of src into dst, returns the compressed size (0 if capacity is below LZ4CompressBound)
+size_t LZ4CompressBlock(const BYTE *src, size_t length, BYTE *dst, size_t capacity);
+
+// Decode a block into exactly raw_length bytes, false if it is malformed or doesn't decode to raw_length
+bool LZ4DecompressBlock(const BYTE *src, size_t length, BYTE *dst, size_t raw_length);
+
+// Delta codec used for DELTA_PACKET: the packet XORed with the previous one (zero past its end),
+// as runs of control byte 0x00-0x7F = (n - 1) unchanged bytes, 0x80-0xFF = (n - 1) | 0x80 followed by n XOR bytes;
+// unchanged bytes at the end are left out
+
+// Largest delta size of a length-byte packet
+size_t DeltaEncodeBound(size_t length);
+
+// Encode packet against base into dst (DeltaEncodeBound(length) bytes), returns the delta size
+size_t DeltaEncode(const BYTE *base, size_t base_length, const BYTE *packet, size_t length, BYTE *dst);
+
+// Rebuild a length-byte packet from base and its delta, false if the delta is malformed
+bool DeltaDecode(const BYTE *base, size_t base_length, const BYTE *delta, size_t delta_length, BYTE *packet, size_t length);
+
+#endif
@@ -1,4 +1,4 @@
-#pragma once
+﻿#pragma once
 #include <Windows.h>
 
 // Configuration
@@ -51,6 +51,38 @@ enum MessageHeader {
 	REGISTER_QUEUE,    // Register a new injection queue with configuration
 	UNREGISTER_QUEUE,  // Remove a queue registration
 	CLEAR_QUEUES,      // Clear all queue registrations
+	INJECT_GROUP,      // Inject one or more complete multi-packet groups in a single frame
+	REGISTER_TEMPLATE,   // Register a packet template with typed slots
+	UNREGISTER_TEMPLATE, // Remove a packet template
+	INJECT_TEMPLATE,     // Inject a group built from templates and argument values
+	SET_QUEUE_SHAPING,   // Set token bucket and priority class of a queue
+	SET_GLOBAL_RATE,     // Set the global injection packets-per-second ceiling
+	SET_ACKS,            // Enable/disable injection acknowledgements for this connection
+	INJECT_ACK,          // Outcome of one injected packet (DLL → client)
+	GET_INJECT_STATS,    // Request injection latency histograms
+	INJECT_STATS,        // Injection latency histograms (DLL → client)
+	REGISTER_RULE,       // Register a reactive rule (match packet → inject template)
+	UNREGISTER_RULE,     // Remove a reactive rule
+	REGISTER_FILTER,     // Upload a filter/rewrite program run inside the hooks
+	UNREGISTER_FILTER,   // Remove a filter program
+	GET_FILTER_STATS,    // Request per-program filter counters
+	FILTER_STATS,        // Per-program filter counters (DLL → client)
+	SUBSCRIBE,           // Choose which captured messages this connection receives
+	SET_COMPRESSION,     // Negotiate compression of this connection's capture stream (reply carries the accepted codec)
+	COMPRESSED_BATCH,    // Several capture frames compressed as one block (DLL → client)
+	GET_SUBSCRIBER_STATS,// Request per-connection capture stream counters
+	SUBSCRIBER_STATS,    // Per-connection capture stream counters (DLL → client)
+	SET_ENCODING,        // Choose stream encodings of this connection (reply carries the accepted ones)
+	DELTA_PACKET,        // SEND/RECV packet encoded against the previous one of its opcode (DLL → client)
+	REPEAT_PACKET,       // Run of exact repeats of the previous packet of an opcode (DLL → client)
+	DEFINE_SYMBOL,       // New entry of this connection's address/string dictionary (DLL → client)
+	COMPACT_MESSAGE,     // Captured message with its address (and string) replaced by dictionary ids (DLL → client)
+	GRANT_CREDIT,        // Flow control: allow the DLL to send more of the capture stream to this connection
+	FLIGHT_DUMP,         // Dump the flight recorder to a file and/or this connection
+	FLIGHT_RECORDING,    // Part of a flight recorder dump (DLL → client)
+	RESUME,              // Number the capture stream on this connection and replay it from a sequence
+	STREAM_SEQUENCE,     // Sequence of the next capture stream message on this connection (DLL → client)
+	STREAM_GAP,          // Capture stream messages a RESUME asked for that are no longer retained (DLL → client)
 };
 
 enum FormatUpdate {
@@ -62,6 +94,119 @@ enum FormatUpdate {
 #define MAX_QUEUE_NAME_LENGTH 32
 #define MAX_TIMESTAMP_OFFSETS 8
 #define MAX_PACKETS_PER_QUEUE 8
+#define MAX_QUEUE_PRIORITY 3
+#define DEFAULT_QUEUE_PRIORITY 1
+
+// Reactive rule constants
+#define MAX_RULE_PREDICATES 8
+
+// Filter program constants
+#define MAX_FILTER_INSNS 64
+#define MAX_FILTER_PROGRAMS 32
+
+// Filter VM instructions: accumulator A and index register X (64-bit), k = FilterInsn.k
+// Jumps are relative to the next instruction and forward only, so every program terminates
+enum FilterOpcode {
+	FILTER_LD,         // A = size bytes at offset (little-endian); out of range → program passes the packet
+	FILTER_LDX,        // A = size bytes at X + offset
+	FILTER_LD_LEN,     // A = packet length
+	FILTER_LD_IMM,     // A = k
+	FILTER_TAX,        // X = A
+	FILTER_TXA,        // A = X
+	FILTER_AND,        // A &= k
+	FILTER_OR,         // A |= k
+	FILTER_XOR,        // A ^= k
+	FILTER_ADD,        // A += k
+	FILTER_SUB,        // A -= k
+	FILTER_LSH,        // A <<= k (k < 64)
+	FILTER_RSH,        // A >>= k (k < 64)
+	FILTER_JA,         // pc += jt
+	FILTER_JEQ,        // pc += (A == k) ? jt : jf
+	FILTER_JGT,        // pc += (A > k) ? jt : jf
+	FILTER_JGE,        // pc += (A >= k) ? jt : jf
+	FILTER_JSET,       // pc += (A & k) ? jt : jf
+	FILTER_ST,         // Rewrite size bytes at offset with A (packet length never changes)
+	FILTER_STX,        // Rewrite size bytes at X + offset with A
+	FILTER_RET_PASS,   // Stop, let the packet through (later programs still run)
+	FILTER_RET_DROP,   // Stop, block the packet
+	FILTER_OPCODE_COUNT,
+};
+
+// Subscription flags (SubscribeMessage.flags)
+#define SUBSCRIBE_SEND   0x01                // SENDPACKET messages (and ENCODE traces with SUBSCRIBE_TRACES)
+#define SUBSCRIBE_RECV   0x02                // RECVPACKET messages (and DECODE traces with SUBSCRIBE_TRACES)
+#define SUBSCRIBE_TRACES 0x04                // Format trace messages
+#define SUBSCRIBE_ALL    (SUBSCRIBE_SEND | SUBSCRIBE_RECV | SUBSCRIBE_TRACES)
+
+// How SubscribeMessage.opcodes is applied to SENDPACKET/RECVPACKET messages
+enum SubscribeOpcodeMode {
+	SUBSCRIBE_ALL_OPCODES,   // Bitmap ignored
+	SUBSCRIBE_ALLOW_OPCODES, // Only opcodes whose bit is set
+	SUBSCRIBE_DENY_OPCODES,  // Every opcode except those whose bit is set
+};
+
+// Capture stream codecs (CompressionMessage.codec, CompressedBatchMessage.codec)
+enum CompressionCodec {
+	COMPRESSION_NONE,        // Frames are sent as they are (CompressedBatchMessage: stored uncompressed)
+	COMPRESSION_LZ4,         // LZ4 block format (PacketCompress.h)
+	COMPRESSION_CODEC_COUNT,
+};
+
+// Capture stream encodings (EncodingMessage.flags)
+#define ENCODING_DELTA      0x01             // DELTA_PACKET/REPEAT_PACKET against the previous packet of the same direction and opcode
+#define ENCODING_DICTIONARY 0x02             // COMPACT_MESSAGE with return addresses and strings sent once as DEFINE_SYMBOL
+#define ENCODING_ALL        (ENCODING_DELTA | ENCODING_DICTIONARY)
+
+// Dictionary kinds (SymbolDefineMessage.kind)
+enum SymbolKind {
+	SYMBOL_ADDRESS,          // value is a ULONGLONG return address
+	SYMBOL_STRING,           // value is the Extra.data of an ENCODESTR/DECODESTR trace (WORD length + characters)
+};
+
+// CompactMessage.flags
+#define COMPACT_STRING_SYMBOL 0x01           // body ends with a WORD string symbol instead of Extra.data
+
+// What happens to a credit-controlled connection's stream when credit runs low or out (CreditMessage.policy)
+enum FlowControlPolicy {
+	FLOW_CONTROL_OFF,         // No credit, sent as fast as the connection's ring allows
+	FLOW_CONTROL_BUFFER,      // Held back until more credit is granted (up to SUBSCRIBER_RING_SIZE frames, then dropped)
+	FLOW_CONTROL_DOWNSAMPLE,  // Below half the last grant only 1 in CREDIT_DOWNSAMPLE_RATE packets (no traces), dropped when out
+	FLOW_CONTROL_DROP_TRACES, // Below half the last grant format traces are dropped, packets are dropped when out
+	FLOW_CONTROL_SPILL,       // Lossless: what doesn't fit (out of credit or ring full) goes to an overflow file and is sent from there in order
+	FLOW_CONTROL_POLICY_COUNT,
+};
+
+// FlightDumpMessage.target
+#define FLIGHT_DUMP_TO_FILE   0x01           // flight-*.rpc in RECORDER_DIR
+#define FLIGHT_DUMP_TO_CLIENT 0x02           // FLIGHT_RECORDING messages on the requesting connection
+#define FLIGHT_RECORDING_CHUNK_SIZE (512 * 1024)
+
+// Outcome of an injection request (InjectAckMessage.result)
+enum InjectResult {
+	INJECT_OK,                   // Packet was passed to SendPacket/ProcessPacket
+	INJECT_QUEUE_NOT_REGISTERED, // Target queue does not exist
+	INJECT_MALFORMED,            // Frame could not be parsed (id is 0)
+	INJECT_GROUP_SIZE_MISMATCH,  // Group size differs from the queue's packet_count
+	INJECT_TEMPLATE_FAILED,      // Template unknown, argument missing or slot could not be filled
+	INJECT_DROPPED,              // Queue was unregistered/cleared before the packet was injected
+	INJECT_RESULT_COUNT,
+};
+
+// Latency histogram buckets: bucket i counts values in [2^i, 2^(i+1)) microseconds (bucket 0 includes 0)
+#define INJECT_LATENCY_BUCKETS 24
+
+// Packet template constants
+#define MAX_TEMPLATE_SLOTS 16
+#define MAX_TEMPLATE_ARGS 16
+
+// Slot types for packet templates
+enum TemplateSlotType {
+	SLOT_TIMESTAMP,    // GetTickCount() at injection time
+	SLOT_COUNTER,      // param1 + param2 * n, n increments on every injection of the template
+	SLOT_RANDOM,       // Random value in [param1, param2]
+	SLOT_LAST_SEEN,    // Last value seen at offset param2 of received opcode param1
+	SLOT_ARGUMENT,     // Client-supplied argument number param1
+};
 
 // Packet editor message structure
 typedef struct {
@@ -115,4 +260,353 @@ typedef struct {
 	DWORD packet_intervals_ms[MAX_PACKETS_PER_QUEUE];  // Delay BEFORE injecting each packet in the group (in ms)
 } QueueConfigMessage;
 
+// Bulk group injection (client → DLL), header = INJECT_GROUP
+// groups[] holds group_count groups, each laid out as:
+//   BYTE packet_count (1-8) followed by packet_count InjectGroupPacket entries
+typedef struct {
+	MessageHeader header;                     // INJECT_GROUP
+	char queue_name[MAX_QUEUE_NAME_LENGTH];  // Target queue (must be registered)
+	DWORD group_count;                        // Number of groups in this frame
+	BYTE groups[1];                           // Packed group list
+} InjectGroupMessage;
+
+// One length-prefixed packet inside an InjectGroupMessage group
+typedef struct {
+	MessageHeader header;                     // SENDPACKET or RECVPACKET
+	DWORD id;                                 // Client-chosen id (0 if unused)
+	DWORD length;                             // Packet size
+	BYTE packet[1];                           // Packet data
+} InjectGroupPacket;
+
+// One typed slot of a packet template, written little-endian over the template bytes
+typedef struct {
+	BYTE type;                                // TemplateSlotType
+	BYTE size;                                // Value size (1, 2, 4 or 8)
+	BYTE padding[2];                          // Padding for alignment
+	DWORD offset;                             // Offset in the packet (opcode included)
+	ULONGLONG param1;                         // See TemplateSlotType
+	ULONGLONG param2;                         // See TemplateSlotType
+} TemplateSlot;
+
+// Packet template registration (client → DLL), header = REGISTER_TEMPLATE
+// Re-registering an existing template_id replaces it
+typedef struct {
+	MessageHeader header;                     // REGISTER_TEMPLATE
+	DWORD template_id;                        // Client-chosen id (non-zero)
+	MessageHeader packet_type;                // SENDPACKET or RECVPACKET
+	BYTE slot_count;                          // Number of slots in use (0-16)
+	BYTE padding[3];                          // Padding for alignment
+	TemplateSlot slots[MAX_TEMPLATE_SLOTS];   // Slot definitions
+	DWORD length;                             // Template packet size
+	BYTE packet[1];                           // Template packet, slot bytes are placeholders
+} TemplateConfigMessage;
+
+// Template removal (client → DLL), header = UNREGISTER_TEMPLATE
+typedef struct {
+	MessageHeader header;                     // UNREGISTER_TEMPLATE
+	DWORD template_id;                        // Template to remove
+} TemplateRemoveMessage;
+
+// Templated group injection (client → DLL), header = INJECT_TEMPLATE
+// packets[] holds packet_count InjectTemplatePacket entries forming one group
+typedef struct {
+	MessageHeader header;                     // INJECT_TEMPLATE
+	char queue_name[MAX_QUEUE_NAME_LENGTH];  // Target queue (must be registered)
+	DWORD packet_count;                       // Packets in the group (1-8)
+	BYTE packets[1];                          // Packed InjectTemplatePacket list
+} InjectTemplateMessage;
+
+// One templated packet inside an InjectTemplateMessage
+typedef struct {
+	DWORD template_id;                        // Registered template
+	DWORD id;                                 // Client-chosen id (0 if unused)
+	DWORD arg_count;                          // Number of arguments (0-16)
+	ULONGLONG args[1];                        // Values for SLOT_ARGUMENT slots
+} InjectTemplatePacket;
+
+// Queue shaping (client → DLL), header = SET_QUEUE_SHAPING
+typedef struct {
+	MessageHeader header;                     // SET_QUEUE_SHAPING
+	char queue_name[MAX_QUEUE_NAME_LENGTH];  // Registered queue
+	DWORD rate_pps;                           // Token refill rate in packets per second (0 = unlimited)
+	DWORD burst;                              // Bucket capacity in packets (0 = 1)
+	BYTE priority;                            // Priority class (0 = highest, 3 = lowest)
+	BYTE padding[3];                          // Padding for alignment
+} QueueShapingMessage;
+
+// Global injection ceiling (client → DLL), header = SET_GLOBAL_RATE
+typedef struct {
+	MessageHeader header;                     // SET_GLOBAL_RATE
+	DWORD rate_pps;                           // Packets per second over all queues (0 = unlimited)
+	DWORD burst;                              // Bucket capacity in packets (0 = 1)
+} GlobalRateMessage;
+
+// Acknowledgement control (client → DLL), header = SET_ACKS
+typedef struct {
+	MessageHeader header;                     // SET_ACKS
+	DWORD enabled;                            // 1 = send INJECT_ACK for every injection from this connection
+} AckControlMessage;
+
+// Injection acknowledgement (DLL → client), header = INJECT_ACK
+// Timestamps are microseconds on the DLL's monotonic clock, 0 if the stage was not reached
+typedef struct {
+	MessageHeader header;                     // INJECT_ACK
+	DWORD id;                                 // Request id (PacketEditorMessage/InjectGroupPacket/InjectTemplatePacket id)
+	DWORD result;                             // InjectResult
+	char queue_name[MAX_QUEUE_NAME_LENGTH];  // Target queue
+	ULONGLONG received_us;                    // Frame received from TCP
+	ULONGLONG scheduled_us;                   // Picked by the injector
+	ULONGLONG executed_us;                    // SendPacket/ProcessPacket returned
+} InjectAckMessage;
+
+// Injection statistics (DLL → client), header = INJECT_STATS, reply to GET_INJECT_STATS
+typedef struct {
+	MessageHeader header;                     // INJECT_STATS
+	DWORD results[INJECT_RESULT_COUNT];       // Count per InjectResult
+	DWORD queue_wait_us[INJECT_LATENCY_BUCKETS];  // received → scheduled
+	DWORD exec_us[INJECT_LATENCY_BUCKETS];        // scheduled → executed
+} InjectStatsMessage;
+
+// Byte-mask predicate of a rule: (little-endian value at offset & mask) == value
+typedef struct {
+	DWORD offset;                             // Offset in the packet (opcode included)
+	BYTE length;                              // Bytes compared (1-8)
+	BYTE padding[3];                          // Padding for alignment
+	ULONGLONG mask;                           // Applied before comparing
+	ULONGLONG value;                          // Expected masked value
+} RulePredicate;
+
+// Field copied out of a matching packet, extracted values become template arguments in order
+typedef struct {
+	DWORD offset;                             // Offset in the packet (opcode included)
+	BYTE size;                                // 1, 2, 4 or 8 bytes (little-endian)
+	BYTE padding[3];                          // Padding for alignment
+} RuleExtract;
+
+// Reactive rule registration (client → DLL), header = REGISTER_RULE
+// Evaluated inside the hooks; a match instantiates template_id and queues it into queue_name
+typedef struct {
+	MessageHeader header;                     // REGISTER_RULE
+	DWORD rule_id;                            // Client-chosen id (non-zero), re-registering replaces
+	MessageHeader direction;                  // SENDPACKET or RECVPACKET
+	WORD opcode;                              // Opcode to match
+	BYTE predicate_count;                     // 0-8
+	BYTE extract_count;                       // 0-16
+	RulePredicate predicates[MAX_RULE_PREDICATES];
+	RuleExtract extracts[MAX_TEMPLATE_ARGS];
+	DWORD template_id;                        // Template to emit
+	char queue_name[MAX_QUEUE_NAME_LENGTH];  // Queue the packet is injected into (packet_count must be 1)
+	DWORD cooldown_ms;                        // Minimum time between two firings (0 = none)
+} RuleConfigMessage;
+
+// Rule removal (client → DLL), header = UNREGISTER_RULE
+typedef struct {
+	MessageHeader header;                     // UNREGISTER_RULE
+	DWORD rule_id;                            // Rule to remove
+} RuleRemoveMessage;
+
+// One filter VM instruction
+typedef struct {
+	BYTE code;                                // FilterOpcode
+	BYTE size;                                // Load/store width: 1, 2, 4 or 8
+	BYTE jt;                                  // Jump offset if true (FILTER_JA: always)
+	BYTE jf;                                  // Jump offset if false
+	DWORD offset;                             // Packet offset of loads/stores (opcode included)
+	ULONGLONG k;                              // Immediate operand
+} FilterInsn;
+
+// Filter program upload (client → DLL), header = REGISTER_FILTER
+// Programs run in program_id order on every packet of their direction, before the original function
+typedef struct {
+	MessageHeader header;                     // REGISTER_FILTER
+	DWORD program_id;                         // Client-chosen id (non-zero), re-registering replaces
+	MessageHeader direction;                  // SENDPACKET or RECVPACKET
+	DWORD insn_count;                         // 1-64, the last instruction must be a FILTER_RET_*
+	FilterInsn insns[1];                      // insn_count instructions
+} FilterProgramMessage;
+
+// Filter program removal (client → DLL), header = UNREGISTER_FILTER
+typedef struct {
+	MessageHeader header;                     // UNREGISTER_FILTER
+	DWORD program_id;                         // Program to remove
+} FilterRemoveMessage;
+
+// Counters of one filter program
+typedef struct {
+	DWORD program_id;
+	MessageHeader direction;
+	ULONGLONG runs;                           // Packets the program ran on
+	ULONGLONG drops;                          // Packets it blocked
+	ULONGLONG rewrites;                       // Packets it modified
+	ULONGLONG insns_executed;                 // Instructions executed over all runs
+	ULONGLONG total_ns;                       // Time spent in the program
+	ULONGLONG max_ns;                         // Slowest single run
+} FilterProgramStats;
+
+// Filter statistics (DLL → client), header = FILTER_STATS
+typedef struct {
+	MessageHeader header;                     // FILTER_STATS
+	DWORD program_count;
+	FilterProgramStats programs[1];           // program_count entries
+} FilterStatsMessage;
+
+// Subscription of a connection (client → DLL), header = SUBSCRIBE
+// Connections receive everything until they subscribe, a new SUBSCRIBE replaces the previous one
+typedef struct {
+	MessageHeader header;                     // SUBSCRIBE
+	DWORD flags;                              // SUBSCRIBE_* flags
+	DWORD opcode_mode;                        // SubscribeOpcodeMode
+	BYTE opcodes[0x10000 / 8];                // Bit (opcode & 7) of byte (opcode >> 3)
+} SubscribeMessage;
+
+// Compression negotiation (client → DLL and reply DLL → client), header = SET_COMPRESSION
+// The reply's codec is the one the DLL will use, COMPRESSION_NONE if the requested one is unknown
+typedef struct {
+	MessageHeader header;                     // SET_COMPRESSION
+	DWORD codec;                              // CompressionCodec
+} CompressionMessage;
+
+// Coalesced capture frames (DLL → client), header = COMPRESSED_BATCH
+// data decodes to raw_length bytes holding frame_count complete frames (magic + length + data)
+typedef struct {
+	MessageHeader header;                     // COMPRESSED_BATCH
+	DWORD codec;                              // CompressionCodec of data
+	DWORD raw_length;                         // Size of the decoded frames
+	DWORD frame_count;
+	BYTE data[1];
+} CompressedBatchMessage;
+
+// Capture stream counters of one connection
+typedef struct {
+	DWORD client_id;
+	DWORD codec;                              // CompressionCodec in use
+	ULONGLONG published;                      // Messages queued or attempted for this connection
+	ULONGLONG dropped;                        // Messages lost because its write queue was full
+	ULONGLONG batches;                        // COMPRESSED_BATCH messages sent
+	ULONGLONG raw_bytes;                      // Frame bytes before compression
+	ULONGLONG compressed_bytes;               // Frame bytes after compression
+	ULONGLONG compress_ns;                    // Time spent compressing
+	ULONGLONG delta_messages;                 // Packets sent as DELTA_PACKET
+	ULONGLONG repeated_messages;              // Packets folded into REPEAT_PACKET runs
+	DWORD encoding;                           // ENCODING_* flags in use
+	ULONGLONG compact_messages;               // Messages sent as COMPACT_MESSAGE
+	ULONGLONG symbols_defined;                // DEFINE_SYMBOL messages sent
+	DWORD flow_policy;                        // FlowControlPolicy in use
+	LONGLONG credit_messages;                 // Credit left (may be negative by one frame, 0 when not limited)
+	LONGLONG credit_bytes;
+	ULONGLONG credit_dropped;                 // Messages dropped by the flow control policy (included in dropped)
+	DWORD backlog_frames;                     // Frames held back waiting for credit
+	ULONGLONG spilled;                        // Messages that went through the overflow file (FLOW_CONTROL_SPILL)
+	ULONGLONG spill_bytes;                    // Bytes in the overflow file now
+} SubscriberStats;
+
+// Capture stream statistics (DLL → client), header = SUBSCRIBER_STATS
+typedef struct {
+	MessageHeader header;                     // SUBSCRIBER_STATS
+	DWORD subscriber_count;
+	SubscriberStats subscribers[1];           // subscriber_count entries
+} SubscriberStatsMessage;
+
+// Stream encoding selection (client → DLL and reply DLL → client), header = SET_ENCODING
+// The reply's flags are the encodings the DLL will use, unknown flags are cleared
+typedef struct {
+	MessageHeader header;                     // SET_ENCODING
+	DWORD flags;                              // ENCODING_* flags
+} EncodingMessage;
+
+// Packet encoded against the previous packet of (direction, opcode) sent on this connection (DLL → client), header = DELTA_PACKET
+// Decodes (PacketCompress.h DeltaDecode) to the PacketEditorMessage fields below plus Binary.packet
+typedef struct {
+	MessageHeader header;                     // DELTA_PACKET
+	MessageHeader direction;                  // SENDPACKET or RECVPACKET
+	DWORD id;
+	ULONGLONG addr;
+	WORD opcode;                              // Selects the previous packet
+	DWORD length;                             // Packet size after decoding
+	BYTE delta[1];                            // XOR against the previous packet, run-length encoded
+} DeltaPacketMessage;
+
+// Run of packets identical to the previous packet of (direction, opcode) (DLL → client), header = REPEAT_PACKET
+// Stands for count packets with ids first_id, first_id + 2, ... (consecutive ids of the direction)
+typedef struct {
+	MessageHeader header;                     // REPEAT_PACKET
+	MessageHeader direction;                  // SENDPACKET or RECVPACKET
+	DWORD first_id;
+	ULONGLONG addr;
+	WORD opcode;
+	DWORD count;
+} RepeatPacketMessage;
+
+// Dictionary entry of this connection (DLL → client), header = DEFINE_SYMBOL
+// Sent before the first message using it; ids count up from 0 per kind and restart when the dictionaries are reset
+typedef struct {
+	MessageHeader header;                     // DEFINE_SYMBOL
+	DWORD kind;                               // SymbolKind
+	WORD symbol;
+	DWORD length;                             // Size of value
+	BYTE value[1];
+} SymbolDefineMessage;
+
+// PacketEditorMessage with its address as a dictionary id (DLL → client), header = COMPACT_MESSAGE
+// body is the PacketEditorMessage union without padding: Binary (length + packet) for SEND/RECV,
+// Extra (pos, size, update, data when updated) for traces, with COMPACT_STRING_SYMBOL data is a WORD string symbol
+typedef struct {
+	MessageHeader header;                     // COMPACT_MESSAGE
+	BYTE type;                                // Original MessageHeader
+	BYTE flags;                               // COMPACT_* flags
+	WORD addr_symbol;                         // SYMBOL_ADDRESS id of addr
+	DWORD id;
+	BYTE body[1];
+} CompactMessage;
+
+// Credit grant (client → DLL), header = GRANT_CREDIT, not replied
+// Credit adds up over grants and is spent when a frame is queued to the connection (frame bytes including magic + length,
+// messages as decoded by the client). A unit that was never granted isn't limited. policy FLOW_CONTROL_OFF turns flow
+// control off and releases what was held back
+typedef struct {
+	MessageHeader header;                     // GRANT_CREDIT
+	DWORD policy;                             // FlowControlPolicy
+	DWORD messages;                           // Messages to add (0 = none)
+	DWORD bytes;                              // Bytes to add (0 = none)
+} CreditMessage;
+
+// Flight recorder dump request (client → DLL), header = FLIGHT_DUMP
+typedef struct {
+	MessageHeader header;                     // FLIGHT_DUMP
+	DWORD target;                             // FLIGHT_DUMP_* flags
+	DWORD seconds;                            // Seconds back from now (0 = RECORDER_SECONDS)
+} FlightDumpMessage;
+
+// One part of a flight recorder dump (DLL → client), header = FLIGHT_RECORDING
+// The parts of a dump make up a capture segment file (CaptureSegmentHeader + CaptureRecords), the last one ends at total_size
+typedef struct {
+	MessageHeader header;                     // FLIGHT_RECORDING
+	DWORD dump_id;                            // Same in every part of one dump
+	DWORD offset;                             // Offset of data in the file
+	DWORD total_size;                         // File size, 0 if the recorder is off
+	BYTE data[1];                             // Up to FLIGHT_RECORDING_CHUNK_SIZE bytes
+} FlightRecordingMessage;
+
+// Resume the capture stream (client → DLL), header = RESUME
+// Retained messages from sequence on are replayed before live ones, 0 only turns numbering on
+typedef struct {
+	MessageHeader header;                     // RESUME
+	ULONGLONG sequence;                       // First sequence the client doesn't have (0 = none, live only)
+} ResumeMessage;
+
+// Sequence of the next capture stream message (DLL → client), header = STREAM_SEQUENCE
+// Sent on numbered connections when that message doesn't follow the previous one sent, later messages count up by 1
+// (a REPEAT_PACKET counts as its repeats, DEFINE_SYMBOL and messages that aren't capture stream messages don't count)
+typedef struct {
+	MessageHeader header;                     // STREAM_SEQUENCE
+	ULONGLONG sequence;
+} StreamSequenceMessage;
+
+// Messages lost to a RESUME (DLL → client), header = STREAM_GAP
+typedef struct {
+	MessageHeader header;                     // STREAM_GAP
+	ULONGLONG first;                          // First sequence that is no longer retained
+	ULONGLONG count;                          // Number of sequences lost
+} StreamGapMessage;
+
 #pragma pack(pop)
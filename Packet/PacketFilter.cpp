@@ -0,0 +1,308 @@
+﻿// PacketFilter.cpp - Bounded filter/rewrite VM run by the hooks to block or modify packets in place
+#include"PacketFilter.h"
+#include"PacketSender.h"
+#include"../Share/Simple/DebugLog.h"
+#include <map>
+#include <vector>
+
+struct FilterProgram {
+	DWORD program_id;
+	MessageHeader direction;
+	std::vector<FilterInsn> insns;
+	FilterProgramStats stats;
+};
+
+// Installed programs keyed by id, so each direction runs them in program_id order
+std::map<DWORD, FilterProgram> filter_programs;
+
+// Programs per direction, read without the lock so unfiltered packets cost one comparison
+volatile LONG filter_program_count[2] = { 0, 0 };
+
+CRITICAL_SECTION filter_cs;
+bool filter_initialized = false;
+LARGE_INTEGER filter_qpc_frequency;
+
+void InitFilterLock() {
+	if (!filter_initialized) {
+		InitializeCriticalSection(&filter_cs);
+		QueryPerformanceFrequency(&filter_qpc_frequency);
+		filter_initialized = true;
+	}
+}
+
+bool IsFilterAccessSize(BYTE size) {
+	return size == 1 || size == 2 || size == 4 || size == 8;
+}
+
+// Reject anything that could read out of the program, loop or fall off its end
+bool VerifyFilterProgram(const FilterInsn* insns, DWORD insn_count, std::wstring& error) {
+	if (insn_count == 0 || insn_count > MAX_FILTER_INSNS) {
+		error = L"instruction count " + std::to_wstring(insn_count);
+		return false;
+	}
+
+	for (DWORD pc = 0; pc < insn_count; pc++) {
+		const FilterInsn& insn = insns[pc];
+		DWORD next = pc + 1;
+
+		switch (insn.code) {
+		case FILTER_LD:
+		case FILTER_LDX:
+		case FILTER_ST:
+		case FILTER_STX:
+			if (!IsFilterAccessSize(insn.size)) {
+				error = L"access size " + std::to_wstring(insn.size) + L" at " + std::to_wstring(pc);
+				return false;
+			}
+			break;
+		case FILTER_LSH:
+		case FILTER_RSH:
+			if (insn.k >= 64) {
+				error = L"shift " + std::to_wstring(insn.k) + L" at " + std::to_wstring(pc);
+				return false;
+			}
+			break;
+		case FILTER_JA:
+			if (next + insn.jt >= insn_count) {
+				error = L"jump out of program at " + std::to_wstring(pc);
+				return false;
+			}
+			break;
+		case FILTER_JEQ:
+		case FILTER_JGT:
+		case FILTER_JGE:
+		case FILTER_JSET:
+			if (next + insn.jt >= insn_count || next + insn.jf >= insn_count) {
+				error = L"jump out of program at " + std::to_wstring(pc);
+				return false;
+			}
+			break;
+		case FILTER_LD_LEN:
+		case FILTER_LD_IMM:
+		case FILTER_TAX:
+		case FILTER_TXA:
+		case FILTER_AND:
+		case FILTER_OR:
+		case FILTER_XOR:
+		case FILTER_ADD:
+		case FILTER_SUB:
+		case FILTER_RET_PASS:
+		case FILTER_RET_DROP:
+			break;
+		default:
+			error = L"unknown opcode " + std::to_wstring(insn.code) + L" at " + std::to_wstring(pc);
+			return false;
+		}
+	}
+
+	BYTE last = insns[insn_count - 1].code;
+	if (last != FILTER_RET_PASS && last != FILTER_RET_DROP) {
+		error = L"program does not end with a return";
+		return false;
+	}
+	return true;
+}
+
+// Register (or replace) a filter program
+bool RegisterFilter(const FilterProgramMessage& program, size_t message_size) {
+	if (program.program_id == 0) {
+		DEBUGLOG(L"[FILTER] ERROR: program_id 0 is reserved");
+		return false;
+	}
+	if (program.direction != SENDPACKET && program.direction != RECVPACKET) {
+		DEBUGLOG(L"[FILTER] ERROR: Invalid direction " + std::to_wstring(program.direction));
+		return false;
+	}
+	if (program.insn_count > MAX_FILTER_INSNS ||
+		message_size < offsetof(FilterProgramMessage, insns) + program.insn_count * sizeof(FilterInsn)) {
+		DEBUGLOG(L"[FILTER] ERROR: Program " + std::to_wstring(program.program_id) + L" truncated (" +
+			std::to_wstring(program.insn_count) + L" instructions, " + std::to_wstring(message_size) + L" bytes)");
+		return false;
+	}
+
+	std::wstring error;
+	if (!VerifyFilterProgram(program.insns, program.insn_count, error)) {
+		DEBUGLOG(L"[FILTER] ERROR: Program " + std::to_wstring(program.program_id) + L" rejected: " + error);
+		return false;
+	}
+
+	FilterProgram installed;
+	installed.program_id = program.program_id;
+	installed.direction = program.direction;
+	installed.insns.assign(program.insns, program.insns + program.insn_count);
+	memset(&installed.stats, 0, sizeof(installed.stats));
+	installed.stats.program_id = program.program_id;
+	installed.stats.direction = program.direction;
+
+	InitFilterLock();
+	EnterCriticalSection(&filter_cs);
+	auto existing = filter_programs.find(program.program_id);
+	if (existing == filter_programs.end() && filter_programs.size() >= MAX_FILTER_PROGRAMS) {
+		LeaveCriticalSection(&filter_cs);
+		DEBUGLOG(L"[FILTER] ERROR: Too many programs, " + std::to_wstring(program.program_id) + L" rejected");
+		return false;
+	}
+	if (existing != filter_programs.end()) {
+		InterlockedDecrement(&filter_program_count[existing->second.direction == RECVPACKET]);
+	}
+	filter_programs[program.program_id] = installed;
+	InterlockedIncrement(&filter_program_count[installed.direction == RECVPACKET]);
+	LeaveCriticalSection(&filter_cs);
+
+	DEBUGLOG(L"[FILTER] Registered program " + std::to_wstring(program.program_id) + L" (" +
+		std::wstring(program.direction == SENDPACKET ? L"SEND" : L"RECV") + L", " +
+		std::to_wstring(program.insn_count) + L" instructions)");
+	return true;
+}
+
+bool UnregisterFilter(DWORD program_id) {
+	InitFilterLock();
+	EnterCriticalSection(&filter_cs);
+	auto program_it = filter_programs.find(program_id);
+	bool removed = (program_it != filter_programs.end());
+	ULONGLONG runs = 0, drops = 0;
+	if (removed) {
+		runs = program_it->second.stats.runs;
+		drops = program_it->second.stats.drops;
+		InterlockedDecrement(&filter_program_count[program_it->second.direction == RECVPACKET]);
+		filter_programs.erase(program_it);
+	}
+	LeaveCriticalSection(&filter_cs);
+
+	if (removed) {
+		DEBUGLOG(L"[FILTER] Unregistered program " + std::to_wstring(program_id) + L" (runs=" +
+			std::to_wstring(runs) + L", drops=" + std::to_wstring(drops) + L")");
+	}
+	return removed;
+}
+
+bool FilterAccessInRange(ULONGLONG offset, BYTE size, DWORD length) {
+	return offset <= length && length - offset >= size;
+}
+
+// Returns true to drop; loads out of range end the program with pass
+bool ExecuteFilterProgram(FilterProgram& program, BYTE* packet, DWORD length, bool& rewritten) {
+	const FilterInsn* insns = &program.insns[0];
+	DWORD insn_count = (DWORD)program.insns.size();
+	ULONGLONG A = 0, X = 0;
+	DWORD executed = 0;
+	bool drop = false;
+
+	for (DWORD pc = 0; pc < insn_count; pc++) {
+		const FilterInsn& insn = insns[pc];
+		executed++;
+
+		if (insn.code == FILTER_RET_PASS || insn.code == FILTER_RET_DROP) {
+			drop = (insn.code == FILTER_RET_DROP);
+			break;
+		}
+
+		switch (insn.code) {
+		case FILTER_LD:
+		case FILTER_LDX: {
+			ULONGLONG offset = insn.offset + ((insn.code == FILTER_LDX) ? X : 0);
+			if (!FilterAccessInRange(offset, insn.size, length)) {
+				pc = insn_count;
+				break;
+			}
+			A = 0;
+			for (BYTE i = 0; i < insn.size; i++) {
+				A |= (ULONGLONG)packet[offset + i] << (i * 8);
+			}
+			break;
+		}
+		case FILTER_ST:
+		case FILTER_STX: {
+			ULONGLONG offset = insn.offset + ((insn.code == FILTER_STX) ? X : 0);
+			if (!FilterAccessInRange(offset, insn.size, length)) {
+				pc = insn_count;
+				break;
+			}
+			for (BYTE i = 0; i < insn.size; i++) {
+				packet[offset + i] = (BYTE)(A >> (i * 8));
+			}
+			rewritten = true;
+			break;
+		}
+		case FILTER_LD_LEN: A = length; break;
+		case FILTER_LD_IMM: A = insn.k; break;
+		case FILTER_TAX: X = A; break;
+		case FILTER_TXA: A = X; break;
+		case FILTER_AND: A &= insn.k; break;
+		case FILTER_OR: A |= insn.k; break;
+		case FILTER_XOR: A ^= insn.k; break;
+		case FILTER_ADD: A += insn.k; break;
+		case FILTER_SUB: A -= insn.k; break;
+		case FILTER_LSH: A <<= insn.k; break;
+		case FILTER_RSH: A >>= insn.k; break;
+		case FILTER_JA: pc += insn.jt; break;
+		case FILTER_JEQ: pc += (A == insn.k) ? insn.jt : insn.jf; break;
+		case FILTER_JGT: pc += (A > insn.k) ? insn.jt : insn.jf; break;
+		case FILTER_JGE: pc += (A >= insn.k) ? insn.jt : insn.jf; break;
+		case FILTER_JSET: pc += (A & insn.k) ? insn.jt : insn.jf; break;
+		default: pc = insn_count; break;
+		}
+	}
+
+	program.stats.insns_executed += executed;
+	return drop;
+}
+
+// Runs on the thread that called the hook, usually the game's main thread
+bool RunPacketFilters(MessageHeader direction, BYTE* packet, DWORD length) {
+	if (filter_program_count[direction == RECVPACKET] == 0) {
+		return false;
+	}
+
+	// Packets of the injector are sent as requested
+	if (IsInjectingPacket()) {
+		return false;
+	}
+
+	bool drop = false;
+
+	EnterCriticalSection(&filter_cs);
+	for (auto& program_kv : filter_programs) {
+		FilterProgram& program = program_kv.second;
+		if (program.direction != direction) {
+			continue;
+		}
+
+		LARGE_INTEGER start, end;
+		QueryPerformanceCounter(&start);
+		bool rewritten = false;
+		drop = ExecuteFilterProgram(program, packet, length, rewritten);
+		QueryPerformanceCounter(&end);
+
+		ULONGLONG elapsed_ns = (ULONGLONG)(end.QuadPart - start.QuadPart) * 1000000000 / filter_qpc_frequency.QuadPart;
+		program.stats.runs++;
+		program.stats.total_ns += elapsed_ns;
+		if (elapsed_ns > program.stats.max_ns) {
+			program.stats.max_ns = elapsed_ns;
+		}
+		if (rewritten) {
+			program.stats.rewrites++;
+		}
+		if (drop) {
+			program.stats.drops++;
+			break;
+		}
+	}
+	LeaveCriticalSection(&filter_cs);
+
+	return drop;
+}
+
+void GetFilterStats(std::vector<BYTE>& message) {
+	InitFilterLock();
+	EnterCriticalSection(&filter_cs);
+	message.assign(offsetof(FilterStatsMessage, programs) + filter_programs.size() * sizeof(FilterProgramStats), 0);
+	FilterStatsMessage* stats = (FilterStatsMessage*)&message[0];
+	stats->header = FILTER_STATS;
+	stats->program_count = (DWORD)filter_programs.size();
+	DWORD index = 0;
+	for (auto& program_kv : filter_programs) {
+		stats->programs[index++] = program_kv.second.stats;
+	}
+	LeaveCriticalSection(&filter_cs);
+}
@@ -0,0 +1,19 @@
+﻿#ifndef __PACKET_FILTER_H__
+#define __PACKET_FILTER_H__
+
+#include<Windows.h>
+#include<vector>
+#include"PacketDefs.h"
+
+// Filter program registry (called from the TCP thread), programs are verified before they are installed
+bool RegisterFilter(const FilterProgramMessage& program, size_t message_size);
+bool UnregisterFilter(DWORD program_id);
+
+// Run the programs of direction on a packet before the original function is called
+// The packet may be rewritten in place, returns true if a program dropped it
+bool RunPacketFilters(MessageHeader direction, BYTE* packet, DWORD length);
+
+// FILTER_STATS message with the counters of every installed program
+void GetFilterStats(std::vector<BYTE>& message);
+
+#endif
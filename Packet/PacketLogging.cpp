@@ -1,6 +1,12 @@
 ﻿#include"PacketLogging.h"
 #include"PacketQueue.h"
 #include"../Share/Simple/DebugLog.h"
+#include"PacketTemplate.h"
+#include"PacketRules.h"
+#include"PacketFilter.h"
+#include"PacketSubscribers.h"
+#include"PacketCapture.h"
+#include"PacketRecorder.h"
 
 //DWORD packet_id_out = (GetCurrentProcessId() << 16); // 偶数
 //DWORD packet_id_in = (GetCurrentProcessId() << 16) + 1; // 奇数
@@ -61,6 +67,11 @@ void AddExtra(PacketExtraInformation &pxi) {
 		return; // Queue not initialized
 	}
 
+	// Nobody subscribed to format traces and they aren't recorded
+	if (!SubscribersWantTraces() && !CaptureWantsTraces() && !RecorderWantsTraces()) {
+		return;
+	}
+
 	size_t total_size = sizeof(PacketEditorMessage) + pxi.size;
 	size_t buffer_index;
 	BYTE* b = g_BufferPool->Allocate(total_size, buffer_index);
@@ -119,6 +130,7 @@ void ClearQueue(OutPacket *op) {
 
 void AddQueue(PacketExtraInformation &pxi) {
 	if (!tracking_cs_initialized) return;
+	if (!SubscribersWantTraces() && !CaptureWantsTraces() && !RecorderWantsTraces()) return;
 
 	//DEBUG(L"debug... ID : " + std::to_wstring(pxi.id) + L", " + std::to_wstring(pxi.pos) + L", " + std::to_wstring(pxi.size));
 	ULONG_PTR tracking_id = pxi.tracking;
@@ -155,6 +167,24 @@ void AddExtraAll(OutPacket *op) {
 void AddSendPacket(OutPacket *op, ULONG_PTR addr, bool &bBlock) {
 	AddExtraAll(op);
 
+	bool bFiltered = false;
+	if (op->encoded >= sizeof(WORD)) {
+#ifdef _WIN64
+		// Programs see the plain opcode; an encrypted header can't be rewritten
+		WORD wEncryptedHeader = *(WORD *)&op->packet[0];
+		if (op->header) {
+			*(WORD *)&op->packet[0] = op->header;
+		}
+		bFiltered = RunPacketFilters(SENDPACKET, op->packet, op->encoded);
+		if (op->header) {
+			*(WORD *)&op->packet[0] = wEncryptedHeader;
+		}
+#else
+		bFiltered = RunPacketFilters(SENDPACKET, op->packet, op->encoded);
+#endif
+	}
+	bBlock = bFiltered;
+
 	if (!g_BufferPool || !g_PacketQueue) {
 		static bool logged_init_error = false;
 		if (!logged_init_error) {
@@ -195,10 +225,16 @@ void AddSendPacket(OutPacket *op, ULONG_PTR addr, bool &bBlock) {
 	}
 #endif
 
-	bBlock = false;
+	// Rules see the plain opcode, the buffer is handed to the capture worker right after
+	if (!bFiltered) {
+		EvaluatePacketRules(SENDPACKET, pem->Binary.packet, pem->Binary.length);
+	}
+
+	bBlock = bFiltered;
 
 	// If blocking enabled, wait for response. Otherwise send async (much faster!)
-	if (g_EnableBlocking) {
+	// A packet dropped by a filter is still captured but never waits for the client
+	if (g_EnableBlocking && !bFiltered) {
 		g_PacketQueue->QueuePacketBlocking(b, total_size, buffer_index, bBlock);
 	} else {
 		g_PacketQueue->QueuePacket(b, total_size, buffer_index);
@@ -206,6 +242,14 @@ void AddSendPacket(OutPacket *op, ULONG_PTR addr, bool &bBlock) {
 }
 
 void AddRecvPacket(InPacket *ip, ULONG_PTR addr, bool &bBlock) {
+	// Keep last-seen template fields current even when capture is unavailable
+	bool bFiltered = RunPacketFilters(RECVPACKET, &ip->packet[4], ip->size);
+	bBlock = bFiltered;
+	if (!bFiltered) {
+		UpdateTemplateWatches(&ip->packet[4], ip->size);
+		EvaluatePacketRules(RECVPACKET, &ip->packet[4], ip->size);
+	}
+
 	if (!g_BufferPool || !g_PacketQueue) {
 		static bool logged_init_error = false;
 		if (!logged_init_error) {
@@ -239,10 +283,10 @@ void AddRecvPacket(InPacket *ip, ULONG_PTR addr, bool &bBlock) {
 	pem->Binary.length = ip->size;
 	memcpy_s(pem->Binary.packet, ip->size, &ip->packet[4], ip->size);
 
-	bBlock = false;
+	bBlock = bFiltered;
 
 	// If blocking enabled, wait for response. Otherwise send async (much faster!)
-	if (g_EnableBlocking) {
+	if (g_EnableBlocking && !bFiltered) {
 		g_PacketQueue->QueuePacketBlocking(b, total_size, buffer_index, bBlock);
 	} else {
 		g_PacketQueue->QueuePacket(b, total_size, buffer_index);
@@ -256,6 +300,7 @@ int g_TCPPort = 8275;
 // TCP functions implemented in PacketTCP.cpp
 extern bool SendPacketDataTCP(BYTE *bData, ULONG_PTR uLength);
 extern bool RecvPacketDataTCP(std::vector<BYTE> &vData);
+extern void FlushPacketDataTCP();
 
 // TCP-only implementation (pipe removed)
 bool SendPacketData(BYTE *bData, ULONG_PTR uLength) {
@@ -266,4 +311,8 @@ bool SendPacketData(BYTE *bData, ULONG_PTR uLength) {
 bool RecvPacketData(std::vector<BYTE> &vData) {
 	// TCP-only implementation
 	return RecvPacketDataTCP(vData);
+}
+
+void FlushPacketData() {
+	FlushPacketDataTCP();
 }
\ No newline at end of file
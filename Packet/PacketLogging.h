@@ -41,6 +41,7 @@ bool RestartTCPClient();
 // TCP-only interface for sending packets
 bool SendPacketData(BYTE *bData, ULONG_PTR uLength);
 bool RecvPacketData(std::vector<BYTE> &vData);
+void FlushPacketData();  // After a batch of SendPacketData calls and when idle (compressed subscribers send their batch, lossless ones their spill)
 
 
 #endif
\ No newline at end of file
@@ -3,6 +3,8 @@
 #include"PacketDefs.h"
 #include"PacketQueue.h"
 #include"PacketLogging.h"
+#include"PacketCapture.h"
+#include"PacketRecorder.h"
 
 PacketBufferPool* g_BufferPool = NULL;
 AsyncPacketQueue* g_PacketQueue = NULL;
@@ -138,7 +140,9 @@ bool AsyncPacketQueue::QueuePacket(BYTE* data, size_t size, size_t buffer_index)
 	qp.response_event = NULL;
 	qp.block_result = false;
 
+	// Taken under the lock so capture times never go backwards in queue order (the capture index relies on it)
 	EnterCriticalSection(&queue_cs);
+	QueryPerformanceCounter(&qp.captured);
 	packet_queue.push(qp);
 	size_t queue_size = packet_queue.size();
 	LeaveCriticalSection(&queue_cs);
@@ -175,6 +179,7 @@ bool AsyncPacketQueue::QueuePacketBlocking(BYTE* data, size_t size, size_t buffe
 	}
 
 	EnterCriticalSection(&queue_cs);
+	QueryPerformanceCounter(&qp.captured);
 	packet_queue.push(qp);
 	LeaveCriticalSection(&queue_cs);
 
@@ -220,6 +225,10 @@ void AsyncPacketQueue::ProcessQueue() {
 
 			processed++;
 
+			// Recorded straight from the pool buffer, whether or not a client is connected
+			WriteCaptureRecord(qp.data, qp.size, qp.captured);
+			WriteRecorderRecord(qp.data, qp.size, qp.captured);
+
 			// Send packet through pipe or TCP
 			bool success = false;
 			if (SendPacketData(qp.data, qp.size)) {
@@ -269,6 +278,9 @@ void AsyncPacketQueue::ProcessQueue() {
 				SetEvent(qp.response_event);
 			}
 		}
+
+		// Compressed subscribers get what this batch coalesced, lossless ones what they spilled (also while idle)
+		FlushPacketData();
 	}
 }
 
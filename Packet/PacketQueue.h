@@ -36,6 +36,7 @@ struct QueuedPacket {
 	bool needs_response;
 	HANDLE response_event; // For blocking packets only
 	bool block_result;
+	LARGE_INTEGER captured; // QueryPerformanceCounter when the hook queued it (capture recording timestamp)
 };
 
 // Lock-free-ish async packet queue with background worker
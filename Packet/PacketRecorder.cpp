@@ -0,0 +1,475 @@
+﻿// PacketRecorder.cpp - Flight recorder: a fixed-size ring in memory holding the most recent captured messages
+// The worker copies each message into the ring as a CaptureRecord, overwriting the oldest ones. A trigger (opcode or byte
+// pattern, FLIGHT_DUMP command, crash) writes the last seconds out as a capture segment file the capture tools can read
+
+#include"../Share/Simple/Simple.h"
+#include"../Share/Simple/DebugLog.h"
+#include"PacketRecorder.h"
+#include"PacketCapture.h"
+#include"PacketSubscribers.h"
+
+// Configuration (LoadPacketConfig)
+size_t recorder_size = 0;
+DWORD recorder_seconds = DEFAULT_RECORDER_SECONDS;
+DWORD recorder_post_seconds = DEFAULT_RECORDER_POST_SECONDS;
+std::wstring recorder_dir;
+bool recorder_traces = true;
+bool recorder_crash_dump = true;
+BYTE recorder_trigger_opcodes[2][CAPTURE_OPCODE_BITMAP_SIZE];
+bool recorder_opcode_triggers = false;
+AobScan *recorder_pattern = NULL;
+
+// Ring (guarded by recorder_cs). Positions only grow, position p is at recorder_ring[p % recorder_size].
+// A record never straddles the end of the ring: RECORDER_WRAP is written instead and the record goes to the start
+BYTE *recorder_ring = NULL;
+ULONGLONG recorder_head = 0;                  // Where the next record goes
+ULONGLONG recorder_tail = 0;                  // Oldest record
+CRITICAL_SECTION recorder_cs;
+
+// Triggered dump waiting for its post-trigger seconds (guarded by recorder_cs)
+bool recorder_dump_pending = false;
+DWORD recorder_dump_due_ms = 0;
+ULONGLONG recorder_dump_trigger_us = 0;
+ULONGLONG recorder_last_trigger_us = 0;
+std::wstring recorder_dump_reason;
+
+// FLIGHT_DUMP commands waiting for the recorder thread (guarded by recorder_cs)
+struct FlightDumpRequest {
+	DWORD client_id;
+	DWORD target;
+	ULONGLONG from_us;
+};
+std::vector<FlightDumpRequest> recorder_requests;
+DWORD recorder_client_dumps = 0;              // FLIGHT_RECORDING dump ids, recorder thread only
+
+volatile bool recorder_running = false;
+volatile bool recorder_stopping = false;
+HANDLE recorder_thread = NULL;
+HANDLE recorder_wake_event = NULL;
+LARGE_INTEGER recorder_qpc_frequency;
+LARGE_INTEGER recorder_base_qpc;
+ULONGLONG recorder_base_time_us = 0;
+LPTOP_LEVEL_EXCEPTION_FILTER recorder_previous_filter = NULL;
+
+// Counters (guarded by recorder_cs)
+ULONGLONG recorder_records = 0;
+ULONGLONG recorder_dropped = 0;
+DWORD recorder_dumps = 0;
+
+void SetRecorderConfig(DWORD size_mb, DWORD seconds, DWORD post_seconds, const std::wstring &dir, bool traces, bool crash_dump) {
+	if (size_mb > MAX_RECORDER_MB) {
+		size_mb = MAX_RECORDER_MB;
+	}
+	recorder_size = (size_t)size_mb << 20;
+	recorder_seconds = seconds ? seconds : DEFAULT_RECORDER_SECONDS;
+	recorder_post_seconds = post_seconds;
+	recorder_dir = dir;
+	while (!recorder_dir.empty() && (recorder_dir.back() == L'\\' || recorder_dir.back() == L'/')) {
+		recorder_dir.pop_back();
+	}
+	recorder_traces = traces;
+	recorder_crash_dump = crash_dump;
+}
+
+// "0x0010, 7D 0x00A5" into the bitmap of one direction, false on anything that isn't a hex opcode
+bool ParseRecorderOpcodes(const std::wstring &list, BYTE *bitmap) {
+	size_t i = 0;
+	while (i < list.length()) {
+		if (list[i] == L',' || list[i] == L' ') {
+			i++;
+			continue;
+		}
+		size_t end = list.find_first_of(L", ", i);
+		std::wstring item = list.substr(i, end == std::wstring::npos ? std::wstring::npos : end - i);
+		i = end == std::wstring::npos ? list.length() : end;
+
+		WCHAR *stop = NULL;
+		unsigned long opcode = wcstoul(item.c_str(), &stop, 16);
+		if (*stop || opcode > 0xFFFF) {
+			DEBUGLOG(L"[RECORDER] Invalid trigger opcode: " + item);
+			return false;
+		}
+		bitmap[opcode >> 3] |= 1 << (opcode & 7);
+		recorder_opcode_triggers = true;
+	}
+	return true;
+}
+
+bool SetRecorderTriggers(const std::wstring &send_opcodes, const std::wstring &recv_opcodes, const std::wstring &pattern) {
+	memset(recorder_trigger_opcodes, 0, sizeof(recorder_trigger_opcodes));
+	recorder_opcode_triggers = false;
+	bool ok = ParseRecorderOpcodes(send_opcodes, recorder_trigger_opcodes[SENDPACKET]) && ParseRecorderOpcodes(recv_opcodes, recorder_trigger_opcodes[RECVPACKET]);
+
+	if (recorder_pattern) {
+		delete recorder_pattern;
+		recorder_pattern = NULL;
+	}
+	if (!pattern.empty()) {
+		recorder_pattern = new AobScan(pattern);
+		if (!recorder_pattern->size()) {
+			DEBUGLOG(L"[RECORDER] Invalid trigger pattern: " + pattern);
+			delete recorder_pattern;
+			recorder_pattern = NULL;
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+bool RecorderWantsTraces() {
+	return recorder_running && recorder_traces;
+}
+
+// Must be called with recorder_cs held and a record in the ring
+void EvictRecorderRecord() {
+	size_t position = (size_t)(recorder_tail % recorder_size);
+	DWORD length = *(DWORD *)(recorder_ring + position);
+	recorder_tail += length == RECORDER_WRAP ? recorder_size - position : length;
+}
+
+// Records captured at or after from_us (up to the newest one when the copy starts), as a segment file image
+// Takes recorder_cs for RECORDER_COPY_CHUNK bytes of the ring at a time, records the worker evicts in between are left out.
+// lock is false during a crash, the ring is then read as it is
+void CopyFlightRecording(ULONGLONG from_us, std::vector<BYTE> &image, bool lock) {
+	image.assign(sizeof(CaptureSegmentHeader), 0);
+	ULONGLONG record_count = 0;
+	ULONGLONG start_time_us = 0;
+	ULONGLONG skipped = 0;
+
+	if (lock) {
+		EnterCriticalSection(&recorder_cs);
+	}
+	DWORD sequence = recorder_dumps++;
+	ULONGLONG position = recorder_tail;
+	ULONGLONG end = recorder_head;
+	size_t copied = 0;
+	while (position < end) {
+		if (lock && copied >= RECORDER_COPY_CHUNK) {
+			LeaveCriticalSection(&recorder_cs);
+			EnterCriticalSection(&recorder_cs);
+			copied = 0;
+			if (!recorder_running || recorder_stopping) {
+				break;
+			}
+			if (position < recorder_tail) {
+				skipped += recorder_tail - position;
+				position = recorder_tail;
+				continue;
+			}
+		}
+		size_t offset = (size_t)(position % recorder_size);
+		const CaptureRecord *record = (const CaptureRecord *)(recorder_ring + offset);
+		if (record->length == RECORDER_WRAP) {
+			position += recorder_size - offset;
+			continue;
+		}
+		// Capture times don't go backwards, everything from the first recent record on is copied
+		if (record->time_us >= from_us || record_count) {
+			if (!record_count) {
+				start_time_us = record->time_us;
+			}
+			image.insert(image.end(), (const BYTE *)record, (const BYTE *)record + record->length);
+			record_count++;
+		}
+		copied += record->length;
+		position += record->length;
+	}
+	if (lock) {
+		LeaveCriticalSection(&recorder_cs);
+	}
+	if (skipped) {
+		DEBUGLOG(L"[RECORDER] " + std::to_wstring(skipped) + L" bytes of records were evicted while the dump was copied");
+	}
+
+	CaptureSegmentHeader *header = (CaptureSegmentHeader *)&image[0];
+	header->magic = CAPTURE_SEGMENT_MAGIC;
+	header->version = CAPTURE_FORMAT_VERSION;
+	header->header_size = sizeof(CaptureSegmentHeader);
+	header->segment_size = (DWORD)image.size();
+	header->sequence = sequence;
+	header->start_time_us = start_time_us;
+	header->process_id = GetCurrentProcessId();
+	header->flags = CAPTURE_SEGMENT_CLOSED;
+	header->end_offset = image.size();
+	header->record_count = record_count;
+}
+
+bool RequestFlightDump(DWORD client_id, const FlightDumpMessage &request) {
+	if (!recorder_running) {
+		return false;
+	}
+	FlightDumpRequest pending = { client_id, request.target, GetCaptureUnixTimeUs() - (ULONGLONG)(request.seconds ? request.seconds : recorder_seconds) * 1000000 };
+	EnterCriticalSection(&recorder_cs);
+	bool running = recorder_running;
+	if (running) {
+		recorder_requests.push_back(pending);
+		SetEvent(recorder_wake_event);
+	}
+	LeaveCriticalSection(&recorder_cs);
+	return running;
+}
+
+bool WriteFlightRecordingFile(const std::wstring &reason, const std::vector<BYTE> &image) {
+	SYSTEMTIME st;
+	GetLocalTime(&st);
+	WCHAR name[64];
+	swprintf_s(name, L"\\flight-%04u%02u%02u-%02u%02u%02u-%03u-", st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond, st.wMilliseconds);
+	std::wstring path = recorder_dir + name + reason + L".rpc";
+
+	HANDLE file = CreateFileW(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		DEBUGLOG(L"[RECORDER] Failed to create " + path + L" (error " + std::to_wstring(GetLastError()) + L")");
+		return false;
+	}
+	DWORD written = 0;
+	BOOL ok = WriteFile(file, &image[0], (DWORD)image.size(), &written, NULL) && written == image.size();
+	CloseHandle(file);
+	if (!ok) {
+		DEBUGLOG(L"[RECORDER] Failed to write " + path + L" (error " + std::to_wstring(GetLastError()) + L")");
+		DeleteFileW(path.c_str());
+		return false;
+	}
+	DEBUGLOG(L"[RECORDER] Dumped " + std::to_wstring(((const CaptureSegmentHeader *)&image[0])->record_count) + L" records to " + path);
+	return true;
+}
+
+// FLIGHT_RECORDING parts of a dump, queued to the connection that asked for it (dropped if it's gone meanwhile)
+void SendFlightRecording(DWORD client_id, const std::vector<BYTE> &image) {
+	DWORD dump_id = ++recorder_client_dumps;
+	const size_t header_size = offsetof(FlightRecordingMessage, data);
+	size_t offset = 0;
+	do {
+		size_t chunk = image.size() - offset < FLIGHT_RECORDING_CHUNK_SIZE ? image.size() - offset : FLIGHT_RECORDING_CHUNK_SIZE;
+		std::vector<BYTE> part(header_size + chunk);
+		FlightRecordingMessage *frm = (FlightRecordingMessage *)&part[0];
+		frm->header = FLIGHT_RECORDING;
+		frm->dump_id = dump_id;
+		frm->offset = (DWORD)offset;
+		frm->total_size = (DWORD)image.size();
+		if (chunk) {
+			memcpy(frm->data, &image[offset], chunk);
+		}
+		if (!SendToSubscriber(client_id, &part[0], part.size())) {
+			return;
+		}
+		offset += chunk;
+	} while (offset < image.size());
+}
+
+// Called by the worker, the dump is written by the recorder thread once the post-trigger seconds are recorded too
+void TriggerFlightDump(const WCHAR *reason, ULONGLONG time_us) {
+	EnterCriticalSection(&recorder_cs);
+	// One dump per RECORDER_SECONDS, a trigger firing on every packet doesn't produce overlapping dumps
+	if (!recorder_dump_pending && (!recorder_last_trigger_us || time_us >= recorder_last_trigger_us + (ULONGLONG)recorder_seconds * 1000000)) {
+		recorder_dump_pending = true;
+		recorder_dump_due_ms = GetTickCount() + recorder_post_seconds * 1000;
+		recorder_dump_trigger_us = time_us;
+		recorder_last_trigger_us = time_us;
+		recorder_dump_reason = reason;
+		SetEvent(recorder_wake_event);
+	}
+	LeaveCriticalSection(&recorder_cs);
+}
+
+void WriteRecorderRecord(const BYTE *data, size_t length, const LARGE_INTEGER &captured) {
+	if (!recorder_running) {
+		return;
+	}
+
+	size_t record_size = (offsetof(CaptureRecord, message) + length + 7) & ~(size_t)7;
+	LONGLONG ticks = captured.QuadPart - recorder_base_qpc.QuadPart;
+	ULONGLONG time_us = recorder_base_time_us + (ticks / recorder_qpc_frequency.QuadPart) * 1000000 + (ticks % recorder_qpc_frequency.QuadPart) * 1000000 / recorder_qpc_frequency.QuadPart;
+
+	EnterCriticalSection(&recorder_cs);
+	// Keeps the padding at a wrap below a record's size, so a record always fits once the ring is emptied
+	if (record_size > recorder_size / 4) {
+		recorder_dropped++;
+		LeaveCriticalSection(&recorder_cs);
+		return;
+	}
+	size_t position = (size_t)(recorder_head % recorder_size);
+	size_t skip = recorder_size - position < record_size ? recorder_size - position : 0;
+	while (recorder_head + skip + record_size - recorder_tail > recorder_size) {
+		EvictRecorderRecord();
+	}
+	if (skip) {
+		*(DWORD *)(recorder_ring + position) = RECORDER_WRAP;
+		recorder_head += skip;
+		position = 0;
+	}
+	CaptureRecord *record = (CaptureRecord *)(recorder_ring + position);
+	record->length = (DWORD)record_size;
+	record->message_length = (DWORD)length;
+	record->time_us = time_us;
+	memcpy(record->message, data, length);
+	recorder_head += record_size;
+	recorder_records++;
+	LeaveCriticalSection(&recorder_cs);
+
+	if (!recorder_opcode_triggers && !recorder_pattern) {
+		return;
+	}
+	const PacketEditorMessage *message = (const PacketEditorMessage *)data;
+	if (length < offsetof(PacketEditorMessage, Binary.packet) + sizeof(WORD) || (message->header != SENDPACKET && message->header != RECVPACKET)) {
+		return;
+	}
+	size_t packet_length = length - offsetof(PacketEditorMessage, Binary.packet);
+	if (message->Binary.length < packet_length) {
+		packet_length = message->Binary.length;
+	}
+	if (packet_length < sizeof(WORD)) {
+		return;
+	}
+
+	WORD opcode = *(WORD *)message->Binary.packet;
+	WCHAR reason[32];
+	if (recorder_opcode_triggers && (recorder_trigger_opcodes[message->header][opcode >> 3] & (1 << (opcode & 7)))) {
+		swprintf_s(reason, L"%s-%04X", message->header == SENDPACKET ? L"send" : L"recv", opcode);
+		TriggerFlightDump(reason, time_us);
+		return;
+	}
+	if (recorder_pattern && packet_length >= recorder_pattern->size()) {
+		for (size_t i = 0; i + recorder_pattern->size() <= packet_length; i++) {
+			if (recorder_pattern->Compare((ULONG_PTR)&message->Binary.packet[i])) {
+				swprintf_s(reason, L"pattern-%04X", opcode);
+				TriggerFlightDump(reason, time_us);
+				return;
+			}
+		}
+	}
+}
+
+DWORD WINAPI RecorderThreadProc(LPVOID) {
+	while (!recorder_stopping) {
+		DWORD wait_ms = INFINITE;
+		bool dump = false;
+		std::wstring reason;
+		ULONGLONG trigger_us = 0;
+		std::vector<FlightDumpRequest> requests;
+
+		EnterCriticalSection(&recorder_cs);
+		if (recorder_dump_pending) {
+			LONG remaining = (LONG)(recorder_dump_due_ms - GetTickCount());
+			if (remaining <= 0) {
+				dump = true;
+				reason = recorder_dump_reason;
+				trigger_us = recorder_dump_trigger_us;
+				recorder_dump_pending = false;
+			} else {
+				wait_ms = (DWORD)remaining;
+			}
+		}
+		requests.swap(recorder_requests);
+		LeaveCriticalSection(&recorder_cs);
+
+		if (dump) {
+			// The window is counted from the trigger, the post-trigger seconds come on top
+			std::vector<BYTE> image;
+			CopyFlightRecording(trigger_us - (ULONGLONG)recorder_seconds * 1000000, image, true);
+			WriteFlightRecordingFile(reason, image);
+		}
+		// FLIGHT_DUMP commands, the connection's I/O loop only queued them
+		for (auto &request : requests) {
+			std::vector<BYTE> image;
+			CopyFlightRecording(request.from_us, image, true);
+			if (request.target & FLIGHT_DUMP_TO_FILE) {
+				WriteFlightRecordingFile(L"command", image);
+			}
+			if (request.target & FLIGHT_DUMP_TO_CLIENT) {
+				SendFlightRecording(request.client_id, image);
+			}
+		}
+		if (dump || !requests.empty()) {
+			continue;
+		}
+		WaitForSingleObject(recorder_wake_event, wait_ms);
+	}
+	return 0;
+}
+
+LONG WINAPI RecorderCrashFilter(EXCEPTION_POINTERS *exception) {
+	static volatile LONG crashed = 0;
+	if (recorder_running && InterlockedExchange(&crashed, 1) == 0) {
+		// The crashing thread may be the worker holding the lock, the ring is read as it is then
+		bool locked = TryEnterCriticalSection(&recorder_cs) != FALSE;
+		std::vector<BYTE> image;
+		CopyFlightRecording(GetCaptureUnixTimeUs() - (ULONGLONG)recorder_seconds * 1000000, image, false);
+		if (locked) {
+			LeaveCriticalSection(&recorder_cs);
+		}
+		WCHAR reason[32];
+		swprintf_s(reason, L"crash-%08X", exception->ExceptionRecord->ExceptionCode);
+		WriteFlightRecordingFile(reason, image);
+	}
+	return recorder_previous_filter ? recorder_previous_filter(exception) : EXCEPTION_CONTINUE_SEARCH;
+}
+
+bool StartFlightRecorder() {
+	if (!recorder_size || recorder_running) {
+		return false;
+	}
+
+	// Committed up front, pages are only backed once the ring reaches them
+	recorder_ring = (BYTE *)VirtualAlloc(NULL, recorder_size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (!recorder_ring) {
+		DEBUGLOG(L"[RECORDER] Failed to allocate " + std::to_wstring(recorder_size >> 20) + L" MB (error " + std::to_wstring(GetLastError()) + L"), recorder disabled");
+		return false;
+	}
+	if (!CreateDirectoryW(recorder_dir.c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+		DEBUGLOG(L"[RECORDER] Can't create " + recorder_dir + L" (error " + std::to_wstring(GetLastError()) + L"), dumps will fail");
+	}
+
+	InitializeCriticalSection(&recorder_cs);
+	QueryPerformanceFrequency(&recorder_qpc_frequency);
+	QueryPerformanceCounter(&recorder_base_qpc);
+	recorder_base_time_us = GetCaptureUnixTimeUs();
+	recorder_head = recorder_tail = 0;
+	recorder_dump_pending = false;
+	recorder_last_trigger_us = 0;
+
+	recorder_wake_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+	recorder_stopping = false;
+	recorder_running = true;
+	recorder_thread = CreateThread(NULL, 0, RecorderThreadProc, NULL, 0, NULL);
+	if (recorder_crash_dump) {
+		recorder_previous_filter = SetUnhandledExceptionFilter(RecorderCrashFilter);
+	}
+	DEBUGLOG(L"[RECORDER] Keeping the last " + std::to_wstring(recorder_size >> 20) + L" MB, dumps of " + std::to_wstring(recorder_seconds) +
+		L" s (+" + std::to_wstring(recorder_post_seconds) + L" s after a trigger) to " + recorder_dir);
+	return true;
+}
+
+void StopFlightRecorder() {
+	if (!recorder_running) {
+		return;
+	}
+
+	if (recorder_crash_dump) {
+		// Only if nothing installed its own filter over ours meanwhile
+		LPTOP_LEVEL_EXCEPTION_FILTER current = SetUnhandledExceptionFilter(recorder_previous_filter);
+		if (current != RecorderCrashFilter) {
+			SetUnhandledExceptionFilter(current);
+		}
+	}
+
+	recorder_stopping = true;
+	SetEvent(recorder_wake_event);
+	if (recorder_thread) {
+		WaitForSingleObject(recorder_thread, 5000);
+		CloseHandle(recorder_thread);
+		recorder_thread = NULL;
+	}
+	CloseHandle(recorder_wake_event);
+	recorder_wake_event = NULL;
+
+	EnterCriticalSection(&recorder_cs);
+	recorder_running = false;
+	VirtualFree(recorder_ring, 0, MEM_RELEASE);
+	recorder_ring = NULL;
+	recorder_requests.clear();
+	LeaveCriticalSection(&recorder_cs);
+
+	DEBUGLOG(L"[RECORDER] Stopped after " + std::to_wstring(recorder_records) + L" records (" + std::to_wstring(recorder_dropped) + L" too large, " +
+		std::to_wstring(recorder_dumps) + L" dumps)");
+	DeleteCriticalSection(&recorder_cs);
+}
@@ -0,0 +1,40 @@
+﻿#ifndef __PACKET_RECORDER_H__
+#define __PACKET_RECORDER_H__
+
+#include<Windows.h>
+#include<string>
+#include<vector>
+#include"PacketDefs.h"
+
+// Defaults of the flight recorder (RECORDER_* in RirePE.ini)
+#define DEFAULT_RECORDER_SECONDS 30
+#define DEFAULT_RECORDER_POST_SECONDS 5
+#define MAX_RECORDER_MB 1024
+
+// Ring entries are CaptureRecords, this length marks where the writer went back to the start of the ring
+#define RECORDER_WRAP 0xFFFFFFFF
+
+// Ring bytes a dump copies per hold of the lock, the worker keeps recording in between
+#define RECORDER_COPY_CHUNK (1024 * 1024)
+
+// Set from the INI before StartFlightRecorder, size_mb 0 keeps the recorder off. dir receives the dump files
+void SetRecorderConfig(DWORD size_mb, DWORD seconds, DWORD post_seconds, const std::wstring &dir, bool traces, bool crash_dump);
+// Dump when one of these SEND/RECV opcodes (comma separated hex) or a packet matching the AobScan pattern is captured
+bool SetRecorderTriggers(const std::wstring &send_opcodes, const std::wstring &recv_opcodes, const std::wstring &pattern);
+
+// Allocate the ring, start the dump thread and install the crash handler, false if the recorder is off
+bool StartFlightRecorder();
+// Free the ring, called after the capture worker has stopped
+void StopFlightRecorder();
+
+// Format traces are produced while this is true even without trace subscribers
+bool RecorderWantsTraces();
+
+// Copy a message into the ring and check the triggers, called by the capture worker only
+void WriteRecorderRecord(const BYTE *data, size_t length, const LARGE_INTEGER &captured);
+
+// FLIGHT_DUMP from a connection, made by the recorder thread: the last seconds of the ring (0 = RECORDER_SECONDS) go to
+// <dir>\flight-<local time>-command.rpc and/or back to the connection in FLIGHT_RECORDING parts. False if the recorder is off
+bool RequestFlightDump(DWORD client_id, const FlightDumpMessage &request);
+
+#endif
@@ -0,0 +1,223 @@
+﻿// PacketRules.cpp - Reactive rules: match a hooked packet and queue a templated injection in-process
+#include"PacketRules.h"
+#include"PacketSender.h"
+#include"PacketTemplate.h"
+#include"PacketAck.h"
+#include"../Share/Simple/DebugLog.h"
+#include <map>
+#include <string>
+#include <vector>
+
+struct PacketRule {
+	DWORD rule_id;
+	DWORD client_id;                         // Connection that registered the rule (acks, fair queuing)
+	MessageHeader direction;
+	WORD opcode;
+	std::vector<RulePredicate> predicates;
+	std::vector<RuleExtract> extracts;
+	DWORD template_id;
+	std::string queue_name;
+	DWORD cooldown_ms;
+	DWORD last_fire_ms;
+	bool fired;
+	DWORD hit_count;
+};
+
+// Injection of a rule that matched, performed after the rule lock is released
+struct RuleFiring {
+	DWORD rule_id;
+	DWORD client_id;
+	DWORD template_id;
+	std::string queue_name;
+	std::vector<ULONGLONG> args;
+};
+
+std::map<DWORD, PacketRule> packet_rules;
+
+// Bit per opcode and direction, read without the lock so packets without rules cost one lookup
+BYTE rule_opcodes[2][0x10000 / 8];
+
+CRITICAL_SECTION rules_cs;
+bool rules_initialized = false;
+
+void InitRulesLock() {
+	if (!rules_initialized) {
+		InitializeCriticalSection(&rules_cs);
+		rules_initialized = true;
+	}
+}
+
+ULONGLONG ReadLittleEndian(const BYTE* data, BYTE size) {
+	ULONGLONG value = 0;
+	for (BYTE i = 0; i < size; i++) {
+		value |= (ULONGLONG)data[i] << (i * 8);
+	}
+	return value;
+}
+
+// Must be called with rules_cs held
+void RebuildRuleOpcodes() {
+	memset(rule_opcodes, 0, sizeof(rule_opcodes));
+	for (auto& rule_kv : packet_rules) {
+		const PacketRule& rule = rule_kv.second;
+		rule_opcodes[rule.direction == RECVPACKET][rule.opcode >> 3] |= (BYTE)(1 << (rule.opcode & 7));
+	}
+}
+
+// Register (or replace) a rule
+bool RegisterRule(const RuleConfigMessage& config, DWORD client_id) {
+	if (config.rule_id == 0) {
+		DEBUGLOG(L"[RULE] ERROR: rule_id 0 is reserved");
+		return false;
+	}
+	if (config.direction != SENDPACKET && config.direction != RECVPACKET) {
+		DEBUGLOG(L"[RULE] ERROR: Invalid direction " + std::to_wstring(config.direction));
+		return false;
+	}
+	if (config.predicate_count > MAX_RULE_PREDICATES || config.extract_count > MAX_TEMPLATE_ARGS) {
+		DEBUGLOG(L"[RULE] ERROR: Too many predicates/extracts (" + std::to_wstring(config.predicate_count) + L"/" +
+			std::to_wstring(config.extract_count) + L")");
+		return false;
+	}
+
+	PacketRule rule;
+	rule.rule_id = config.rule_id;
+	rule.client_id = client_id;
+	rule.direction = config.direction;
+	rule.opcode = config.opcode;
+	for (BYTE i = 0; i < config.predicate_count; i++) {
+		if (config.predicates[i].length == 0 || config.predicates[i].length > sizeof(ULONGLONG)) {
+			DEBUGLOG(L"[RULE] ERROR: Invalid predicate " + std::to_wstring(i) + L" length " + std::to_wstring(config.predicates[i].length));
+			return false;
+		}
+		rule.predicates.push_back(config.predicates[i]);
+	}
+	for (BYTE i = 0; i < config.extract_count; i++) {
+		BYTE size = config.extracts[i].size;
+		if (size != 1 && size != 2 && size != 4 && size != 8) {
+			DEBUGLOG(L"[RULE] ERROR: Invalid extract " + std::to_wstring(i) + L" size " + std::to_wstring(size));
+			return false;
+		}
+		rule.extracts.push_back(config.extracts[i]);
+	}
+	rule.template_id = config.template_id;
+	rule.queue_name = std::string(config.queue_name, strnlen(config.queue_name, MAX_QUEUE_NAME_LENGTH));
+	rule.cooldown_ms = config.cooldown_ms;
+	rule.last_fire_ms = 0;
+	rule.fired = false;
+	rule.hit_count = 0;
+
+	InitRulesLock();
+	EnterCriticalSection(&rules_cs);
+	packet_rules[rule.rule_id] = rule;
+	RebuildRuleOpcodes();
+	LeaveCriticalSection(&rules_cs);
+
+	std::wstring queue_name_w(rule.queue_name.begin(), rule.queue_name.end());
+	wchar_t opcode[8];
+	swprintf_s(opcode, L"%04X", rule.opcode);
+	DEBUGLOG(L"[RULE] Registered rule " + std::to_wstring(rule.rule_id) + L" (" +
+		std::wstring(rule.direction == SENDPACKET ? L"SEND" : L"RECV") + L" 0x" + opcode +
+		L", predicates=" + std::to_wstring(rule.predicates.size()) + L", extracts=" + std::to_wstring(rule.extracts.size()) +
+		L" -> template " + std::to_wstring(rule.template_id) + L" into '" + queue_name_w + L"')");
+	return true;
+}
+
+bool UnregisterRule(DWORD rule_id) {
+	InitRulesLock();
+	EnterCriticalSection(&rules_cs);
+	auto rule_it = packet_rules.find(rule_id);
+	DWORD hit_count = (rule_it != packet_rules.end()) ? rule_it->second.hit_count : 0;
+	bool removed = (rule_it != packet_rules.end());
+	if (removed) {
+		packet_rules.erase(rule_it);
+		RebuildRuleOpcodes();
+	}
+	LeaveCriticalSection(&rules_cs);
+
+	if (removed) {
+		DEBUGLOG(L"[RULE] Unregistered rule " + std::to_wstring(rule_id) + L" (fired " + std::to_wstring(hit_count) + L" times)");
+	}
+	return removed;
+}
+
+bool RuleMatches(const PacketRule& rule, const BYTE* packet, DWORD length) {
+	for (auto& predicate : rule.predicates) {
+		if (predicate.offset > length || length - predicate.offset < predicate.length) {
+			return false;
+		}
+		if ((ReadLittleEndian(&packet[predicate.offset], predicate.length) & predicate.mask) != predicate.value) {
+			return false;
+		}
+	}
+	for (auto& extract : rule.extracts) {
+		if (extract.offset > length || length - extract.offset < extract.size) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Runs on the thread that called the hook, usually the game's main thread
+void EvaluatePacketRules(MessageHeader direction, const BYTE* packet, DWORD length) {
+	if (length < sizeof(WORD)) {
+		return;
+	}
+
+	WORD opcode = *(WORD *)&packet[0];
+	if (!(rule_opcodes[direction == RECVPACKET][opcode >> 3] & (1 << (opcode & 7)))) {
+		return;
+	}
+
+	// Rules never react to injected packets, a rule emitting what it matches would loop
+	if (IsInjectingPacket()) {
+		return;
+	}
+
+	ULONGLONG received_us = GetInjectTimeUs();
+	DWORD now = GetTickCount();
+	std::vector<RuleFiring> firings;
+
+	EnterCriticalSection(&rules_cs);
+	for (auto& rule_kv : packet_rules) {
+		PacketRule& rule = rule_kv.second;
+		if (rule.direction != direction || rule.opcode != opcode) {
+			continue;
+		}
+		if (rule.fired && now - rule.last_fire_ms < rule.cooldown_ms) {
+			continue;
+		}
+		if (!RuleMatches(rule, packet, length)) {
+			continue;
+		}
+
+		RuleFiring firing;
+		firing.rule_id = rule.rule_id;
+		firing.client_id = rule.client_id;
+		firing.template_id = rule.template_id;
+		firing.queue_name = rule.queue_name;
+		for (auto& extract : rule.extracts) {
+			firing.args.push_back(ReadLittleEndian(&packet[extract.offset], extract.size));
+		}
+		firings.push_back(firing);
+
+		rule.fired = true;
+		rule.last_fire_ms = now;
+		rule.hit_count++;
+	}
+	LeaveCriticalSection(&rules_cs);
+
+	// Templates and queues have their own locks, they are not taken while holding rules_cs
+	for (auto& firing : firings) {
+		std::vector<MultiPacketGroup> groups(1);
+		PacketRef packet_ref;
+		if (!InstantiateTemplate(firing.template_id, firing.rule_id, firing.args.empty() ? NULL : &firing.args[0], (DWORD)firing.args.size(), packet_ref)) {
+			ReportInjection(firing.client_id, firing.rule_id, firing.queue_name, INJECT_TEMPLATE_FAILED, received_us, 0, 0);
+			continue;
+		}
+		groups[0].packets.push_back(packet_ref);
+		groups[0].template_ids.push_back(firing.template_id);
+		groups[0].received_us.push_back(received_us);
+		EnqueueGroups(firing.queue_name, groups, firing.client_id);
+	}
+}
@@ -0,0 +1,14 @@
+﻿#ifndef __PACKET_RULES_H__
+#define __PACKET_RULES_H__
+
+#include<Windows.h>
+#include"PacketDefs.h"
+
+// Rule registry (called from the TCP thread)
+bool RegisterRule(const RuleConfigMessage& config, DWORD client_id);
+bool UnregisterRule(DWORD rule_id);
+
+// Evaluate rules against a packet seen by the hooks (opcode first), matches queue their template
+void EvaluatePacketRules(MessageHeader direction, const BYTE* packet, DWORD length);
+
+#endif
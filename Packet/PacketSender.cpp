@@ -3,6 +3,9 @@
 #include"../Share/Hook/SimpleHook.h"
 #include"../Packet/PacketHook.h"
 #include"PacketDefs.h"
+#include"PacketSender.h"
+#include"PacketTemplate.h"
+#include"PacketAck.h"
 #include"../Share/Simple/DebugLog.h"
 #include <queue>
 #include <map>
@@ -13,46 +16,42 @@
 
 bool bInjectorCallback = false;
 
-// Timestamp configuration for a single packet
-struct TimestampConfig {
-	bool needs_update;
-	std::vector<DWORD> offsets;
-};
+// Map from queue name to queue configuration
+std::map<std::string, QueueConfig> queue_configs;
 
-// Multi-packet group waiting to be injected
-struct MultiPacketGroup {
-	std::vector<std::vector<BYTE>> packets;  // Multiple packets to inject together
-	DWORD queued_time_ms;
-	BYTE current_packet_index;               // Index of next packet to inject (0-based)
-	DWORD next_packet_time_ms;               // When the next packet should be injected
-};
+// Map from queue name to per-client packet queues
+std::map<std::string, ClientGroupQueues> packet_queues;
 
-// Dynamic queue configuration structure
-struct QueueConfig {
-	std::string queue_name;
-	DWORD injection_interval_ms;
-	DWORD last_injection_time_ms;
-	BYTE packet_count;                       // Number of packets expected in each group
-	std::vector<TimestampConfig> timestamp_configs;  // Timestamp config for each packet
-	std::vector<DWORD> packet_intervals_ms;  // Delay BEFORE injecting each packet (in ms)
-
-	// Active group being injected (for atomic group injection)
-	bool has_active_group;
-	MultiPacketGroup active_group;
-};
+// Temporary storage for incomplete multi-packet groups being assembled, per client
+std::map<std::pair<DWORD, std::string>, IncompleteGroup> incomplete_groups;
 
-// Map from queue name to queue configuration
-std::map<std::string, QueueConfig> queue_configs;
+// Global packets-per-second ceiling over all queues
+TokenBucket global_bucket = { 0, 1, 1.0, 0 };
+
+// Deficit round robin state: deficit per client and the client served last
+#define DRR_QUANTUM MAX_PACKETS_PER_QUEUE
+std::map<DWORD, DWORD> client_deficits;
+DWORD drr_last_client = 0;
+
+volatile LONG next_injection_client = 0;
 
-// Map from queue name to packet queue
-std::map<std::string, std::queue<MultiPacketGroup>> packet_queues;
+// Packet picked for injection, carried out of the critical section
+struct PendingInjection {
+	std::string queue_name;
+	TimestampConfig timestamp_config;        // Timestamp rewrite for this packet
+	DWORD next_interval_ms;                  // Delay before the group's next packet
+	MultiPacketGroup group;
+	size_t remaining;
+};
 
-// Temporary storage for incomplete multi-packet groups being assembled
-struct IncompleteGroup {
-	std::vector<std::vector<BYTE>> packets;
-	DWORD start_time_ms;
+// Queue (or active group) that can inject its next packet in this pass
+struct InjectionCandidate {
+	const std::string* queue_name;           // Key in queue_configs
+	DWORD client_id;
+	bool is_active;                          // Continuation of the active group
+	BYTE priority;
+	DWORD interval_ms;
 };
-std::map<std::string, IncompleteGroup> incomplete_groups;
 
 CRITICAL_SECTION injection_queue_cs;
 bool injection_queue_initialized = false;
@@ -62,6 +61,43 @@ inline DWORD GetCurrentTimeMs() {
 	return GetTickCount();
 }
 
+// Token bucket helpers
+void RefillBucket(TokenBucket& bucket, DWORD now) {
+	if (bucket.rate_pps == 0) {
+		return;
+	}
+	DWORD elapsed = now - bucket.last_refill_ms;
+	bucket.last_refill_ms = now;
+	bucket.tokens = min(bucket.tokens + (double)elapsed * bucket.rate_pps / 1000.0, (double)bucket.burst);
+}
+
+// A group takes the tokens of all its packets at once: it waits until the bucket holds them (or is full, when the burst
+// is smaller) and may leave it in debt, which the refill pays back before the next group
+bool BucketHasToken(const TokenBucket& bucket, DWORD count = 1) {
+	return bucket.rate_pps == 0 || bucket.tokens >= (double)min(count, bucket.burst);
+}
+
+void TakeToken(TokenBucket& bucket, DWORD count = 1) {
+	if (bucket.rate_pps) {
+		bucket.tokens -= (double)count;
+	}
+}
+
+void ResetBucket(TokenBucket& bucket, DWORD rate_pps, DWORD burst) {
+	bucket.rate_pps = rate_pps;
+	bucket.burst = burst ? burst : 1;
+	bucket.tokens = (double)bucket.burst;
+	bucket.last_refill_ms = GetCurrentTimeMs();
+}
+
+size_t QueueDepth(const ClientGroupQueues& queues) {
+	size_t depth = 0;
+	for (auto& kv : queues) {
+		depth += kv.second.size();
+	}
+	return depth;
+}
+
 // Register a new queue configuration
 bool RegisterQueue(const QueueConfigMessage& config) {
 	if (!injection_queue_initialized) {
@@ -93,12 +129,22 @@ bool RegisterQueue(const QueueConfigMessage& config) {
 	// Initialize active group tracking (for atomic group injection)
 	qc.has_active_group = false;
 
+	// Shaping survives re-registration, new queues start unlimited
+	auto existing_it = queue_configs.find(qc.queue_name);
+	if (existing_it != queue_configs.end()) {
+		qc.bucket = existing_it->second.bucket;
+		qc.priority = existing_it->second.priority;
+	} else {
+		ResetBucket(qc.bucket, 0, 1);
+		qc.priority = DEFAULT_QUEUE_PRIORITY;
+	}
+
 	// Register the queue
 	queue_configs[qc.queue_name] = qc;
 
 	// Initialize empty queue if not exists
 	if (packet_queues.find(qc.queue_name) == packet_queues.end()) {
-		packet_queues[qc.queue_name] = std::queue<MultiPacketGroup>();
+		packet_queues[qc.queue_name] = ClientGroupQueues();
 	}
 
 	LeaveCriticalSection(&injection_queue_cs);
@@ -119,26 +165,72 @@ bool RegisterQueue(const QueueConfigMessage& config) {
 	return true;
 }
 
+bool MakePacketRef(const PacketSlab& slab, size_t offset, MessageHeader header, DWORD id, DWORD length, PacketRef& ref) {
+	if (offset < PACKET_HEADROOM || offset > slab->size() || length < sizeof(WORD) || length > slab->size() - offset) {
+		return false;
+	}
+	ref.slab = slab;
+	ref.header = header;
+	ref.id = id;
+	ref.offset = (DWORD)offset;
+	ref.length = length;
+	return true;
+}
+
+// Report every packet from index first on as not injected
+void ReportPackets(DWORD client_id, const std::vector<PacketRef>& packets, const std::vector<ULONGLONG>& received_us,
+	size_t first, const std::string& queue_name, InjectResult result) {
+	for (size_t i = first; i < packets.size(); i++) {
+		ReportInjection(client_id, packets[i].id, queue_name, result, (i < received_us.size()) ? received_us[i] : 0, 0, 0);
+	}
+}
+
+// Report everything still waiting in a queue as dropped (injection_queue_cs must be held)
+void ReportDroppedQueue(const std::string& queue_name) {
+	auto config_it = queue_configs.find(queue_name);
+	if (config_it != queue_configs.end() && config_it->second.has_active_group) {
+		MultiPacketGroup& active = config_it->second.active_group;
+		ReportPackets(active.client_id, active.packets, active.received_us, active.current_packet_index, queue_name, INJECT_DROPPED);
+	}
+
+	auto queue_it = packet_queues.find(queue_name);
+	if (queue_it != packet_queues.end()) {
+		for (auto& client_kv : queue_it->second) {
+			std::queue<MultiPacketGroup>& queue = client_kv.second;
+			for (; !queue.empty(); queue.pop()) {
+				ReportPackets(client_kv.first, queue.front().packets, queue.front().received_us, 0, queue_name, INJECT_DROPPED);
+			}
+		}
+	}
+
+	for (auto& incomplete_kv : incomplete_groups) {
+		if (incomplete_kv.first.second == queue_name) {
+			ReportPackets(incomplete_kv.first.first, incomplete_kv.second.packets, incomplete_kv.second.received_us, 0, queue_name, INJECT_DROPPED);
+		}
+	}
+}
+
 // Unregister a queue by name
 bool UnregisterQueue(const std::string& queue_name) {
 	EnterCriticalSection(&injection_queue_cs);
 
 	auto config_it = queue_configs.find(queue_name);
 	if (config_it != queue_configs.end()) {
-		queue_configs.erase(config_it);
+		ReportDroppedQueue(queue_name);
+		queue_configs.erase(queue_name);
 
 		// Clear the queue
-		auto queue_it = packet_queues.find(queue_name);
-		if (queue_it != packet_queues.end()) {
-			while (!queue_it->second.empty()) {
-				queue_it->second.pop();
+		packet_queues.erase(queue_name);
+
+		// Clear incomplete groups of every client
+		for (auto it = incomplete_groups.begin(); it != incomplete_groups.end();) {
+			if (it->first.second == queue_name) {
+				it = incomplete_groups.erase(it);
+			} else {
+				++it;
 			}
-			packet_queues.erase(queue_it);
 		}
 
-		// Clear incomplete group if exists
-		incomplete_groups.erase(queue_name);
-
 		LeaveCriticalSection(&injection_queue_cs);
 
 		std::wstring queue_name_w(queue_name.begin(), queue_name.end());
@@ -155,12 +247,9 @@ void ClearAllQueues() {
 	EnterCriticalSection(&injection_queue_cs);
 
 	// Clear all queues
-	for (auto& kv : packet_queues) {
-		while (!kv.second.empty()) {
-			kv.second.pop();
-		}
+	for (auto& config_kv : queue_configs) {
+		ReportDroppedQueue(config_kv.first);
 	}
-
 	packet_queues.clear();
 	queue_configs.clear();
 	incomplete_groups.clear();
@@ -170,23 +259,153 @@ void ClearAllQueues() {
 	DEBUGLOG(L"[QUEUE] Cleared all queue registrations");
 }
 
+// Enqueue complete groups for a queue with a single lock acquisition
+bool EnqueueGroups(const std::string& queue_name, std::vector<MultiPacketGroup>& groups, DWORD client_id) {
+	if (!injection_queue_initialized) {
+		InitializeCriticalSection(&injection_queue_cs);
+		injection_queue_initialized = true;
+	}
+
+	EnterCriticalSection(&injection_queue_cs);
+
+	std::wstring queue_name_w(queue_name.begin(), queue_name.end());
+	auto config_it = queue_configs.find(queue_name);
+	if (config_it == queue_configs.end()) {
+		LeaveCriticalSection(&injection_queue_cs);
+		for (auto& group : groups) {
+			ReportPackets(client_id, group.packets, group.received_us, 0, queue_name, INJECT_QUEUE_NOT_REGISTERED);
+		}
+		DEBUGLOG(L"[QUEUE] ERROR: Queue '" + queue_name_w + L"' not registered!");
+		return false;
+	}
+
+	// Per-packet timestamp configs and delays are indexed by position, so every group must match the registration
+	for (auto& group : groups) {
+		if (group.packets.size() != config_it->second.packet_count) {
+			BYTE expected = config_it->second.packet_count;
+			LeaveCriticalSection(&injection_queue_cs);
+			for (auto& rejected : groups) {
+				ReportPackets(client_id, rejected.packets, rejected.received_us, 0, queue_name, INJECT_GROUP_SIZE_MISMATCH);
+			}
+			DEBUGLOG(L"[QUEUE] ERROR: Group of " + std::to_wstring(group.packets.size()) + L" packet(s) does not match queue '" +
+				queue_name_w + L"' packet_count=" + std::to_wstring(expected));
+			return false;
+		}
+	}
+
+	DWORD now = GetCurrentTimeMs();
+	std::queue<MultiPacketGroup>& queue = packet_queues[queue_name][client_id];
+	for (auto& group : groups) {
+		group.queued_time_ms = now;
+		group.current_packet_index = 0;  // Start at first packet
+		group.next_packet_time_ms = now; // Can inject first packet immediately
+		group.client_id = client_id;
+		queue.push(std::move(group));
+	}
+	size_t queue_size = queue.size();
+	bool wake_injector = (config_it->second.injection_interval_ms == 0);
+
+	LeaveCriticalSection(&injection_queue_cs);
+
+	if (queue_size > 10) {
+		DEBUGLOG(L"[QUEUE] WARNING: Queue '" + queue_name_w + L"' depth reached " + std::to_wstring(queue_size) +
+			L" groups for client " + std::to_wstring(client_id) + L"!");
+	}
+
+	if (wake_injector) {
+		WakePacketInjector();
+	}
+	return true;
+}
+
+// Set token bucket and priority class of a registered queue
+bool SetQueueShaping(const QueueShapingMessage& shaping) {
+	std::string queue_name(shaping.queue_name, strnlen(shaping.queue_name, MAX_QUEUE_NAME_LENGTH));
+	std::wstring queue_name_w(queue_name.begin(), queue_name.end());
+
+	if (!injection_queue_initialized) {
+		InitializeCriticalSection(&injection_queue_cs);
+		injection_queue_initialized = true;
+	}
+
+	EnterCriticalSection(&injection_queue_cs);
+	auto config_it = queue_configs.find(queue_name);
+	if (config_it == queue_configs.end()) {
+		LeaveCriticalSection(&injection_queue_cs);
+		DEBUGLOG(L"[QUEUE] ERROR: Queue '" + queue_name_w + L"' not registered!");
+		return false;
+	}
+	ResetBucket(config_it->second.bucket, shaping.rate_pps, shaping.burst);
+	config_it->second.priority = min(shaping.priority, MAX_QUEUE_PRIORITY);
+	LeaveCriticalSection(&injection_queue_cs);
+
+	DEBUGLOG(L"[QUEUE] Shaping for '" + queue_name_w + L"': rate=" + std::to_wstring(shaping.rate_pps) +
+		L"pps, burst=" + std::to_wstring(shaping.burst) + L", priority=" + std::to_wstring(min(shaping.priority, MAX_QUEUE_PRIORITY)));
+	return true;
+}
+
+// Set the packets-per-second ceiling shared by all queues
+void SetGlobalInjectionRate(DWORD rate_pps, DWORD burst) {
+	if (!injection_queue_initialized) {
+		InitializeCriticalSection(&injection_queue_cs);
+		injection_queue_initialized = true;
+	}
+
+	EnterCriticalSection(&injection_queue_cs);
+	ResetBucket(global_bucket, rate_pps, burst);
+	LeaveCriticalSection(&injection_queue_cs);
+
+	DEBUGLOG(L"[QUEUE] Global injection rate: " + (rate_pps ? std::to_wstring(rate_pps) + L"pps, burst=" + std::to_wstring(global_bucket.burst) : std::wstring(L"unlimited")));
+}
+
+// Each TCP connection gets an id, groups are queued and scheduled per id
+DWORD AcquireInjectionClient() {
+	return (DWORD)InterlockedIncrement(&next_injection_client);
+}
+
+// Queued groups of a disconnected client are still injected, only partial groups are discarded
+void ReleaseInjectionClient(DWORD client_id) {
+	if (!injection_queue_initialized) {
+		return;
+	}
+
+	EnterCriticalSection(&injection_queue_cs);
+	for (auto it = incomplete_groups.begin(); it != incomplete_groups.end();) {
+		if (it->first.first == client_id) {
+			it = incomplete_groups.erase(it);
+		} else {
+			++it;
+		}
+	}
+	LeaveCriticalSection(&injection_queue_cs);
+}
+
+// Set while the injector calls into the game, the hooks see that packet as well
+bool injecting_packet = false;
+
+bool IsInjectingPacket() {
+	return injecting_packet;
+}
+
 // Helper function to inject a single packet (extracted from PacketInjector for reuse)
-void InjectSinglePacket(std::vector<BYTE>& data) {
-	PacketEditorMessage *pcm = (PacketEditorMessage *)&data[0];
+// The packet is used in place; for RECVPACKET the headroom in front of it is overwritten
+void InjectSinglePacket(const PacketRef& ref) {
+	BYTE *packet_data = ref.data();
 
-	if (pcm->header == SENDPACKET) {
+	if (ref.header == SENDPACKET) {
 #ifdef _WIN64
-		WORD wHeader = *(WORD *)&pcm->Binary.packet[0];
+		WORD wHeader = *(WORD *)&packet_data[0];
 		OutPacket p;
 		memset(&p, 0, sizeof(p));
 		COutPacket_Hook(&p, wHeader);
 
 		WORD wEncryptedHeader = *(WORD *)&p.packet[0];
-		p.encoded = (DWORD)pcm->Binary.length;
+		p.encoded = (DWORD)ref.length;
 #if MAPLE_VERSION <= 414
-		p.packet = &pcm->Binary.packet[0];
+		p.packet = &packet_data[0];
 #else
-		memcpy_s(&p.packet[0], pcm->Binary.length, &pcm->Binary.packet[0], pcm->Binary.length);
+		// COutPacket owns this buffer on newer clients, it has to be filled
+		memcpy_s(&p.packet[0], ref.length, &packet_data[0], ref.length);
 #endif
 		if (wHeader != wEncryptedHeader) {
 			*(WORD *)&p.packet[0] = wEncryptedHeader;
@@ -204,39 +423,39 @@ void InjectSinglePacket(std::vector<BYTE>& data) {
 		}
 
 		// Initialize OutPacket structure with header using COutPacket
-		WORD wHeader = *(WORD *)&pcm->Binary.packet[0];
+		WORD wHeader = *(WORD *)&packet_data[0];
 		OutPacket p;
 		memset(&p, 0, sizeof(p));
 		COutPacket_Hook(&p, 0, wHeader);
 
 		// Set up the packet data
-		p.packet = &pcm->Binary.packet[0];
-		p.encoded = pcm->Binary.length;
+		p.packet = &packet_data[0];
+		p.encoded = ref.length;
 
 		_EnterSendPacket_Original(&p);
 #endif
 	}
-	else if (pcm->header == RECVPACKET) {
-		std::vector<BYTE> packet;
-		packet.resize(pcm->Binary.length + 0x04);
+	else if (ref.header == RECVPACKET) {
+		// Prefix goes into the headroom, the length field it replaces was already parsed
+		BYTE *packet = packet_data - PACKET_HEADROOM;
 		packet[0] = 0xF7;
 		packet[1] = 0x39;
 		packet[2] = 0xEF;
 		packet[3] = 0x39;
-		memcpy_s(&packet[4], pcm->Binary.length, &pcm->Binary.packet[0], pcm->Binary.length);
+		DWORD packet_size = ref.length + PACKET_HEADROOM;
 #ifdef _WIN64
-		WORD wHeader = *(WORD *)&pcm->Binary.packet[0];
-		wHeader = *(WORD *)&packet[0];
-		InPacket p = { 0x00, 0x02, &packet[0], (DWORD)packet.size(), wHeader, (DWORD)pcm->Binary.length, 0x04 };
+		WORD wHeader = *(WORD *)&packet[0];
+		InPacket p = { 0x00, 0x02, &packet[0], packet_size, wHeader, (DWORD)ref.length, 0x04 };
 		ProcessPacket_Hook(_CClientSocket(), &p);
 #else
-		InPacket p = { 0x00, 0x02, &packet[0], (WORD)packet.size(), 0x00, (WORD)pcm->Binary.length, 0x00, 0x04 };
+		InPacket p = { 0x00, 0x02, &packet[0], (WORD)packet_size, 0x00, (WORD)ref.length, 0x00, 0x04 };
 		ProcessPacket_Hook((void *)GetCClientSocket(), 0, &p);
 #endif
 	}
 }
 
-VOID CALLBACK PacketInjector(HWND, UINT, UINT_PTR, DWORD) {
+// Runs one injection pass over all queues, returns the number of packets injected
+size_t RunPacketInjector() {
 	static int call_count = 0;
 	call_count++;
 
@@ -253,116 +472,221 @@ VOID CALLBACK PacketInjector(HWND, UINT, UINT_PTR, DWORD) {
 	}
 
 	// Process packets from all registered queues
-	// Priority: queues with shortest intervals first
+	// Order: priority class, then continuations of active groups, then new groups by deficit round robin over clients
 
 	EnterCriticalSection(&injection_queue_cs);
 
-	// Build a list of queues that are ready to inject (have packets and interval elapsed)
-	std::vector<std::string> ready_queue_names;
+	RefillBucket(global_bucket, current_time_ms);
+
+	// Build the candidates that are ready now (at most one packet per queue per pass)
+	std::vector<InjectionCandidate> candidates;
 
 	for (auto& config_kv : queue_configs) {
 		const std::string& queue_name = config_kv.first;
 		QueueConfig& config = config_kv.second;
 
-		MultiPacketGroup* group_to_check = nullptr;
-		bool is_active_group = false;
+		RefillBucket(config.bucket, current_time_ms);
 
 		// ATOMIC GROUP INJECTION: Check if there's an active group being injected
 		if (config.has_active_group) {
-			// Active group exists, use it (don't pull from queue)
-			group_to_check = &config.active_group;
-			is_active_group = true;
-		} else {
-			// No active group, check if queue has groups waiting
-			auto queue_it = packet_queues.find(queue_name);
-			if (queue_it == packet_queues.end() || queue_it->second.empty()) {
-				continue;  // No groups waiting
+			// Subsequent packets: only check per-packet timing, the group took the queue's tokens for all its packets
+			if (current_time_ms >= config.active_group.next_packet_time_ms) {
+				candidates.push_back({ &config_kv.first, config.active_group.client_id, true, config.priority, config.injection_interval_ms });
 			}
-			// Pull the front group and activate it
-			group_to_check = &queue_it->second.front();
-			is_active_group = false;  // Will be activated when injected
+			continue;
 		}
 
-		// Check timing for the group
-		DWORD time_since_queued = current_time_ms - group_to_check->queued_time_ms;
+		// First packet: must satisfy inter-group delay and have the tokens of the whole group in the queue's bucket
 		DWORD time_since_last = current_time_ms - config.last_injection_time_ms;
-		bool next_packet_ready = (current_time_ms >= group_to_check->next_packet_time_ms);
-		bool is_first_packet = (group_to_check->current_packet_index == 0);
-
-		bool ready = false;
-		if (is_first_packet) {
-			// First packet: must satisfy inter-group delay
-			ready = (time_since_last >= config.injection_interval_ms && next_packet_ready);
-		} else {
-			// Subsequent packets: only check per-packet timing
-			ready = next_packet_ready;
+		if (time_since_last < config.injection_interval_ms || !BucketHasToken(config.bucket, config.packet_count)) {
+			continue;
 		}
 
-		if (ready) {
-			ready_queue_names.push_back(queue_name);
-			// Always log for DIRECT queue, otherwise only every 25 ticks
-			if (queue_name == "DIRECT" || call_count % 25 == 1) {
-				std::wstring qname_w(queue_name.begin(), queue_name.end());
-				std::wstring status = is_active_group ? L"ACTIVE" : L"NEW";
-				auto queue_it = packet_queues.find(queue_name);
-				size_t queue_depth = (queue_it != packet_queues.end()) ? queue_it->second.size() : 0;
-				DEBUGLOG(L"[INJECT-READY] Queue '" + qname_w + L"' ready [" + status + L"] (depth=" +
-					std::to_wstring(queue_depth) + L", pkt=" +
-					std::to_wstring(group_to_check->current_packet_index + 1) + L"/" +
-					std::to_wstring(config.packet_count) + L")");
+		auto queue_it = packet_queues.find(queue_name);
+		if (queue_it == packet_queues.end()) {
+			continue;
+		}
+		for (auto& client_kv : queue_it->second) {
+			if (!client_kv.second.empty() && current_time_ms >= client_kv.second.front().next_packet_time_ms) {
+				candidates.push_back({ &config_kv.first, client_kv.first, false, config.priority, config.injection_interval_ms });
 			}
 		}
 	}
 
 	// If no queues are ready, exit early
-	if (ready_queue_names.empty()) {
+	if (candidates.empty()) {
 		LeaveCriticalSection(&injection_queue_cs);
-		return;
+		return 0;
 	}
 
-	if (call_count % 25 == 1) {
-		DEBUGLOG(L"[INJECT-START] Processing " + std::to_wstring(ready_queue_names.size()) + L" ready queue(s)");
+	// Priority class first, continuations before new groups, then shorter intervals
+	std::stable_sort(candidates.begin(), candidates.end(),
+		[](const InjectionCandidate& a, const InjectionCandidate& b) {
+			if (a.priority != b.priority) {
+				return a.priority < b.priority;
+			}
+			if (a.is_active != b.is_active) {
+				return a.is_active;
+			}
+			return a.interval_ms < b.interval_ms;
+		});
+
+	std::vector<const InjectionCandidate*> selected;
+	std::set<const std::string*> used_queues;
+	std::set<DWORD> backlogged_clients;
+
+	for (size_t class_begin = 0; class_begin < candidates.size();) {
+		size_t class_end = class_begin;
+		while (class_end < candidates.size() && candidates[class_end].priority == candidates[class_begin].priority) {
+			class_end++;
+		}
+
+		// Continuations keep groups atomic, they only wait for the global ceiling
+		size_t i = class_begin;
+		for (; i < class_end && candidates[i].is_active; i++) {
+			if (!BucketHasToken(global_bucket)) {
+				break;
+			}
+			TakeToken(global_bucket);
+			used_queues.insert(candidates[i].queue_name);
+			selected.push_back(&candidates[i]);
+		}
+		while (i < class_end && candidates[i].is_active) {
+			i++;
+		}
+
+		// New groups: deficit round robin across clients, a group costs its packet count
+		std::map<DWORD, std::vector<const InjectionCandidate*>> client_candidates;
+		for (; i < class_end; i++) {
+			client_candidates[candidates[i].client_id].push_back(&candidates[i]);
+			backlogged_clients.insert(candidates[i].client_id);
+		}
+
+		bool progress = true;
+		while (progress && !client_candidates.empty() && BucketHasToken(global_bucket)) {
+			progress = false;
+
+			// Visit clients in id order, starting after the one served last
+			auto client_it = client_candidates.upper_bound(drr_last_client);
+			for (size_t visited = 0; visited < client_candidates.size(); visited++, client_it++) {
+				if (client_it == client_candidates.end()) {
+					client_it = client_candidates.begin();
+				}
+				// No quantum once the global ceiling is reached, deficits would otherwise grow every tick it stays empty
+				if (!BucketHasToken(global_bucket)) {
+					break;
+				}
+				DWORD client_id = client_it->first;
+				auto& pending = client_it->second;
+				DWORD& deficit = client_deficits[client_id];
+				deficit += DRR_QUANTUM;
+
+				for (auto candidate_it = pending.begin(); candidate_it != pending.end();) {
+					const InjectionCandidate* candidate = *candidate_it;
+					if (used_queues.count(candidate->queue_name)) {
+						candidate_it = pending.erase(candidate_it);
+						continue;
+					}
+
+					QueueConfig& config = queue_configs[*candidate->queue_name];
+					if (config.packet_count > deficit || !BucketHasToken(global_bucket)) {
+						break;
+					}
+
+					deficit -= config.packet_count;
+					TakeToken(global_bucket);
+					TakeToken(config.bucket, config.packet_count);
+					used_queues.insert(candidate->queue_name);
+					selected.push_back(candidate);
+					drr_last_client = client_id;
+					candidate_it = pending.erase(candidate_it);
+					progress = true;
+				}
+
+				if (pending.empty()) {
+					deficit = 0;
+				}
+			}
+
+			for (auto it = client_candidates.begin(); it != client_candidates.end();) {
+				it = it->second.empty() ? client_candidates.erase(it) : std::next(it);
+			}
+		}
+
+		class_begin = class_end;
 	}
 
-	// Sort by interval (shorter intervals = higher priority)
-	std::sort(ready_queue_names.begin(), ready_queue_names.end(),
-		[](const std::string& a, const std::string& b) {
-			return queue_configs[a].injection_interval_ms < queue_configs[b].injection_interval_ms;
-		});
+	// Clients without pending new groups lose their deficit (standard DRR)
+	for (auto it = client_deficits.begin(); it != client_deficits.end();) {
+		it = backlogged_clients.count(it->first) ? std::next(it) : client_deficits.erase(it);
+	}
 
-	// Process ALL ready queues (not just one!) to maximize throughput
-	// Limit to max 10 queues per tick to avoid blocking too long
-	size_t max_queues_per_tick = min(ready_queue_names.size(), 10);
+	if (selected.empty()) {
+		LeaveCriticalSection(&injection_queue_cs);
+		return 0;
+	}
+
+	if (call_count % 25 == 1) {
+		DEBUGLOG(L"[INJECT-START] Processing " + std::to_wstring(selected.size()) + L" of " +
+			std::to_wstring(candidates.size()) + L" ready candidate(s)");
+	}
 
-	std::vector<std::tuple<std::string, QueueConfig, MultiPacketGroup, size_t, bool>> groups_to_inject;
+	std::vector<PendingInjection> groups_to_inject;
+	groups_to_inject.reserve(selected.size());
 
-	for (size_t q = 0; q < max_queues_per_tick; q++) {
-		std::string queue_name = ready_queue_names[q];
+	for (const InjectionCandidate* candidate : selected) {
+		std::string queue_name = *candidate->queue_name;
 		QueueConfig& config = queue_configs[queue_name];
+		ClientGroupQueues& client_queues = packet_queues[queue_name];
 
 		MultiPacketGroup group;
 		bool was_active = false;
 		size_t remaining = 0;
 
-		if (config.has_active_group) {
+		if (candidate->is_active) {
 			// Use the active group (already being injected)
 			group = config.active_group;
 			was_active = true;
-			auto queue_it = packet_queues.find(queue_name);
-			remaining = (queue_it != packet_queues.end()) ? queue_it->second.size() : 0;
 		} else {
-			// Pull from queue and activate it
-			group = packet_queues[queue_name].front();
-			packet_queues[queue_name].pop();
-			remaining = packet_queues[queue_name].size();
+			// Pull from the client's queue and activate it
+			std::queue<MultiPacketGroup>& queue = client_queues[candidate->client_id];
+			group = queue.front();
+			queue.pop();
+			if (queue.empty()) {
+				client_queues.erase(candidate->client_id);
+			}
 			was_active = false;
 
-			// Mark this group as active for atomic injection
+			// Mark this group as active for atomic group injection
 			config.has_active_group = true;
 			config.active_group = group;
 		}
+		remaining = QueueDepth(client_queues);
+		group.scheduled_us = GetInjectTimeUs();
+
+		// Always log for DIRECT queue, otherwise only every 25 ticks
+		if (queue_name == "DIRECT" || call_count % 25 == 1) {
+			std::wstring qname_w(queue_name.begin(), queue_name.end());
+			std::wstring status = was_active ? L"ACTIVE" : L"NEW";
+			DEBUGLOG(L"[INJECT-READY] Queue '" + qname_w + L"' ready [" + status + L"] (client=" +
+				std::to_wstring(group.client_id) + L", depth=" + std::to_wstring(remaining) + L", pkt=" +
+				std::to_wstring(group.current_packet_index + 1) + L"/" +
+				std::to_wstring(config.packet_count) + L")");
+		}
 
-		groups_to_inject.push_back(std::make_tuple(queue_name, config, group, remaining, was_active));
+		// Only the settings this packet needs are copied, packet bytes stay in their slab
+		PendingInjection pending;
+		pending.queue_name = queue_name;
+		BYTE packet_idx = group.current_packet_index;
+		if (packet_idx < config.timestamp_configs.size()) {
+			pending.timestamp_config = config.timestamp_configs[packet_idx];
+		} else {
+			pending.timestamp_config.needs_update = false;
+		}
+		pending.next_interval_ms = (packet_idx + 1u < config.packet_intervals_ms.size()) ? config.packet_intervals_ms[packet_idx + 1] : 0;
+		pending.group = std::move(group);
+		pending.remaining = remaining;
+		groups_to_inject.push_back(std::move(pending));
 	}
 
 	LeaveCriticalSection(&injection_queue_cs);
@@ -370,28 +694,27 @@ VOID CALLBACK PacketInjector(HWND, UINT, UINT_PTR, DWORD) {
 	// Now inject all groups outside the critical section
 	DWORD new_timestamp = GetCurrentTimeMs();
 
-	for (auto& tuple : groups_to_inject) {
-		std::string queue_name = std::get<0>(tuple);
-		QueueConfig config = std::get<1>(tuple);
-		MultiPacketGroup group = std::get<2>(tuple);
-		size_t remaining = std::get<3>(tuple);
-		bool was_active = std::get<4>(tuple);
+	for (auto& pending : groups_to_inject) {
+		const std::string& queue_name = pending.queue_name;
+		MultiPacketGroup& group = pending.group;
+		size_t remaining = pending.remaining;
 
 		// Get the current packet index to inject
 		BYTE packet_idx = group.current_packet_index;
 
+		// Templated packets get their timestamp/counter/random/last-seen slots filled now
+		bool slots_filled = true;
+		if (packet_idx < group.template_ids.size() && group.template_ids[packet_idx]) {
+			slots_filled = FillTemplateSlots(group.template_ids[packet_idx], group.packets[packet_idx]);
+		}
+
 		// Update timestamp for the current packet only
-		if (packet_idx < config.timestamp_configs.size()) {
-			TimestampConfig& ts_config = config.timestamp_configs[packet_idx];
-			if (ts_config.needs_update) {
-				PacketEditorMessage *pcm = (PacketEditorMessage *)&group.packets[packet_idx][0];
-				if (pcm->header == SENDPACKET) {
-					// Update all configured timestamp offsets
-					for (DWORD offset : ts_config.offsets) {
-						if (offset + 4 <= pcm->Binary.length) {
-							*(DWORD *)&pcm->Binary.packet[offset] = new_timestamp;
-						}
-					}
+		PacketRef& packet = group.packets[packet_idx];
+		if (pending.timestamp_config.needs_update && packet.header == SENDPACKET) {
+			// Update all configured timestamp offsets
+			for (DWORD offset : pending.timestamp_config.offsets) {
+				if (offset + 4 <= packet.length) {
+					*(DWORD *)&packet.data()[offset] = new_timestamp;
 				}
 			}
 		}
@@ -405,8 +728,16 @@ VOID CALLBACK PacketInjector(HWND, UINT, UINT_PTR, DWORD) {
 				std::to_wstring(remaining) + L" groups)");
 		}
 
-		// Inject the current packet
-		InjectSinglePacket(group.packets[packet_idx]);
+		// Inject the current packet (a template that can't be filled skips only this packet)
+		if (slots_filled) {
+			injecting_packet = true;
+			InjectSinglePacket(packet);
+			injecting_packet = false;
+		}
+
+		ReportInjection(group.client_id, packet.id, queue_name, slots_filled ? INJECT_OK : INJECT_TEMPLATE_FAILED,
+			(packet_idx < group.received_us.size()) ? group.received_us[packet_idx] : 0, group.scheduled_us,
+			slots_filled ? GetInjectTimeUs() : 0);
 
 		// Move to next packet
 		group.current_packet_index++;
@@ -414,10 +745,7 @@ VOID CALLBACK PacketInjector(HWND, UINT, UINT_PTR, DWORD) {
 		// ATOMIC GROUP INJECTION: Update active_group instead of re-queuing
 		if (group.current_packet_index < group.packets.size()) {
 			// More packets remain - calculate next packet timing
-			DWORD next_packet_interval = 0;
-			if (group.current_packet_index < config.packet_intervals_ms.size()) {
-				next_packet_interval = config.packet_intervals_ms[group.current_packet_index];
-			}
+			DWORD next_packet_interval = pending.next_interval_ms;
 			group.next_packet_time_ms = new_timestamp + next_packet_interval;
 
 			// Update the active group (DON'T re-queue)
@@ -445,6 +773,61 @@ VOID CALLBACK PacketInjector(HWND, UINT, UINT_PTR, DWORD) {
 			}
 		}
 	}
+
+	return groups_to_inject.size();
+}
+
+VOID CALLBACK PacketInjector(HWND, UINT, UINT_PTR, DWORD) {
+	RunPacketInjector();
+}
+
+// Private message posted by the TCP thread so zero-interval queues don't wait for WM_TIMER
+#define WM_PACKET_INJECT (WM_APP + 0x1337)
+#define MAX_WAKE_PASSES 16
+
+HWND hInjectorWindow = NULL;
+WNDPROC _MapleWndProc = NULL;
+volatile LONG injector_wake_pending = 0;
+
+LRESULT CALLBACK InjectorWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
+	if (uMsg == WM_PACKET_INJECT) {
+		// Clear before draining so a request queued meanwhile posts a new message
+		InterlockedExchange(&injector_wake_pending, 0);
+		// Drain everything due now; later work is left to the timer so input/paint aren't starved
+		for (int pass = 0; pass < MAX_WAKE_PASSES; pass++) {
+			if (!RunPacketInjector()) {
+				break;
+			}
+		}
+		return 0;
+	}
+	return CallWindowProcA(_MapleWndProc, hwnd, uMsg, wParam, lParam);
+}
+
+void InstallPacketInjector(HWND hwnd) {
+	SetTimer(hwnd, 1337, 10, PacketInjector);  // Increased from 50ms to 10ms (100Hz instead of 20Hz), kept as fallback
+
+	_MapleWndProc = (WNDPROC)SetWindowLongPtrA(hwnd, GWLP_WNDPROC, (LONG_PTR)InjectorWndProc);
+	if (_MapleWndProc) {
+		hInjectorWindow = hwnd;
+		DEBUGLOG(L"PacketInjector wakeup installed (WndProc subclassed)");
+	}
+	else {
+		DEBUGLOG(L"PacketInjector wakeup NOT installed, injections run on timer only");
+	}
+}
+
+void WakePacketInjector() {
+	if (!hInjectorWindow) {
+		return;
+	}
+	// One message in flight is enough, the handler drains all due work
+	if (InterlockedCompareExchange(&injector_wake_pending, 1, 0) != 0) {
+		return;
+	}
+	if (!PostMessageA(hInjectorWindow, WM_PACKET_INJECT, 0, 0)) {
+		InterlockedExchange(&injector_wake_pending, 0);
+	}
 }
 
 decltype(CreateWindowExA) *_CreateWindowExA = NULL;
@@ -453,7 +836,7 @@ HWND WINAPI CreateWindowExA_Hook(DWORD dwExStyle, LPCSTR lpClassName, LPCSTR lpW
 		HWND hRet = _CreateWindowExA(dwExStyle, lpClassName, lpWindowName, dwStyle, X, Y, nWidth, nHeight, hWndParent, hMenu, hInstance, lpParam);
 		if (!bInjectorCallback) {
 			bInjectorCallback = true;
-			SetTimer(hRet, 1337, 10, PacketInjector);  // Increased from 50ms to 10ms (100Hz instead of 20Hz)
+			InstallPacketInjector(hRet);
 			DEBUG(L"MAIN THREAD OK 2");
 			DEBUGLOG(L"PacketInjector timer callback installed (via CreateWindowExA hook)");
 		}
@@ -471,7 +854,7 @@ BOOL CALLBACK SearchMaple(HWND hwnd, LPARAM lParam) {
 				if (wcscmp(wcClassName, L"MapleStoryClass") == 0) {
 					if (!bInjectorCallback) {
 						bInjectorCallback = true;
-						SetTimer(hwnd, 1337, 10, PacketInjector);  // Increased from 50ms to 10ms (100Hz instead of 20Hz)
+						InstallPacketInjector(hwnd);
 						DEBUG(L"MAIN THREAD OK 1");
 						DEBUGLOG(L"PacketInjector timer callback installed (via SearchMaple)");
 					}
@@ -0,0 +1,115 @@
+﻿#ifndef __PACKET_SENDER_H__
+#define __PACKET_SENDER_H__
+
+#include<Windows.h>
+#include<queue>
+#include<map>
+#include<memory>
+#include<string>
+#include<vector>
+#include"PacketDefs.h"
+
+// Receive buffer shared by every packet parsed out of it, freed when the last group using it is done
+typedef std::shared_ptr<std::vector<BYTE>> PacketSlab;
+
+// Writable bytes in front of every packet, RECVPACKET injection puts its 4-byte prefix there
+// (the wire formats always have the DWORD length right before the packet bytes)
+#define PACKET_HEADROOM 4
+
+// Packet inside a slab, referenced without copying
+struct PacketRef {
+	PacketSlab slab;
+	MessageHeader header;                    // SENDPACKET or RECVPACKET
+	DWORD id;                                // Request id (for acks)
+	DWORD offset;                            // Offset of the packet bytes in the slab
+	DWORD length;                            // Packet size
+
+	BYTE *data() const { return &(*slab)[offset]; }
+};
+
+// Timestamp configuration for a single packet
+struct TimestampConfig {
+	bool needs_update;
+	std::vector<DWORD> offsets;
+};
+
+// Multi-packet group waiting to be injected
+struct MultiPacketGroup {
+	std::vector<PacketRef> packets;          // Multiple packets to inject together
+	DWORD queued_time_ms;
+	BYTE current_packet_index;               // Index of next packet to inject (0-based)
+	DWORD next_packet_time_ms;               // When the next packet should be injected
+	std::vector<DWORD> template_ids;         // Template of each packet (empty or 0 = raw packet)
+	DWORD client_id;                         // TCP connection that queued the group
+	std::vector<ULONGLONG> received_us;      // TCP receipt time of each packet (for acks)
+	ULONGLONG scheduled_us;                  // When the injector picked the current packet
+};
+
+// Token bucket in packets (rate_pps 0 = unlimited)
+struct TokenBucket {
+	DWORD rate_pps;                          // Refill rate in packets per second
+	DWORD burst;                             // Bucket capacity in packets
+	double tokens;
+	DWORD last_refill_ms;
+};
+
+// Dynamic queue configuration structure
+struct QueueConfig {
+	std::string queue_name;
+	DWORD injection_interval_ms;
+	DWORD last_injection_time_ms;
+	BYTE packet_count;                       // Number of packets expected in each group
+	std::vector<TimestampConfig> timestamp_configs;  // Timestamp config for each packet
+	std::vector<DWORD> packet_intervals_ms;  // Delay BEFORE injecting each packet (in ms)
+
+	// Shaping (SET_QUEUE_SHAPING), kept across re-registration
+	TokenBucket bucket;
+	BYTE priority;                           // Priority class (0 = highest)
+
+	// Active group being injected (for atomic group injection)
+	bool has_active_group;
+	MultiPacketGroup active_group;
+};
+
+// Temporary storage for incomplete multi-packet groups being assembled
+struct IncompleteGroup {
+	std::vector<PacketRef> packets;
+	std::vector<ULONGLONG> received_us;
+	DWORD start_time_ms;
+};
+
+// Groups waiting in one queue, one FIFO per client connection so clients are scheduled fairly
+typedef std::map<DWORD, std::queue<MultiPacketGroup>> ClientGroupQueues;
+
+// Queue state shared between the TCP thread and the main thread (guarded by injection_queue_cs)
+extern std::map<std::string, QueueConfig> queue_configs;
+extern std::map<std::string, ClientGroupQueues> packet_queues;
+extern std::map<std::pair<DWORD, std::string>, IncompleteGroup> incomplete_groups;  // Keyed by (client_id, queue_name)
+extern CRITICAL_SECTION injection_queue_cs;
+extern bool injection_queue_initialized;
+
+// Reference length bytes at offset of slab, false if they don't fit or lack headroom
+bool MakePacketRef(const PacketSlab& slab, size_t offset, MessageHeader header, DWORD id, DWORD length, PacketRef& ref);
+
+// Queue management
+bool RegisterQueue(const QueueConfigMessage& config);
+bool UnregisterQueue(const std::string& queue_name);
+void ClearAllQueues();
+bool EnqueueGroups(const std::string& queue_name, std::vector<MultiPacketGroup>& groups, DWORD client_id);
+size_t QueueDepth(const ClientGroupQueues& queues);
+
+// Injection shaping
+bool SetQueueShaping(const QueueShapingMessage& shaping);
+void SetGlobalInjectionRate(DWORD rate_pps, DWORD burst);
+
+// Client connections (ids are used for fair queuing)
+DWORD AcquireInjectionClient();
+void ReleaseInjectionClient(DWORD client_id);
+
+// Wake the main thread so due injections run without waiting for the next timer tick
+void WakePacketInjector();
+
+// True while the injector is inside the game's send/process function (main thread only)
+bool IsInjectingPacket();
+
+#endif
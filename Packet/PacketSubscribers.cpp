@@ -0,0 +1,1278 @@
+﻿// PacketSubscribers.cpp - Capture stream fan-out, bounded per-client output on the TCP server's I/O loop
+// Must include SimpleTCP.h BEFORE Windows.h
+
+#include"../Share/Simple/SimpleTCP.h"
+#include"../Share/Simple/DebugLog.h"
+#include"PacketSubscribers.h"
+#include"PacketCompress.h"
+#include <deque>
+#include <map>
+#include <string>
+
+// Last packet of a (direction, opcode) sent to a delta-encoding subscriber, what its next DELTA_PACKET is based on
+struct DeltaBase {
+	ULONGLONG addr;
+	std::vector<BYTE> packet;
+};
+
+// Published frame kept for RESUME
+struct RetainedFrame {
+	ULONGLONG sequence;
+	PublishedFrame frame;
+};
+
+struct Subscriber {
+	DWORD client_id;
+	TCPServerThread *client;
+
+	// Subscription (SUBSCRIBE), only changed under subscribers_cs
+	DWORD flags;
+	DWORD opcode_mode;
+	std::vector<BYTE> opcodes;
+
+	// Slow consumer state: a full ring (the connection's write queue) drops new frames for this subscriber only
+	bool lagging;
+	bool disconnecting;
+	DWORD lag_start_ms;
+
+	// Compression (SET_COMPRESSION): frames are coalesced into batch until the worker flushes it
+	DWORD codec;
+	std::vector<BYTE> batch;
+	DWORD batch_frames;
+	DWORD batch_messages;
+
+	// Stream encodings (SET_ENCODING), bases are keyed by direction << 16 | opcode
+	DWORD encoding;
+	std::map<DWORD, DeltaBase> delta_bases;
+
+	// Pending run of exact repeats, sent as one REPEAT_PACKET when anything else goes to this subscriber
+	DWORD repeat_key;
+	DWORD repeat_first_id;
+	DWORD repeat_next_id;
+	ULONGLONG repeat_addr;
+	DWORD repeat_count;
+
+	// Dictionaries (ENCODING_DICTIONARY), ids are handed out in definition order
+	std::map<ULONGLONG, WORD> address_symbols;
+	std::map<std::string, WORD> string_symbols;
+
+	// Flow control (GRANT_CREDIT), only the units the client has granted are limited
+	DWORD flow_policy;
+	bool credit_messages_limited;
+	bool credit_bytes_limited;
+	LONGLONG credit_messages;
+	LONGLONG credit_bytes;
+	DWORD last_grant_messages;
+	DWORD last_grant_bytes;
+	DWORD downsample_count;
+	std::deque<std::pair<PublishedFrame, DWORD>> backlog;  // FLOW_CONTROL_BUFFER frames (and their message counts) waiting for credit
+
+	// Stream numbering (RESUME), next_sequence is the number the client gives the next message it gets (0 = unknown)
+	bool sequenced;
+	ULONGLONG next_sequence;
+
+	// A replay may queue more than the ring holds, live frames get that much more room until the connection has caught up
+	bool replaying;
+	size_t replay_allowance;
+	ULONGLONG replayed;
+
+	// FLOW_CONTROL_SPILL overflow file, used as a ring of subscriber_spill_size bytes. Positions only grow: frames are
+	// appended at spill_write_position (written out from spill_write_buffer up to spill_flushed_position) and read back
+	// from spill_read_position through spill_read_buffer, in order. Each frame is preceded by its message count
+	HANDLE spill_file;
+	DWORD spill_open_failure_ms;               // When the file last failed to open (0 = it didn't)
+	ULONGLONG spill_write_position;
+	ULONGLONG spill_flushed_position;
+	ULONGLONG spill_read_position;
+	std::vector<BYTE> spill_write_buffer;
+	std::vector<BYTE> spill_read_buffer;
+	size_t spill_read_offset;
+	ULONGLONG spill_frames;
+	ULONGLONG spill_messages;
+	ULONGLONG spilled;
+
+	ULONGLONG published;
+	ULONGLONG dropped;
+	ULONGLONG batches;
+	ULONGLONG raw_bytes;
+	ULONGLONG compressed_bytes;
+	ULONGLONG compress_ns;
+	ULONGLONG delta_messages;
+	ULONGLONG repeated_messages;
+	ULONGLONG compact_messages;
+	ULONGLONG symbols_defined;
+	ULONGLONG credit_dropped;
+};
+
+std::map<DWORD, std::shared_ptr<Subscriber>> subscribers;
+CRITICAL_SECTION subscribers_cs;
+
+// Subscribers with SUBSCRIBE_TRACES, read without the lock by the hooks
+volatile LONG trace_subscriber_count = 0;
+// Set when a numbered trace subscriber (one that used RESUME) disconnected, traces are still produced so it finds them
+// when it resumes. Cleared once the retained window no longer reaches back to retain_traces_sequence, the first
+// sequence published after the last such disconnect (guarded by subscribers_cs)
+volatile bool retain_traces = false;
+ULONGLONG retain_traces_sequence = 0;
+
+// Subscribers with a codec or an encoding or spilled frames, lets the worker skip flushing when there are none
+volatile LONG compressed_subscriber_count = 0;
+volatile LONG encoded_subscriber_count = 0;
+volatile LONG spilling_subscriber_count = 0;
+LARGE_INTEGER compress_qpc_frequency;
+
+DWORD subscriber_ring_size = DEFAULT_SUBSCRIBER_RING_SIZE;
+DWORD subscriber_max_lag_ms = DEFAULT_SUBSCRIBER_MAX_LAG_MS;
+
+std::wstring subscriber_spill_dir;
+ULONGLONG subscriber_spill_size = (ULONGLONG)DEFAULT_SUBSCRIBER_SPILL_MB << 20;
+
+// Every published message gets the next sequence, the most recent ones are retained for RESUME (guarded by subscribers_cs)
+ULONGLONG stream_sequence = 1;
+std::deque<RetainedFrame> retained_frames;
+size_t retained_bytes = 0;
+size_t stream_retain_bytes = (size_t)DEFAULT_STREAM_RETAIN_MB << 20;
+
+// Called from StartTCPClient before any client can connect, later calls are no-ops
+void InitPacketSubscribers() {
+	static bool initialized = false;
+	if (!initialized) {
+		InitializeCriticalSection(&subscribers_cs);
+		QueryPerformanceFrequency(&compress_qpc_frequency);
+		initialized = true;
+	}
+}
+
+void SetSubscriberLimits(DWORD ring_size, DWORD max_lag_ms) {
+	subscriber_ring_size = ring_size ? ring_size : DEFAULT_SUBSCRIBER_RING_SIZE;
+	subscriber_max_lag_ms = max_lag_ms;
+	DEBUGLOG(L"[SUB] Ring size " + std::to_wstring(subscriber_ring_size) + L" messages, max lag " +
+		std::to_wstring(subscriber_max_lag_ms) + L" ms");
+}
+
+// Called from LoadPacketConfig before any client can connect
+void SetSubscriberSpill(const std::wstring &dir, DWORD size_mb) {
+	subscriber_spill_dir = dir;
+	while (!subscriber_spill_dir.empty() && (subscriber_spill_dir.back() == L'\\' || subscriber_spill_dir.back() == L'/')) {
+		subscriber_spill_dir.pop_back();
+	}
+	subscriber_spill_size = (ULONGLONG)(size_mb ? size_mb : DEFAULT_SUBSCRIBER_SPILL_MB) << 20;
+	DEBUGLOG(L"[SUB] Overflow files of up to " + std::to_wstring(subscriber_spill_size >> 20) + L" MB in " +
+		(subscriber_spill_dir.empty() ? std::wstring(L"the temp directory") : subscriber_spill_dir));
+}
+
+// Called from LoadPacketConfig before anything is published
+void SetStreamRetention(DWORD size_mb) {
+	if (size_mb > MAX_STREAM_RETAIN_MB) {
+		size_mb = MAX_STREAM_RETAIN_MB;
+	}
+	stream_retain_bytes = (size_t)size_mb << 20;
+	DEBUGLOG(L"[SUB] Retaining " + std::to_wstring(size_mb) + L" MB of the capture stream for RESUME");
+}
+
+bool AddSubscriber(DWORD client_id, TCPServerThread *client) {
+	InitPacketSubscribers();
+
+	std::shared_ptr<Subscriber> subscriber = std::make_shared<Subscriber>();
+	subscriber->client_id = client_id;
+	subscriber->client = client;
+	subscriber->flags = SUBSCRIBE_ALL;
+	subscriber->opcode_mode = SUBSCRIBE_ALL_OPCODES;
+	subscriber->lagging = false;
+	subscriber->disconnecting = false;
+	subscriber->lag_start_ms = 0;
+	subscriber->codec = COMPRESSION_NONE;
+	subscriber->batch_frames = 0;
+	subscriber->batch_messages = 0;
+	subscriber->encoding = 0;
+	subscriber->repeat_key = 0;
+	subscriber->repeat_first_id = 0;
+	subscriber->repeat_next_id = 0;
+	subscriber->repeat_addr = 0;
+	subscriber->repeat_count = 0;
+	subscriber->flow_policy = FLOW_CONTROL_OFF;
+	subscriber->credit_messages_limited = false;
+	subscriber->credit_bytes_limited = false;
+	subscriber->credit_messages = 0;
+	subscriber->credit_bytes = 0;
+	subscriber->last_grant_messages = 0;
+	subscriber->last_grant_bytes = 0;
+	subscriber->downsample_count = 0;
+	subscriber->sequenced = false;
+	subscriber->next_sequence = 0;
+	subscriber->replaying = false;
+	subscriber->replay_allowance = 0;
+	subscriber->replayed = 0;
+	subscriber->spill_file = NULL;
+	subscriber->spill_open_failure_ms = 0;
+	subscriber->spill_write_position = 0;
+	subscriber->spill_flushed_position = 0;
+	subscriber->spill_read_position = 0;
+	subscriber->spill_read_offset = 0;
+	subscriber->spill_frames = 0;
+	subscriber->spill_messages = 0;
+	subscriber->spilled = 0;
+	subscriber->published = 0;
+	subscriber->dropped = 0;
+	subscriber->batches = 0;
+	subscriber->raw_bytes = 0;
+	subscriber->compressed_bytes = 0;
+	subscriber->compress_ns = 0;
+	subscriber->delta_messages = 0;
+	subscriber->repeated_messages = 0;
+	subscriber->compact_messages = 0;
+	subscriber->symbols_defined = 0;
+	subscriber->credit_dropped = 0;
+
+	EnterCriticalSection(&subscribers_cs);
+	subscribers[client_id] = subscriber;
+	size_t subscriber_count = subscribers.size();
+	InterlockedIncrement(&trace_subscriber_count);
+	LeaveCriticalSection(&subscribers_cs);
+
+	DEBUGLOG(L"[SUB] Subscriber " + std::to_wstring(client_id) + L" added (" + std::to_wstring(subscriber_count) + L" connected)");
+	return true;
+}
+
+// Called before the connection is destroyed, no frame is queued to it afterwards
+void RemoveSubscriber(DWORD client_id) {
+	InitPacketSubscribers();
+
+	EnterCriticalSection(&subscribers_cs);
+	auto subscriber_it = subscribers.find(client_id);
+	if (subscriber_it == subscribers.end()) {
+		LeaveCriticalSection(&subscribers_cs);
+		return;
+	}
+	std::shared_ptr<Subscriber> subscriber = subscriber_it->second;
+	subscribers.erase(subscriber_it);
+	if (subscriber->flags & SUBSCRIBE_TRACES) {
+		InterlockedDecrement(&trace_subscriber_count);
+		if (subscriber->sequenced && stream_retain_bytes) {
+			retain_traces_sequence = stream_sequence;
+			retain_traces = true;
+		}
+	}
+	if (subscriber->codec != COMPRESSION_NONE) {
+		InterlockedDecrement(&compressed_subscriber_count);
+	}
+	if (subscriber->encoding) {
+		InterlockedDecrement(&encoded_subscriber_count);
+	}
+	if (subscriber->spill_frames) {
+		InterlockedDecrement(&spilling_subscriber_count);
+	}
+	LeaveCriticalSection(&subscribers_cs);
+
+	// Deleted on close
+	if (subscriber->spill_file) {
+		CloseHandle(subscriber->spill_file);
+	}
+
+	DEBUGLOG(L"[SUB] Subscriber " + std::to_wstring(client_id) + L" removed (published=" +
+		std::to_wstring(subscriber->published) + L", dropped=" + std::to_wstring(subscriber->dropped) + L", replayed=" +
+		std::to_wstring(subscriber->replayed) + L")");
+}
+
+bool SetSubscription(DWORD client_id, const SubscribeMessage& subscription) {
+	InitPacketSubscribers();
+
+	if (subscription.opcode_mode > SUBSCRIBE_DENY_OPCODES) {
+		DEBUGLOG(L"[SUB] ERROR: Invalid opcode mode " + std::to_wstring(subscription.opcode_mode));
+		return false;
+	}
+
+	EnterCriticalSection(&subscribers_cs);
+	auto subscriber_it = subscribers.find(client_id);
+	if (subscriber_it == subscribers.end()) {
+		LeaveCriticalSection(&subscribers_cs);
+		return false;
+	}
+	Subscriber *subscriber = subscriber_it->second.get();
+	if ((subscriber->flags & SUBSCRIBE_TRACES) && !(subscription.flags & SUBSCRIBE_TRACES)) {
+		InterlockedDecrement(&trace_subscriber_count);
+	}
+	else if (!(subscriber->flags & SUBSCRIBE_TRACES) && (subscription.flags & SUBSCRIBE_TRACES)) {
+		InterlockedIncrement(&trace_subscriber_count);
+	}
+	subscriber->flags = subscription.flags;
+	subscriber->opcode_mode = subscription.opcode_mode;
+	if (subscription.opcode_mode == SUBSCRIBE_ALL_OPCODES) {
+		subscriber->opcodes.clear();
+	}
+	else {
+		subscriber->opcodes.assign(subscription.opcodes, subscription.opcodes + sizeof(subscription.opcodes));
+	}
+	LeaveCriticalSection(&subscribers_cs);
+
+	DEBUGLOG(L"[SUB] Subscriber " + std::to_wstring(client_id) + L" subscribed (" +
+		std::wstring((subscription.flags & SUBSCRIBE_SEND) ? L"SEND " : L"") +
+		std::wstring((subscription.flags & SUBSCRIBE_RECV) ? L"RECV " : L"") +
+		std::wstring((subscription.flags & SUBSCRIBE_TRACES) ? L"TRACES " : L"") +
+		L"opcode mode " + std::to_wstring(subscription.opcode_mode) + L")");
+	return true;
+}
+
+bool SubscribersWantTraces() {
+	return trace_subscriber_count != 0 || retain_traces;
+}
+
+// Must be called with subscribers_cs held
+bool SubscriberWants(const Subscriber *subscriber, MessageHeader header, const BYTE *data, ULONG_PTR length) {
+	if (header == SENDPACKET || header == RECVPACKET) {
+		if (!(subscriber->flags & ((header == SENDPACKET) ? SUBSCRIBE_SEND : SUBSCRIBE_RECV))) {
+			return false;
+		}
+		if (subscriber->opcode_mode == SUBSCRIBE_ALL_OPCODES) {
+			return true;
+		}
+		const PacketEditorMessage *pem = (const PacketEditorMessage *)data;
+		if (length < offsetof(PacketEditorMessage, Binary.packet) + sizeof(WORD) || pem->Binary.length < sizeof(WORD)) {
+			return subscriber->opcode_mode == SUBSCRIBE_DENY_OPCODES;
+		}
+		WORD opcode = *(WORD *)&pem->Binary.packet[0];
+		bool listed = (subscriber->opcodes[opcode >> 3] & (1 << (opcode & 7))) != 0;
+		return (subscriber->opcode_mode == SUBSCRIBE_ALLOW_OPCODES) ? listed : !listed;
+	}
+
+	// Format traces follow the direction of the packet they describe
+	if (!(subscriber->flags & SUBSCRIBE_TRACES)) {
+		return false;
+	}
+	if (header >= ENCODE_BEGIN && header <= ENCODE_END) {
+		return (subscriber->flags & SUBSCRIBE_SEND) != 0;
+	}
+	if (header >= DECODE_BEGIN && header <= DECODE_END) {
+		return (subscriber->flags & SUBSCRIBE_RECV) != 0;
+	}
+	return true;
+}
+
+// Must be called with subscribers_cs held, the frame's messages were counted as published
+void DropFrame(Subscriber *subscriber, DWORD messages) {
+	subscriber->dropped += messages;
+
+	// The next message the client gets is announced with its sequence
+	subscriber->next_sequence = 0;
+
+	// The client never sees this frame, deltas, repeats and symbols would be based on things it doesn't have
+	if (subscriber->encoding & ENCODING_DELTA) {
+		subscriber->delta_bases.clear();
+		subscriber->published += subscriber->repeat_count;
+		subscriber->dropped += subscriber->repeat_count;
+		subscriber->repeat_count = 0;
+	}
+	if (subscriber->encoding & ENCODING_DICTIONARY) {
+		subscriber->address_symbols.clear();
+		subscriber->string_symbols.clear();
+	}
+}
+
+// Must be called with subscribers_cs held, puts the frame in the connection's ring, false if it was dropped because the ring is full
+bool SendFrame(Subscriber *subscriber, const PublishedFrame &frame, DWORD now, DWORD messages) {
+	if (!subscriber->client->QueueFrame(frame, subscriber_ring_size + subscriber->replay_allowance)) {
+		DropFrame(subscriber, messages);
+
+		if (!subscriber->lagging) {
+			subscriber->lagging = true;
+			subscriber->lag_start_ms = now;
+			DEBUGLOG(L"[SUB] Subscriber " + std::to_wstring(subscriber->client_id) + L" is lagging, dropping its messages");
+		}
+		else if (subscriber_max_lag_ms && !subscriber->disconnecting && now - subscriber->lag_start_ms >= subscriber_max_lag_ms) {
+			subscriber->disconnecting = true;
+			DEBUGLOG(L"[SUB] Subscriber " + std::to_wstring(subscriber->client_id) + L" lagged for " +
+				std::to_wstring(now - subscriber->lag_start_ms) + L" ms, disconnecting");
+			subscriber->client->Shutdown();
+		}
+		return false;
+	}
+
+	// Recovered once the I/O loop has caught up to half the ring
+	if (subscriber->lagging && subscriber->client->PendingFrames() < subscriber_ring_size / 2) {
+		subscriber->lagging = false;
+		DEBUGLOG(L"[SUB] Subscriber " + std::to_wstring(subscriber->client_id) + L" caught up (dropped " +
+			std::to_wstring(subscriber->dropped) + L" so far)");
+	}
+
+	// The room given to a replay is taken back once the connection is down to its ring
+	if (subscriber->replay_allowance && !subscriber->replaying && subscriber->client->PendingFrames() < subscriber_ring_size) {
+		subscriber->replay_allowance = 0;
+	}
+	return true;
+}
+
+// Must be called with subscribers_cs held, a frame may overdraw the credit left (so a large batch never waits forever)
+bool HasCredit(const Subscriber *subscriber) {
+	return (!subscriber->credit_messages_limited || subscriber->credit_messages > 0) &&
+		(!subscriber->credit_bytes_limited || subscriber->credit_bytes > 0);
+}
+
+// Must be called with subscribers_cs held, less than half the last grant is left
+bool CreditLow(const Subscriber *subscriber) {
+	return (subscriber->credit_messages_limited && subscriber->credit_messages * 2 < subscriber->last_grant_messages) ||
+		(subscriber->credit_bytes_limited && subscriber->credit_bytes * 2 < subscriber->last_grant_bytes);
+}
+
+// Must be called with subscribers_cs held
+void SpendCredit(Subscriber *subscriber, const PublishedFrame &frame, DWORD messages) {
+	if (subscriber->credit_messages_limited) {
+		subscriber->credit_messages -= messages;
+	}
+	if (subscriber->credit_bytes_limited) {
+		subscriber->credit_bytes -= (LONGLONG)frame->size();
+	}
+}
+
+// Must be called with subscribers_cs held, reads or writes the overflow file at a position of its ring
+bool SpillFileIO(Subscriber *subscriber, ULONGLONG position, BYTE *data, size_t size, bool write) {
+	while (size) {
+		ULONGLONG offset = position % subscriber_spill_size;
+		size_t chunk = (size < subscriber_spill_size - offset) ? size : (size_t)(subscriber_spill_size - offset);
+		LARGE_INTEGER file_offset;
+		file_offset.QuadPart = (LONGLONG)offset;
+		DWORD done = 0;
+		if (!SetFilePointerEx(subscriber->spill_file, file_offset, NULL, FILE_BEGIN) ||
+			!(write ? WriteFile(subscriber->spill_file, data, (DWORD)chunk, &done, NULL) : ReadFile(subscriber->spill_file, data, (DWORD)chunk, &done, NULL)) ||
+			done != chunk) {
+			return false;
+		}
+		position += chunk;
+		data += chunk;
+		size -= chunk;
+	}
+	return true;
+}
+
+// Must be called with subscribers_cs held
+bool FlushSpillBuffer(Subscriber *subscriber) {
+	if (subscriber->spill_write_buffer.empty()) {
+		return true;
+	}
+	bool written = SpillFileIO(subscriber, subscriber->spill_flushed_position, &subscriber->spill_write_buffer[0], subscriber->spill_write_buffer.size(), true);
+	subscriber->spill_flushed_position += subscriber->spill_write_buffer.size();
+	subscriber->spill_write_buffer.clear();
+	return written;
+}
+
+// Must be called with subscribers_cs held, the file is empty again (kept open for the next spill)
+void ResetSpill(Subscriber *subscriber) {
+	if (subscriber->spill_frames) {
+		InterlockedDecrement(&spilling_subscriber_count);
+	}
+	subscriber->spill_write_position = 0;
+	subscriber->spill_flushed_position = 0;
+	subscriber->spill_read_position = 0;
+	subscriber->spill_write_buffer.clear();
+	subscriber->spill_read_buffer.clear();
+	subscriber->spill_read_offset = 0;
+	subscriber->spill_frames = 0;
+	subscriber->spill_messages = 0;
+}
+
+// Must be called with subscribers_cs held, after a file error everything spilled is lost
+void DiscardSpill(Subscriber *subscriber) {
+	DEBUGLOG(L"[SUB] Subscriber " + std::to_wstring(subscriber->client_id) + L" overflow file failed (error " +
+		std::to_wstring(GetLastError()) + L"), " + std::to_wstring(subscriber->spill_messages) + L" spilled messages lost");
+	DWORD messages = (DWORD)subscriber->spill_messages;
+	ResetSpill(subscriber);
+	DropFrame(subscriber, messages);
+}
+
+// Must be called with subscribers_cs held, appends a frame to the overflow file, false if it's full or can't be written
+bool SpillFrame(Subscriber *subscriber, const PublishedFrame &frame, DWORD messages) {
+	if (!subscriber->spill_file) {
+		// Don't retry a failing disk for every message
+		DWORD now = GetTickCount();
+		if (subscriber->spill_open_failure_ms && now - subscriber->spill_open_failure_ms < 1000) {
+			return false;
+		}
+		std::wstring dir = subscriber_spill_dir;
+		if (dir.empty()) {
+			WCHAR temp_path[MAX_PATH + 1] = {};
+			GetTempPathW(MAX_PATH + 1, temp_path);
+			dir = temp_path;
+			dir.pop_back();
+		}
+		std::wstring path = dir + L"\\RirePE-spill-" + std::to_wstring(GetCurrentProcessId()) + L"-" + std::to_wstring(subscriber->client_id) + L".tmp";
+		subscriber->spill_file = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+			FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+		if (subscriber->spill_file == INVALID_HANDLE_VALUE) {
+			subscriber->spill_file = NULL;
+			// Logged once per run of failures
+			if (!subscriber->spill_open_failure_ms) {
+				DEBUGLOG(L"[SUB] Failed to create " + path + L" (error " + std::to_wstring(GetLastError()) + L"), dropping instead");
+			}
+			subscriber->spill_open_failure_ms = now ? now : 1;
+			return false;
+		}
+		subscriber->spill_open_failure_ms = 0;
+		DEBUGLOG(L"[SUB] Subscriber " + std::to_wstring(subscriber->client_id) + L" is spilling to " + path);
+	}
+
+	size_t size = sizeof(DWORD) + frame->size();
+	if (subscriber->spill_write_position + size - subscriber->spill_read_position > subscriber_spill_size) {
+		return false;
+	}
+	subscriber->spill_write_buffer.insert(subscriber->spill_write_buffer.end(), (BYTE *)&messages, (BYTE *)&messages + sizeof(DWORD));
+	subscriber->spill_write_buffer.insert(subscriber->spill_write_buffer.end(), frame->begin(), frame->end());
+	subscriber->spill_write_position += size;
+	if (subscriber->spill_frames++ == 0) {
+		InterlockedIncrement(&spilling_subscriber_count);
+	}
+	subscriber->spill_messages += messages;
+	subscriber->spilled += messages;
+
+	if (subscriber->spill_write_buffer.size() >= SPILL_WRITE_BUFFER_SIZE && !FlushSpillBuffer(subscriber)) {
+		DiscardSpill(subscriber);
+	}
+	return true;
+}
+
+// Must be called with subscribers_cs held, at least needed unread bytes in spill_read_buffer
+bool FillSpillBuffer(Subscriber *subscriber, size_t needed) {
+	std::vector<BYTE> &buffer = subscriber->spill_read_buffer;
+	buffer.erase(buffer.begin(), buffer.begin() + subscriber->spill_read_offset);
+	subscriber->spill_read_offset = 0;
+	while (buffer.size() < needed) {
+		// The newest frames may not be written out yet
+		if (subscriber->spill_read_position == subscriber->spill_flushed_position && !FlushSpillBuffer(subscriber)) {
+			return false;
+		}
+		size_t available = (size_t)(subscriber->spill_flushed_position - subscriber->spill_read_position);
+		if (!available) {
+			return false;
+		}
+		size_t chunk = (available < SPILL_READ_BUFFER_SIZE) ? available : SPILL_READ_BUFFER_SIZE;
+		if (chunk < needed - buffer.size()) {
+			chunk = (available < needed - buffer.size()) ? available : needed - buffer.size();
+		}
+		size_t offset = buffer.size();
+		buffer.resize(offset + chunk);
+		if (!SpillFileIO(subscriber, subscriber->spill_read_position, &buffer[offset], chunk, false)) {
+			return false;
+		}
+		subscriber->spill_read_position += chunk;
+	}
+	return true;
+}
+
+// Must be called with subscribers_cs held, the oldest spilled frame (empty on a file error)
+PublishedFrame ReadSpilledFrame(Subscriber *subscriber, DWORD &messages) {
+	const size_t header_size = sizeof(DWORD) * 3;  // messages, magic, length
+	if (subscriber->spill_read_buffer.size() - subscriber->spill_read_offset < header_size && !FillSpillBuffer(subscriber, header_size)) {
+		return PublishedFrame();
+	}
+	DWORD length = *(DWORD *)&subscriber->spill_read_buffer[subscriber->spill_read_offset + sizeof(DWORD) * 2];
+	if (subscriber->spill_read_buffer.size() - subscriber->spill_read_offset < header_size + length && !FillSpillBuffer(subscriber, header_size + length)) {
+		return PublishedFrame();
+	}
+	const BYTE *record = &subscriber->spill_read_buffer[subscriber->spill_read_offset];
+	messages = *(DWORD *)record;
+	subscriber->spill_read_offset += header_size + length;
+	return std::make_shared<std::vector<BYTE>>(record + sizeof(DWORD), record + header_size + length);
+}
+
+// Must be called with subscribers_cs held, moves spilled frames back to the connection while its ring has room (and credit is left)
+void DrainSpill(Subscriber *subscriber) {
+	if (!subscriber->spill_frames) {
+		return;
+	}
+	size_t pending = subscriber->client->PendingFrames();
+	while (subscriber->spill_frames && pending < subscriber_ring_size && HasCredit(subscriber)) {
+		DWORD messages = 0;
+		PublishedFrame frame = ReadSpilledFrame(subscriber, messages);
+		if (!frame) {
+			DiscardSpill(subscriber);
+			return;
+		}
+		subscriber->spill_messages -= messages;
+		if (--subscriber->spill_frames == 0) {
+			InterlockedDecrement(&spilling_subscriber_count);
+			ResetSpill(subscriber);
+		}
+		SpendCredit(subscriber, frame, messages);
+		subscriber->client->QueueFrame(frame);
+		pending++;
+	}
+}
+
+// Must be called with subscribers_cs held, false if the policy sheds this message because credit is low or out
+// Shed before encoding, so deltas and symbols stay valid (QueueFrame would have to reset them)
+bool CreditAdmits(Subscriber *subscriber, MessageHeader header) {
+	if (subscriber->flow_policy == FLOW_CONTROL_OFF || subscriber->flow_policy == FLOW_CONTROL_SPILL) {
+		return true;
+	}
+	if (subscriber->flow_policy == FLOW_CONTROL_BUFFER) {
+		if (subscriber->backlog.size() < subscriber_ring_size + subscriber->replay_allowance) {
+			return true;
+		}
+	}
+	else if (!CreditLow(subscriber)) {
+		return true;
+	}
+	// Traces go first, downsampling then keeps 1 packet in CREDIT_DOWNSAMPLE_RATE
+	else if (HasCredit(subscriber) && (header == SENDPACKET || header == RECVPACKET)) {
+		if (subscriber->flow_policy == FLOW_CONTROL_DROP_TRACES || subscriber->downsample_count++ % CREDIT_DOWNSAMPLE_RATE == 0) {
+			return true;
+		}
+	}
+	subscriber->published++;
+	subscriber->dropped++;
+	subscriber->credit_dropped++;
+	return false;
+}
+
+// Must be called with subscribers_cs held, frame carries messages capture messages (more than one for a batch)
+// Within credit (or without flow control) the frame goes to the ring, otherwise the subscriber's policy applies
+void QueueFrame(Subscriber *subscriber, const PublishedFrame &frame, DWORD now, DWORD messages = 1) {
+	subscriber->published += messages;
+
+	// Lossless: spilled when credit is out or the ring is full, and then everything after it until the file is drained
+	if (subscriber->flow_policy == FLOW_CONTROL_SPILL || subscriber->spill_frames) {
+		if (!subscriber->spill_frames && HasCredit(subscriber) && subscriber->client->QueueFrame(frame, subscriber_ring_size + subscriber->replay_allowance)) {
+			SpendCredit(subscriber, frame, messages);
+			return;
+		}
+		if (!SpillFrame(subscriber, frame, messages)) {
+			DropFrame(subscriber, messages);
+		}
+		return;
+	}
+
+	if (subscriber->flow_policy != FLOW_CONTROL_OFF) {
+		if (!subscriber->backlog.empty() || !HasCredit(subscriber)) {
+			if (subscriber->flow_policy == FLOW_CONTROL_BUFFER && subscriber->backlog.size() < subscriber_ring_size + subscriber->replay_allowance) {
+				subscriber->backlog.push_back(std::make_pair(frame, messages));
+				return;
+			}
+			subscriber->credit_dropped += messages;
+			DropFrame(subscriber, messages);
+			return;
+		}
+		SpendCredit(subscriber, frame, messages);
+	}
+	SendFrame(subscriber, frame, now, messages);
+}
+
+// Must be called with subscribers_cs held
+// Sends the coalesced frames as one COMPRESSED_BATCH, stored as they are when they don't compress
+void FlushBatch(Subscriber *subscriber, DWORD now) {
+	if (subscriber->batch.empty()) {
+		return;
+	}
+
+	const size_t header_size = sizeof(DWORD) * 2 + offsetof(CompressedBatchMessage, data);
+	size_t raw_length = subscriber->batch.size();
+	std::shared_ptr<std::vector<BYTE>> buffer = std::make_shared<std::vector<BYTE>>(header_size + LZ4CompressBound(raw_length));
+
+	LARGE_INTEGER start, end;
+	QueryPerformanceCounter(&start);
+	DWORD codec = COMPRESSION_LZ4;
+	size_t compressed_length = LZ4CompressBlock(&subscriber->batch[0], raw_length, &(*buffer)[header_size], buffer->size() - header_size);
+	if (compressed_length == 0 || compressed_length >= raw_length) {
+		codec = COMPRESSION_NONE;
+		compressed_length = raw_length;
+		memcpy(&(*buffer)[header_size], &subscriber->batch[0], raw_length);
+	}
+	QueryPerformanceCounter(&end);
+	buffer->resize(header_size + compressed_length);
+
+	TCPMessage *msg = (TCPMessage *)&(*buffer)[0];
+	msg->magic = TCP_MESSAGE_MAGIC;
+	msg->length = (DWORD)(buffer->size() - sizeof(DWORD) * 2);
+	CompressedBatchMessage *cbm = (CompressedBatchMessage *)msg->data;
+	cbm->header = COMPRESSED_BATCH;
+	cbm->codec = codec;
+	cbm->raw_length = (DWORD)raw_length;
+	cbm->frame_count = subscriber->batch_frames;
+
+	subscriber->batches++;
+	subscriber->raw_bytes += raw_length;
+	subscriber->compressed_bytes += compressed_length;
+	subscriber->compress_ns += (ULONGLONG)(end.QuadPart - start.QuadPart) * 1000000000 / compress_qpc_frequency.QuadPart;
+
+	DWORD messages = subscriber->batch_messages;
+	subscriber->batch.clear();
+	subscriber->batch_frames = 0;
+	subscriber->batch_messages = 0;
+	QueueFrame(subscriber, buffer, now, messages);
+}
+
+// Must be called with subscribers_cs held
+void AppendToBatch(Subscriber *subscriber, const PublishedFrame &frame, DWORD now, DWORD messages) {
+	if (!subscriber->batch.empty() && subscriber->batch.size() + frame->size() > COMPRESSION_BATCH_SIZE) {
+		FlushBatch(subscriber, now);
+	}
+	subscriber->batch.insert(subscriber->batch.end(), frame->begin(), frame->end());
+	subscriber->batch_frames++;
+	subscriber->batch_messages += messages;
+}
+
+// Must be called with subscribers_cs held, queued as is or coalesced depending on the codec
+void DeliverFrame(Subscriber *subscriber, const PublishedFrame &frame, DWORD now, DWORD messages = 1) {
+	if (subscriber->codec != COMPRESSION_NONE) {
+		AppendToBatch(subscriber, frame, now, messages);
+	}
+	else {
+		QueueFrame(subscriber, frame, now, messages);
+	}
+}
+
+// Frame of data (magic + length + data)
+PublishedFrame MakeFrame(const BYTE *data, ULONG_PTR length) {
+	std::shared_ptr<std::vector<BYTE>> buffer = std::make_shared<std::vector<BYTE>>(sizeof(DWORD) * 2 + length);
+	TCPMessage *msg = (TCPMessage *)&(*buffer)[0];
+	msg->magic = TCP_MESSAGE_MAGIC;
+	msg->length = (DWORD)length;
+	memcpy(msg->data, data, length);
+	return buffer;
+}
+
+// Must be called with subscribers_cs held, sends the pending run of repeats before anything else goes out
+void FlushRepeat(Subscriber *subscriber, DWORD now) {
+	if (subscriber->repeat_count == 0) {
+		return;
+	}
+
+	RepeatPacketMessage repeat;
+	repeat.header = REPEAT_PACKET;
+	repeat.direction = (MessageHeader)(subscriber->repeat_key >> 16);
+	repeat.first_id = subscriber->repeat_first_id;
+	repeat.addr = subscriber->repeat_addr;
+	repeat.opcode = (WORD)subscriber->repeat_key;
+	repeat.count = subscriber->repeat_count;
+
+	subscriber->repeated_messages += subscriber->repeat_count;
+	subscriber->repeat_count = 0;
+	DeliverFrame(subscriber, MakeFrame((BYTE *)&repeat, sizeof(repeat)), now, repeat.count);
+}
+
+// Must be called with subscribers_cs held
+// Sends a SEND/RECV packet as a repeat or a delta against the previous packet of its opcode,
+// false if it has to go out whole (the caller sends the shared frame)
+bool PublishDelta(Subscriber *subscriber, const BYTE *data, ULONG_PTR length, DWORD now) {
+	const PacketEditorMessage *pem = (const PacketEditorMessage *)data;
+	const size_t header_size = offsetof(PacketEditorMessage, Binary.packet);
+	if (length < header_size || pem->Binary.length < sizeof(WORD) || pem->Binary.length > length - header_size) {
+		FlushRepeat(subscriber, now);
+		return false;
+	}
+
+	const BYTE *packet = pem->Binary.packet;
+	DWORD packet_length = pem->Binary.length;
+	WORD opcode = *(WORD *)packet;
+	DWORD key = ((DWORD)pem->header << 16) | opcode;
+
+	if (packet_length > DELTA_MAX_PACKET_SIZE) {
+		FlushRepeat(subscriber, now);
+		subscriber->delta_bases.erase(key);
+		return false;
+	}
+
+	auto base_it = subscriber->delta_bases.find(key);
+	bool repeat = false;
+	if (base_it != subscriber->delta_bases.end()) {
+		DeltaBase &base = base_it->second;
+		repeat = base.addr == pem->addr && base.packet.size() == packet_length && memcmp(&base.packet[0], packet, packet_length) == 0;
+		// Folded into the pending run while ids stay consecutive
+		if (repeat && subscriber->repeat_count && subscriber->repeat_key == key && subscriber->repeat_next_id == pem->id) {
+			subscriber->repeat_count++;
+			subscriber->repeat_next_id += 2;
+			return true;
+		}
+	}
+	FlushRepeat(subscriber, now);
+
+	// A drop while flushing resets every base, the packet then goes out whole
+	base_it = subscriber->delta_bases.find(key);
+	if (repeat && base_it != subscriber->delta_bases.end()) {
+		subscriber->repeat_key = key;
+		subscriber->repeat_first_id = pem->id;
+		subscriber->repeat_next_id = pem->id + 2;
+		subscriber->repeat_addr = pem->addr;
+		subscriber->repeat_count = 1;
+		return true;
+	}
+
+	// Sent whole when there is no base yet or the delta isn't smaller
+	PublishedFrame delta_frame;
+	if (base_it != subscriber->delta_bases.end()) {
+		DeltaBase &base = base_it->second;
+		const size_t delta_header_size = offsetof(DeltaPacketMessage, delta);
+		std::shared_ptr<std::vector<BYTE>> buffer = std::make_shared<std::vector<BYTE>>(sizeof(DWORD) * 2 + delta_header_size + DeltaEncodeBound(packet_length));
+		size_t delta_length = DeltaEncode(&base.packet[0], base.packet.size(), packet, packet_length, &(*buffer)[sizeof(DWORD) * 2 + delta_header_size]);
+		if (delta_header_size + delta_length < header_size + packet_length) {
+			buffer->resize(sizeof(DWORD) * 2 + delta_header_size + delta_length);
+			TCPMessage *msg = (TCPMessage *)&(*buffer)[0];
+			msg->magic = TCP_MESSAGE_MAGIC;
+			msg->length = (DWORD)(delta_header_size + delta_length);
+			DeltaPacketMessage *dpm = (DeltaPacketMessage *)msg->data;
+			dpm->header = DELTA_PACKET;
+			dpm->direction = pem->header;
+			dpm->id = pem->id;
+			dpm->addr = pem->addr;
+			dpm->opcode = opcode;
+			dpm->length = packet_length;
+			delta_frame = buffer;
+		}
+	}
+
+	// Updated before delivery, a drop while delivering resets every base
+	DeltaBase &base = subscriber->delta_bases[key];
+	base.addr = pem->addr;
+	base.packet.assign(packet, packet + packet_length);
+
+	if (!delta_frame) {
+		return false;
+	}
+	subscriber->delta_messages++;
+	DeliverFrame(subscriber, delta_frame, now);
+	return true;
+}
+
+// Must be called with subscribers_cs held
+void DefineSymbol(Subscriber *subscriber, DWORD kind, WORD symbol, const BYTE *value, DWORD length, DWORD now) {
+	std::vector<BYTE> message(offsetof(SymbolDefineMessage, value) + length);
+	SymbolDefineMessage *sdm = (SymbolDefineMessage *)&message[0];
+	sdm->header = DEFINE_SYMBOL;
+	sdm->kind = kind;
+	sdm->symbol = symbol;
+	sdm->length = length;
+	memcpy(sdm->value, value, length);
+
+	subscriber->symbols_defined++;
+	DeliverFrame(subscriber, MakeFrame(&message[0], message.size()), now, 0);
+}
+
+// Must be called with subscribers_cs held
+// Sends a message as COMPACT_MESSAGE, defining its address (and string) first if they are new,
+// false if it has to go out whole (malformed, or a dictionary is full)
+bool PublishCompact(Subscriber *subscriber, const BYTE *data, ULONG_PTR length, DWORD now) {
+	const PacketEditorMessage *pem = (const PacketEditorMessage *)data;
+	const size_t pem_header_size = offsetof(PacketEditorMessage, Binary);
+	if (length < pem_header_size || (DWORD)pem->header > 0xFF) {
+		return false;
+	}
+
+	// Body without the padding of the union, and the string of a string trace
+	const BYTE *body = data + pem_header_size;
+	size_t body_size = length - pem_header_size;
+	const BYTE *string = NULL;
+	size_t string_size = 0;
+	if (pem->header == SENDPACKET || pem->header == RECVPACKET) {
+		if (body_size < sizeof(DWORD) || pem->Binary.length > body_size - sizeof(DWORD)) {
+			return false;
+		}
+		body_size = sizeof(DWORD) + pem->Binary.length;
+	}
+	else if (pem->header >= ENCODE_BEGIN && pem->header <= DECODE_END) {
+		const size_t extra_header_size = offsetof(PacketEditorMessage, Extra.data) - pem_header_size;
+		if (body_size < extra_header_size) {
+			return false;
+		}
+		size_t data_size = (pem->Extra.update == FORMAT_UPDATE) ? pem->Extra.size : 0;
+		if (data_size > body_size - extra_header_size) {
+			return false;
+		}
+		body_size = extra_header_size + data_size;
+		if ((pem->header == ENCODESTR || pem->header == DECODESTR) && data_size && data_size <= DICTIONARY_MAX_STRING_SIZE) {
+			string = pem->Extra.data;
+			string_size = data_size;
+		}
+	}
+
+	auto address_it = subscriber->address_symbols.find(pem->addr);
+	if (address_it == subscriber->address_symbols.end()) {
+		if (subscriber->address_symbols.size() >= DICTIONARY_MAX_SYMBOLS) {
+			return false;
+		}
+		WORD symbol = (WORD)subscriber->address_symbols.size();
+		subscriber->address_symbols[pem->addr] = symbol;
+		ULONGLONG addr = pem->addr;
+		DefineSymbol(subscriber, SYMBOL_ADDRESS, symbol, (BYTE *)&addr, sizeof(addr), now);
+	}
+
+	std::string string_key;
+	if (string) {
+		string_key.assign((const char *)string, string_size);
+		if (subscriber->string_symbols.find(string_key) == subscriber->string_symbols.end()) {
+			if (subscriber->string_symbols.size() < DICTIONARY_MAX_SYMBOLS) {
+				WORD symbol = (WORD)subscriber->string_symbols.size();
+				subscriber->string_symbols[string_key] = symbol;
+				DefineSymbol(subscriber, SYMBOL_STRING, symbol, string, (DWORD)string_size, now);
+			}
+		}
+	}
+
+	// A definition that was dropped reset the dictionaries, the message then goes out whole
+	address_it = subscriber->address_symbols.find(pem->addr);
+	if (address_it == subscriber->address_symbols.end()) {
+		return false;
+	}
+	auto string_it = subscriber->string_symbols.end();
+	if (string) {
+		string_it = subscriber->string_symbols.find(string_key);
+	}
+
+	const size_t compact_header_size = offsetof(CompactMessage, body);
+	size_t compact_body_size = (string_it != subscriber->string_symbols.end()) ? body_size - string_size + sizeof(WORD) : body_size;
+	std::vector<BYTE> message(compact_header_size + compact_body_size);
+	CompactMessage *cm = (CompactMessage *)&message[0];
+	cm->header = COMPACT_MESSAGE;
+	cm->type = (BYTE)pem->header;
+	cm->flags = 0;
+	cm->addr_symbol = address_it->second;
+	cm->id = pem->id;
+	if (string_it != subscriber->string_symbols.end()) {
+		cm->flags |= COMPACT_STRING_SYMBOL;
+		memcpy(cm->body, body, body_size - string_size);
+		*(WORD *)&cm->body[body_size - string_size] = string_it->second;
+	}
+	else {
+		memcpy(cm->body, body, body_size);
+	}
+
+	subscriber->compact_messages++;
+	DeliverFrame(subscriber, MakeFrame(&message[0], message.size()), now);
+	return true;
+}
+
+DWORD SetEncoding(DWORD client_id, DWORD flags) {
+	InitPacketSubscribers();
+
+	if (flags & ~ENCODING_ALL) {
+		DEBUGLOG(L"[SUB] Unknown encoding flags " + std::to_wstring(flags & ~ENCODING_ALL) + L" ignored");
+		flags &= ENCODING_ALL;
+	}
+
+	EnterCriticalSection(&subscribers_cs);
+	auto subscriber_it = subscribers.find(client_id);
+	if (subscriber_it == subscribers.end()) {
+		LeaveCriticalSection(&subscribers_cs);
+		return 0;
+	}
+	Subscriber *subscriber = subscriber_it->second.get();
+
+	// Pending repeats go out under the old encoding, every encoding starts from scratch
+	DWORD now = GetTickCount();
+	FlushRepeat(subscriber, now);
+	subscriber->delta_bases.clear();
+	subscriber->address_symbols.clear();
+	subscriber->string_symbols.clear();
+	if (!subscriber->encoding && flags) {
+		InterlockedIncrement(&encoded_subscriber_count);
+	}
+	else if (subscriber->encoding && !flags) {
+		InterlockedDecrement(&encoded_subscriber_count);
+	}
+	subscriber->encoding = flags;
+	LeaveCriticalSection(&subscribers_cs);
+
+	DEBUGLOG(L"[SUB] Subscriber " + std::to_wstring(client_id) + L" uses encodings " + std::to_wstring(flags));
+	return flags;
+}
+
+bool GrantCredit(DWORD client_id, const CreditMessage& grant) {
+	InitPacketSubscribers();
+
+	if (grant.policy >= FLOW_CONTROL_POLICY_COUNT) {
+		DEBUGLOG(L"[SUB] Unknown flow control policy " + std::to_wstring(grant.policy) + L", grant ignored");
+		return false;
+	}
+
+	EnterCriticalSection(&subscribers_cs);
+	auto subscriber_it = subscribers.find(client_id);
+	if (subscriber_it == subscribers.end()) {
+		LeaveCriticalSection(&subscribers_cs);
+		return false;
+	}
+	Subscriber *subscriber = subscriber_it->second.get();
+
+	if (subscriber->flow_policy != grant.policy) {
+		DEBUGLOG(L"[SUB] Subscriber " + std::to_wstring(client_id) + L" uses flow control policy " + std::to_wstring(grant.policy));
+	}
+	subscriber->flow_policy = grant.policy;
+	if (grant.policy == FLOW_CONTROL_OFF) {
+		subscriber->credit_messages_limited = false;
+		subscriber->credit_bytes_limited = false;
+		subscriber->credit_messages = 0;
+		subscriber->credit_bytes = 0;
+	}
+	if (grant.messages) {
+		subscriber->credit_messages_limited = true;
+		subscriber->credit_messages += grant.messages;
+		subscriber->last_grant_messages = grant.messages;
+	}
+	if (grant.bytes) {
+		subscriber->credit_bytes_limited = true;
+		subscriber->credit_bytes += grant.bytes;
+		subscriber->last_grant_bytes = grant.bytes;
+	}
+
+	// What was held back goes out first, in order
+	DWORD now = GetTickCount();
+	while (!subscriber->backlog.empty() && (subscriber->flow_policy == FLOW_CONTROL_OFF || HasCredit(subscriber))) {
+		std::pair<PublishedFrame, DWORD> held = subscriber->backlog.front();
+		subscriber->backlog.pop_front();
+		if (subscriber->flow_policy != FLOW_CONTROL_OFF) {
+			SpendCredit(subscriber, held.first, held.second);
+		}
+		// A numbered client would count the frames after a lost one from the wrong sequence
+		if (!SendFrame(subscriber, held.first, now, held.second) && subscriber->sequenced) {
+			for (auto &lost : subscriber->backlog) {
+				subscriber->dropped += lost.second;
+			}
+			subscriber->backlog.clear();
+		}
+	}
+	// Then what was spilled
+	DrainSpill(subscriber);
+	LeaveCriticalSection(&subscribers_cs);
+
+	return true;
+}
+
+DWORD SetCompression(DWORD client_id, DWORD codec) {
+	InitPacketSubscribers();
+
+	if (codec >= COMPRESSION_CODEC_COUNT) {
+		DEBUGLOG(L"[SUB] Unknown codec " + std::to_wstring(codec) + L", compression stays off");
+		codec = COMPRESSION_NONE;
+	}
+
+	EnterCriticalSection(&subscribers_cs);
+	auto subscriber_it = subscribers.find(client_id);
+	if (subscriber_it == subscribers.end()) {
+		LeaveCriticalSection(&subscribers_cs);
+		return COMPRESSION_NONE;
+	}
+	Subscriber *subscriber = subscriber_it->second.get();
+
+	// What was coalesced under the previous codec goes out first
+	DWORD now = GetTickCount();
+	FlushRepeat(subscriber, now);
+	FlushBatch(subscriber, now);
+	if (subscriber->codec == COMPRESSION_NONE && codec != COMPRESSION_NONE) {
+		InterlockedIncrement(&compressed_subscriber_count);
+	}
+	else if (subscriber->codec != COMPRESSION_NONE && codec == COMPRESSION_NONE) {
+		InterlockedDecrement(&compressed_subscriber_count);
+	}
+	subscriber->codec = codec;
+	LeaveCriticalSection(&subscribers_cs);
+
+	DEBUGLOG(L"[SUB] Subscriber " + std::to_wstring(client_id) + L" uses codec " + std::to_wstring(codec));
+	return codec;
+}
+
+// Must be called with subscribers_cs held, not a capture stream message (counts as none)
+void SendStreamSequence(Subscriber *subscriber, ULONGLONG sequence, DWORD now) {
+	StreamSequenceMessage ssm;
+	ssm.header = STREAM_SEQUENCE;
+	ssm.sequence = sequence;
+	DeliverFrame(subscriber, MakeFrame((BYTE *)&ssm, sizeof(ssm)), now, 0);
+}
+
+// Must be called with subscribers_cs held, sends a message of the capture stream (live or replayed) to one subscriber
+// frame is the message framed as is, made here if it's still empty
+void PublishToSubscriber(Subscriber *subscriber, ULONGLONG sequence, MessageHeader header, const BYTE *data, ULONG_PTR length, PublishedFrame &frame, DWORD now) {
+	if (!SubscriberWants(subscriber, header, data, length) || !CreditAdmits(subscriber, header)) {
+		return;
+	}
+
+	// A numbered client is told the sequence when it isn't the one after the previous message it got
+	if (subscriber->sequenced && subscriber->next_sequence != sequence) {
+		FlushRepeat(subscriber, now);
+		subscriber->next_sequence = sequence;
+		SendStreamSequence(subscriber, sequence, now);
+		// Without its sequence the message would be numbered wrong
+		if (subscriber->next_sequence != sequence) {
+			subscriber->published++;
+			subscriber->dropped++;
+			return;
+		}
+	}
+	// Reset by a drop while delivering
+	subscriber->next_sequence = sequence + 1;
+
+	if (subscriber->encoding & ENCODING_DELTA) {
+		if ((header == SENDPACKET || header == RECVPACKET) && PublishDelta(subscriber, data, length, now)) {
+			return;
+		}
+		FlushRepeat(subscriber, now);
+	}
+	if ((subscriber->encoding & ENCODING_DICTIONARY) && PublishCompact(subscriber, data, length, now)) {
+		return;
+	}
+
+	// Framed once for the first subscriber that wants it, every ring holds a reference
+	if (!frame) {
+		frame = MakeFrame(data, length);
+	}
+	DeliverFrame(subscriber, frame, now);
+}
+
+bool PublishMessage(const BYTE *data, ULONG_PTR length) {
+	InitPacketSubscribers();
+
+	EnterCriticalSection(&subscribers_cs);
+	ULONGLONG sequence = stream_sequence++;
+	PublishedFrame frame;
+
+	// Retained whether anyone is connected or not, a client resuming after a disconnect gets what it missed
+	if (stream_retain_bytes) {
+		frame = MakeFrame(data, length);
+		RetainedFrame retained = { sequence, frame };
+		retained_frames.push_back(retained);
+		retained_bytes += frame->size() + RETAINED_FRAME_OVERHEAD;
+		while (retained_bytes > stream_retain_bytes) {
+			retained_bytes -= retained_frames.front().frame->size() + RETAINED_FRAME_OVERHEAD;
+			retained_frames.pop_front();
+		}
+	}
+	if (retain_traces && (retained_frames.empty() || retained_frames.front().sequence > retain_traces_sequence)) {
+		// A client resuming from before that disconnect gets a gap either way
+		retain_traces = false;
+		DEBUGLOG(L"[SUB] Retained stream no longer reaches the last trace subscriber disconnect, traces only for connected clients");
+	}
+
+	if (subscribers.empty()) {
+		LeaveCriticalSection(&subscribers_cs);
+		return false;
+	}
+
+	MessageHeader header = (length >= sizeof(MessageHeader)) ? *(MessageHeader *)data : UNKNOWN;
+	DWORD now = GetTickCount();
+	for (auto &subscriber_kv : subscribers) {
+		PublishToSubscriber(subscriber_kv.second.get(), sequence, header, data, length, frame, now);
+	}
+	LeaveCriticalSection(&subscribers_cs);
+
+	return true;
+}
+
+bool ResumeStream(DWORD client_id, ULONGLONG sequence) {
+	InitPacketSubscribers();
+
+	EnterCriticalSection(&subscribers_cs);
+	auto subscriber_it = subscribers.find(client_id);
+	if (subscriber_it == subscribers.end()) {
+		LeaveCriticalSection(&subscribers_cs);
+		return false;
+	}
+	Subscriber *subscriber = subscriber_it->second.get();
+
+	// What was coalesced before goes out first, the client drops capture messages until it gets a STREAM_SEQUENCE
+	DWORD now = GetTickCount();
+	FlushRepeat(subscriber, now);
+	FlushBatch(subscriber, now);
+	subscriber->sequenced = true;
+	subscriber->next_sequence = 0;
+
+	ULONGLONG oldest = retained_frames.empty() ? stream_sequence : retained_frames.front().sequence;
+	ULONGLONG lost = 0;
+	if (sequence && sequence < oldest) {
+		StreamGapMessage sgm;
+		sgm.header = STREAM_GAP;
+		sgm.first = sequence;
+		sgm.count = oldest - sequence;
+		DeliverFrame(subscriber, MakeFrame((BYTE *)&sgm, sizeof(sgm)), now, 0);
+		lost = sgm.count;
+	}
+
+	// Retained frames have consecutive sequences, the replay goes through the subscription, encodings and credit like live data
+	ULONGLONG replayed = 0;
+	if (sequence && sequence < stream_sequence) {
+		size_t first = (sequence > oldest) ? (size_t)(sequence - oldest) : 0;
+		replayed = retained_frames.size() - first;
+		subscriber->replaying = true;
+		subscriber->replay_allowance = (size_t)replayed * 2 + 2;
+		for (size_t i = first; i < retained_frames.size(); i++) {
+			PublishedFrame frame = retained_frames[i].frame;
+			const BYTE *data = &(*frame)[sizeof(DWORD) * 2];
+			ULONG_PTR length = frame->size() - sizeof(DWORD) * 2;
+			MessageHeader header = (length >= sizeof(MessageHeader)) ? *(MessageHeader *)data : UNKNOWN;
+			PublishToSubscriber(subscriber, retained_frames[i].sequence, header, data, length, frame, now);
+		}
+		FlushRepeat(subscriber, now);
+		FlushBatch(subscriber, now);
+		subscriber->replaying = false;
+		subscriber->replayed += replayed;
+	}
+
+	// Live messages go on from here, the client gets its position even if none of the replay was for it
+	if (subscriber->next_sequence != stream_sequence) {
+		subscriber->next_sequence = stream_sequence;
+		SendStreamSequence(subscriber, stream_sequence, now);
+	}
+	ULONGLONG next = stream_sequence;
+	LeaveCriticalSection(&subscribers_cs);
+
+	DEBUGLOG(L"[SUB] Subscriber " + std::to_wstring(client_id) + L" resumed from " + std::to_wstring(sequence) + L" (" +
+		std::to_wstring(replayed) + L" replayed, " + std::to_wstring(lost) + L" lost, live from " + std::to_wstring(next) + L")");
+	return true;
+}
+
+void FlushPublishedBatches() {
+	if (compressed_subscriber_count == 0 && encoded_subscriber_count == 0 && spilling_subscriber_count == 0) {
+		return;
+	}
+
+	EnterCriticalSection(&subscribers_cs);
+	DWORD now = GetTickCount();
+	for (auto &subscriber_kv : subscribers) {
+		FlushRepeat(subscriber_kv.second.get(), now);
+		FlushBatch(subscriber_kv.second.get(), now);
+		DrainSpill(subscriber_kv.second.get());
+	}
+	LeaveCriticalSection(&subscribers_cs);
+}
+
+bool SendToSubscriber(DWORD client_id, const BYTE *data, ULONG_PTR length) {
+	InitPacketSubscribers();
+
+	// Framed before taking the lock, queuing only moves the reference
+	PublishedFrame frame = MakeFrame(data, length);
+	EnterCriticalSection(&subscribers_cs);
+	auto subscriber_it = subscribers.find(client_id);
+	bool queued = subscriber_it != subscribers.end() && subscriber_it->second->client->QueueFrame(frame);
+	LeaveCriticalSection(&subscribers_cs);
+	return queued;
+}
+
+void GetSubscriberStats(std::vector<BYTE>& message) {
+	InitPacketSubscribers();
+
+	EnterCriticalSection(&subscribers_cs);
+	message.assign(offsetof(SubscriberStatsMessage, subscribers) + subscribers.size() * sizeof(SubscriberStats), 0);
+	SubscriberStatsMessage *stats = (SubscriberStatsMessage *)&message[0];
+	stats->header = SUBSCRIBER_STATS;
+	stats->subscriber_count = (DWORD)subscribers.size();
+	DWORD index = 0;
+	for (auto &subscriber_kv : subscribers) {
+		const Subscriber *subscriber = subscriber_kv.second.get();
+		SubscriberStats &entry = stats->subscribers[index++];
+		entry.client_id = subscriber->client_id;
+		entry.codec = subscriber->codec;
+		entry.published = subscriber->published;
+		entry.dropped = subscriber->dropped;
+		entry.batches = subscriber->batches;
+		entry.raw_bytes = subscriber->raw_bytes;
+		entry.compressed_bytes = subscriber->compressed_bytes;
+		entry.compress_ns = subscriber->compress_ns;
+		entry.delta_messages = subscriber->delta_messages;
+		entry.repeated_messages = subscriber->repeated_messages;
+		entry.encoding = subscriber->encoding;
+		entry.compact_messages = subscriber->compact_messages;
+		entry.symbols_defined = subscriber->symbols_defined;
+		entry.flow_policy = subscriber->flow_policy;
+		entry.credit_messages = subscriber->credit_messages;
+		entry.credit_bytes = subscriber->credit_bytes;
+		entry.credit_dropped = subscriber->credit_dropped;
+		entry.backlog_frames = (DWORD)subscriber->backlog.size();
+		entry.spilled = subscriber->spilled;
+		entry.spill_bytes = subscriber->spill_write_position - subscriber->spill_read_position +
+			(subscriber->spill_read_buffer.size() - subscriber->spill_read_offset);
+	}
+	LeaveCriticalSection(&subscribers_cs);
+}
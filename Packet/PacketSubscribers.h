@@ -0,0 +1,90 @@
+﻿#ifndef __PACKET_SUBSCRIBERS_H__
+#define __PACKET_SUBSCRIBERS_H__
+
+#include<Windows.h>
+#include<memory>
+#include<string>
+#include<vector>
+#include"PacketDefs.h"
+
+class TCPServerThread;
+
+// Default limits of a subscriber's output ring
+#define DEFAULT_SUBSCRIBER_RING_SIZE 4096
+#define DEFAULT_SUBSCRIBER_MAX_LAG_MS 5000
+
+// Frame bytes a compressed subscriber coalesces before its batch is flushed without waiting for the worker
+#define COMPRESSION_BATCH_SIZE (64 * 1024)
+
+// Larger packets are always sent whole to delta-encoding subscribers (and not kept as a base)
+#define DELTA_MAX_PACKET_SIZE 4096
+
+// Dictionary limits of a subscriber (per kind), values past them are sent inline
+#define DICTIONARY_MAX_SYMBOLS 0x10000
+#define DICTIONARY_MAX_STRING_SIZE 256
+
+// Packets kept by FLOW_CONTROL_DOWNSAMPLE while credit is low (1 in N)
+#define CREDIT_DOWNSAMPLE_RATE 4
+
+// Overflow file of a FLOW_CONTROL_SPILL connection, it is written and read through buffers of these sizes
+#define DEFAULT_SUBSCRIBER_SPILL_MB 1024
+#define SPILL_WRITE_BUFFER_SIZE (64 * 1024)
+#define SPILL_READ_BUFFER_SIZE (256 * 1024)
+
+// Capture stream kept for RESUME, in MB of frames (each retained frame also counts its bookkeeping)
+#define DEFAULT_STREAM_RETAIN_MB 16
+#define MAX_STREAM_RETAIN_MB 1024
+#define RETAINED_FRAME_OVERHEAD 64
+
+// Framed message (magic + length + data) shared by every subscriber ring it was published to (same type as TCPFrame)
+typedef std::shared_ptr<const std::vector<BYTE>> PublishedFrame;
+
+void InitPacketSubscribers();
+
+// Ring capacity in messages and how long a subscriber may keep overflowing before it's disconnected (0 = never)
+void SetSubscriberLimits(DWORD ring_size, DWORD max_lag_ms);
+
+// Where FLOW_CONTROL_SPILL connections put their overflow file (empty = the temp directory) and its size per connection
+void SetSubscriberSpill(const std::wstring &dir, DWORD size_mb);
+
+// How much of the capture stream is kept for RESUME (0 = nothing, resuming only reports the gap)
+void SetStreamRetention(DWORD size_mb);
+
+// Connections receiving the capture stream (called from the TCP server's I/O loop)
+bool AddSubscriber(DWORD client_id, TCPServerThread *client);
+void RemoveSubscriber(DWORD client_id);
+bool SetSubscription(DWORD client_id, const SubscribeMessage& subscription);
+
+// Codec of a connection's capture stream, returns the accepted one (COMPRESSION_NONE if codec is unknown)
+DWORD SetCompression(DWORD client_id, DWORD codec);
+
+// Stream encodings (ENCODING_*) of a connection, returns the accepted flags
+DWORD SetEncoding(DWORD client_id, DWORD flags);
+
+// Add credit to a connection (and set its flow control policy), queues what was held back and now fits
+bool GrantCredit(DWORD client_id, const CreditMessage& grant);
+
+// Number a connection's capture stream and queue the retained messages from sequence on (STREAM_GAP for what aged out)
+// ahead of live ones
+bool ResumeStream(DWORD client_id, ULONGLONG sequence);
+
+// False when no subscriber wants format traces, lets the hooks skip producing them. Stays true after a trace subscriber
+// that used RESUME disconnected, until the retained stream no longer reaches back to the disconnect
+bool SubscribersWantTraces();
+
+// Frame data (a PacketEditorMessage) once and queue it to every subscriber that asked for it,
+// never blocks on a socket. Returns false if nobody is subscribed
+bool PublishMessage(const BYTE *data, ULONG_PTR length);
+
+// Compress and queue what compressed subscribers have coalesced (and pending repeat runs), and move spilled frames back
+// to connections that have room again. Called by the worker after each batch and when it's idle
+void FlushPublishedBatches();
+
+// Queue a reply (data is a message, framed here) to a connection from a thread other than its I/O loop, outside the capture
+// stream: no credit or ring limit applies. False if the connection is gone
+bool SendToSubscriber(DWORD client_id, const BYTE *data, ULONG_PTR length);
+
+// SUBSCRIBER_STATS message with the counters of every connection
+void GetSubscriberStats(std::vector<BYTE>& message);
+
+#endif
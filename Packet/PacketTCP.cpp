@@ -1,4 +1,4 @@
-// TCP wrapper implementation - Multi-packet queue support
+﻿// TCP wrapper implementation - Multi-packet queue support
 // This file must be compiled separately and include SimpleTCP.h BEFORE Windows.h
 
 #include"../Share/Simple/SimpleTCP.h"
@@ -6,16 +6,20 @@
 #include"../Share/Simple/DebugLog.h"
 #include"PacketLogging.h"
 #include"PacketDefs.h"
+#include"PacketSender.h"
+#include"PacketTemplate.h"
+#include"PacketAck.h"
+#include"PacketRules.h"
+#include"PacketFilter.h"
+#include"PacketSubscribers.h"
+#include"PacketRecorder.h"
 #include <vector>
 #include <queue>
 #include <map>
 #include <string>
 
-// TCP server instance and connected client thread
+// TCP server instance, its I/O loop serves every connection
 TCPServer *ts = NULL;
-TCPServerThread *current_client = NULL;
-CRITICAL_SECTION tcp_client_cs;
-bool tcp_cs_initialized = false;
 
 // TCP configuration (defined in PacketLogging.cpp)
 extern std::string g_TCPHost;
@@ -24,281 +28,655 @@ extern int g_TCPPort;
 // Initialize tracking (defined in PacketLogging.cpp)
 extern void InitTracking();
 
-// Multi-packet group structure
-struct MultiPacketGroup {
-	std::vector<std::vector<BYTE>> packets;
-	DWORD queued_time_ms;
-	BYTE current_packet_index;               // Index of next packet to inject (0-based)
-	DWORD next_packet_time_ms;               // When the next packet should be injected
-};
-
-// External references to packet injection infrastructure (from PacketSender.cpp)
-extern std::map<std::string, std::queue<MultiPacketGroup>> packet_queues;
-extern CRITICAL_SECTION injection_queue_cs;
-extern bool injection_queue_initialized;
-
-// Temporary storage for incomplete multi-packet groups being assembled
-struct IncompleteGroup {
-	std::vector<std::vector<BYTE>> packets;
-	DWORD start_time_ms;
-};
-extern std::map<std::string, IncompleteGroup> incomplete_groups;
-
-// Queue management functions (from PacketSender.cpp)
-extern bool RegisterQueue(const QueueConfigMessage& config);
-extern bool UnregisterQueue(const std::string& queue_name);
-extern void ClearAllQueues();
-
-// Queue configuration map (from PacketSender.cpp)
-struct TimestampConfig {
-	bool needs_update;
-	std::vector<DWORD> offsets;
-};
-
-struct QueueConfig {
-	std::string queue_name;
-	DWORD injection_interval_ms;
-	DWORD last_injection_time_ms;
-	BYTE packet_count;
-	std::vector<TimestampConfig> timestamp_configs;
-};
-extern std::map<std::string, QueueConfig> queue_configs;
-
-// Communication callback for TCP server - handles each client connection
-bool TCPCommunicate(TCPServerThread &client) {
+// Commands carry their MessageHeader at offset 0 (packet injection requests start with the queue name)
+static bool IsCommandMessage(MessageHeader type) {
+	switch (type) {
+	case REGISTER_QUEUE:
+	case UNREGISTER_QUEUE:
+	case CLEAR_QUEUES:
+	case INJECT_GROUP:
+	case REGISTER_TEMPLATE:
+	case UNREGISTER_TEMPLATE:
+	case INJECT_TEMPLATE:
+	case SET_QUEUE_SHAPING:
+	case SET_GLOBAL_RATE:
+	case SET_ACKS:
+	case GET_INJECT_STATS:
+	case REGISTER_RULE:
+	case UNREGISTER_RULE:
+	case REGISTER_FILTER:
+	case UNREGISTER_FILTER:
+	case GET_FILTER_STATS:
+	case SUBSCRIBE:
+	case SET_COMPRESSION:
+	case GET_SUBSCRIBER_STATS:
+	case SET_ENCODING:
+	case GRANT_CREDIT:
+	case FLIGHT_DUMP:
+	case RESUME:
+		return true;
+	default:
+		break;
+	}
+	return false;
+}
+
+// Injection requests are told apart from commands by their first 4 bytes, a one-character queue name (null-padded)
+// reads as its character code there. Such a name is refused when the code is a command
+static bool QueueNameIsCommand(const std::string &queue_name) {
+	MessageHeader type = (MessageHeader)0;
+	memcpy(&type, queue_name.c_str(), min(queue_name.length(), sizeof(type)));
+	return IsCommandMessage(type);
+}
+
+// Reference length bytes at offset of a received frame, false if they run past the frame
+static bool MakeFramePacketRef(const TCPFrameView &frame, size_t offset, MessageHeader header, DWORD id, DWORD length, PacketRef &ref) {
+	if (offset > frame.size() || length > frame.size() - offset) {
+		return false;
+	}
+	return MakePacketRef(frame.buffer, frame.offset + offset, header, id, length, ref);
+}
+
+// Parse an INJECT_GROUP frame into complete groups, rejects the whole frame if anything is malformed
+// Packets are referenced in place inside the connection's read buffer
+static bool ParseInjectGroup(const TCPFrameView &data, std::string &queue_name, std::vector<MultiPacketGroup> &groups) {
+	const size_t header_size = offsetof(InjectGroupMessage, groups);
+	const size_t packet_header_size = offsetof(InjectGroupPacket, packet);
+
+	if (data.size() < header_size) {
+		return false;
+	}
+
+	InjectGroupMessage *igm = (InjectGroupMessage *)&data[0];
+	queue_name = std::string(igm->queue_name, strnlen(igm->queue_name, MAX_QUEUE_NAME_LENGTH));
+
+	size_t pos = header_size;
+	groups.reserve(min(igm->group_count, (DWORD)(data.size() - header_size)));
+	for (DWORD g = 0; g < igm->group_count; g++) {
+		if (pos >= data.size()) {
+			return false;
+		}
+
+		BYTE packet_count = data[pos++];
+		if (packet_count == 0 || packet_count > MAX_PACKETS_PER_QUEUE) {
+			return false;
+		}
+
+		MultiPacketGroup group;
+		group.packets.reserve(packet_count);
+		for (BYTE i = 0; i < packet_count; i++) {
+			if (data.size() - pos < packet_header_size) {
+				return false;
+			}
+
+			InjectGroupPacket *igp = (InjectGroupPacket *)&data[pos];
+			if (igp->header != SENDPACKET && igp->header != RECVPACKET) {
+				return false;
+			}
+
+			// The length field in front of the packet is the headroom
+			PacketRef ref;
+			if (!MakeFramePacketRef(data, pos + packet_header_size, igp->header, igp->id, igp->length, ref)) {
+				return false;
+			}
+			group.packets.push_back(std::move(ref));
+
+			pos += packet_header_size + igp->length;
+		}
+		groups.push_back(std::move(group));
+	}
+
+	return pos == data.size();
+}
+
+// Parse an INJECT_TEMPLATE frame into one group, argument slots are filled here
+// failed_id is the request id of the packet whose template could not be instantiated
+static InjectResult ParseInjectTemplate(const TCPFrameView &data, std::string &queue_name, MultiPacketGroup &group, DWORD &failed_id) {
+	const size_t header_size = offsetof(InjectTemplateMessage, packets);
+	const size_t packet_header_size = offsetof(InjectTemplatePacket, args);
+
+	if (data.size() < header_size) {
+		return INJECT_MALFORMED;
+	}
+
+	InjectTemplateMessage *itm = (InjectTemplateMessage *)&data[0];
+	queue_name = std::string(itm->queue_name, strnlen(itm->queue_name, MAX_QUEUE_NAME_LENGTH));
+	if (itm->packet_count == 0 || itm->packet_count > MAX_PACKETS_PER_QUEUE) {
+		return INJECT_MALFORMED;
+	}
+
+	size_t pos = header_size;
+	for (DWORD i = 0; i < itm->packet_count; i++) {
+		if (data.size() - pos < packet_header_size) {
+			return INJECT_MALFORMED;
+		}
+
+		InjectTemplatePacket *itp = (InjectTemplatePacket *)&data[pos];
+		if (itp->arg_count > MAX_TEMPLATE_ARGS || itp->arg_count * sizeof(ULONGLONG) > data.size() - pos - packet_header_size) {
+			return INJECT_MALFORMED;
+		}
+
+		PacketRef ref;
+		if (!InstantiateTemplate(itp->template_id, itp->id, itp->args, itp->arg_count, ref)) {
+			failed_id = itp->id;
+			return INJECT_TEMPLATE_FAILED;
+		}
+		group.packets.push_back(std::move(ref));
+		group.template_ids.push_back(itp->template_id);
+
+		pos += packet_header_size + itp->arg_count * sizeof(ULONGLONG);
+	}
+
+	return (pos == data.size()) ? INJECT_OK : INJECT_MALFORMED;
+}
+
+// Connection callbacks of the TCP server, all called on its I/O loop thread
+// The connection's context holds its client id
+bool OnClientConnect(TCPServerThread &client) {
 	DEBUGLOG(L"[TCP] Client connected to TCP server");
 
-	// Store the current client connection
-	EnterCriticalSection(&tcp_client_cs);
-	current_client = &client;
-	LeaveCriticalSection(&tcp_client_cs);
-	DEBUGLOG(L"[TCP] Client pointer stored, ready for communication");
-
-	// Process incoming commands from TCP client
-	// Clients can send:
-	// 1. REGISTER_QUEUE messages to configure injection queues
-	// 2. SENDPACKET/RECVPACKET messages to inject packets (grouped by queue)
-
-	std::vector<BYTE> data;
-	while (true) {
-		// Receive framed message from client
-		if (!client.Recv(data)) {
-			// Connection closed or error
-			DEBUGLOG(L"[TCP] Client disconnected or receive failed");
-			break;
-		}
-
-		DEBUGLOG(L"[TCP] Received " + std::to_wstring(data.size()) + L" bytes from client");
-
-		// Parse message header to determine message type
-		if (data.size() < sizeof(DWORD)) {
-			DEBUGLOG(L"[TCP] Message too small to parse header");
-			continue;
-		}
-
-		// Read message type
-		// For queue management commands (REGISTER_QUEUE, etc), message type is at offset 0
-		// For packet injection (SENDPACKET/RECVPACKET), message type is at offset 32 (after queue_name)
-		MessageHeader msg_type_at_0 = *(MessageHeader*)&data[0];
-		MessageHeader msg_type;
-
-		// Determine if this is a PacketInjectionRequest or a queue command
-		// Queue commands: REGISTER_QUEUE(32), UNREGISTER_QUEUE(33), CLEAR_QUEUES(34)
-		// Packet injection: SENDPACKET(0), RECVPACKET(1)
-		if (msg_type_at_0 == REGISTER_QUEUE || msg_type_at_0 == UNREGISTER_QUEUE || msg_type_at_0 == CLEAR_QUEUES) {
-			// Queue command - message type at offset 0
-			msg_type = msg_type_at_0;
+	// Injections are queued per connection so clients can't starve each other
+	DWORD client_id = AcquireInjectionClient();
+	client.SetContext((void *)(ULONG_PTR)client_id);
+	RegisterAckClient(client_id, &client);
+
+	// Every connection receives the capture stream through its own ring
+	AddSubscriber(client_id, &client);
+	return true;
+}
+
+// Handles one frame from a client: queue commands and packet injection requests
+// The frame is a view into the connection's read buffer, queued packets reference that buffer
+// directly and the server stops reusing it until they are done
+bool OnClientMessage(TCPServerThread &client, const TCPFrameView &data) {
+	DWORD client_id = (DWORD)(ULONG_PTR)client.GetContext();
+
+	ULONGLONG received_us = GetInjectTimeUs();
+	DEBUGLOG(L"[TCP] Received " + std::to_wstring(data.size()) + L" bytes from client");
+
+	// Parse message header to determine message type
+	if (data.size() < sizeof(DWORD)) {
+		DEBUGLOG(L"[TCP] Message too small to parse header");
+		return true;
+	}
+
+	// Read message type
+	// For queue management commands (REGISTER_QUEUE, etc), message type is at offset 0
+	// For packet injection (SENDPACKET/RECVPACKET), message type is at offset 32 (after queue_name)
+	MessageHeader msg_type_at_0 = *(MessageHeader*)&data[0];
+	MessageHeader msg_type;
+
+	// Determine if this is a PacketInjectionRequest or a queue command
+	// Queue commands: REGISTER_QUEUE(32), UNREGISTER_QUEUE(33), CLEAR_QUEUES(34), INJECT_GROUP(35)
+	// Packet injection: SENDPACKET(0), RECVPACKET(1)
+	if (IsCommandMessage(msg_type_at_0)) {
+		// Queue command - message type at offset 0
+		msg_type = msg_type_at_0;
+	} else {
+		// Packet injection - message type at offset 32 (after queue_name)
+		if (data.size() >= sizeof(PacketInjectionRequest)) {
+			msg_type = *(MessageHeader*)&data[MAX_QUEUE_NAME_LENGTH];
 		} else {
-			// Packet injection - message type at offset 32 (after queue_name)
-			if (data.size() >= sizeof(PacketInjectionRequest)) {
-				msg_type = *(MessageHeader*)&data[MAX_QUEUE_NAME_LENGTH];
-			} else {
-				// Too small, use offset 0 and let it fail gracefully
-				msg_type = msg_type_at_0;
-			}
+			// Too small, use offset 0 and let it fail gracefully
+			msg_type = msg_type_at_0;
 		}
+	}
 
-		DEBUGLOG(L"[TCP] Message type: " + std::to_wstring(msg_type));
+	DEBUGLOG(L"[TCP] Message type: " + std::to_wstring(msg_type));
 
-		// Handle REGISTER_QUEUE messages
-		if (msg_type == REGISTER_QUEUE) {
-			DEBUGLOG(L"[TCP] Processing REGISTER_QUEUE message (size=" + std::to_wstring(data.size()) + L" bytes)");
+	// Handle REGISTER_QUEUE messages
+	if (msg_type == REGISTER_QUEUE) {
+		DEBUGLOG(L"[TCP] Processing REGISTER_QUEUE message (size=" + std::to_wstring(data.size()) + L" bytes)");
 
-			size_t expected_size = sizeof(MessageHeader) + sizeof(QueueConfigMessage);
-			if (data.size() < expected_size) {
-				DEBUGLOG(L"[TCP] REGISTER_QUEUE message too small (got " +
-					std::to_wstring(data.size()) + L" bytes, need " +
-					std::to_wstring(expected_size) + L" bytes)");
-				continue;
-			}
+		size_t expected_size = sizeof(MessageHeader) + sizeof(QueueConfigMessage);
+		if (data.size() < expected_size) {
+			DEBUGLOG(L"[TCP] REGISTER_QUEUE message too small (got " +
+				std::to_wstring(data.size()) + L" bytes, need " +
+				std::to_wstring(expected_size) + L" bytes)");
+			return true;
+		}
 
-			// Extract queue configuration
-			QueueConfigMessage* config = (QueueConfigMessage*)&data[sizeof(MessageHeader)];
+		// Extract queue configuration
+		QueueConfigMessage* config = (QueueConfigMessage*)&data[sizeof(MessageHeader)];
 
-			std::string queue_name_str(config->queue_name, strnlen(config->queue_name, MAX_QUEUE_NAME_LENGTH));
-			std::wstring queue_name_w(queue_name_str.begin(), queue_name_str.end());
-			DEBUGLOG(L"[TCP] Registering queue: '" + queue_name_w + L"' (interval=" +
-				std::to_wstring(config->injection_interval_ms) + L"ms, packet_count=" +
-				std::to_wstring(config->packet_count) + L")");
+		std::string queue_name_str(config->queue_name, strnlen(config->queue_name, MAX_QUEUE_NAME_LENGTH));
+		std::wstring queue_name_w(queue_name_str.begin(), queue_name_str.end());
+		DEBUGLOG(L"[TCP] Registering queue: '" + queue_name_w + L"' (interval=" +
+			std::to_wstring(config->injection_interval_ms) + L"ms, packet_count=" +
+			std::to_wstring(config->packet_count) + L")");
 
-			// Register the queue
-			if (RegisterQueue(*config)) {
-				DEBUGLOG(L"[TCP] Successfully registered queue: '" + queue_name_w + L"'");
-			} else {
-				DEBUGLOG(L"[TCP] Failed to register queue: '" + queue_name_w + L"'");
-			}
-			continue;
+		if (QueueNameIsCommand(queue_name_str)) {
+			DEBUGLOG(L"[TCP] Queue name '" + queue_name_w + L"' would be read as command " +
+				std::to_wstring(queue_name_str[0]) + L", not registered");
+			return true;
 		}
 
-		// Handle UNREGISTER_QUEUE messages
-		if (msg_type == UNREGISTER_QUEUE) {
-			if (data.size() < sizeof(MessageHeader) + MAX_QUEUE_NAME_LENGTH) {
-				DEBUGLOG(L"[TCP] UNREGISTER_QUEUE message too small");
-				continue;
-			}
+		// Register the queue
+		if (RegisterQueue(*config)) {
+			DEBUGLOG(L"[TCP] Successfully registered queue: '" + queue_name_w + L"'");
+		} else {
+			DEBUGLOG(L"[TCP] Failed to register queue: '" + queue_name_w + L"'");
+		}
+		return true;
+	}
 
-			char queue_name_buf[MAX_QUEUE_NAME_LENGTH];
-			memcpy(queue_name_buf, &data[sizeof(MessageHeader)], MAX_QUEUE_NAME_LENGTH);
-			std::string queue_name(queue_name_buf, strnlen(queue_name_buf, MAX_QUEUE_NAME_LENGTH));
+	// Handle UNREGISTER_QUEUE messages
+	if (msg_type == UNREGISTER_QUEUE) {
+		if (data.size() < sizeof(MessageHeader) + MAX_QUEUE_NAME_LENGTH) {
+			DEBUGLOG(L"[TCP] UNREGISTER_QUEUE message too small");
+			return true;
+		}
 
-			if (UnregisterQueue(queue_name)) {
-				std::wstring queue_name_w(queue_name.begin(), queue_name.end());
-				DEBUGLOG(L"[TCP] Successfully unregistered queue: " + queue_name_w);
-			} else {
-				std::wstring queue_name_w(queue_name.begin(), queue_name.end());
-				DEBUGLOG(L"[TCP] Failed to unregister queue: " + queue_name_w);
-			}
-			continue;
+		char queue_name_buf[MAX_QUEUE_NAME_LENGTH];
+		memcpy(queue_name_buf, &data[sizeof(MessageHeader)], MAX_QUEUE_NAME_LENGTH);
+		std::string queue_name(queue_name_buf, strnlen(queue_name_buf, MAX_QUEUE_NAME_LENGTH));
+
+		if (UnregisterQueue(queue_name)) {
+			std::wstring queue_name_w(queue_name.begin(), queue_name.end());
+			DEBUGLOG(L"[TCP] Successfully unregistered queue: " + queue_name_w);
+		} else {
+			std::wstring queue_name_w(queue_name.begin(), queue_name.end());
+			DEBUGLOG(L"[TCP] Failed to unregister queue: " + queue_name_w);
 		}
+		return true;
+	}
+
+	// Handle CLEAR_QUEUES messages
+	if (msg_type == CLEAR_QUEUES) {
+		ClearAllQueues();
+		DEBUGLOG(L"[TCP] Cleared all queue configurations");
+		return true;
+	}
 
-		// Handle CLEAR_QUEUES messages
-		if (msg_type == CLEAR_QUEUES) {
-			ClearAllQueues();
-			DEBUGLOG(L"[TCP] Cleared all queue configurations");
-			continue;
+	// Handle INJECT_GROUP messages (complete groups, no reassembly through incomplete_groups)
+	if (msg_type == INJECT_GROUP) {
+		std::string queue_name;
+		std::vector<MultiPacketGroup> groups;
+		if (!ParseInjectGroup(data, queue_name, groups)) {
+			ReportInjection(client_id, 0, queue_name, INJECT_MALFORMED, received_us, 0, 0);
+			DEBUGLOG(L"[TCP] INJECT_GROUP message malformed, frame dropped (" + std::to_wstring(data.size()) + L" bytes)");
+			return true;
+		}
+		for (auto& group : groups) {
+			group.received_us.assign(group.packets.size(), received_us);
 		}
 
-		// Handle SENDPACKET/RECVPACKET messages (packet injection)
-		// Note: Must check message type to avoid misinterpreting queue commands as packets
-		if (msg_type == SENDPACKET || msg_type == RECVPACKET) {
-			if (data.size() < sizeof(PacketInjectionRequest)) {
-				DEBUGLOG(L"[TCP] Received data too small to be PacketInjectionRequest (got " +
-					std::to_wstring(data.size()) + L" bytes, need at least " +
-					std::to_wstring(sizeof(PacketInjectionRequest)) + L" bytes)");
-				continue;
-			}
+		std::wstring queue_name_w(queue_name.begin(), queue_name.end());
+		size_t group_count = groups.size();
+		if (EnqueueGroups(queue_name, groups, client_id)) {
+			DEBUGLOG(L"[TCP] INJECT_GROUP: queued " + std::to_wstring(group_count) + L" group(s) to '" + queue_name_w + L"'");
+		} else {
+			DEBUGLOG(L"[TCP] INJECT_GROUP: rejected " + std::to_wstring(group_count) + L" group(s) for '" + queue_name_w + L"'");
+		}
+		return true;
+	}
+
+	// Handle REGISTER_TEMPLATE messages
+	if (msg_type == REGISTER_TEMPLATE) {
+		if (data.size() < offsetof(TemplateConfigMessage, packet)) {
+			DEBUGLOG(L"[TCP] REGISTER_TEMPLATE message too small");
+			return true;
+		}
+
+		RegisterTemplate(*(TemplateConfigMessage*)&data[0], data.size());
+		return true;
+	}
+
+	// Handle UNREGISTER_TEMPLATE messages
+	if (msg_type == UNREGISTER_TEMPLATE) {
+		if (data.size() < sizeof(TemplateRemoveMessage)) {
+			DEBUGLOG(L"[TCP] UNREGISTER_TEMPLATE message too small");
+			return true;
+		}
 
-			// Parse injection request (queue_name + PacketEditorMessage)
-			PacketInjectionRequest* req = (PacketInjectionRequest*)&data[0];
-			PacketEditorMessage* pcm = &req->packet_message;
+		DWORD template_id = ((TemplateRemoveMessage*)&data[0])->template_id;
+		if (!UnregisterTemplate(template_id)) {
+			DEBUGLOG(L"[TCP] Failed to unregister template: " + std::to_wstring(template_id));
+		}
+		return true;
+	}
 
-			// Extract queue name
-			std::string queue_name(req->queue_name, strnlen(req->queue_name, MAX_QUEUE_NAME_LENGTH));
+	// Handle INJECT_TEMPLATE messages (one group built from templates)
+	if (msg_type == INJECT_TEMPLATE) {
+		std::string queue_name;
+		std::vector<MultiPacketGroup> groups(1);
+		DWORD failed_id = 0;
+		InjectResult result = ParseInjectTemplate(data, queue_name, groups[0], failed_id);
+		if (result != INJECT_OK) {
+			ReportInjection(client_id, failed_id, queue_name, result, received_us, 0, 0);
+			DEBUGLOG(L"[TCP] INJECT_TEMPLATE message rejected, frame dropped (" + std::to_wstring(data.size()) + L" bytes)");
+			return true;
+		}
+		groups[0].received_us.assign(groups[0].packets.size(), received_us);
+
+		if (!EnqueueGroups(queue_name, groups, client_id)) {
 			std::wstring queue_name_w(queue_name.begin(), queue_name.end());
+			DEBUGLOG(L"[TCP] INJECT_TEMPLATE: rejected group for '" + queue_name_w + L"'");
+		}
+		return true;
+	}
 
-			DEBUGLOG(L"[TCP] Packet injection request: " +
-				std::wstring(pcm->header == SENDPACKET ? L"SENDPACKET" : L"RECVPACKET") +
-				L" for queue '" + queue_name_w + L"'");
+	// Handle SET_QUEUE_SHAPING messages
+	if (msg_type == SET_QUEUE_SHAPING) {
+		if (data.size() < sizeof(QueueShapingMessage)) {
+			DEBUGLOG(L"[TCP] SET_QUEUE_SHAPING message too small");
+			return true;
+		}
 
-				// Log first few bytes of packet (offset by queue_name field)
-				std::wstring packet_preview = L"[TCP] Queue='" + queue_name_w + L"', Packet data (first 16 bytes): ";
-				for (DWORD i = 0; i < min(16, pcm->Binary.length); i++) {
-					wchar_t hex[4];
-					swprintf_s(hex, L"%02X ", pcm->Binary.packet[i]);
-					packet_preview += hex;
-				}
-				DEBUGLOG(packet_preview);
+		SetQueueShaping(*(QueueShapingMessage*)&data[0]);
+		return true;
+	}
 
-				// Initialize critical section if needed
-				if (!injection_queue_initialized) {
-					InitializeCriticalSection(&injection_queue_cs);
-					injection_queue_initialized = true;
-				}
+	// Handle SET_GLOBAL_RATE messages
+	if (msg_type == SET_GLOBAL_RATE) {
+		if (data.size() < sizeof(GlobalRateMessage)) {
+			DEBUGLOG(L"[TCP] SET_GLOBAL_RATE message too small");
+			return true;
+		}
 
-				// Look up queue configuration
-				EnterCriticalSection(&injection_queue_cs);
+		GlobalRateMessage* rate = (GlobalRateMessage*)&data[0];
+		SetGlobalInjectionRate(rate->rate_pps, rate->burst);
+		return true;
+	}
 
-				auto config_it = queue_configs.find(queue_name);
-				if (config_it == queue_configs.end()) {
-					LeaveCriticalSection(&injection_queue_cs);
-					DEBUGLOG(L"[TCP] ERROR: Queue '" + queue_name_w + L"' not registered!");
-					continue;
-				}
+	// Handle SET_ACKS messages
+	if (msg_type == SET_ACKS) {
+		if (data.size() < sizeof(AckControlMessage)) {
+			DEBUGLOG(L"[TCP] SET_ACKS message too small");
+			return true;
+		}
 
-				QueueConfig& config = config_it->second;
-				size_t expected_packet_count = config.packet_count;
+		SetAcksEnabled(client_id, ((AckControlMessage*)&data[0])->enabled != 0);
+		return true;
+	}
 
-				// Get or create incomplete group for this queue
-				IncompleteGroup& incomplete = incomplete_groups[queue_name];
+	// Handle GET_INJECT_STATS messages (replied on this connection)
+	if (msg_type == GET_INJECT_STATS) {
+		InjectStatsMessage stats;
+		GetInjectStats(stats);
+		client.Send((BYTE*)&stats, sizeof(stats));
+		return true;
+	}
 
-				// If this is the first packet in the group, initialize timestamp
-				if (incomplete.packets.empty()) {
-					incomplete.start_time_ms = GetTickCount();
-				}
+	// Handle REGISTER_RULE messages
+	if (msg_type == REGISTER_RULE) {
+		if (data.size() < sizeof(RuleConfigMessage)) {
+			DEBUGLOG(L"[TCP] REGISTER_RULE message too small");
+			return true;
+		}
 
-				// Add packet to incomplete group (only the PacketEditorMessage part, not queue_name)
-				std::vector<BYTE> packet_data(
-					data.begin() + MAX_QUEUE_NAME_LENGTH,  // Skip queue_name
-					data.end()
-				);
-				incomplete.packets.push_back(packet_data);
-
-				DEBUGLOG(L"[TCP] Added packet " + std::to_wstring(incomplete.packets.size()) +
-					L"/" + std::to_wstring(expected_packet_count) + L" to queue '" + queue_name_w + L"'");
-
-				// Check if we've received all packets for this group
-				if (incomplete.packets.size() >= expected_packet_count) {
-					// Create complete multi-packet group
-					MultiPacketGroup group;
-					group.packets = incomplete.packets;
-					group.queued_time_ms = incomplete.start_time_ms;
-					group.current_packet_index = 0;  // Start at first packet
-					group.next_packet_time_ms = incomplete.start_time_ms;  // Can inject first packet immediately
-
-					// Add to packet queue
-					packet_queues[queue_name].push(group);
-					size_t queue_size = packet_queues[queue_name].size();
-
-					DEBUGLOG(L"[TCP] Complete group added to queue '" + queue_name_w +
-						L"' (queue size: " + std::to_wstring(queue_size) + L" group(s))");
-
-					// Clear incomplete group
-					incomplete.packets.clear();
-
-					if (queue_size > 10 && queue_size % 10 == 0) {
-						DEBUGLOG(L"[TCP] WARNING: Queue '" + queue_name_w +
-							L"' depth reached " + std::to_wstring(queue_size) + L" groups!");
-					}
-				}
+		RegisterRule(*(RuleConfigMessage*)&data[0], client_id);
+		return true;
+	}
 
-				LeaveCriticalSection(&injection_queue_cs);
+	// Handle UNREGISTER_RULE messages
+	if (msg_type == UNREGISTER_RULE) {
+		if (data.size() < sizeof(RuleRemoveMessage)) {
+			DEBUGLOG(L"[TCP] UNREGISTER_RULE message too small");
+			return true;
+		}
+
+		DWORD rule_id = ((RuleRemoveMessage*)&data[0])->rule_id;
+		if (!UnregisterRule(rule_id)) {
+			DEBUGLOG(L"[TCP] Failed to unregister rule: " + std::to_wstring(rule_id));
 		}
+		return true;
 	}
 
-	// Client disconnected
-	DEBUGLOG(L"[TCP] Client disconnected from TCP server");
-	EnterCriticalSection(&tcp_client_cs);
-	if (current_client == &client) {
-		current_client = NULL;
+	// Handle REGISTER_FILTER messages
+	if (msg_type == REGISTER_FILTER) {
+		if (data.size() < offsetof(FilterProgramMessage, insns)) {
+			DEBUGLOG(L"[TCP] REGISTER_FILTER message too small");
+			return true;
+		}
+
+		RegisterFilter(*(FilterProgramMessage*)&data[0], data.size());
+		return true;
+	}
+
+	// Handle UNREGISTER_FILTER messages
+	if (msg_type == UNREGISTER_FILTER) {
+		if (data.size() < sizeof(FilterRemoveMessage)) {
+			DEBUGLOG(L"[TCP] UNREGISTER_FILTER message too small");
+			return true;
+		}
+
+		DWORD program_id = ((FilterRemoveMessage*)&data[0])->program_id;
+		if (!UnregisterFilter(program_id)) {
+			DEBUGLOG(L"[TCP] Failed to unregister filter: " + std::to_wstring(program_id));
+		}
+		return true;
+	}
+
+	// Handle GET_FILTER_STATS messages (replied on this connection)
+	if (msg_type == GET_FILTER_STATS) {
+		std::vector<BYTE> stats;
+		GetFilterStats(stats);
+		client.Send(&stats[0], stats.size());
+		return true;
+	}
+
+	// Handle SUBSCRIBE messages
+	if (msg_type == SUBSCRIBE) {
+		if (data.size() < sizeof(SubscribeMessage)) {
+			DEBUGLOG(L"[TCP] SUBSCRIBE message too small");
+			return true;
+		}
+
+		SetSubscription(client_id, *(SubscribeMessage*)&data[0]);
+		return true;
+	}
+
+	// Handle SET_COMPRESSION messages (the reply tells the client which codec is used)
+	if (msg_type == SET_COMPRESSION) {
+		if (data.size() < sizeof(CompressionMessage)) {
+			DEBUGLOG(L"[TCP] SET_COMPRESSION message too small");
+			return true;
+		}
+
+		CompressionMessage reply;
+		reply.header = SET_COMPRESSION;
+		reply.codec = SetCompression(client_id, ((CompressionMessage*)&data[0])->codec);
+		client.Send((BYTE*)&reply, sizeof(reply));
+		return true;
+	}
+
+	// Handle SET_ENCODING messages (the reply tells the client which encodings are used)
+	if (msg_type == SET_ENCODING) {
+		if (data.size() < sizeof(EncodingMessage)) {
+			DEBUGLOG(L"[TCP] SET_ENCODING message too small");
+			return true;
+		}
+
+		EncodingMessage reply;
+		reply.header = SET_ENCODING;
+		reply.flags = SetEncoding(client_id, ((EncodingMessage*)&data[0])->flags);
+		client.Send((BYTE*)&reply, sizeof(reply));
+		return true;
+	}
+
+	// Handle GRANT_CREDIT messages (not replied, clients send one for every part of the stream they consume)
+	if (msg_type == GRANT_CREDIT) {
+		if (data.size() < sizeof(CreditMessage)) {
+			DEBUGLOG(L"[TCP] GRANT_CREDIT message too small");
+			return true;
+		}
+
+		GrantCredit(client_id, *(CreditMessage*)&data[0]);
+		return true;
+	}
+
+	// Handle RESUME messages (the replay and a STREAM_SEQUENCE are the reply)
+	if (msg_type == RESUME) {
+		if (data.size() < sizeof(ResumeMessage)) {
+			DEBUGLOG(L"[TCP] RESUME message too small");
+			return true;
+		}
+
+		ResumeStream(client_id, ((ResumeMessage*)&data[0])->sequence);
+		return true;
 	}
-	LeaveCriticalSection(&tcp_client_cs);
 
+	// Handle GET_SUBSCRIBER_STATS messages (replied on this connection)
+	if (msg_type == GET_SUBSCRIBER_STATS) {
+		std::vector<BYTE> stats;
+		GetSubscriberStats(stats);
+		client.Send(&stats[0], stats.size());
+		return true;
+	}
+
+	// Handle FLIGHT_DUMP messages (written to RECORDER_DIR and/or sent back on this connection in FLIGHT_RECORDING parts)
+	// The recorder thread copies and writes the dump, this loop keeps serving every connection meanwhile
+	if (msg_type == FLIGHT_DUMP) {
+		if (data.size() < sizeof(FlightDumpMessage)) {
+			DEBUGLOG(L"[TCP] FLIGHT_DUMP message too small");
+			return true;
+		}
+
+		FlightDumpMessage *fdm = (FlightDumpMessage*)&data[0];
+		if (!RequestFlightDump(client_id, *fdm) && (fdm->target & FLIGHT_DUMP_TO_CLIENT)) {
+			// Recorder off: a single empty part
+			FlightRecordingMessage frm = {};
+			frm.header = FLIGHT_RECORDING;
+			client.Send((BYTE*)&frm, offsetof(FlightRecordingMessage, data));
+		}
+		return true;
+	}
+
+	// Handle SENDPACKET/RECVPACKET messages (packet injection)
+	// Note: Must check message type to avoid misinterpreting queue commands as packets
+	if (msg_type == SENDPACKET || msg_type == RECVPACKET) {
+		if (data.size() < sizeof(PacketInjectionRequest)) {
+			ReportInjection(client_id, 0, "", INJECT_MALFORMED, received_us, 0, 0);
+			DEBUGLOG(L"[TCP] Received data too small to be PacketInjectionRequest (got " +
+				std::to_wstring(data.size()) + L" bytes, need at least " +
+				std::to_wstring(sizeof(PacketInjectionRequest)) + L" bytes)");
+			return true;
+		}
+
+		// Parse injection request (queue_name + PacketEditorMessage)
+		PacketInjectionRequest* req = (PacketInjectionRequest*)&data[0];
+		PacketEditorMessage* pcm = &req->packet_message;
+
+		// Extract queue name
+		std::string queue_name(req->queue_name, strnlen(req->queue_name, MAX_QUEUE_NAME_LENGTH));
+		std::wstring queue_name_w(queue_name.begin(), queue_name.end());
+
+		DEBUGLOG(L"[TCP] Packet injection request: " +
+			std::wstring(pcm->header == SENDPACKET ? L"SENDPACKET" : L"RECVPACKET") +
+			L" for queue '" + queue_name_w + L"'");
+
+			// Log first few bytes of packet (offset by queue_name field)
+			std::wstring packet_preview = L"[TCP] Queue='" + queue_name_w + L"', Packet data (first 16 bytes): ";
+			for (DWORD i = 0; i < min(16, pcm->Binary.length); i++) {
+				wchar_t hex[4];
+				swprintf_s(hex, L"%02X ", pcm->Binary.packet[i]);
+				packet_preview += hex;
+			}
+			DEBUGLOG(packet_preview);
+
+			// Initialize critical section if needed
+			if (!injection_queue_initialized) {
+				InitializeCriticalSection(&injection_queue_cs);
+				injection_queue_initialized = true;
+			}
+
+			// Look up queue configuration
+			EnterCriticalSection(&injection_queue_cs);
+
+			auto config_it = queue_configs.find(queue_name);
+			if (config_it == queue_configs.end()) {
+				LeaveCriticalSection(&injection_queue_cs);
+				ReportInjection(client_id, pcm->id, queue_name, INJECT_QUEUE_NOT_REGISTERED, received_us, 0, 0);
+				DEBUGLOG(L"[TCP] ERROR: Queue '" + queue_name_w + L"' not registered!");
+				return true;
+			}
+
+			QueueConfig& config = config_it->second;
+			size_t expected_packet_count = config.packet_count;
+			bool wake_injector = false;
+
+			// Get or create incomplete group for this queue
+			IncompleteGroup& incomplete = incomplete_groups[std::make_pair(client_id, queue_name)];
+
+			// If this is the first packet in the group, initialize timestamp
+			if (incomplete.packets.empty()) {
+				incomplete.start_time_ms = GetTickCount();
+			}
+
+			// Add packet to incomplete group (referenced in the read buffer, Binary.length is the headroom)
+			PacketRef packet_ref;
+			if (!MakeFramePacketRef(data, offsetof(PacketInjectionRequest, packet_message.Binary.packet), pcm->header, pcm->id, pcm->Binary.length, packet_ref)) {
+				LeaveCriticalSection(&injection_queue_cs);
+				ReportInjection(client_id, pcm->id, queue_name, INJECT_MALFORMED, received_us, 0, 0);
+				DEBUGLOG(L"[TCP] Packet length " + std::to_wstring(pcm->Binary.length) + L" does not fit the message, dropped");
+				return true;
+			}
+			incomplete.packets.push_back(std::move(packet_ref));
+			incomplete.received_us.push_back(received_us);
+
+			DEBUGLOG(L"[TCP] Added packet " + std::to_wstring(incomplete.packets.size()) +
+				L"/" + std::to_wstring(expected_packet_count) + L" to queue '" + queue_name_w + L"'");
+
+			// Check if we've received all packets for this group
+			if (incomplete.packets.size() >= expected_packet_count) {
+				// Create complete multi-packet group
+				MultiPacketGroup group;
+				group.packets = incomplete.packets;
+				group.received_us = incomplete.received_us;
+				group.queued_time_ms = incomplete.start_time_ms;
+				group.current_packet_index = 0;  // Start at first packet
+				group.next_packet_time_ms = incomplete.start_time_ms;  // Can inject first packet immediately
+				group.client_id = client_id;
+
+				// Add to this client's packet queue
+				std::queue<MultiPacketGroup>& client_queue = packet_queues[queue_name][client_id];
+				client_queue.push(group);
+				size_t queue_size = client_queue.size();
+
+				DEBUGLOG(L"[TCP] Complete group added to queue '" + queue_name_w +
+					L"' (queue size: " + std::to_wstring(queue_size) + L" group(s))");
+
+				// Clear incomplete group
+				incomplete.packets.clear();
+				incomplete.received_us.clear();
+
+				// Zero-interval queues are injected right away instead of on the next timer tick
+				wake_injector = (config.injection_interval_ms == 0);
+
+				if (queue_size > 10 && queue_size % 10 == 0) {
+					DEBUGLOG(L"[TCP] WARNING: Queue '" + queue_name_w +
+						L"' depth reached " + std::to_wstring(queue_size) + L" groups!");
+				}
+			}
+
+			LeaveCriticalSection(&injection_queue_cs);
+
+			if (wake_injector) {
+				WakePacketInjector();
+			}
+	}
 	return true;
 }
 
+void OnClientDisconnect(TCPServerThread &client) {
+	DWORD client_id = (DWORD)(ULONG_PTR)client.GetContext();
+
+	DEBUGLOG(L"[TCP] Client disconnected from TCP server");
+	RemoveSubscriber(client_id);
+	ReleaseInjectionClient(client_id);
+	UnregisterAckClient(client_id);
+}
+
 bool StartTCPClient() {
 	DEBUGLOG(L"[TCP] StartTCPClient() called");
 	InitTracking();
-
-	if (!tcp_cs_initialized) {
-		InitializeCriticalSection(&tcp_client_cs);
-		tcp_cs_initialized = true;
-		DEBUGLOG(L"[TCP] Critical section initialized");
-	}
+	InitPacketAcks();
+	InitPacketSubscribers();
 
 	// Create TCP server (note: g_TCPPort is used, g_TCPHost is ignored for server)
 	ts = new TCPServer(g_TCPPort);
-	ts->SetCommunicate(TCPCommunicate);
+	ts->SetCallbacks(OnClientConnect, OnClientMessage, OnClientDisconnect);
 	bool result = ts->Run();
 
 	if (result) {
@@ -311,10 +689,6 @@ bool StartTCPClient() {
 }
 
 bool RestartTCPClient() {
-	EnterCriticalSection(&tcp_client_cs);
-	current_client = NULL;
-	LeaveCriticalSection(&tcp_client_cs);
-
 	if (ts) {
 		delete ts;
 		ts = NULL;
@@ -328,26 +702,16 @@ bool SendPacketDataTCP(BYTE *bData, ULONG_PTR uLength) {
 	static int packet_count = 0;
 	packet_count++;
 
-	// Get client pointer atomically
-	EnterCriticalSection(&tcp_client_cs);
-	TCPServerThread *client = current_client;
-	LeaveCriticalSection(&tcp_client_cs);
-
-	// Send outside critical section to avoid blocking
-	if (client) {
+	// Queued to every subscriber's connection, the I/O loop sends it (a slow client can't stall capture)
+	if (PublishMessage(bData, uLength)) {
 		if (!had_client) {
 			DEBUGLOG(L"[TCP] TCP client is now connected - broadcasting packets");
 			had_client = true;
 		}
-		bool result = client->Send(bData, uLength);
-		if (!result) {
-			DEBUGLOG(L"[TCP] Send failed - client disconnected?");
-			had_client = false;
-		}
 		if (packet_count <= 5 || packet_count % 100 == 0) {
-			DEBUGLOG(L"[TCP PACKET #" + std::to_wstring(packet_count) + L"] Sent to TCP client: " + (result ? L"✓" : L"✗"));
+			DEBUGLOG(L"[TCP PACKET #" + std::to_wstring(packet_count) + L"] Published to TCP subscribers");
 		}
-		return result;
+		return true;
 	}
 
 	// No client connected - this is not an error, just skip TCP send
@@ -358,15 +722,13 @@ bool SendPacketDataTCP(BYTE *bData, ULONG_PTR uLength) {
 	return true;
 }
 
-bool RecvPacketDataTCP(std::vector<BYTE> &vData) {
-	// Get client pointer atomically
-	EnterCriticalSection(&tcp_client_cs);
-	TCPServerThread *client = current_client;
-	LeaveCriticalSection(&tcp_client_cs);
+// End of a worker batch (or idle wait), coalesced frames of compressed subscribers and spilled frames are sent now
+void FlushPacketDataTCP() {
+	FlushPublishedBatches();
+}
 
-	// Recv outside critical section to avoid blocking/deadlock
-	if (client) {
-		return client->Recv(vData);
-	}
+// Client messages are dispatched by the I/O loop (OnClientMessage), there is nothing to pull
+bool RecvPacketDataTCP(std::vector<BYTE> &vData) {
+	vData.clear();
 	return false;
 }
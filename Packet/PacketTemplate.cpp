@@ -0,0 +1,305 @@
+﻿// PacketTemplate.cpp - Registered packet templates with typed slots filled at injection time
+#include"PacketTemplate.h"
+#include"../Share/Simple/DebugLog.h"
+#include <map>
+#include <string>
+#include <vector>
+
+struct PacketTemplate {
+	MessageHeader packet_type;
+	std::vector<BYTE> packet;
+	std::vector<TemplateSlot> slots;
+	std::vector<ULONGLONG> counters;  // Next value for each SLOT_COUNTER slot (indexed like slots)
+};
+
+// Last value seen for one (opcode, offset) pair
+struct WatchedField {
+	ULONGLONG value;
+	BYTE size;     // Bytes to capture (largest slot size using this field)
+	bool seen;
+};
+
+std::map<DWORD, PacketTemplate> packet_templates;
+
+// opcode -> offset -> field, rebuilt whenever templates change
+std::map<WORD, std::map<DWORD, WatchedField>> watched_fields;
+
+// Bit per opcode, read without the lock so unwatched packets cost one lookup
+BYTE watched_opcodes[0x10000 / 8];
+
+CRITICAL_SECTION template_cs;
+bool template_initialized = false;
+
+ULONGLONG template_random_state = 0;
+
+void InitTemplateLock() {
+	if (!template_initialized) {
+		InitializeCriticalSection(&template_cs);
+		template_initialized = true;
+	}
+}
+
+// xorshift64*, seeded lazily
+ULONGLONG NextRandom() {
+	if (template_random_state == 0) {
+		template_random_state = ((ULONGLONG)GetTickCount() << 32) ^ GetCurrentProcessId() ^ 0x9E3779B97F4A7C15ULL;
+	}
+	template_random_state ^= template_random_state >> 12;
+	template_random_state ^= template_random_state << 25;
+	template_random_state ^= template_random_state >> 27;
+	return template_random_state * 0x2545F4914F6CDD1DULL;
+}
+
+void WriteSlotValue(BYTE* dest, BYTE size, ULONGLONG value) {
+	// Little-endian, truncated to the slot size
+	for (BYTE i = 0; i < size; i++) {
+		dest[i] = (BYTE)(value >> (i * 8));
+	}
+}
+
+// Must be called with template_cs held, keeps values of fields that are still watched
+void RebuildWatches() {
+	std::map<WORD, std::map<DWORD, WatchedField>> fields;
+
+	for (auto& template_kv : packet_templates) {
+		for (auto& slot : template_kv.second.slots) {
+			if (slot.type != SLOT_LAST_SEEN) {
+				continue;
+			}
+
+			WORD opcode = (WORD)slot.param1;
+			DWORD offset = (DWORD)slot.param2;
+			WatchedField& field = fields[opcode][offset];
+			if (field.size < slot.size) {
+				field.size = slot.size;
+			}
+		}
+	}
+
+	for (auto& opcode_kv : fields) {
+		auto old_opcode_it = watched_fields.find(opcode_kv.first);
+		if (old_opcode_it == watched_fields.end()) {
+			continue;
+		}
+		for (auto& field_kv : opcode_kv.second) {
+			auto old_field_it = old_opcode_it->second.find(field_kv.first);
+			if (old_field_it != old_opcode_it->second.end() && old_field_it->second.size == field_kv.second.size) {
+				field_kv.second = old_field_it->second;
+			}
+		}
+	}
+
+	watched_fields.swap(fields);
+
+	memset(watched_opcodes, 0, sizeof(watched_opcodes));
+	for (auto& opcode_kv : watched_fields) {
+		watched_opcodes[opcode_kv.first >> 3] |= (BYTE)(1 << (opcode_kv.first & 7));
+	}
+}
+
+// Register (or replace) a template
+bool RegisterTemplate(const TemplateConfigMessage& config, size_t message_size) {
+	if (config.template_id == 0) {
+		DEBUGLOG(L"[TEMPLATE] ERROR: template_id 0 is reserved");
+		return false;
+	}
+	if (config.packet_type != SENDPACKET && config.packet_type != RECVPACKET) {
+		DEBUGLOG(L"[TEMPLATE] ERROR: Invalid packet type " + std::to_wstring(config.packet_type));
+		return false;
+	}
+	if (config.slot_count > MAX_TEMPLATE_SLOTS) {
+		DEBUGLOG(L"[TEMPLATE] ERROR: Too many slots (" + std::to_wstring(config.slot_count) + L")");
+		return false;
+	}
+	if (config.length < sizeof(WORD) || config.length > message_size - offsetof(TemplateConfigMessage, packet)) {
+		DEBUGLOG(L"[TEMPLATE] ERROR: Invalid template length " + std::to_wstring(config.length));
+		return false;
+	}
+
+	PacketTemplate pt;
+	pt.packet_type = config.packet_type;
+	pt.packet.assign(config.packet, config.packet + config.length);
+
+	for (BYTE i = 0; i < config.slot_count; i++) {
+		const TemplateSlot& slot = config.slots[i];
+		bool valid_size = (slot.size == 1 || slot.size == 2 || slot.size == 4 || slot.size == 8);
+		if (slot.type > SLOT_ARGUMENT || !valid_size || slot.offset > config.length || config.length - slot.offset < slot.size) {
+			DEBUGLOG(L"[TEMPLATE] ERROR: Invalid slot " + std::to_wstring(i) + L" (type=" + std::to_wstring(slot.type) +
+				L", size=" + std::to_wstring(slot.size) + L", offset=" + std::to_wstring(slot.offset) + L")");
+			return false;
+		}
+		if (slot.type == SLOT_ARGUMENT && slot.param1 >= MAX_TEMPLATE_ARGS) {
+			DEBUGLOG(L"[TEMPLATE] ERROR: Slot " + std::to_wstring(i) + L" uses argument " + std::to_wstring(slot.param1));
+			return false;
+		}
+		if (slot.type == SLOT_RANDOM && slot.param1 > slot.param2) {
+			DEBUGLOG(L"[TEMPLATE] ERROR: Slot " + std::to_wstring(i) + L" has random range [" + std::to_wstring(slot.param1) +
+				L", " + std::to_wstring(slot.param2) + L"]");
+			return false;
+		}
+		pt.slots.push_back(slot);
+		pt.counters.push_back(slot.param1);
+	}
+
+	InitTemplateLock();
+	EnterCriticalSection(&template_cs);
+	packet_templates[config.template_id] = pt;
+	RebuildWatches();
+	LeaveCriticalSection(&template_cs);
+
+	DEBUGLOG(L"[TEMPLATE] Registered template " + std::to_wstring(config.template_id) + L" (" +
+		std::wstring(pt.packet_type == SENDPACKET ? L"SEND" : L"RECV") + L", length=" + std::to_wstring(pt.packet.size()) +
+		L", slots=" + std::to_wstring(pt.slots.size()) + L")");
+	return true;
+}
+
+// Remove a template, groups already queued with it are dropped at injection time
+bool UnregisterTemplate(DWORD template_id) {
+	InitTemplateLock();
+	EnterCriticalSection(&template_cs);
+	bool removed = packet_templates.erase(template_id) != 0;
+	if (removed) {
+		RebuildWatches();
+	}
+	LeaveCriticalSection(&template_cs);
+
+	if (removed) {
+		DEBUGLOG(L"[TEMPLATE] Unregistered template " + std::to_wstring(template_id));
+	}
+	return removed;
+}
+
+// Copy the template into a new slab and fill client arguments
+bool InstantiateTemplate(DWORD template_id, DWORD id, const ULONGLONG* args, DWORD arg_count, PacketRef& packet) {
+	InitTemplateLock();
+	EnterCriticalSection(&template_cs);
+
+	auto template_it = packet_templates.find(template_id);
+	if (template_it == packet_templates.end()) {
+		LeaveCriticalSection(&template_cs);
+		DEBUGLOG(L"[TEMPLATE] ERROR: Template " + std::to_wstring(template_id) + L" not registered!");
+		return false;
+	}
+
+	const PacketTemplate& pt = template_it->second;
+	PacketSlab slab = std::make_shared<std::vector<BYTE>>(PACKET_HEADROOM + pt.packet.size());
+	memcpy(&(*slab)[PACKET_HEADROOM], &pt.packet[0], pt.packet.size());
+	MakePacketRef(slab, PACKET_HEADROOM, pt.packet_type, id, (DWORD)pt.packet.size(), packet);
+
+	for (auto& slot : pt.slots) {
+		if (slot.type != SLOT_ARGUMENT) {
+			continue;
+		}
+		if (slot.param1 >= arg_count) {
+			LeaveCriticalSection(&template_cs);
+			DEBUGLOG(L"[TEMPLATE] ERROR: Template " + std::to_wstring(template_id) + L" needs argument " +
+				std::to_wstring(slot.param1) + L" but only " + std::to_wstring(arg_count) + L" given");
+			return false;
+		}
+		WriteSlotValue(&packet.data()[slot.offset], slot.size, args[slot.param1]);
+	}
+
+	LeaveCriticalSection(&template_cs);
+	return true;
+}
+
+// Fill the slots whose value depends on injection time
+bool FillTemplateSlots(DWORD template_id, PacketRef& packet) {
+	InitTemplateLock();
+	EnterCriticalSection(&template_cs);
+
+	auto template_it = packet_templates.find(template_id);
+	if (template_it == packet_templates.end()) {
+		LeaveCriticalSection(&template_cs);
+		DEBUGLOG(L"[TEMPLATE] ERROR: Template " + std::to_wstring(template_id) + L" was unregistered, packet dropped");
+		return false;
+	}
+
+	PacketTemplate& pt = template_it->second;
+	if (packet.length != pt.packet.size()) {
+		// Template was replaced by one with a different layout after the packet was queued
+		LeaveCriticalSection(&template_cs);
+		DEBUGLOG(L"[TEMPLATE] ERROR: Template " + std::to_wstring(template_id) + L" changed size, packet dropped");
+		return false;
+	}
+
+	// Resolve every value first so a missing field leaves counters untouched
+	std::vector<ULONGLONG> values(pt.slots.size(), 0);
+	for (size_t i = 0; i < pt.slots.size(); i++) {
+		const TemplateSlot& slot = pt.slots[i];
+		switch (slot.type) {
+		case SLOT_TIMESTAMP:
+			values[i] = GetTickCount();
+			break;
+		case SLOT_COUNTER:
+			values[i] = pt.counters[i];
+			break;
+		case SLOT_RANDOM: {
+			ULONGLONG range = slot.param2 - slot.param1;
+			values[i] = slot.param1 + ((range == ~0ULL) ? NextRandom() : NextRandom() % (range + 1));
+			break;
+		}
+		case SLOT_LAST_SEEN: {
+			// Watches are rebuilt on every registration, so the field always exists
+			WatchedField& field = watched_fields[(WORD)slot.param1][(DWORD)slot.param2];
+			if (!field.seen) {
+				LeaveCriticalSection(&template_cs);
+				wchar_t opcode[8];
+				swprintf_s(opcode, L"%04X", (WORD)slot.param1);
+				DEBUGLOG(L"[TEMPLATE] Template " + std::to_wstring(template_id) + L": opcode 0x" + opcode +
+					L" not seen yet, packet dropped");
+				return false;
+			}
+			values[i] = field.value;
+			break;
+		}
+		default:
+			continue;
+		}
+	}
+
+	for (size_t i = 0; i < pt.slots.size(); i++) {
+		const TemplateSlot& slot = pt.slots[i];
+		if (slot.type == SLOT_ARGUMENT) {
+			continue;
+		}
+		if (slot.type == SLOT_COUNTER) {
+			pt.counters[i] += slot.param2;
+		}
+		WriteSlotValue(&packet.data()[slot.offset], slot.size, values[i]);
+	}
+
+	LeaveCriticalSection(&template_cs);
+	return true;
+}
+
+// Called for every received packet
+void UpdateTemplateWatches(const BYTE* packet, DWORD length) {
+	if (length < sizeof(WORD)) {
+		return;
+	}
+
+	WORD opcode = *(WORD *)&packet[0];
+	if (!(watched_opcodes[opcode >> 3] & (1 << (opcode & 7)))) {
+		return;
+	}
+
+	EnterCriticalSection(&template_cs);
+	auto opcode_it = watched_fields.find(opcode);
+	if (opcode_it != watched_fields.end()) {
+		for (auto& field_kv : opcode_it->second) {
+			DWORD offset = field_kv.first;
+			WatchedField& field = field_kv.second;
+			if (offset > length || length - offset < field.size) {
+				continue;
+			}
+			ULONGLONG value = 0;
+			for (BYTE i = 0; i < field.size; i++) {
+				value |= (ULONGLONG)packet[offset + i] << (i * 8);
+			}
+			field.value = value;
+			field.seen = true;
+		}
+	}
+	LeaveCriticalSection(&template_cs);
+}
@@ -0,0 +1,22 @@
+﻿#ifndef __PACKET_TEMPLATE_H__
+#define __PACKET_TEMPLATE_H__
+
+#include<Windows.h>
+#include<vector>
+#include"PacketDefs.h"
+#include"PacketSender.h"
+
+// Template registry (called from the TCP thread)
+bool RegisterTemplate(const TemplateConfigMessage& config, size_t message_size);
+bool UnregisterTemplate(DWORD template_id);
+
+// Build a packet (in its own slab) from a template, SLOT_ARGUMENT slots are filled here
+bool InstantiateTemplate(DWORD template_id, DWORD id, const ULONGLONG* args, DWORD arg_count, PacketRef& packet);
+
+// Fill timestamp/counter/random/last-seen slots right before injection (main thread)
+bool FillTemplateSlots(DWORD template_id, PacketRef& packet);
+
+// Record fields watched by SLOT_LAST_SEEN slots from a received packet (opcode first)
+void UpdateTemplateWatches(const BYTE* packet, DWORD length);
+
+#endif
@@ -42,9 +42,16 @@ static bool RecvExact(SOCKET sock, char* buffer, int length) {
 // TCPServerThread Implementation
 // ============================================================================
 
-TCPServerThread::TCPServerThread(SOCKET sock, bool (*function)(TCPServerThread&)) {
+TCPServerThread::TCPServerThread(SOCKET sock, TCPServer *owner) {
 	client_socket = sock;
-	communicate = function;
+	server = owner;
+	context = NULL;
+	read_buffer = std::make_shared<std::vector<BYTE>>(TCP_READ_BUFFER_SIZE);
+	read_start = 0;
+	read_end = 0;
+	write_offset = 0;
+	closing = false;
+	InitializeCriticalSection(&send_cs);
 }
 
 TCPServerThread::~TCPServerThread() {
@@ -52,74 +59,58 @@ TCPServerThread::~TCPServerThread() {
 		closesocket(client_socket);
 		client_socket = INVALID_SOCKET;
 	}
-}
-
-bool TCPServerThread::Run() {
-	if (communicate) {
-		return communicate(*this);
-	}
-	return false;
+	DeleteCriticalSection(&send_cs);
 }
 
 bool TCPServerThread::Send(BYTE *bData, ULONG_PTR uLength) {
-	if (client_socket == INVALID_SOCKET || !bData || uLength == 0) {
-		return false;
-	}
-
-	// Allocate message buffer
-	DWORD total_size = sizeof(DWORD) * 2 + (DWORD)uLength;
-	BYTE *buffer = new BYTE[total_size];
-	if (!buffer) {
+	if (!bData || uLength == 0) {
 		return false;
 	}
 
 	// Build message with magic and length
-	TCPMessage *msg = (TCPMessage*)buffer;
+	std::shared_ptr<std::vector<BYTE>> buffer = std::make_shared<std::vector<BYTE>>(sizeof(DWORD) * 2 + uLength);
+	TCPMessage *msg = (TCPMessage*)&(*buffer)[0];
 	msg->magic = TCP_MESSAGE_MAGIC;
 	msg->length = (DWORD)uLength;
 	memcpy(msg->data, bData, uLength);
 
-	// Send the entire message (loop until all bytes sent)
-	int total_sent = 0;
-	while (total_sent < (int)total_size) {
-		int sent = send(client_socket, (char*)buffer + total_sent, total_size - total_sent, 0);
-		if (sent <= 0) {
-			// Socket error or closed
-			delete[] buffer;
-			return false;
-		}
-		total_sent += sent;
-	}
-	delete[] buffer;
-
-	return true;
+	return QueueFrame(buffer);
 }
 
-bool TCPServerThread::Recv(std::vector<BYTE> &vData) {
-	if (client_socket == INVALID_SOCKET) {
+bool TCPServerThread::SendFrame(const BYTE *bFrame, ULONG_PTR uLength) {
+	if (!bFrame || uLength == 0) {
 		return false;
 	}
 
-	// Receive magic and length (header)
-	DWORD magic = 0;
-	DWORD length = 0;
+	return QueueFrame(std::make_shared<const std::vector<BYTE>>(bFrame, bFrame + uLength));
+}
 
-	if (!RecvExact(client_socket, (char*)&magic, sizeof(DWORD)) || magic != TCP_MESSAGE_MAGIC) {
+bool TCPServerThread::QueueFrame(const TCPFrame &frame, size_t max_pending) {
+	EnterCriticalSection(&send_cs);
+	if (closing || (max_pending && write_queue.size() >= max_pending)) {
+		LeaveCriticalSection(&send_cs);
 		return false;
 	}
+	bool was_empty = write_queue.empty();
+	write_queue.push_back(frame);
+	LeaveCriticalSection(&send_cs);
 
-	if (!RecvExact(client_socket, (char*)&length, sizeof(DWORD)) || length == 0 || length > 1024 * 1024) {
-		return false;
+	// Frames queued while the loop is awake are picked up by the same flush
+	if (was_empty) {
+		server->Wake();
 	}
+	return true;
+}
 
-	// Allocate buffer and receive data
-	vData.resize(length);
-	if (!RecvExact(client_socket, (char*)&vData[0], length)) {
-		vData.clear();
-		return false;
-	}
+size_t TCPServerThread::PendingFrames() {
+	EnterCriticalSection(&send_cs);
+	size_t pending = write_queue.size();
+	LeaveCriticalSection(&send_cs);
+	return pending;
+}
 
-	return true;
+bool TCPServerThread::HasPendingWrites() {
+	return PendingFrames() != 0;
 }
 
 bool TCPServerThread::Send(std::wstring wText) {
@@ -127,14 +118,122 @@ bool TCPServerThread::Send(std::wstring wText) {
 	return Send((BYTE*)sText.c_str(), sText.length());
 }
 
-bool TCPServerThread::Recv(std::wstring &wText) {
-	std::vector<BYTE> vData;
-	if (!Recv(vData)) {
+void TCPServerThread::Shutdown() {
+	closing = true;
+	server->Wake();
+}
+
+// Reads what the socket has and hands every complete frame to on_message, false closes the connection
+// Frames are views into the read buffer, one recv() usually carries many of them
+bool TCPServerThread::ReadFrames(bool (*on_message)(TCPServerThread&, const TCPFrameView&)) {
+	int received = recv(client_socket, (char*)&(*read_buffer)[read_end], (int)(read_buffer->size() - read_end), 0);
+	if (received == 0) {
 		return false;
 	}
+	if (received < 0) {
+		return WSAGetLastError() == WSAEWOULDBLOCK;
+	}
+	read_end += received;
 
-	std::string sText((char*)&vData[0], vData.size());
-	wText = std::wstring(sText.begin(), sText.end());
+	size_t needed = sizeof(DWORD) * 2;
+	while (read_end - read_start >= sizeof(DWORD) * 2) {
+		TCPMessage *msg = (TCPMessage*)&(*read_buffer)[read_start];
+		if (msg->magic != TCP_MESSAGE_MAGIC || msg->length == 0 || msg->length > TCP_MAX_FRAME_SIZE) {
+			return false;
+		}
+		size_t frame_size = sizeof(DWORD) * 2 + msg->length;
+		if (read_end - read_start < frame_size) {
+			needed = frame_size;
+			break;
+		}
+
+		TCPFrameView frame;
+		frame.buffer = read_buffer;
+		frame.offset = read_start + sizeof(DWORD) * 2;
+		frame.length = msg->length;
+		read_start += frame_size;
+
+		if (on_message && !on_message(*this, frame)) {
+			return false;
+		}
+	}
+
+	PrepareReadBuffer(needed);
+	return true;
+}
+
+// Makes room for the next recv(), needed is the full size of the frame starting at read_start
+// The buffer is compacted in place while nobody references it, otherwise it is filled up
+// and only then replaced, the unparsed tail moving to the new one (the old one lives on with its frames)
+void TCPServerThread::PrepareReadBuffer(size_t needed) {
+	std::vector<BYTE> &buffer = *read_buffer;
+	size_t pending = read_end - read_start;
+
+	if (read_buffer.use_count() == 1) {
+		if (pending && read_start) {
+			memmove(&buffer[0], &buffer[read_start], pending);
+		}
+		read_start = 0;
+		read_end = pending;
+		// Grown only for frames larger than the buffer, back to the normal size once they are consumed
+		if (buffer.size() < needed) {
+			buffer.resize(needed);
+		}
+		else if (buffer.size() > TCP_READ_BUFFER_SIZE && needed <= TCP_READ_BUFFER_SIZE) {
+			buffer.resize(TCP_READ_BUFFER_SIZE);
+			buffer.shrink_to_fit();
+		}
+		return;
+	}
+
+	if (read_start + needed <= buffer.size() && buffer.size() - read_end >= TCP_READ_BUFFER_SIZE / 4) {
+		return;
+	}
+	TCPBuffer fresh = std::make_shared<std::vector<BYTE>>(needed > TCP_READ_BUFFER_SIZE ? needed : TCP_READ_BUFFER_SIZE);
+	if (pending) {
+		memcpy(&(*fresh)[0], &buffer[read_start], pending);
+	}
+	read_buffer = fresh;
+	read_start = 0;
+	read_end = pending;
+}
+
+// Writes queued frames in batches until the socket would block, false closes the connection
+bool TCPServerThread::Flush() {
+	EnterCriticalSection(&send_cs);
+	while (!write_queue.empty()) {
+		WSABUF buffers[TCP_MAX_WRITE_BATCH];
+		DWORD count = 0;
+		for (auto it = write_queue.begin(); it != write_queue.end() && count < TCP_MAX_WRITE_BATCH; ++it, ++count) {
+			size_t offset = (count == 0) ? write_offset : 0;
+			buffers[count].buf = (char*)&(**it)[offset];
+			buffers[count].len = (ULONG)((*it)->size() - offset);
+		}
+
+		DWORD sent = 0;
+		if (WSASend(client_socket, buffers, count, &sent, 0, NULL, NULL) == SOCKET_ERROR) {
+			bool would_block = (WSAGetLastError() == WSAEWOULDBLOCK);
+			LeaveCriticalSection(&send_cs);
+			return would_block;
+		}
+
+		// Drop what was fully sent, remember how far into the next frame we got
+		size_t remaining = sent;
+		while (remaining && !write_queue.empty()) {
+			size_t frame_left = write_queue.front()->size() - write_offset;
+			if (remaining < frame_left) {
+				write_offset += remaining;
+				break;
+			}
+			remaining -= frame_left;
+			write_queue.pop_front();
+			write_offset = 0;
+		}
+		if (sent == 0) {
+			break;
+		}
+	}
+	LeaveCriticalSection(&send_cs);
 	return true;
 }
 
@@ -142,11 +241,17 @@ bool TCPServerThread::Recv(std::wstring &wText) {
 // TCPServer Implementation
 // ============================================================================
 
-bool (*TCPServer::communicate)(TCPServerThread&) = NULL;
-
 TCPServer::TCPServer(int nPort) {
 	port = nPort;
 	listen_socket = INVALID_SOCKET;
+	wake_socket = INVALID_SOCKET;
+	memset(&wake_addr, 0, sizeof(wake_addr));
+	wake_pending = 0;
+	running = false;
+	loop_thread = NULL;
+	on_connect = NULL;
+	on_message = NULL;
+	on_disconnect = NULL;
 }
 
 TCPServer::~TCPServer() {
@@ -154,22 +259,36 @@ TCPServer::~TCPServer() {
 }
 
 void TCPServer::Stop() {
+	if (loop_thread) {
+		running = false;
+		Wake();
+		WaitForSingleObject(loop_thread, INFINITE);
+		CloseHandle(loop_thread);
+		loop_thread = NULL;
+	}
 	if (listen_socket != INVALID_SOCKET) {
 		closesocket(listen_socket);
 		listen_socket = INVALID_SOCKET;
 	}
+	if (wake_socket != INVALID_SOCKET) {
+		closesocket(wake_socket);
+		wake_socket = INVALID_SOCKET;
+	}
 }
 
-bool TCPServer::SetCommunicate(bool (*function)(TCPServerThread&)) {
-	communicate = function;
+bool TCPServer::SetCallbacks(bool (*connect)(TCPServerThread&), bool (*message)(TCPServerThread&, const TCPFrameView&), void (*disconnect)(TCPServerThread&)) {
+	on_connect = connect;
+	on_message = message;
+	on_disconnect = disconnect;
 	return true;
 }
 
-DWORD WINAPI TCPServer::ClientThreadProc(LPVOID param) {
-	SOCKET client_socket = (SOCKET)(ULONG_PTR)param;
-	TCPServerThread thread(client_socket, communicate);
-	thread.Run();
-	return 0;
+void TCPServer::Wake() {
+	// One datagram is enough until the loop has drained it
+	if (wake_socket != INVALID_SOCKET && InterlockedExchange(&wake_pending, 1) == 0) {
+		char signal = 0;
+		sendto(wake_socket, &signal, 1, 0, (sockaddr*)&wake_addr, sizeof(wake_addr));
+	}
 }
 
 bool TCPServer::Run() {
@@ -206,20 +325,136 @@ bool TCPServer::Run() {
 		return false;
 	}
 
-	// Accept connections in background thread
-	CreateThread(NULL, 0, [](LPVOID param) -> DWORD {
-		TCPServer* server = (TCPServer*)param;
-		while (server->listen_socket != INVALID_SOCKET) {
-			SOCKET client_socket = accept(server->listen_socket, NULL, NULL);
-			if (client_socket != INVALID_SOCKET) {
-				// Spawn thread for each client
-				CreateThread(NULL, 0, ClientThreadProc, (LPVOID)(ULONG_PTR)client_socket, 0, NULL);
+	// Wake socket bound to an ephemeral loopback port
+	wake_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	memset(&wake_addr, 0, sizeof(wake_addr));
+	wake_addr.sin_family = AF_INET;
+	wake_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	wake_addr.sin_port = 0;
+	int wake_addr_size = sizeof(wake_addr);
+	if (wake_socket == INVALID_SOCKET ||
+		bind(wake_socket, (sockaddr*)&wake_addr, sizeof(wake_addr)) == SOCKET_ERROR ||
+		getsockname(wake_socket, (sockaddr*)&wake_addr, &wake_addr_size) == SOCKET_ERROR) {
+		Stop();
+		return false;
+	}
+
+	unsigned long non_blocking = 1;
+	ioctlsocket(listen_socket, FIONBIO, &non_blocking);
+	ioctlsocket(wake_socket, FIONBIO, &non_blocking);
+
+	// Accept, reads and writes of every client are served by this thread
+	running = true;
+	loop_thread = CreateThread(NULL, 0, LoopThreadProc, this, 0, NULL);
+	if (!loop_thread) {
+		running = false;
+		Stop();
+		return false;
+	}
+
+	return true;
+}
+
+DWORD WINAPI TCPServer::LoopThreadProc(LPVOID param) {
+	TCPServer *server = (TCPServer*)param;
+	server->Loop();
+	return 0;
+}
+
+void TCPServer::Accept() {
+	while (true) {
+		SOCKET client_socket = accept(listen_socket, NULL, NULL);
+		if (client_socket == INVALID_SOCKET) {
+			return;
+		}
+
+		unsigned long non_blocking = 1;
+		ioctlsocket(client_socket, FIONBIO, &non_blocking);
+		int nodelay = 1;
+		setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, (char*)&nodelay, sizeof(nodelay));
+
+		TCPServerThread *connection = new TCPServerThread(client_socket, this);
+		connections.push_back(connection);
+		if (on_connect && !on_connect(*connection)) {
+			Close(connections.size() - 1);
+		}
+	}
+}
+
+void TCPServer::Close(size_t index) {
+	TCPServerThread *connection = connections[index];
+	connections.erase(connections.begin() + index);
+
+	EnterCriticalSection(&connection->send_cs);
+	connection->closing = true;
+	LeaveCriticalSection(&connection->send_cs);
+
+	if (on_disconnect) {
+		on_disconnect(*connection);
+	}
+	delete connection;
+}
+
+void TCPServer::Loop() {
+	std::vector<WSAPOLLFD> fds;
+
+	while (running) {
+		// [0] wake socket, [1] listen socket, [2 + i] connections[i]
+		fds.resize(2 + connections.size());
+		fds[0].fd = wake_socket;
+		fds[0].events = POLLIN;
+		fds[1].fd = listen_socket;
+		fds[1].events = POLLIN;
+		for (size_t i = 0; i < connections.size(); i++) {
+			fds[2 + i].fd = connections[i]->client_socket;
+			fds[2 + i].events = POLLIN | (connections[i]->HasPendingWrites() ? POLLOUT : 0);
+		}
+		for (auto &fd : fds) {
+			fd.revents = 0;
+		}
+
+		if (WSAPoll(&fds[0], (ULONG)fds.size(), -1) == SOCKET_ERROR) {
+			Sleep(1);
+			continue;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			char drain[64];
+			InterlockedExchange(&wake_pending, 0);
+			while (recvfrom(wake_socket, drain, sizeof(drain), 0, NULL, NULL) > 0) {
 			}
 		}
-		return 0;
-	}, this, 0, NULL);
 
-	return true;
+		// Connections accepted below are polled from the next iteration on
+		size_t polled = connections.size();
+		for (size_t i = polled; i-- > 0;) {
+			TCPServerThread *connection = connections[i];
+			short revents = fds[2 + i].revents;
+			bool alive = !connection->closing;
+
+			if (alive && (revents & (POLLIN | POLLHUP | POLLERR))) {
+				alive = connection->ReadFrames(on_message);
+			}
+			if (alive && (revents & POLLNVAL)) {
+				alive = false;
+			}
+			// Also flushes frames queued since the poll started (the wake covered them)
+			if (alive && connection->HasPendingWrites()) {
+				alive = connection->Flush();
+			}
+			if (!alive || connection->closing) {
+				Close(i);
+			}
+		}
+
+		if (fds[1].revents & POLLIN) {
+			Accept();
+		}
+	}
+
+	while (!connections.empty()) {
+		Close(connections.size() - 1);
+	}
 }
 
 // ============================================================================
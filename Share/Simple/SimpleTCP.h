@@ -11,10 +11,15 @@
 #include <Windows.h>
 #include <vector>
 #include <string>
+#include <deque>
+#include <memory>
 
 #pragma comment(lib, "ws2_32.lib")
 
 #define TCP_MESSAGE_MAGIC 0xA11CE
+#define TCP_MAX_FRAME_SIZE (1024 * 1024)
+#define TCP_READ_BUFFER_SIZE (64 * 1024)  // One recv() fills it with as many frames as are available
+#define TCP_MAX_WRITE_BATCH 64            // Frames handed to one WSASend
 
 #pragma pack(push, 1)
 typedef struct {
@@ -24,39 +29,95 @@ typedef struct {
 } TCPMessage;
 #pragma pack(pop)
 
-// TCP Server Thread - handles a single client connection
+// Framed message shared between connection write queues (magic + length + data)
+typedef std::shared_ptr<const std::vector<BYTE>> TCPFrame;
+
+// Connection read buffer, handlers may keep a reference to it (the server then stops reusing it)
+typedef std::shared_ptr<std::vector<BYTE>> TCPBuffer;
+
+// Frame body received by the server, a view into the connection's read buffer (no copy)
+struct TCPFrameView {
+	TCPBuffer buffer;
+	size_t offset;                           // Offset of the frame body in buffer
+	size_t length;                           // Frame body size
+
+	BYTE *data() const { return &(*buffer)[offset]; }
+	size_t size() const { return length; }
+	BYTE &operator[](size_t index) const { return (*buffer)[offset + index]; }
+};
+
+class TCPServer;
+
+// TCP Server connection - one client, driven by the server's I/O loop (name kept from thread-per-client days)
 class TCPServerThread {
 private:
 	SOCKET client_socket;
-	bool (*communicate)(TCPServerThread&);
+	TCPServer *server;
+	void *context;
+
+	// Bytes received, [read_start, read_end) is not parsed into frames yet (I/O loop only)
+	TCPBuffer read_buffer;
+	size_t read_start;
+	size_t read_end;
+
+	// Frames waiting to be written, write_queue.front() is partially sent up to write_offset
+	std::deque<TCPFrame> write_queue;
+	size_t write_offset;
+	CRITICAL_SECTION send_cs;
+	volatile bool closing;
+
+	friend class TCPServer;
+	bool ReadFrames(bool (*on_message)(TCPServerThread&, const TCPFrameView&));
+	void PrepareReadBuffer(size_t needed);
+	bool Flush();
+	bool HasPendingWrites();
 
 public:
-	TCPServerThread(SOCKET sock, bool (*function)(TCPServerThread&));
+	TCPServerThread(SOCKET sock, TCPServer *owner);
 	~TCPServerThread();
 
-	bool Run();
+	// Queue data for the I/O loop, never blocks; false once the connection is closing
 	bool Send(BYTE *bData, ULONG_PTR uLength);
-	bool Recv(std::vector<BYTE> &vData);
+	bool SendFrame(const BYTE *bFrame, ULONG_PTR uLength);  // Already framed (magic + length + data)
+	bool QueueFrame(const TCPFrame &frame, size_t max_pending = 0);  // Shared frame, false if max_pending frames are waiting
+	size_t PendingFrames();
 	bool Send(std::wstring wText);
-	bool Recv(std::wstring &wText);
+	void Shutdown();  // Closes the connection from the I/O loop, on_disconnect is called there
+
+	void SetContext(void *pContext) { context = pContext; }
+	void *GetContext() { return context; }
 };
 
-// TCP Server - listens for connections on a port
+// TCP Server - accepts clients and serves all of them from a single non-blocking WSAPoll loop
 class TCPServer {
 private:
 	int port;
 	SOCKET listen_socket;
-	static bool (*communicate)(TCPServerThread&);
-
-	static DWORD WINAPI ClientThreadProc(LPVOID param);
+	SOCKET wake_socket;  // Loopback UDP socket, a datagram to itself wakes the loop
+	sockaddr_in wake_addr;
+	volatile LONG wake_pending;
+	volatile bool running;
+	HANDLE loop_thread;
+	std::vector<TCPServerThread*> connections;  // I/O loop only
+
+	bool (*on_connect)(TCPServerThread&);
+	bool (*on_message)(TCPServerThread&, const TCPFrameView&);
+	void (*on_disconnect)(TCPServerThread&);
+
+	static DWORD WINAPI LoopThreadProc(LPVOID param);
+	void Loop();
+	void Accept();
+	void Close(size_t index);
 
 public:
 	TCPServer(int nPort);
 	~TCPServer();
 
-	bool SetCommunicate(bool (*function)(TCPServerThread&));
+	// Called on the I/O loop thread, returning false from on_connect/on_message closes the connection
+	bool SetCallbacks(bool (*connect)(TCPServerThread&), bool (*message)(TCPServerThread&, const TCPFrameView&), void (*disconnect)(TCPServerThread&));
 	bool Run();
 	void Stop();
+	void Wake();  // Any thread: make the loop flush newly queued writes
 };
 
 // TCP Client - connects to a TCP server
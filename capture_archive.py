@@ -0,0 +1,494 @@
+#!/usr/bin/env python3
+"""
+RirePE Capture Archive
+Compacts closed capture segments into columnar archives for long-term storage, and scans them
+
+An archive (archive-<first sequence>-<last sequence>.rpa) holds one block per message kind
+(SEND/RECV opcode, or trace type) per time window. Every block stores its records as columns:
+delta-encoded timestamps and ids, return addresses as indexes into the archive's address
+dictionary, packet lengths, the first bytes of the packets as one column per byte offset, and
+the remaining bytes. Columns are compressed separately and blocks carry min/max of time, id and
+length, so a scan reads only the blocks and columns it needs.
+
+Examples:
+    python capture_archive.py compact captures/ --window 60 --delete
+    python capture_archive.py info captures/archive/
+    python capture_archive.py scan captures/archive/ --send --opcode 0x0010 --offset 6 --size 4 --from 14:00
+"""
+
+import argparse
+import mmap
+import os
+import re
+import struct
+import sys
+import zlib
+
+from capture_store import (CaptureStore, CAPTURE_RECORD_HEADER, SENDPACKET, RECVPACKET, MESSAGE_HEADER,
+                           iter_records, parse_time, format_time)
+
+ARCHIVE_MAGIC = 0x41455052           # "RPEA"
+ARCHIVE_VERSION = 1
+ARCHIVE_NAME = re.compile(r'^archive-(\d{8})-(\d{8})\.rpa$', re.IGNORECASE)
+ARCHIVE_BYTE_COLUMNS = 64            # Packet bytes stored one column per offset, the rest goes to COLUMN_TAIL
+DEFAULT_WINDOW_SECONDS = 60
+
+# magic, version, header_size, first_sequence, last_sequence, first_time_us, last_time_us, record_count,
+# window_us, block_count, address_count, directory_offset, address_offset
+ARCHIVE_HEADER = struct.Struct('<IHHIIQQQQIIQQ8x')
+# kind (MessageHeader), opcode, layout, prefix_length, count, min/max time, min/max id, min/max length,
+# column_count, columns_offset
+ARCHIVE_BLOCK = struct.Struct('<IHHHxxIQQIIIIIQ')
+# column, codec, offset, stored_size, raw_size
+ARCHIVE_COLUMN = struct.Struct('<HHQII')
+
+# Block layouts
+LAYOUT_PACKET = 0                    # SEND/RECV packets of one opcode
+LAYOUT_RAW = 1                       # Traces (and packets too short for an opcode): message body after the header
+
+# Columns
+COLUMN_TIME = 0                      # Zigzag varint deltas of time_us
+COLUMN_ID = 1                        # Zigzag varint deltas of the message id
+COLUMN_ADDR = 2                      # Varint index into the address dictionary
+COLUMN_LENGTH = 3                    # Varint packet (or body) length
+COLUMN_TAIL = 4                      # Packet bytes past prefix_length, concatenated
+COLUMN_BODY = 5                      # LAYOUT_RAW bodies, concatenated
+COLUMN_BYTE = 0x100                  # + offset: byte at that offset of every packet (offset < prefix_length)
+
+CODEC_NONE = 0
+CODEC_ZLIB = 1
+
+
+def encode_varints(values):
+    out = bytearray()
+    for value in values:
+        while value >= 0x80:
+            out.append((value & 0x7F) | 0x80)
+            value >>= 7
+        out.append(value)
+    return bytes(out)
+
+
+def decode_varints(data, count):
+    values = [0] * count
+    pos = 0
+    for i in range(count):
+        value = shift = 0
+        while True:
+            byte = data[pos]
+            pos += 1
+            value |= (byte & 0x7F) << shift
+            if byte < 0x80:
+                break
+            shift += 7
+        values[i] = value
+    return values
+
+
+def encode_deltas(values):
+    """Zigzag varints of the differences between consecutive values (the first against 0)"""
+    out = []
+    previous = 0
+    for value in values:
+        delta = value - previous
+        out.append((delta << 1) if delta >= 0 else ((-delta << 1) - 1))
+        previous = value
+    return encode_varints(out)
+
+
+def decode_deltas(data, count):
+    values = decode_varints(data, count)
+    previous = 0
+    for i, value in enumerate(values):
+        previous += (value >> 1) if not value & 1 else -((value + 1) >> 1)
+        values[i] = previous
+    return values
+
+
+class BlockBuilder:
+    """Records of one block while its window is open"""
+
+    def __init__(self, kind, opcode, layout):
+        self.kind = kind
+        self.opcode = opcode
+        self.layout = layout
+        self.times = []
+        self.ids = []
+        self.addrs = []
+        self.lengths = []
+        self.payloads = []
+
+    def add(self, time_us, message_id, addr_index, payload):
+        self.times.append(time_us)
+        self.ids.append(message_id)
+        self.addrs.append(addr_index)
+        self.lengths.append(len(payload))
+        self.payloads.append(payload)
+
+    def columns(self):
+        """(column, raw bytes) of the block, and its prefix length"""
+        columns = [(COLUMN_TIME, encode_deltas(self.times)), (COLUMN_ID, encode_deltas(self.ids)),
+                   (COLUMN_ADDR, encode_varints(self.addrs)), (COLUMN_LENGTH, encode_varints(self.lengths))]
+        if self.layout == LAYOUT_RAW:
+            columns.append((COLUMN_BODY, b''.join(self.payloads)))
+            return columns, 0
+
+        prefix = min(min(self.lengths), ARCHIVE_BYTE_COLUMNS)
+        if prefix:
+            # Row-major prefixes, every prefix-th byte is one column
+            rows = b''.join(payload[:prefix] for payload in self.payloads)
+            for offset in range(prefix):
+                columns.append((COLUMN_BYTE + offset, rows[offset::prefix]))
+        columns.append((COLUMN_TAIL, b''.join(payload[prefix:] for payload in self.payloads)))
+        return columns, prefix
+
+
+class ArchiveWriter:
+    """Streams records into an archive, one window of blocks in memory at a time"""
+
+    def __init__(self, path, window_us, level=6):
+        self.path = path
+        self.file = open(path, 'wb')
+        self.window_us = window_us
+        self.level = level
+        self.window = None
+        self.builders = {}
+        self.blocks = []                 # Directory entries (without the column table offset fixed up)
+        self.addresses = {}
+        self.record_count = 0
+        self.first_time_us = None
+        self.last_time_us = 0
+        self.first_sequence = None
+        self.last_sequence = 0
+        self.file.write(bytes(ARCHIVE_HEADER.size))
+
+    def add(self, sequence, time_us, message):
+        if len(message) < 16:
+            return
+        if self.first_sequence is None:
+            self.first_sequence = sequence
+        self.last_sequence = sequence
+
+        window = time_us // self.window_us
+        if self.window is None or window > self.window:
+            self.flush_window()
+            self.window = window
+
+        header, message_id, addr = struct.unpack_from('<IIQ', message)
+        addr_index = self.addresses.setdefault(addr, len(self.addresses))
+        key = (header, 0, LAYOUT_RAW)
+        payload = message[16:]
+        if header in (SENDPACKET, RECVPACKET) and len(message) >= MESSAGE_HEADER.size:
+            length = struct.unpack_from('<I', message, 16)[0]
+            packet = message[MESSAGE_HEADER.size:MESSAGE_HEADER.size + length]
+            if len(packet) >= 2:
+                key = (header, struct.unpack_from('<H', packet)[0], LAYOUT_PACKET)
+                payload = packet
+        builder = self.builders.get(key)
+        if builder is None:
+            builder = self.builders[key] = BlockBuilder(*key)
+        builder.add(time_us, message_id, addr_index, payload)
+
+        self.record_count += 1
+        if self.first_time_us is None:
+            self.first_time_us = time_us
+        self.last_time_us = max(self.last_time_us, time_us)
+
+    def flush_window(self):
+        for key in sorted(self.builders):
+            self.write_block(self.builders[key])
+        self.builders = {}
+
+    def write_block(self, builder):
+        columns, prefix = builder.columns()
+        table = []
+        for column, raw in columns:
+            stored, codec = raw, CODEC_NONE
+            if len(raw) > 64:
+                compressed = zlib.compress(raw, self.level)
+                if len(compressed) < len(raw):
+                    stored, codec = compressed, CODEC_ZLIB
+            table.append(ARCHIVE_COLUMN.pack(column, codec, self.file.tell(), len(stored), len(raw)))
+            self.file.write(stored)
+        columns_offset = self.file.tell()
+        self.file.write(b''.join(table))
+        self.blocks.append(ARCHIVE_BLOCK.pack(builder.kind, builder.opcode, builder.layout, prefix, len(builder.times),
+                                              min(builder.times), max(builder.times), min(builder.ids), max(builder.ids),
+                                              min(builder.lengths), max(builder.lengths), len(table), columns_offset))
+
+    def close(self):
+        self.flush_window()
+        directory_offset = self.file.tell()
+        self.file.write(b''.join(self.blocks))
+        address_offset = self.file.tell()
+        addresses = sorted(self.addresses, key=self.addresses.get)
+        self.file.write(struct.pack('<%dQ' % len(addresses), *addresses))
+        self.file.seek(0)
+        self.file.write(ARCHIVE_HEADER.pack(ARCHIVE_MAGIC, ARCHIVE_VERSION, ARCHIVE_HEADER.size, self.first_sequence or 0,
+                                            self.last_sequence, self.first_time_us or 0, self.last_time_us, self.record_count,
+                                            self.window_us, len(self.blocks), len(addresses), directory_offset, address_offset))
+        self.file.close()
+
+
+class ArchiveBlock:
+    __slots__ = ('kind', 'opcode', 'layout', 'prefix', 'count', 'min_time_us', 'max_time_us', 'min_id', 'max_id',
+                 'min_length', 'max_length', 'columns')
+
+    def __init__(self, values, columns):
+        (self.kind, self.opcode, self.layout, self.prefix, self.count, self.min_time_us, self.max_time_us,
+         self.min_id, self.max_id, self.min_length, self.max_length) = values
+        self.columns = columns       # column -> (codec, offset, stored_size, raw_size)
+
+
+class CaptureArchive:
+    """Reads only the directory up front, columns on demand"""
+
+    def __init__(self, path):
+        self.path = path
+        self.file = open(path, 'rb')
+        self.view = mmap.mmap(self.file.fileno(), 0, access=mmap.ACCESS_READ)
+        (magic, version, _, self.first_sequence, self.last_sequence, self.first_time_us, self.last_time_us,
+         self.record_count, self.window_us, block_count, self.address_count, directory_offset,
+         self.address_offset) = ARCHIVE_HEADER.unpack_from(self.view)
+        if magic != ARCHIVE_MAGIC or version != ARCHIVE_VERSION:
+            raise ValueError(f"{path}: not a capture archive")
+        self.blocks = []
+        for i in range(block_count):
+            values = ARCHIVE_BLOCK.unpack_from(self.view, directory_offset + i * ARCHIVE_BLOCK.size)
+            column_count, columns_offset = values[-2:]
+            columns = {}
+            for j in range(column_count):
+                column, codec, offset, stored_size, raw_size = ARCHIVE_COLUMN.unpack_from(self.view, columns_offset + j * ARCHIVE_COLUMN.size)
+                columns[column] = (codec, offset, stored_size, raw_size)
+            self.blocks.append(ArchiveBlock(values[:-2], columns))
+        self.addresses = None
+
+    def close(self):
+        self.view.close()
+        self.file.close()
+
+    def address(self, index):
+        if self.addresses is None:
+            self.addresses = struct.unpack_from('<%dQ' % self.address_count, self.view, self.address_offset)
+        return self.addresses[index]
+
+    def column(self, block, column):
+        codec, offset, stored_size, raw_size = block.columns[column]
+        data = self.view[offset:offset + stored_size]
+        return zlib.decompress(data) if codec == CODEC_ZLIB else data
+
+    def select(self, kinds=None, opcodes=None, start_us=None, end_us=None):
+        """Blocks that can hold matches, pruned on their directory entry alone"""
+        for block in self.blocks:
+            if kinds is not None and block.kind not in kinds:
+                continue
+            if opcodes is not None and (block.layout != LAYOUT_PACKET or block.opcode not in opcodes):
+                continue
+            if (start_us is not None and block.max_time_us < start_us) or (end_us is not None and block.min_time_us > end_us):
+                continue
+            yield block
+
+    def times(self, block):
+        return decode_deltas(self.column(block, COLUMN_TIME), block.count)
+
+    def records(self, block):
+        """(time_us, kind, id, addr, payload) of every record of a block, payload is the packet or the trace body"""
+        times = self.times(block)
+        ids = decode_deltas(self.column(block, COLUMN_ID), block.count)
+        addrs = decode_varints(self.column(block, COLUMN_ADDR), block.count)
+        lengths = decode_varints(self.column(block, COLUMN_LENGTH), block.count)
+        if block.layout == LAYOUT_RAW:
+            body = self.column(block, COLUMN_BODY)
+            pos = 0
+            for i in range(block.count):
+                yield times[i], block.kind, ids[i], self.address(addrs[i]), body[pos:pos + lengths[i]]
+                pos += lengths[i]
+            return
+        prefix = block.prefix
+        rows = bytearray(block.count * prefix)
+        for offset in range(prefix):
+            rows[offset::prefix] = self.column(block, COLUMN_BYTE + offset)
+        tail = self.column(block, COLUMN_TAIL)
+        pos = 0
+        for i in range(block.count):
+            rest = lengths[i] - prefix
+            yield times[i], block.kind, ids[i], self.address(addrs[i]), bytes(rows[i * prefix:(i + 1) * prefix]) + tail[pos:pos + rest]
+            pos += rest
+
+    def field_values(self, block, offset, size, start_us=None, end_us=None):
+        """(time_us, value) of a little-endian field of every packet of a block, value None if the packet is too short"""
+        times = self.times(block)
+        in_prefix = min(max(block.prefix - offset, 0), size)
+        columns = [self.column(block, COLUMN_BYTE + offset + k) for k in range(in_prefix)]
+        lengths = tail = None
+        if in_prefix < size:
+            # Part of the field lies past the byte columns for at least some packets
+            lengths = decode_varints(self.column(block, COLUMN_LENGTH), block.count)
+            tail = self.column(block, COLUMN_TAIL)
+        pos = 0
+        for i in range(block.count):
+            time_us = times[i]
+            value = None
+            if lengths is None or offset + size <= lengths[i]:
+                value = 0
+                for k in range(in_prefix):
+                    value |= columns[k][i] << (8 * k)
+                if lengths is not None:
+                    start = pos + offset + in_prefix - block.prefix
+                    for k in range(in_prefix, size):
+                        value |= tail[start + k - in_prefix] << (8 * k)
+            if lengths is not None:
+                pos += lengths[i] - block.prefix
+            if (start_us is None or time_us >= start_us) and (end_us is None or time_us <= end_us):
+                yield time_us, value
+
+
+def archive_paths(path):
+    """Archives of a directory in sequence order, or the file itself"""
+    if not os.path.isdir(path):
+        return [path]
+    archives = []
+    for name in os.listdir(path):
+        match = ARCHIVE_NAME.match(name)
+        if match:
+            archives.append((int(match.group(1)), os.path.join(path, name)))
+    return [archive_path for _, archive_path in sorted(archives)]
+
+
+def closed(segment):
+    """The DLL closed the segment (CAPTURE_SEGMENT_CLOSED), the one being recorded and the spare are left alone"""
+    try:
+        return segment.final
+    except (OSError, ValueError):
+        return False
+
+
+def compact(capture_dir, archive_dir, window_us, delete=False):
+    """Archive the closed segments newer than every existing archive, returns the new archive path (None if nothing to do)"""
+    os.makedirs(archive_dir, exist_ok=True)
+    archived = -1
+    for path in archive_paths(archive_dir):
+        match = ARCHIVE_NAME.match(os.path.basename(path))
+        if match:
+            archived = max(archived, int(match.group(2)))
+
+    store = CaptureStore(capture_dir)
+    segments = [segment for segment in store.segments if segment.sequence > archived and closed(segment)]
+    path = None
+    if segments:
+        path = archive_segments(segments, archive_dir, window_us)
+        archived = segments[-1].sequence
+
+    if delete:
+        # Also what an earlier run archived without deleting
+        for segment in store.segments:
+            if segment.sequence <= archived and closed(segment):
+                os.remove(segment.path)
+                if os.path.exists(segment.index_path):
+                    os.remove(segment.index_path)
+    return path
+
+
+def archive_segments(segments, archive_dir, window_us):
+
+    temp_path = os.path.join(archive_dir, 'archive.tmp')
+    writer = ArchiveWriter(temp_path, window_us)
+    for segment in segments:
+        header_size = segment.read_header()[3]
+        with open(segment.path, 'rb') as f, mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as view:
+            for offset, time_us, message_length in iter_records(view, header_size, len(view)):
+                start = offset + CAPTURE_RECORD_HEADER.size
+                writer.add(segment.sequence, time_us, view[start:start + message_length])
+    writer.close()
+    path = os.path.join(archive_dir, f"archive-{segments[0].sequence:08d}-{segments[-1].sequence:08d}.rpa")
+    os.replace(temp_path, path)
+    return path
+
+
+def cmd_compact(args):
+    archive_dir = args.archive_dir or os.path.join(args.directory, 'archive')
+    path = compact(args.directory, archive_dir, int(args.window * 1000000), args.delete)
+    if not path:
+        print("[+] No closed segments to compact")
+        return 0
+    archive = CaptureArchive(path)
+    print(f"[+] {path}: {archive.record_count} records in {len(archive.blocks)} blocks, {os.path.getsize(path)} bytes")
+    archive.close()
+    return 0
+
+
+def cmd_info(args):
+    for path in archive_paths(args.path):
+        archive = CaptureArchive(path)
+        raw = sum(column[3] for block in archive.blocks for column in block.columns.values())
+        print(f"{os.path.basename(path)}  segments {archive.first_sequence}-{archive.last_sequence}  "
+              f"{format_time(archive.first_time_us)} - {format_time(archive.last_time_us)}  "
+              f"{archive.record_count} records  {len(archive.blocks)} blocks  {raw} -> {os.path.getsize(path)} bytes")
+        if args.blocks:
+            for block in archive.blocks:
+                name = f"0x{block.opcode:04X}" if block.layout == LAYOUT_PACKET else 'raw'
+                print(f"  kind {block.kind:2} {name:6}  {block.count:7} records  {format_time(block.min_time_us)} - "
+                      f"{format_time(block.max_time_us)}  length {block.min_length}-{block.max_length}")
+        archive.close()
+    return 0
+
+
+def cmd_scan(args):
+    kinds = tuple(d for d, wanted in ((SENDPACKET, args.send), (RECVPACKET, args.recv)) if wanted) or (SENDPACKET, RECVPACKET)
+    count = 0
+    for path in archive_paths(args.path):
+        archive = CaptureArchive(path)
+        if (args.start is not None and archive.last_time_us < args.start) or (args.end is not None and archive.first_time_us > args.end):
+            archive.close()
+            continue
+        for block in archive.select(kinds, {args.opcode}, args.start, args.end):
+            if args.offset + args.size > block.max_length:
+                continue
+            for time_us, value in archive.field_values(block, args.offset, args.size, args.start, args.end):
+                if value is None:
+                    continue
+                count += 1
+                if not args.count:
+                    print(f"{format_time(time_us)}  {'>>>' if block.kind == SENDPACKET else '<<<'} 0x{block.opcode:04X}  "
+                          f"{value} (0x{value:0{args.size * 2}X})")
+        archive.close()
+    if args.count:
+        print(count)
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description='RirePE Capture Archive - columnar long-term capture storage')
+    commands = parser.add_subparsers(dest='command', required=True)
+
+    compact_parser = commands.add_parser('compact', help='Archive the closed segments of a capture directory')
+    compact_parser.add_argument('directory', help='Capture directory (CAPTURE_DIR)')
+    compact_parser.add_argument('--archive-dir', help='Where archives go (default: <directory>/archive)')
+    compact_parser.add_argument('--window', type=float, default=DEFAULT_WINDOW_SECONDS,
+                                help=f'Seconds of records per block (default: {DEFAULT_WINDOW_SECONDS})')
+    compact_parser.add_argument('--delete', action='store_true', help='Delete the segments once archived')
+
+    info = commands.add_parser('info', help='List archives (and their blocks)')
+    info.add_argument('path', help='Archive directory or file')
+    info.add_argument('--blocks', action='store_true', help='List every block')
+
+    scan = commands.add_parser('scan', help='Print a field of every packet of an opcode')
+    scan.add_argument('path', help='Archive directory or file')
+    scan.add_argument('--send', action='store_true', help='SEND packets (default: both directions)')
+    scan.add_argument('--recv', action='store_true', help='RECV packets (default: both directions)')
+    scan.add_argument('--opcode', type=lambda v: int(v, 0) & 0xFFFF, required=True)
+    scan.add_argument('--offset', type=lambda v: int(v, 0), required=True, help='Field offset in the packet (opcode included)')
+    scan.add_argument('--size', type=int, choices=(1, 2, 4, 8), default=4, help='Field size (default: 4)')
+    scan.add_argument('--from', dest='start', type=parse_time, help='Start time: HH:MM[:SS] today, ISO date and time, or Unix microseconds')
+    scan.add_argument('--to', dest='end', type=parse_time, help='End time (inclusive)')
+    scan.add_argument('--count', action='store_true', help='Only print the number of values')
+
+    args = parser.parse_args()
+    try:
+        return {'compact': cmd_compact, 'info': cmd_info, 'scan': cmd_scan}[args.command](args)
+    except BrokenPipeError:
+        return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,280 @@
+#!/usr/bin/env python3
+"""
+RirePE pcapng Export
+Converts capture segments, or the live TCP stream, into a pcapng file for Wireshark
+
+Every SEND/RECV packet becomes an Enhanced Packet Block on a LINKTYPE_USER interface (the
+packet bytes, opcode first) with its capture time in microseconds. The direction is in
+epb_flags, the packet id in epb_packetid and the return address in a custom option; format
+traces become custom blocks. Records are streamed from the memory-mapped segments to the
+output, so captures of any size convert without being loaded.
+
+Examples:
+    python capture_pcapng.py captures/ -o session.pcapng
+    python capture_pcapng.py captures/capture-00000012.rpc --no-traces -o send_recv.pcapng
+    python capture_pcapng.py --live 127.0.0.1:9999 -o - | wireshark -k -i -
+"""
+
+import argparse
+import glob
+import mmap
+import os
+import struct
+import sys
+import time
+
+from capture_store import (CAPTURE_SEGMENT_HEADER, CAPTURE_SEGMENT_MAGIC, CAPTURE_RECORD_HEADER, MESSAGE_HEADER,
+                           SENDPACKET, RECVPACKET, capture_segment_paths)
+
+# Block types
+PCAPNG_SECTION_HEADER = 0x0A0D0D0A
+PCAPNG_INTERFACE_DESCRIPTION = 0x00000001
+PCAPNG_ENHANCED_PACKET = 0x00000006
+PCAPNG_CUSTOM_BLOCK = 0x00000BAD     # Copyable custom block
+PCAPNG_BYTE_ORDER_MAGIC = 0x1A2B3C4D
+
+# Options
+OPT_END = 0
+SHB_USERAPPL = 4
+IF_NAME = 2
+IF_DESCRIPTION = 3
+IF_TSRESOL = 9
+EPB_FLAGS = 2
+EPB_PACKETID = 5
+OPT_CUSTOM_BINARY = 2989             # Copyable custom option, binary data
+
+EPB_FLAGS_INBOUND = 0x01
+EPB_FLAGS_OUTBOUND = 0x02
+
+LINKTYPE_USER0 = 147
+LINKTYPE_USER15 = 162
+# RFC 5612 documentation enterprise number, pass --pen to use your own
+DEFAULT_PEN = 32473
+
+# Custom option/block contents after the PEN
+RIREPE_OPTION_ADDRESS = 1            # DWORD field, ULONGLONG return address
+RIREPE_BLOCK_TRACE = 1               # DWORD kind, ULONGLONG time_us, PacketEditorMessage of the trace
+
+TRACE_HEADERS = range(2, 32)         # ENCODE_BEGIN .. UNKNOWN (PacketDefs.h)
+FLUSH_SIZE = 1 << 20
+
+EPB_HEADER = struct.Struct('<IIIIIII')
+# epb_flags, epb_packetid, custom option (PEN, field, address), end of options, block length
+EPB_OPTIONS = struct.Struct('<HHIHHQHHIIQHHI')
+CUSTOM_BLOCK_HEADER = struct.Struct('<IIIIQ')
+PADDING = bytes(4)
+
+
+def pcapng_option(code, value):
+    return struct.pack('<HH', code, len(value)) + value + PADDING[:-len(value) % 4]
+
+
+def pcapng_block(block_type, body):
+    length = 12 + len(body)
+    return struct.pack('<II', block_type, length) + body + struct.pack('<I', length)
+
+
+class PcapngWriter:
+    """One section with one interface, blocks buffered and written in FLUSH_SIZE chunks"""
+
+    def __init__(self, output, linktype=LINKTYPE_USER0, pen=DEFAULT_PEN, traces=True):
+        self.output = output
+        self.pen = pen
+        self.traces = traces
+        self.chunks = []
+        self.buffered = 0
+        self.packets = 0
+        self.trace_blocks = 0
+
+        options = pcapng_option(SHB_USERAPPL, b'RirePE capture_pcapng.py') + struct.pack('<HH', OPT_END, 0)
+        self.write(pcapng_block(PCAPNG_SECTION_HEADER, struct.pack('<IHHq', PCAPNG_BYTE_ORDER_MAGIC, 1, 0, -1) + options))
+        options = (pcapng_option(IF_NAME, b'RirePE') + pcapng_option(IF_DESCRIPTION, b'Game packets captured by the RirePE hooks') +
+                   pcapng_option(IF_TSRESOL, bytes([6])) + struct.pack('<HH', OPT_END, 0))
+        # snaplen 0: no limit
+        self.write(pcapng_block(PCAPNG_INTERFACE_DESCRIPTION, struct.pack('<HHI', linktype, 0, 0) + options))
+
+    def write(self, data):
+        self.chunks.append(data)
+        self.buffered += len(data)
+        if self.buffered >= FLUSH_SIZE:
+            self.flush()
+
+    def flush(self):
+        if self.chunks:
+            self.output.write(b''.join(self.chunks))
+            self.chunks = []
+            self.buffered = 0
+        self.output.flush()
+
+    def add_message(self, time_us, message):
+        """A PacketEditorMessage: SEND/RECV as a packet block, a format trace as a custom block, anything else is skipped"""
+        if len(message) < 16:
+            return
+        header = struct.unpack_from('<I', message)[0]
+        if header in (SENDPACKET, RECVPACKET) and len(message) >= MESSAGE_HEADER.size:
+            _, packet_id, addr, length = MESSAGE_HEADER.unpack_from(message)
+            packet = message[MESSAGE_HEADER.size:MESSAGE_HEADER.size + length]
+            self.add_packet(time_us, header, packet_id, addr, packet)
+        elif self.traces and header in TRACE_HEADERS:
+            body_length = 16 + len(message)
+            padding = PADDING[:-body_length % 4]
+            length = 12 + body_length + len(padding)
+            self.write(CUSTOM_BLOCK_HEADER.pack(PCAPNG_CUSTOM_BLOCK, length, self.pen, RIREPE_BLOCK_TRACE, time_us) +
+                       bytes(message) + padding + struct.pack('<I', length))
+            self.trace_blocks += 1
+
+    def add_packet(self, time_us, direction, packet_id, addr, packet):
+        captured = len(packet)
+        padding = PADDING[:-captured % 4]
+        length = EPB_HEADER.size + captured + len(padding) + EPB_OPTIONS.size
+        flags = EPB_FLAGS_OUTBOUND if direction == SENDPACKET else EPB_FLAGS_INBOUND
+        self.write(EPB_HEADER.pack(PCAPNG_ENHANCED_PACKET, length, 0, time_us >> 32, time_us & 0xFFFFFFFF, captured, captured) +
+                   bytes(packet) + padding +
+                   EPB_OPTIONS.pack(EPB_FLAGS, 4, flags, EPB_PACKETID, 8, packet_id,
+                                    OPT_CUSTOM_BINARY, 16, self.pen, RIREPE_OPTION_ADDRESS, addr, OPT_END, 0, length))
+        self.packets += 1
+
+
+def export_segments(paths, writer):
+    for path in paths:
+        with open(path, 'rb') as f:
+            if os.fstat(f.fileno()).st_size < CAPTURE_SEGMENT_HEADER.size:
+                continue
+            with mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as view:
+                magic, _, header_size = CAPTURE_SEGMENT_HEADER.unpack_from(view)[:3]
+                if magic != CAPTURE_SEGMENT_MAGIC:
+                    raise ValueError(f"{path}: not a capture segment")
+                export_records(view, header_size, writer)
+
+
+def export_records(view, offset, writer):
+    """Packet blocks straight from the mapping, the add_packet path inlined since it runs once per record"""
+    record_header = CAPTURE_RECORD_HEADER.unpack_from
+    message_header = MESSAGE_HEADER.unpack_from
+    epb_header = EPB_HEADER.pack
+    epb_options = EPB_OPTIONS.pack
+    pen = writer.pen
+    end = len(view)
+    chunks = []
+    buffered = 0
+    while offset + CAPTURE_RECORD_HEADER.size <= end:
+        length, message_length, time_us = record_header(view, offset)
+        if length == 0 or offset + length > end or CAPTURE_RECORD_HEADER.size + message_length > length:
+            break
+        message = offset + CAPTURE_RECORD_HEADER.size
+        offset += length
+        if message_length >= MESSAGE_HEADER.size:
+            header, packet_id, addr, packet_length = message_header(view, message)
+            if header <= RECVPACKET:
+                captured = min(packet_length, message_length - MESSAGE_HEADER.size)
+                padding = PADDING[:-captured % 4]
+                block_length = EPB_HEADER.size + captured + len(padding) + EPB_OPTIONS.size
+                start = message + MESSAGE_HEADER.size
+                block = b''.join((epb_header(PCAPNG_ENHANCED_PACKET, block_length, 0, time_us >> 32, time_us & 0xFFFFFFFF, captured, captured),
+                                  view[start:start + captured], padding,
+                                  epb_options(EPB_FLAGS, 4, EPB_FLAGS_OUTBOUND if header == SENDPACKET else EPB_FLAGS_INBOUND,
+                                              EPB_PACKETID, 8, packet_id, OPT_CUSTOM_BINARY, 16, pen, RIREPE_OPTION_ADDRESS, addr,
+                                              OPT_END, 0, block_length)))
+                chunks.append(block)
+                buffered += block_length
+                writer.packets += 1
+                if buffered >= FLUSH_SIZE:
+                    writer.write(b''.join(chunks))
+                    chunks = []
+                    buffered = 0
+                continue
+        if chunks:
+            # Keep the block order
+            writer.write(b''.join(chunks))
+            chunks = []
+            buffered = 0
+        writer.add_message(time_us, view[message:message + message_length])
+    if chunks:
+        writer.write(b''.join(chunks))
+
+
+def export_live(host, port, writer, traces):
+    from tcp_inject_example import RirePETCPClient, SUBSCRIBE_SEND, SUBSCRIBE_RECV, SUBSCRIBE_TRACES
+
+    client = RirePETCPClient(host, port)
+    client.connect()
+    print(f"[+] Connected to {host}:{port}", file=sys.stderr)
+    try:
+        client.subscribe(SUBSCRIBE_SEND | SUBSCRIBE_RECV | (SUBSCRIBE_TRACES if traces else 0))
+        while True:
+            started = time.perf_counter()
+            data = client.recv_message(timeout=0.5)
+            if data is None:
+                # A closed connection returns at once, a timeout doesn't
+                if time.perf_counter() - started < 0.25:
+                    print("[-] Connection closed", file=sys.stderr)
+                    break
+                # Keep a piped Wireshark up to date while the game is idle
+                writer.flush()
+                continue
+            # The stream carries no capture time, packets are stamped when they arrive
+            writer.add_message(time.time_ns() // 1000, data)
+            if not client.pending:
+                writer.flush()
+    finally:
+        client.disconnect()
+
+
+def parse_linktype(value):
+    linktype = int(value, 0)
+    if not LINKTYPE_USER0 <= linktype <= LINKTYPE_USER15:
+        raise argparse.ArgumentTypeError(f"link type must be LINKTYPE_USER0-15 ({LINKTYPE_USER0}-{LINKTYPE_USER15})")
+    return linktype
+
+
+def main():
+    parser = argparse.ArgumentParser(description='RirePE pcapng Export - convert captures for Wireshark')
+    parser.add_argument('sources', nargs='*', help='Capture directories or capture-*.rpc segments')
+    parser.add_argument('--live', metavar='HOST:PORT', help='Export the live TCP stream instead (until Ctrl+C)')
+    parser.add_argument('-o', '--output', required=True, help='pcapng file to write, - for stdout')
+    parser.add_argument('--linktype', type=parse_linktype, default=LINKTYPE_USER0,
+                        help=f'Interface link type, {LINKTYPE_USER0}-{LINKTYPE_USER15} (default: {LINKTYPE_USER0}, LINKTYPE_USER0)')
+    parser.add_argument('--pen', type=int, default=DEFAULT_PEN, help=f'Private Enterprise Number of the custom options and blocks (default: {DEFAULT_PEN})')
+    parser.add_argument('--no-traces', action='store_true', help='Leave the format traces out')
+
+    args = parser.parse_args()
+    if bool(args.sources) == bool(args.live):
+        parser.error('give either capture sources or --live')
+
+    paths = []
+    for source in args.sources:
+        matches = sorted(glob.glob(source)) or [source]
+        for match in matches:
+            if not os.path.exists(match):
+                print(f"[-] {match} not found", file=sys.stderr)
+                return 1
+            paths.extend(capture_segment_paths(match))
+
+    output = sys.stdout.buffer if args.output == '-' else open(args.output, 'wb')
+    writer = PcapngWriter(output, args.linktype, args.pen, not args.no_traces)
+    try:
+        if args.live:
+            host, _, port = args.live.rpartition(':')
+            export_live(host or '127.0.0.1', int(port), writer, not args.no_traces)
+        else:
+            export_segments(paths, writer)
+    except (KeyboardInterrupt, BrokenPipeError):
+        pass
+    except ConnectionResetError as e:
+        print(f"[-] {e}", file=sys.stderr)
+    except (OSError, ValueError) as e:
+        print(f"[-] {e}", file=sys.stderr)
+        return 1
+    finally:
+        try:
+            writer.flush()
+        except BrokenPipeError:
+            pass
+        if output is not sys.stdout.buffer:
+            output.close()
+    print(f"[+] {writer.packets} packets, {writer.trace_blocks} traces written", file=sys.stderr)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
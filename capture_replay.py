@@ -0,0 +1,296 @@
+#!/usr/bin/env python3
+"""
+RirePE Capture Replay
+Re-injects the SEND packets of a recorded session through the DLL's injection queues,
+keeping the original gaps between packets
+
+Sources (read as a stream, a capture of any length doesn't have to fit in memory):
+- Capture segments written by the DLL (CAPTURE_DIR): a directory or capture-*.rpc files
+- Logs written by packet_monitor.py
+
+Examples:
+    python capture_replay.py captures/
+    python capture_replay.py captures/ --speed 4 --skip 0x0029
+    python capture_replay.py session.log --wait-recv 0x007D --timestamp 0x00A5:6
+"""
+
+import argparse
+import glob
+import os
+import re
+import struct
+import sys
+import threading
+import time
+
+from capture_store import capture_segment_paths, iter_capture_packets
+from tcp_inject_example import (RirePETCPClient, SENDPACKET, RECVPACKET, INJECT_ACK,
+                                SUBSCRIBE_RECV, MAX_TIMESTAMP_OFFSETS)
+
+MIN_SPEED = 0.5
+MAX_SPEED = 20.0
+
+REPLAY_QUEUE = 'REPLAY'
+ACK_TIMEOUT = 5.0
+
+
+def iter_monitor_log(path):
+    """(time_us, direction, packet) of the SEND/RECV entries of a packet_monitor.py log"""
+    entry = re.compile(r'^\[\d+\] (\d\d):(\d\d):(\d\d)\.(\d{3}) (>>>|<<<) (SENDPACKET|RECVPACKET)\s*$')
+    day_us = 24 * 3600 * 1000000
+    days = 0
+    last_us = None
+    current = None
+    with open(path, 'r', encoding='utf-8', errors='replace') as f:
+        for line in f:
+            match = entry.match(line)
+            if match:
+                h, m, s, ms = (int(match.group(i)) for i in range(1, 5))
+                time_us = ((h * 60 + m) * 60 + s) * 1000000 + ms * 1000
+                # Logs only carry the time of day
+                if last_us is not None and time_us + days * day_us < last_us:
+                    days += 1
+                last_us = time_us + days * day_us
+                current = (last_us, SENDPACKET if match.group(6) == 'SENDPACKET' else RECVPACKET)
+                continue
+            if current and line.startswith('  Data: '):
+                try:
+                    packet = bytes.fromhex(line[8:].strip())
+                except ValueError:
+                    packet = None
+                if packet is not None:
+                    yield current[0], current[1], packet
+                current = None
+
+
+def iter_recording(sources):
+    """Packets of every source, in the order given"""
+    for source in sources:
+        if os.path.isdir(source) or source.lower().endswith('.rpc'):
+            yield from iter_capture_packets(capture_segment_paths(source))
+        else:
+            yield from iter_monitor_log(source)
+
+
+def opcode_of(packet):
+    return struct.unpack_from('<H', packet)[0] if len(packet) >= 2 else None
+
+
+class CaptureReplay:
+    """Paces recorded SEND packets into REGISTER_QUEUE queues and waits for live RECV packets"""
+
+    def __init__(self, client, speed=1.0, only=None, skip=(), wait_recv=None, wait_timeout=10.0, timestamps=None):
+        self.client = client
+        self.speed = speed
+        self.only = set(only) if only else None
+        self.skip = set(skip)
+        self.wait_recv = wait_recv          # None = don't wait, empty set = every RECV opcode
+        self.wait_timeout = wait_timeout
+        self.timestamps = timestamps or {}  # opcode (or None for the rest) -> timestamp offsets
+
+        # Filled by the receive thread
+        self.lock = threading.Condition()
+        self.live_recv = {}                 # opcode -> RECV packets seen since the replay started
+        self.acked = 0
+        self.failed = 0
+        self.running = False
+
+        self.sent = 0
+        self.next_id = 1
+        self.expected_recv = {}             # opcode -> recorded RECV packets waited for
+        self.wait_timeouts = 0
+        self.last_queue = None
+
+    def queue_for(self, opcode):
+        """Packets with their own timestamp offsets go through their own queue"""
+        return f"{REPLAY_QUEUE}_{opcode:04X}" if opcode in self.timestamps else REPLAY_QUEUE
+
+    def setup(self):
+        self.client.set_acks(True)
+        if self.wait_recv is not None:
+            self.client.subscribe(SUBSCRIBE_RECV, allow=sorted(self.wait_recv) if self.wait_recv else None)
+        else:
+            self.client.subscribe(0)
+        self.client.register_queue(REPLAY_QUEUE, 1, 0, [self.timestamps.get(None, ())])
+        for opcode, offsets in self.timestamps.items():
+            if opcode is not None:
+                self.client.register_queue(self.queue_for(opcode), 1, 0, [offsets])
+
+        self.running = True
+        self.receiver = threading.Thread(target=self.receive, daemon=True)
+        self.receiver.start()
+
+    def teardown(self):
+        self.wait_acked(self.sent)
+        self.client.unregister_queue(REPLAY_QUEUE)
+        for opcode in self.timestamps:
+            if opcode is not None:
+                self.client.unregister_queue(self.queue_for(opcode))
+        self.client.set_acks(False)
+        self.running = False
+        self.receiver.join()
+
+    def receive(self):
+        while self.running:
+            started = time.perf_counter()
+            try:
+                data = self.client.recv_message(timeout=0.5)
+            except OSError:
+                break
+            if data is None:
+                # A closed connection returns at once, a timeout doesn't
+                if time.perf_counter() - started < 0.25:
+                    print("[-] Connection closed")
+                    break
+                continue
+            if len(data) < 4:
+                continue
+            header = struct.unpack_from('<I', data)[0]
+            with self.lock:
+                if header == INJECT_ACK:
+                    ack = self.client.parse_inject_ack(data)
+                    self.acked += 1
+                    if ack['result'] != 'OK':
+                        self.failed += 1
+                        print(f"[-] Packet #{ack['id']} not injected: {ack['result']}")
+                elif header == RECVPACKET and len(data) >= 22:
+                    opcode = struct.unpack_from('<H', data, 20)[0]
+                    self.live_recv[opcode] = self.live_recv.get(opcode, 0) + 1
+                self.lock.notify_all()
+
+    def wait_acked(self, count):
+        """Wait until count injections were acknowledged, false on timeout"""
+        with self.lock:
+            return self.lock.wait_for(lambda: self.acked >= count, ACK_TIMEOUT)
+
+    def wait_for_recv(self, opcode):
+        """Wait until the live session received as many packets of opcode as the recording had so far"""
+        self.expected_recv[opcode] = self.expected_recv.get(opcode, 0) + 1
+        needed = self.expected_recv[opcode]
+        with self.lock:
+            if self.live_recv.get(opcode, 0) >= needed:
+                return False
+            if not self.lock.wait_for(lambda: self.live_recv.get(opcode, 0) >= needed, self.wait_timeout):
+                self.wait_timeouts += 1
+                print(f"[-] RECV 0x{opcode:04X} not received within {self.wait_timeout:g}s, continuing")
+            return True
+
+    def inject(self, opcode, packet):
+        queue = self.queue_for(opcode)
+        # Queues are served side by side, so keep the recorded order when moving to another one
+        if self.last_queue is not None and queue != self.last_queue and not self.wait_acked(self.sent):
+            print("[-] Injections not acknowledged, continuing")
+        self.client.send_inject_group(queue, [[(SENDPACKET, packet, self.next_id)]])
+        self.last_queue = queue
+        self.next_id += 1
+        self.sent += 1
+
+    def run(self, packets):
+        start_us = None
+        start_clock = 0.0
+        skipped = 0
+        for time_us, direction, packet in packets:
+            opcode = opcode_of(packet)
+            if opcode is None:
+                continue
+            if direction == SENDPACKET and ((self.only is not None and opcode not in self.only) or opcode in self.skip):
+                skipped += 1
+                continue
+            waits = direction == RECVPACKET and self.wait_recv is not None and (not self.wait_recv or opcode in self.wait_recv)
+            if direction == RECVPACKET and not waits:
+                continue
+
+            if start_us is None:
+                start_us, start_clock = time_us, time.perf_counter()
+            delay = start_clock + (time_us - start_us) / 1000000.0 / self.speed - time.perf_counter()
+            if delay > 0:
+                time.sleep(delay)
+
+            if waits:
+                # The rest of the recording is timed from when the game actually got the packet
+                if self.wait_for_recv(opcode):
+                    start_us, start_clock = time_us, time.perf_counter()
+                continue
+
+            self.inject(opcode, packet)
+            if self.sent % 100 == 0:
+                print(f"[+] {self.sent} packets injected")
+
+        print(f"[+] Replay done: {self.sent} packets injected, {skipped} filtered out, "
+              f"{self.wait_timeouts} RECV waits timed out")
+
+
+def parse_opcode(value):
+    return int(value, 0) & 0xFFFF
+
+
+def parse_timestamp(value):
+    """OPCODE:OFFSET[,OFFSET...] or *:OFFSET[,...] for every other opcode"""
+    opcode, _, offsets = value.partition(':')
+    offsets = [int(offset, 0) for offset in offsets.split(',') if offset]
+    if not offsets or len(offsets) > MAX_TIMESTAMP_OFFSETS:
+        raise argparse.ArgumentTypeError(f"expected OPCODE:OFFSET[,OFFSET...] with 1-{MAX_TIMESTAMP_OFFSETS} offsets")
+    return (None if opcode == '*' else parse_opcode(opcode)), offsets
+
+
+def parse_speed(value):
+    speed = float(value)
+    if not MIN_SPEED <= speed <= MAX_SPEED:
+        raise argparse.ArgumentTypeError(f"speed must be between {MIN_SPEED:g} and {MAX_SPEED:g}")
+    return speed
+
+
+def main():
+    parser = argparse.ArgumentParser(description='RirePE Capture Replay - re-inject a recorded session')
+    parser.add_argument('sources', nargs='+', help='Capture directory, capture-*.rpc files or packet_monitor.py logs')
+    parser.add_argument('--host', default='127.0.0.1', help='Server host (default: 127.0.0.1)')
+    parser.add_argument('--port', type=int, default=9999, help='Server port (default: 9999)')
+    parser.add_argument('--speed', type=parse_speed, default=1.0, help='Replay speed, 0.5 to 20 (default: 1)')
+    parser.add_argument('--only', type=parse_opcode, action='append', help='Only replay this SEND opcode (repeatable)')
+    parser.add_argument('--skip', type=parse_opcode, action='append', default=[], help='Don\'t replay this SEND opcode (repeatable)')
+    parser.add_argument('--wait-recv', action='append', metavar='OPCODE',
+                        help='Wait for the game to receive this recorded RECV opcode before going on (repeatable, "all" for every RECV)')
+    parser.add_argument('--wait-timeout', type=float, default=10.0, help='Seconds to wait for a RECV packet (default: 10)')
+    parser.add_argument('--timestamp', type=parse_timestamp, action='append', default=[], metavar='OPCODE:OFFSET[,OFFSET]',
+                        help='Have the DLL write GetTickCount() at these offsets of this opcode when injecting it (repeatable, * = every other opcode)')
+
+    args = parser.parse_args()
+
+    sources = []
+    for source in args.sources:
+        matches = glob.glob(source)
+        sources.extend(sorted(matches) if matches else [source])
+    for source in sources:
+        if not os.path.exists(source):
+            print(f"[-] {source} not found")
+            return 1
+
+    wait_recv = None
+    if args.wait_recv:
+        wait_recv = set() if 'all' in args.wait_recv else {parse_opcode(opcode) for opcode in args.wait_recv}
+
+    client = RirePETCPClient(args.host, args.port)
+    try:
+        client.connect()
+    except OSError as e:
+        print(f"[-] Failed to connect to {args.host}:{args.port}: {e}")
+        return 1
+    print(f"[+] Connected to {args.host}:{args.port}")
+
+    replay = CaptureReplay(client, args.speed, args.only, args.skip, wait_recv, args.wait_timeout, dict(args.timestamp))
+    try:
+        replay.setup()
+        replay.run(iter_recording(sources))
+        replay.teardown()
+        if replay.failed:
+            print(f"[-] {replay.failed} packets were not injected")
+    except KeyboardInterrupt:
+        print("\n[+] Stopped by user")
+    finally:
+        client.disconnect()
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
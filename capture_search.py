@@ -0,0 +1,335 @@
+#!/usr/bin/env python3
+"""
+RirePE Capture Search
+Finds the SEND/RECV packets containing a byte pattern in capture segments and archives
+
+Patterns use the AobScan syntax: hex bytes, ?? for any byte, and ? for one nibble
+("1? ?F" matches 0x10-0x1F followed by any byte ending in F); spaces are ignored.
+Files are searched side by side in worker processes and matches are printed as they are found,
+with the bytes around them.
+
+Examples:
+    python capture_search.py "E8 03 00 00" captures/
+    python capture_search.py "10 00 ?? ?? 4? 42 0F" captures/ captures/archive/ --send --context 16
+    python capture_search.py "7D 00" captures/archive/ --recv --from 2026-09-01 --count
+"""
+
+import argparse
+import bisect
+import mmap
+import multiprocessing
+import os
+import re
+import struct
+import sys
+
+from capture_store import (CAPTURE_SEGMENT_HEADER, CAPTURE_SEGMENT_NAME, CAPTURE_RECORD_HEADER, MESSAGE_HEADER,
+                           SENDPACKET, RECVPACKET, capture_segment_paths, iter_records, parse_time, format_time)
+from capture_archive import CaptureArchive, ARCHIVE_NAME, LAYOUT_PACKET, archive_paths
+
+DEFAULT_CONTEXT = 8
+RESULT_BATCH = 256                   # Matches per message from a worker
+RESULT_QUEUE_BATCHES = 4             # Batches waiting per worker before it blocks
+
+
+class CaptureMatch:
+    __slots__ = ('path', 'time_us', 'direction', 'id', 'opcode', 'offset', 'length', 'before', 'data', 'after')
+
+    def __init__(self, path, time_us, direction, message_id, packet, offset, size, context):
+        self.path = path
+        self.time_us = time_us
+        self.direction = direction
+        self.id = message_id
+        self.opcode = struct.unpack_from('<H', packet)[0] if len(packet) >= 2 else None
+        self.offset = offset                          # Match offset in the packet
+        self.length = len(packet)
+        self.before = bytes(packet[max(offset - context, 0):offset])
+        self.data = bytes(packet[offset:offset + size])
+        self.after = bytes(packet[offset + size:offset + size + context])
+
+
+class AobPattern:
+    """AobScan pattern, searched for by its longest run of fixed bytes and checked with a regular expression"""
+
+    def __init__(self, aob):
+        digits = []
+        for c in aob:
+            if c == ' ':
+                continue
+            if c in '0123456789abcdefABCDEF':
+                digits.append(c.upper())
+            elif c in '?*':
+                digits.append('?')
+            else:
+                raise ValueError(f"invalid character {c!r} in pattern")
+        if len(digits) < 2 or len(digits) % 2:
+            raise ValueError("pattern must be whole bytes")
+
+        self.text = aob
+        self.size = len(digits) // 2
+        parts = []
+        fixed = []                                    # Byte value, or None where the byte isn't fully known
+        for i in range(0, len(digits), 2):
+            high, low = digits[i], digits[i + 1]
+            if high != '?' and low != '?':
+                value = int(high + low, 16)
+                parts.append(re.escape(bytes([value])))
+                fixed.append(value)
+                continue
+            fixed.append(None)
+            if high == '?' and low == '?':
+                parts.append(b'.')
+            elif high == '?':
+                parts.append(b'[' + b''.join(re.escape(bytes([(h << 4) | int(low, 16)])) for h in range(16)) + b']')
+            else:
+                parts.append(b'[' + b''.join(re.escape(bytes([(int(high, 16) << 4) | l])) for l in range(16)) + b']')
+        self.regex = re.compile(b''.join(parts), re.DOTALL)
+
+        # Longest run of fixed bytes
+        self.anchor = b''
+        self.anchor_offset = 0
+        start = None
+        for i, value in enumerate(fixed + [None]):
+            if value is not None and start is None:
+                start = i
+            elif value is None and start is not None:
+                if i - start > len(self.anchor):
+                    self.anchor = bytes(fixed[start:i])
+                    self.anchor_offset = start
+                start = None
+        self.exact = len(self.anchor) == self.size
+
+    def finditer(self, buffer, start=0, end=None):
+        """Offsets of every (overlapping) match in buffer[start:end]"""
+        end = len(buffer) if end is None else end
+        if not self.anchor:
+            # No byte is fully known, every position is a candidate
+            match = self.regex.search(buffer, start, end)
+            while match:
+                yield match.start()
+                match = self.regex.search(buffer, match.start() + 1, end)
+            return
+        find = buffer.find
+        anchor_end = end - (self.size - self.anchor_offset - len(self.anchor))
+        pos = find(self.anchor, start + self.anchor_offset, anchor_end)
+        while pos >= 0:
+            match_start = pos - self.anchor_offset
+            if self.exact or self.regex.match(buffer, match_start, end):
+                yield match_start
+            pos = find(self.anchor, pos + 1, anchor_end)
+
+
+class SearchFilter:
+    def __init__(self, directions=(SENDPACKET, RECVPACKET), opcodes=None, start_us=None, end_us=None):
+        self.directions = directions
+        self.opcodes = opcodes
+        self.start_us = start_us
+        self.end_us = end_us
+
+    def accepts(self, direction, packet, time_us):
+        if direction not in self.directions:
+            return False
+        if self.opcodes is not None and (len(packet) < 2 or struct.unpack_from('<H', packet)[0] not in self.opcodes):
+            return False
+        return (self.start_us is None or time_us >= self.start_us) and (self.end_us is None or time_us <= self.end_us)
+
+
+def search_segment(path, pattern, search_filter, context):
+    """Matches of a capture segment: the whole mapping is searched, records are only walked if something matched"""
+    with open(path, 'rb') as f, mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as view:
+        header_size = CAPTURE_SEGMENT_HEADER.unpack_from(view)[2]
+        starts = None
+        for pos in pattern.finditer(view, header_size):
+            if starts is None:
+                # Packet bounds of the SEND/RECV records
+                starts, ends, records = [], [], []
+                for offset, time_us, message_length in iter_records(view, header_size, len(view)):
+                    message = offset + CAPTURE_RECORD_HEADER.size
+                    if message_length < MESSAGE_HEADER.size:
+                        continue
+                    header, message_id, _, length = MESSAGE_HEADER.unpack_from(view, message)
+                    if header not in (SENDPACKET, RECVPACKET):
+                        continue
+                    starts.append(message + MESSAGE_HEADER.size)
+                    ends.append(message + MESSAGE_HEADER.size + min(length, message_length - MESSAGE_HEADER.size))
+                    records.append((time_us, header, message_id))
+            i = bisect.bisect_right(starts, pos) - 1
+            if i < 0 or pos + pattern.size > ends[i]:
+                continue
+            time_us, direction, message_id = records[i]
+            packet = view[starts[i]:ends[i]]
+            if search_filter.accepts(direction, packet, time_us):
+                yield CaptureMatch(path, time_us, direction, message_id, packet, pos - starts[i], pattern.size, context)
+
+
+def search_archive(path, pattern, search_filter, context):
+    """Matches of an archive: blocks are pruned on the directory, the packets of the others searched as one buffer"""
+    archive = CaptureArchive(path)
+    try:
+        for block in archive.select(search_filter.directions, search_filter.opcodes, search_filter.start_us, search_filter.end_us):
+            if block.layout != LAYOUT_PACKET or block.max_length < pattern.size:
+                continue
+            records = list(archive.records(block))
+            buffer = b''.join(record[4] for record in records)
+            starts = []
+            pos = 0
+            for record in records:
+                starts.append(pos)
+                pos += len(record[4])
+            for pos in pattern.finditer(buffer):
+                i = bisect.bisect_right(starts, pos) - 1
+                offset = pos - starts[i]
+                time_us, direction, message_id, _, packet = records[i]
+                if offset + pattern.size <= len(packet) and search_filter.accepts(direction, packet, time_us):
+                    yield CaptureMatch(path, time_us, direction, message_id, packet, offset, pattern.size, context)
+    finally:
+        archive.close()
+
+
+def search_file(path, pattern, search_filter, context):
+    if path.lower().endswith('.rpa'):
+        return search_archive(path, pattern, search_filter, context)
+    return search_segment(path, pattern, search_filter, context)
+
+
+def search_paths(paths):
+    """Segments and archives of the arguments: files as given, directories with their archive/ subdirectory"""
+    files = []
+    for path in paths:
+        if not os.path.isdir(path):
+            files.append(path)
+            continue
+        archives = archive_paths(path)
+        if os.path.isdir(os.path.join(path, 'archive')):
+            archives += archive_paths(os.path.join(path, 'archive'))
+        # Segments compacted but not deleted yet are searched in their archive only
+        archived = [tuple(int(n) for n in ARCHIVE_NAME.match(os.path.basename(archive)).groups()) for archive in archives]
+        for segment in capture_segment_paths(path):
+            sequence = int(CAPTURE_SEGMENT_NAME.match(os.path.basename(segment)).group(1))
+            if not any(first <= sequence <= last for first, last in archived):
+                files.append(segment)
+        files.extend(archives)
+    return [path for path in files if os.path.isfile(path)]
+
+
+def search_worker(tasks, results, aob, search_filter, context):
+    pattern = AobPattern(aob)
+    while True:
+        path = tasks.get()
+        if path is None:
+            break
+        batch = []
+        try:
+            for match in search_file(path, pattern, search_filter, context):
+                batch.append(match)
+                if len(batch) >= RESULT_BATCH:
+                    results.put(('matches', batch))
+                    batch = []
+        except (OSError, ValueError, struct.error) as e:
+            results.put(('error', f"{path}: {e}"))
+        if batch:
+            results.put(('matches', batch))
+    results.put(('done', None))
+
+
+def search(files, aob, search_filter, context=DEFAULT_CONTEXT, jobs=None):
+    """CaptureMatch of every match, streamed; in file order with one job, otherwise in recording order per file only"""
+    jobs = max(1, min(jobs or os.cpu_count() or 1, len(files)))
+    if jobs == 1:
+        pattern = AobPattern(aob)
+        for path in files:
+            try:
+                yield from search_file(path, pattern, search_filter, context)
+            except (OSError, ValueError, struct.error) as e:
+                print(f"[-] {path}: {e}", file=sys.stderr)
+        return
+
+    tasks = multiprocessing.Queue()
+    for path in files:
+        tasks.put(path)
+    for _ in range(jobs):
+        tasks.put(None)
+    # Bounded, so workers wait for a slow consumer instead of piling up matches
+    results = multiprocessing.Queue(jobs * RESULT_QUEUE_BATCHES)
+    workers = [multiprocessing.Process(target=search_worker, args=(tasks, results, aob, search_filter, context), daemon=True)
+               for _ in range(jobs)]
+    for worker in workers:
+        worker.start()
+    try:
+        running = jobs
+        while running:
+            kind, value = results.get()
+            if kind == 'done':
+                running -= 1
+            elif kind == 'error':
+                print(f"[-] {value}", file=sys.stderr)
+            else:
+                yield from value
+    finally:
+        for worker in workers:
+            if worker.is_alive():
+                worker.terminate()
+            worker.join()
+
+
+def format_match(match):
+    direction = '>>>' if match.direction == SENDPACKET else '<<<'
+    opcode = f"0x{match.opcode:04X}" if match.opcode is not None else '------'
+    before = ' '.join(f"{b:02X}" for b in match.before)
+    data = ' '.join(f"{b:02X}" for b in match.data)
+    after = ' '.join(f"{b:02X}" for b in match.after)
+    context = f"{'.. ' if match.offset > len(match.before) else ''}{before} [{data}] {after}"
+    if match.offset + len(match.data) + len(match.after) < match.length:
+        context += ' ..'
+    return (f"{format_time(match.time_us)}  {direction} {opcode}  #{match.id:<8} +{match.offset:<5} "
+            f"{context.strip()}  ({os.path.basename(match.path)})")
+
+
+def main():
+    parser = argparse.ArgumentParser(description='RirePE Capture Search - find packets containing a byte pattern')
+    parser.add_argument('pattern', help='AobScan pattern, e.g. "10 00 ?? ?? 4? 42"')
+    parser.add_argument('paths', nargs='+', help='Capture directories, capture-*.rpc segments, archive directories or .rpa archives')
+    parser.add_argument('--send', action='store_true', help='SEND packets (default: both directions)')
+    parser.add_argument('--recv', action='store_true', help='RECV packets (default: both directions)')
+    parser.add_argument('--opcode', type=lambda v: int(v, 0) & 0xFFFF, action='append', help='Only this opcode (repeatable)')
+    parser.add_argument('--from', dest='start', type=parse_time, help='Start time: HH:MM[:SS] today, ISO date and time, or Unix microseconds')
+    parser.add_argument('--to', dest='end', type=parse_time, help='End time (inclusive)')
+    parser.add_argument('--context', type=int, default=DEFAULT_CONTEXT, help=f'Bytes shown around a match (default: {DEFAULT_CONTEXT})')
+    parser.add_argument('--jobs', type=int, help='Worker processes (default: one per CPU, 1 keeps the recording order)')
+    parser.add_argument('--limit', type=int, help='Stop after this many matches')
+    parser.add_argument('--count', action='store_true', help='Only print the number of matches')
+
+    args = parser.parse_args()
+    try:
+        AobPattern(args.pattern)
+    except ValueError as e:
+        print(f"[-] Invalid pattern: {e}")
+        return 1
+
+    files = search_paths(args.paths)
+    if not files:
+        print("[-] No capture segments or archives found")
+        return 1
+
+    directions = tuple(d for d, wanted in ((SENDPACKET, args.send), (RECVPACKET, args.recv)) if wanted) or (SENDPACKET, RECVPACKET)
+    search_filter = SearchFilter(directions, set(args.opcode) if args.opcode else None, args.start, args.end)
+    count = 0
+    matches = search(files, args.pattern, search_filter, max(args.context, 0), args.jobs)
+    try:
+        for match in matches:
+            count += 1
+            if not args.count:
+                print(format_match(match))
+            if args.limit and count >= args.limit:
+                break
+    except (BrokenPipeError, KeyboardInterrupt):
+        pass
+    finally:
+        matches.close()
+    if args.count:
+        print(count)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
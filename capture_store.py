@@ -0,0 +1,509 @@
+#!/usr/bin/env python3
+"""
+RirePE Capture Store
+Reads the capture segments the DLL records into CAPTURE_DIR and answers opcode/time-range
+queries through the index written next to every closed segment (capture-<sequence>.rpx)
+
+Only the indexes and the segments that can hold matches are memory-mapped; a segment
+without an index (the one being recorded, or one left behind by a crash) is indexed in memory.
+
+Examples:
+    python capture_store.py info captures/
+    python capture_store.py query captures/ --recv --opcode 0x007D --from 14:00 --to 14:05
+    python capture_store.py query captures/ --opcode 0x0010 --opcode 0x0020 --count
+    python capture_store.py index captures/
+"""
+
+import argparse
+import heapq
+import mmap
+import os
+import re
+import struct
+import sys
+from array import array
+from datetime import date, datetime, time as dtime
+
+SENDPACKET = 0
+RECVPACKET = 1
+
+# Capture segment format (PacketCapture.h)
+CAPTURE_SEGMENT_MAGIC = 0x53455052
+CAPTURE_SEGMENT_CLOSED = 0x01
+CAPTURE_SEGMENT_HEADER = struct.Struct('<IHHIIQIIQQ16x')
+CAPTURE_RECORD_HEADER = struct.Struct('<IIQ')
+CAPTURE_SEGMENT_NAME = re.compile(r'^capture-(\d{8})\.rpc$', re.IGNORECASE)
+
+# Capture index format (PacketCapture.h)
+CAPTURE_INDEX_MAGIC = 0x49455052
+CAPTURE_INDEX_VERSION = 1
+CAPTURE_INDEX_TIME_STEP = 64
+CAPTURE_OPCODE_BITMAP_SIZE = 0x10000 // 8
+CAPTURE_INDEX_HEADER = struct.Struct('<IHHIIQQQIIII16x')
+CAPTURE_TIME_ENTRY = struct.Struct('<QII')
+CAPTURE_OPCODE_ENTRY = struct.Struct('<HHII')
+
+# PacketEditorMessage: header, id, addr, Binary.length, Binary.packet
+MESSAGE_HEADER = struct.Struct('<IIQI')
+
+
+def capture_segment_paths(path):
+    """Segment files of a capture directory in sequence order, or the file itself"""
+    if not os.path.isdir(path):
+        return [path]
+    segments = []
+    for name in os.listdir(path):
+        match = CAPTURE_SEGMENT_NAME.match(name)
+        if match:
+            segments.append((int(match.group(1)), os.path.join(path, name)))
+    return [segment_path for _, segment_path in sorted(segments)]
+
+
+def iter_records(view, offset, end):
+    """(offset, time_us, message_length) of the records of a segment view from offset, stops at the first unwritten record"""
+    end = min(end, len(view))
+    while offset + CAPTURE_RECORD_HEADER.size <= end:
+        length, message_length, time_us = CAPTURE_RECORD_HEADER.unpack_from(view, offset)
+        if length == 0 or offset + length > end or CAPTURE_RECORD_HEADER.size + message_length > length:
+            break
+        yield offset, time_us, message_length
+        offset += length
+
+
+def packet_opcode(view, offset, message_length):
+    """(direction, opcode) of a SEND/RECV record, None for traces"""
+    if message_length < MESSAGE_HEADER.size + 2:
+        return None
+    header, _, _, length = MESSAGE_HEADER.unpack_from(view, offset + CAPTURE_RECORD_HEADER.size)
+    if header not in (SENDPACKET, RECVPACKET) or length < 2:
+        return None
+    return header, struct.unpack_from('<H', view, offset + CAPTURE_RECORD_HEADER.size + MESSAGE_HEADER.size)[0]
+
+
+def iter_capture_segment(path):
+    """(time_us, message) of every record of a segment file"""
+    with open(path, 'rb') as f:
+        if os.fstat(f.fileno()).st_size < CAPTURE_SEGMENT_HEADER.size:
+            return
+        with mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as view:
+            magic, _, header_size = CAPTURE_SEGMENT_HEADER.unpack_from(view)[:3]
+            if magic != CAPTURE_SEGMENT_MAGIC:
+                raise ValueError(f"{path}: not a capture segment")
+            for offset, time_us, message_length in iter_records(view, header_size, len(view)):
+                start = offset + CAPTURE_RECORD_HEADER.size
+                yield time_us, view[start:start + message_length]
+
+
+def iter_capture_packets(paths):
+    """(time_us, direction, packet) of the SEND/RECV messages of capture segments, traces are skipped"""
+    for path in paths:
+        for time_us, message in iter_capture_segment(path):
+            if len(message) < MESSAGE_HEADER.size:
+                continue
+            header, _, _, length = MESSAGE_HEADER.unpack_from(message)
+            if header not in (SENDPACKET, RECVPACKET):
+                continue
+            yield time_us, header, message[MESSAGE_HEADER.size:MESSAGE_HEADER.size + length]
+
+
+def build_index(view, sequence, header_size, end_offset):
+    """Index of a segment view, in the .rpx format the DLL writes"""
+    bitmaps = bytearray(2 * CAPTURE_OPCODE_BITMAP_SIZE)
+    times = []
+    opcode_offsets = {}
+    record_count = 0
+    first_time_us = last_time_us = 0
+    end = header_size
+    for offset, time_us, message_length in iter_records(view, header_size, end_offset):
+        if record_count % CAPTURE_INDEX_TIME_STEP == 0:
+            times.append(CAPTURE_TIME_ENTRY.pack(time_us, offset, record_count))
+        if record_count == 0:
+            first_time_us = time_us
+        last_time_us = time_us
+        record_count += 1
+        end = offset + CAPTURE_RECORD_HEADER.size + message_length
+        end = (end + 7) & ~7
+        key = packet_opcode(view, offset, message_length)
+        if key:
+            direction, opcode = key
+            bitmaps[direction * CAPTURE_OPCODE_BITMAP_SIZE + (opcode >> 3)] |= 1 << (opcode & 7)
+            opcode_offsets.setdefault(key, array('I')).append(offset)
+
+    entries = []
+    offsets = array('I')
+    for (direction, opcode), values in sorted(opcode_offsets.items()):
+        entries.append(CAPTURE_OPCODE_ENTRY.pack(direction, opcode, len(offsets), len(values)))
+        offsets.extend(values)
+    if sys.byteorder != 'little':
+        offsets.byteswap()
+    header = CAPTURE_INDEX_HEADER.pack(CAPTURE_INDEX_MAGIC, CAPTURE_INDEX_VERSION, CAPTURE_INDEX_HEADER.size, sequence,
+                                       record_count, first_time_us, last_time_us, end, CAPTURE_INDEX_TIME_STEP,
+                                       len(times), len(entries), len(offsets))
+    return b''.join([header, bytes(bitmaps)] + times + entries + [offsets.tobytes()])
+
+
+class CaptureIndex:
+    """Index of one segment over a .rpx mapping or a built index"""
+
+    def __init__(self, buffer):
+        self.buffer = buffer
+        (magic, version, header_size, self.sequence, self.record_count, self.first_time_us, self.last_time_us,
+         self.end_offset, self.time_step, time_count, opcode_count, offset_count) = CAPTURE_INDEX_HEADER.unpack_from(buffer)
+        if magic != CAPTURE_INDEX_MAGIC or version != CAPTURE_INDEX_VERSION:
+            raise ValueError("not a capture index")
+        self.bitmaps = header_size
+        self.times = self.bitmaps + 2 * CAPTURE_OPCODE_BITMAP_SIZE
+        self.time_count = time_count
+        self.opcodes = self.times + time_count * CAPTURE_TIME_ENTRY.size
+        self.opcode_count = opcode_count
+        self.offsets = self.opcodes + opcode_count * CAPTURE_OPCODE_ENTRY.size
+        if self.offsets + offset_count * 4 > len(buffer):
+            raise ValueError("truncated capture index")
+        self.directory = None
+
+    def has_opcode(self, direction, opcode):
+        return bool(self.buffer[self.bitmaps + direction * CAPTURE_OPCODE_BITMAP_SIZE + (opcode >> 3)] & (1 << (opcode & 7)))
+
+    def opcode_offsets(self, direction, opcode):
+        """Record offsets of one opcode, ascending"""
+        if not self.has_opcode(direction, opcode):
+            return array('I')
+        if self.directory is None:
+            self.directory = {(d, o): (first, count) for d, o, first, count in
+                              CAPTURE_OPCODE_ENTRY.iter_unpack(self.buffer[self.opcodes:self.offsets])}
+        first, count = self.directory.get((direction, opcode), (0, 0))
+        offsets = array('I', self.buffer[self.offsets + first * 4:self.offsets + (first + count) * 4])
+        if sys.byteorder != 'little':
+            offsets.byteswap()
+        return offsets
+
+    def seek(self, time_us):
+        """Offset of a record at or before the first record at time_us"""
+        lo, hi = 0, self.time_count
+        while lo < hi:
+            mid = (lo + hi) // 2
+            if CAPTURE_TIME_ENTRY.unpack_from(self.buffer, self.times + mid * CAPTURE_TIME_ENTRY.size)[0] < time_us:
+                lo = mid + 1
+            else:
+                hi = mid
+        entry = max(lo - 1, 0)
+        return CAPTURE_TIME_ENTRY.unpack_from(self.buffer, self.times + entry * CAPTURE_TIME_ENTRY.size)[1] if self.time_count else None
+
+
+class CaptureRecord:
+    __slots__ = ('sequence', 'offset', 'time_us', 'direction', 'id', 'addr', 'message')
+
+    def __init__(self, sequence, offset, time_us, message):
+        self.sequence = sequence
+        self.offset = offset
+        self.time_us = time_us
+        self.message = message
+        self.direction, self.id, self.addr = struct.unpack_from('<IIQ', message) if len(message) >= 16 else (None, 0, 0)
+
+    @property
+    def packet(self):
+        """Packet bytes of a SEND/RECV record"""
+        length = struct.unpack_from('<I', self.message, 16)[0]
+        return self.message[MESSAGE_HEADER.size:MESSAGE_HEADER.size + length]
+
+    @property
+    def opcode(self):
+        return struct.unpack_from('<H', self.message, MESSAGE_HEADER.size)[0] if self.direction in (SENDPACKET, RECVPACKET) and len(self.message) >= MESSAGE_HEADER.size + 2 else None
+
+
+class CaptureSegment:
+    def __init__(self, path, sequence):
+        self.path = path
+        self.sequence = sequence
+        self.index_path = os.path.splitext(path)[0] + '.rpx'
+        self.header = None          # (start_time_us, flags, end_offset, header_size)
+        self.next_start_us = None   # Start of the next segment, bounds this one's records
+        self.newest = False         # The newest segment recorded to, it may still be
+
+    @property
+    def final(self):
+        """No more records will be added, the DLL closed it"""
+        return bool(self.read_header()[1] & CAPTURE_SEGMENT_CLOSED)
+
+    @property
+    def activated(self):
+        """Recorded to at some point, the spare the DLL prepares ahead has no start time and no records"""
+        start_time_us, _, _, header_size = self.read_header()
+        return bool(start_time_us) or self.record_at(header_size)
+
+    def record_at(self, offset):
+        """A record was written at offset"""
+        with open(self.path, 'rb') as f:
+            f.seek(offset)
+            data = f.read(CAPTURE_RECORD_HEADER.size)
+        return len(data) == CAPTURE_RECORD_HEADER.size and CAPTURE_RECORD_HEADER.unpack(data)[0] != 0
+
+    def read_header(self):
+        if self.header is None:
+            with open(self.path, 'rb') as f:
+                data = f.read(CAPTURE_SEGMENT_HEADER.size)
+            if len(data) < CAPTURE_SEGMENT_HEADER.size:
+                raise ValueError(f"{self.path}: not a capture segment")
+            magic, _, header_size, _, _, start_time_us, _, flags, end_offset, _ = CAPTURE_SEGMENT_HEADER.unpack(data)
+            if magic != CAPTURE_SEGMENT_MAGIC:
+                raise ValueError(f"{self.path}: not a capture segment")
+            self.header = (start_time_us, flags, end_offset, header_size)
+        return self.header
+
+    def open_index(self):
+        """(index, mapping to close) from the .rpx file, None if there is none or it is out of date"""
+        try:
+            if not self.final:
+                return None
+            with open(self.index_path, 'rb') as f:
+                mapping = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        except (OSError, ValueError):
+            return None
+        try:
+            index = CaptureIndex(mapping)
+            end_offset = self.read_header()[2]
+            # An index written while the segment was still recorded to stops short of its records
+            if index.sequence == self.sequence and index.end_offset >= end_offset and not self.record_at(index.end_offset):
+                return index, mapping
+        except (OSError, ValueError):
+            pass
+        mapping.close()
+        return None
+
+
+class CaptureStore:
+    """Segments of a capture directory"""
+
+    def __init__(self, directory):
+        self.directory = directory
+        self.segments = []
+        for path in capture_segment_paths(directory):
+            match = CAPTURE_SEGMENT_NAME.match(os.path.basename(path))
+            if match:
+                self.segments.append(CaptureSegment(path, int(match.group(1))))
+        for segment in reversed(self.segments):
+            try:
+                if segment.activated:
+                    segment.newest = True
+                    break
+            except (OSError, ValueError):
+                continue
+
+    def segment_bounds(self, i):
+        """Time range a segment may hold without opening it (None = unknown)"""
+        segment = self.segments[i]
+        start_us = segment.read_header()[0]
+        if segment.next_start_us is None:
+            for later in self.segments[i + 1:]:
+                try:
+                    if later.activated:
+                        segment.next_start_us = later.read_header()[0]
+                        break
+                except (OSError, ValueError):
+                    continue
+        return start_us, segment.next_start_us
+
+    def query(self, directions=(SENDPACKET, RECVPACKET), opcodes=None, start_us=None, end_us=None):
+        """CaptureRecord of every record matching, in recording order; opcodes None = every record (traces included)"""
+        for i, segment in enumerate(self.segments):
+            try:
+                if not segment.activated:
+                    continue
+                seg_start, seg_end = self.segment_bounds(i)
+            except (OSError, ValueError):
+                continue
+            # Records are timed from the segment start; a packet queued just before a rotation can be a little earlier
+            if end_us is not None and seg_start > end_us + 1000000:
+                break
+            if start_us is not None and seg_end is not None and seg_end < start_us:
+                continue
+            yield from self.query_segment(segment, directions, opcodes, start_us, end_us)
+
+    def query_segment(self, segment, directions, opcodes, start_us, end_us):
+        opened = segment.open_index()
+        index_mapping = None
+        try:
+            with open(segment.path, 'rb') as f, mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as view:
+                _, _, end_offset, header_size = segment.read_header()
+                if opened:
+                    index, index_mapping = opened
+                else:
+                    index = CaptureIndex(build_index(view, segment.sequence, header_size, len(view)))
+                if not index.record_count:
+                    return
+                if (start_us is not None and index.last_time_us < start_us) or (end_us is not None and index.first_time_us > end_us):
+                    return
+
+                def record_time(offset):
+                    return CAPTURE_RECORD_HEADER.unpack_from(view, offset)[2]
+
+                def make(offset):
+                    _, message_length, time_us = CAPTURE_RECORD_HEADER.unpack_from(view, offset)
+                    start = offset + CAPTURE_RECORD_HEADER.size
+                    return CaptureRecord(segment.sequence, offset, time_us, view[start:start + message_length])
+
+                if opcodes is not None:
+                    lists = []
+                    for direction in directions:
+                        for opcode in opcodes:
+                            offsets = index.opcode_offsets(direction, opcode)
+                            if offsets:
+                                lo = 0 if start_us is None else lower_bound(offsets, start_us, record_time)
+                                hi = len(offsets) if end_us is None else lower_bound(offsets, end_us + 1, record_time)
+                                if lo < hi:
+                                    lists.append(offsets[lo:hi])
+                    for offset in heapq.merge(*lists):
+                        yield make(offset)
+                    return
+
+                offset = header_size if start_us is None else index.seek(start_us)
+                for offset, time_us, message_length in iter_records(view, offset, index.end_offset):
+                    if start_us is not None and time_us < start_us:
+                        continue
+                    if end_us is not None and time_us > end_us:
+                        break
+                    record = make(offset)
+                    if record.direction in directions or (record.direction not in (SENDPACKET, RECVPACKET) and len(directions) == 2):
+                        yield record
+        finally:
+            if index_mapping is not None:
+                index_mapping.close()
+
+    def write_indexes(self, rebuild=False):
+        """Write the index of every final segment that lacks one, returns the sequences indexed"""
+        written = []
+        for segment in self.segments:
+            if not segment.final:
+                continue
+            opened = None if rebuild else segment.open_index()
+            if opened:
+                opened[1].close()
+                continue
+            with open(segment.path, 'rb') as f, mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as view:
+                header_size = segment.read_header()[3]
+                data = build_index(view, segment.sequence, header_size, len(view))
+            temp_path = segment.index_path + '.tmp'
+            with open(temp_path, 'wb') as f:
+                f.write(data)
+            os.replace(temp_path, segment.index_path)
+            written.append(segment.sequence)
+        return written
+
+
+def lower_bound(offsets, time_us, record_time):
+    """First position in offsets whose record is at or after time_us"""
+    lo, hi = 0, len(offsets)
+    while lo < hi:
+        mid = (lo + hi) // 2
+        if record_time(offsets[mid]) < time_us:
+            lo = mid + 1
+        else:
+            hi = mid
+    return lo
+
+
+def parse_time(value):
+    """Unix microseconds of "HH:MM[:SS[.ffffff]]" (today), an ISO date and time, or a number of microseconds"""
+    if value.isdigit():
+        return int(value)
+    try:
+        moment = datetime.combine(date.today(), dtime.fromisoformat(value))
+    except ValueError:
+        try:
+            moment = datetime.fromisoformat(value)
+        except ValueError:
+            raise argparse.ArgumentTypeError(f"invalid time: {value}")
+    return int(moment.timestamp() * 1000000)
+
+
+def format_time(time_us):
+    return datetime.fromtimestamp(time_us / 1000000).strftime('%Y-%m-%d %H:%M:%S.%f')
+
+
+def cmd_info(store, args):
+    for i, segment in enumerate(store.segments):
+        try:
+            start_us, flags, end_offset, _ = segment.read_header()
+        except (OSError, ValueError) as e:
+            print(f"{segment.sequence:08d}  {e}")
+            continue
+        opened = segment.open_index()
+        if opened:
+            index, mapping = opened
+            status = f"{index.record_count} records, {format_time(index.first_time_us)} - {format_time(index.last_time_us)}"
+            mapping.close()
+        elif segment.final:
+            status = 'not indexed'
+        elif not segment.activated:
+            status = 'spare'
+        else:
+            status = 'recording' if segment.newest else 'not closed'
+        print(f"{segment.sequence:08d}  {'closed' if flags & CAPTURE_SEGMENT_CLOSED else 'open  '}  "
+              f"{end_offset:>10} bytes  {status}")
+    return 0
+
+
+def cmd_index(store, args):
+    written = store.write_indexes(args.rebuild)
+    print(f"[+] Indexed {len(written)} segment(s)")
+    return 0
+
+
+def cmd_query(store, args):
+    directions = tuple(d for d, wanted in ((SENDPACKET, args.send), (RECVPACKET, args.recv)) if wanted) or (SENDPACKET, RECVPACKET)
+    count = 0
+    for record in store.query(directions, args.opcode, args.start, args.end):
+        count += 1
+        if not args.count:
+            opcode = record.opcode
+            if opcode is None:
+                print(f"{format_time(record.time_us)}  {record.sequence:08d}:{record.offset:08X}  trace {record.direction}")
+            else:
+                packet = record.packet
+                print(f"{format_time(record.time_us)}  {record.sequence:08d}:{record.offset:08X}  "
+                      f"{'>>>' if record.direction == SENDPACKET else '<<<'} 0x{opcode:04X} id={record.id} "
+                      f"len={len(packet)}  {packet.hex() if args.hex else ''}".rstrip())
+        if args.limit and count >= args.limit:
+            break
+    if args.count:
+        print(count)
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description='RirePE Capture Store - query recorded captures')
+    commands = parser.add_subparsers(dest='command', required=True)
+
+    info = commands.add_parser('info', help='List segments and their indexes')
+    info.add_argument('directory', help='Capture directory (CAPTURE_DIR)')
+
+    index = commands.add_parser('index', help='Index closed segments the DLL didn\'t (e.g. after a crash)')
+    index.add_argument('directory', help='Capture directory (CAPTURE_DIR)')
+    index.add_argument('--rebuild', action='store_true', help='Rebuild existing indexes too')
+
+    query = commands.add_parser('query', help='Print the records matching opcodes and a time range')
+    query.add_argument('directory', help='Capture directory (CAPTURE_DIR)')
+    query.add_argument('--send', action='store_true', help='SEND packets (default: both directions)')
+    query.add_argument('--recv', action='store_true', help='RECV packets (default: both directions)')
+    query.add_argument('--opcode', type=lambda v: int(v, 0) & 0xFFFF, action='append',
+                       help='Only this opcode (repeatable, default: every record, traces included)')
+    query.add_argument('--from', dest='start', type=parse_time, help='Start time: HH:MM[:SS] today, ISO date and time, or Unix microseconds')
+    query.add_argument('--to', dest='end', type=parse_time, help='End time (inclusive)')
+    query.add_argument('--count', action='store_true', help='Only print the number of matches')
+    query.add_argument('--limit', type=int, default=0, help='Stop after this many matches')
+    query.add_argument('--hex', action='store_true', help='Print packet bytes')
+
+    args = parser.parse_args()
+    if not os.path.isdir(args.directory):
+        print(f"[-] {args.directory} is not a directory")
+        return 1
+
+    store = CaptureStore(args.directory)
+    try:
+        return {'info': cmd_info, 'index': cmd_index, 'query': cmd_query}[args.command](store, args)
+    except BrokenPipeError:
+        return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
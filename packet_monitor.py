@@ -8,6 +8,7 @@ import socket
 import struct
 import sys
 import argparse
+import time
 from enum import IntEnum
 from datetime import datetime
 
@@ -579,24 +580,37 @@ class MessageHeader(IntEnum):
     UNKNOWN = 31
 
 
-TCP_MESSAGE_MAGIC = 0xA11CE
+# Protocol constants and the capture stream decoder (batches, deltas, symbols, RESUME numbering)
+from tcp_inject_example import (StreamDecoder, TCP_MESSAGE_MAGIC, SUBSCRIBE, SUBSCRIBE_SEND, SUBSCRIBE_RECV,
+                                SUBSCRIBE_TRACES, SET_COMPRESSION, COMPRESSION_LZ4, SET_ENCODING, ENCODING_DELTA,
+                                ENCODING_DICTIONARY, GRANT_CREDIT, FLOW_CONTROL_BUFFER, FLOW_CONTROL_DOWNSAMPLE,
+                                FLOW_CONTROL_DROP_TRACES, FLOW_CONTROL_SPILL, RESUME, STREAM_GAP)
 
+# --credit-policy choices (GRANT_CREDIT)
+FLOW_CONTROL_POLICIES = {'buffer': FLOW_CONTROL_BUFFER, 'downsample': FLOW_CONTROL_DOWNSAMPLE,
+                         'drop-traces': FLOW_CONTROL_DROP_TRACES, 'spill': FLOW_CONTROL_SPILL}
 
-class PacketMonitor:
+
+class PacketMonitor(StreamDecoder):
     """TCP client for monitoring packets from RirePE DLL"""
 
     def __init__(self, host='127.0.0.1', port=9999):
+        super().__init__()
         self.host = host
         self.port = port
         self.sock = None
         self.packet_count = 0
         self.log_file = None
+        self.credit_window = 0  # Messages of credit kept granted (0 = no flow control)
+        self.credit_policy = 0
+        self.credit_used = 0
 
     def connect(self):
         """Connect to the DLL's TCP server"""
         try:
             self.sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
             self.sock.connect((self.host, self.port))
+            self.reset_stream()
             print(f"[+] Connected to {self.host}:{self.port}")
             return True
         except Exception as e:
@@ -611,7 +625,11 @@ class PacketMonitor:
             print("[+] Disconnected")
 
     def recv_message(self):
-        """Receive a message from the DLL (with magic + length header)"""
+        """Receive a message from the DLL (with magic + length header), batches/deltas/repeats are decoded"""
+        message = self._next_pending()
+        if message is not None:
+            return message
+
         try:
             # Read magic (4 bytes)
             magic_data = self._recv_exact(4)
@@ -635,7 +653,22 @@ class PacketMonitor:
 
             # Read data
             data = self._recv_exact(length)
-            return data
+            if not data:
+                return data
+            decoded = self._decode_stream(data)
+            self.pending.extend(decoded)
+
+            # Re-grant what was consumed once half of the window is used
+            if self.credit_window:
+                self.credit_used += len(decoded)
+                if self.credit_used * 2 >= self.credit_window:
+                    self.grant_credit(self.credit_used)
+                    self.credit_used = 0
+            message = self._next_pending()
+            if message is None:
+                # DEFINE_SYMBOL and STREAM_SEQUENCE only update state, the message using it follows
+                return self.recv_message()
+            return message
 
         except Exception as e:
             print(f"[-] Receive error: {e}")
@@ -749,6 +782,29 @@ class PacketMonitor:
             self.log_file.write(log_line)
             self.log_file.flush()
 
+    def subscribe(self, traces=False):
+        """Ask the DLL for SEND/RECV packets only (and format traces if requested), all opcodes"""
+        flags = SUBSCRIBE_SEND | SUBSCRIBE_RECV | (SUBSCRIBE_TRACES if traces else 0)
+        return self.send_message(struct.pack('<III', SUBSCRIBE, flags, 0) + bytes(0x10000 // 8))
+
+    def set_compression(self, codec=COMPRESSION_LZ4):
+        """Ask the DLL to send the capture stream as compressed batches (it replies with the codec it uses)"""
+        return self.send_message(struct.pack('<II', SET_COMPRESSION, codec))
+
+    def set_encoding(self, flags=ENCODING_DELTA):
+        """Ask the DLL to send packets as deltas (ENCODING_DELTA) and/or addresses and strings as symbols (ENCODING_DICTIONARY)"""
+        return self.send_message(struct.pack('<II', SET_ENCODING, flags))
+
+    def grant_credit(self, messages):
+        """Allow the DLL to send this many more messages (the policy applies when credit runs low or out)"""
+        return self.send_message(struct.pack('<IIII', GRANT_CREDIT, self.credit_policy, messages, 0))
+
+    def resume(self):
+        """Number the capture stream and get what was missed since the last message received (nothing on the first call)"""
+        self.resuming = True
+        sequence, self.sequence = self.sequence or 0, None
+        return self.send_message(struct.pack('<IQ', RESUME, sequence))
+
     def send_packet_to_dll(self, packet_data, is_recv=False):
         """Send a packet to the DLL for injection"""
         # Build PacketEditorMessage
@@ -774,7 +830,24 @@ class PacketMonitor:
 
         return False
 
-    def run(self, log_file=None):
+    def start_stream(self, traces, compress, delta, dictionary, credit, credit_policy, reconnect):
+        """Set up the capture stream of this connection"""
+        self.subscribe(traces)
+        if compress:
+            self.set_compression()
+        if delta or dictionary:
+            self.set_encoding((ENCODING_DELTA if delta else 0) | (ENCODING_DICTIONARY if dictionary else 0))
+        if credit or credit_policy == 'spill':
+            # Spilling needs no credit, 0 sets the policy without limiting the stream
+            self.credit_window = credit
+            self.credit_policy = FLOW_CONTROL_POLICIES[credit_policy]
+            self.credit_used = 0
+            self.grant_credit(credit)
+        if reconnect:
+            self.resume()
+
+    def run(self, log_file=None, traces=False, compress=False, delta=False, dictionary=False, credit=0, credit_policy='buffer',
+            reconnect=False):
         """Main monitoring loop"""
         # Create timestamped log file if not provided
         if not log_file:
@@ -785,12 +858,37 @@ class PacketMonitor:
         print(f"[+] Logging to {log_file}")
 
         try:
+            self.start_stream(traces, compress, delta, dictionary, credit, credit_policy, reconnect)
             print("[+] Monitoring packets (Ctrl+C to stop)...")
             while True:
                 data = self.recv_message()
                 if not data:
                     print("[-] Connection closed")
-                    break
+                    if not reconnect:
+                        break
+                    # The DLL replays what it still has from where the log stopped
+                    self.disconnect()
+                    while not self.connect():
+                        time.sleep(1)
+                    self.start_stream(traces, compress, delta, dictionary, credit, credit_policy, reconnect)
+                    continue
+
+                if len(data) >= 20 and struct.unpack('<I', data[:4])[0] == STREAM_GAP:
+                    first, count = struct.unpack('<QQ', data[4:20])
+                    print(f"[-] {count} messages were lost while disconnected (sequence {first} to {first + count - 1})")
+                    if self.log_file:
+                        self.log_file.write(f"\n[GAP] {count} messages lost (sequence {first} to {first + count - 1})\n")
+                    continue
+
+                if len(data) >= 8 and struct.unpack('<I', data[:4])[0] == SET_COMPRESSION:
+                    codec = struct.unpack('<I', data[4:8])[0]
+                    print(f"[+] Compression {'enabled' if codec == COMPRESSION_LZ4 else 'refused by the DLL'}")
+                    continue
+                if len(data) >= 8 and struct.unpack('<I', data[:4])[0] == SET_ENCODING:
+                    flags = struct.unpack('<I', data[4:8])[0]
+                    print(f"[+] Delta encoding {'enabled' if flags & ENCODING_DELTA else 'off'}, "
+                          f"dictionary encoding {'enabled' if flags & ENCODING_DICTIONARY else 'off'}")
+                    continue
 
                 msg = self.parse_packet_message(data)
                 if msg:
@@ -811,6 +909,15 @@ def main():
     parser.add_argument('--log', help='Log file path')
     parser.add_argument('--send', help='Send a hex packet (e.g., "0A 00 01 02 03")')
     parser.add_argument('--send-recv', action='store_true', help='Send as recv packet (default: send)')
+    parser.add_argument('--traces', action='store_true', help='Also receive encode/decode format traces')
+    parser.add_argument('--compress', action='store_true', help='Receive the capture stream LZ4-compressed')
+    parser.add_argument('--delta', action='store_true', help='Receive packets as deltas against the previous one of their opcode')
+    parser.add_argument('--dictionary', action='store_true', help='Receive return addresses and format strings as symbols')
+    parser.add_argument('--credit', type=int, default=0, help='Flow control: messages the DLL may send ahead of the log (default: off)')
+    parser.add_argument('--credit-policy', choices=sorted(FLOW_CONTROL_POLICIES), default='buffer',
+                        help='What the DLL does when the log falls behind, spill also works without --credit (default: buffer)')
+    parser.add_argument('--reconnect', action='store_true',
+                        help='Reconnect when the connection drops and resume the log where it stopped')
 
     args = parser.parse_args()
 
@@ -828,7 +935,8 @@ def main():
             monitor.send_packet_to_dll(packet_data, args.send_recv)
         else:
             # Monitor mode
-            monitor.run(args.log)
+            monitor.run(args.log, args.traces, args.compress, args.delta, args.dictionary, args.credit, args.credit_policy,
+                        args.reconnect)
     finally:
         monitor.disconnect()
 
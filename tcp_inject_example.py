@@ -14,23 +14,292 @@ import socket
 import struct
 import sys
 import time
+from collections import deque
 
 TCP_MESSAGE_MAGIC = 0xA11CE
 
 # Message types (from RirePE.h MessageHeader enum)
 SENDPACKET = 0
 RECVPACKET = 1
+REGISTER_QUEUE = 32
+UNREGISTER_QUEUE = 33
+INJECT_GROUP = 35
+REGISTER_TEMPLATE = 36
+UNREGISTER_TEMPLATE = 37
+INJECT_TEMPLATE = 38
+SET_QUEUE_SHAPING = 39
+SET_GLOBAL_RATE = 40
+SET_ACKS = 41
+INJECT_ACK = 42
+GET_INJECT_STATS = 43
+INJECT_STATS = 44
+REGISTER_RULE = 45
+UNREGISTER_RULE = 46
+REGISTER_FILTER = 47
+UNREGISTER_FILTER = 48
+GET_FILTER_STATS = 49
+FILTER_STATS = 50
+SUBSCRIBE = 51
+SET_COMPRESSION = 52
+COMPRESSED_BATCH = 53
+GET_SUBSCRIBER_STATS = 54
+SUBSCRIBER_STATS = 55
+SET_ENCODING = 56
+DELTA_PACKET = 57
+REPEAT_PACKET = 58
+DEFINE_SYMBOL = 59
+COMPACT_MESSAGE = 60
+GRANT_CREDIT = 61
+FLIGHT_DUMP = 62
+FLIGHT_RECORDING = 63
+RESUME = 64
+STREAM_SEQUENCE = 65
+STREAM_GAP = 66
+
+# Messages with their header at offset 0, a queue name must not read as one of them (REGISTER_QUEUE refuses it)
+COMMAND_CODES = {REGISTER_QUEUE, UNREGISTER_QUEUE, 34, INJECT_GROUP, REGISTER_TEMPLATE, UNREGISTER_TEMPLATE,
+                 INJECT_TEMPLATE, SET_QUEUE_SHAPING, SET_GLOBAL_RATE, SET_ACKS, GET_INJECT_STATS, REGISTER_RULE,
+                 UNREGISTER_RULE, REGISTER_FILTER, UNREGISTER_FILTER, GET_FILTER_STATS, SUBSCRIBE, SET_COMPRESSION,
+                 GET_SUBSCRIBER_STATS, SET_ENCODING, GRANT_CREDIT, FLIGHT_DUMP, RESUME}
+
+# InjectResult codes carried by INJECT_ACK
+INJECT_RESULTS = ['OK', 'QUEUE_NOT_REGISTERED', 'MALFORMED', 'GROUP_SIZE_MISMATCH', 'TEMPLATE_FAILED', 'DROPPED']
+INJECT_LATENCY_BUCKETS = 24
+
+MAX_QUEUE_NAME_LENGTH = 32
+MAX_TIMESTAMP_OFFSETS = 8
+MAX_PACKETS_PER_QUEUE = 8
+MAX_TEMPLATE_SLOTS = 16
+MAX_TEMPLATE_ARGS = 16
+MAX_RULE_PREDICATES = 8
+
+# Template slot types (TemplateSlotType)
+SLOT_TIMESTAMP = 0     # GetTickCount() at injection time
+SLOT_COUNTER = 1       # param1 + param2 * n
+SLOT_RANDOM = 2        # random in [param1, param2]
+SLOT_LAST_SEEN = 3     # field at offset param2 of the last received opcode param1
+SLOT_ARGUMENT = 4      # argument number param1 of INJECT_TEMPLATE
+
+# Subscription flags and opcode modes (SUBSCRIBE)
+SUBSCRIBE_SEND = 0x01
+SUBSCRIBE_RECV = 0x02
+SUBSCRIBE_TRACES = 0x04
+SUBSCRIBE_ALL_OPCODES = 0
+SUBSCRIBE_ALLOW_OPCODES = 1
+SUBSCRIBE_DENY_OPCODES = 2
+
+# Capture stream codecs (SET_COMPRESSION, COMPRESSED_BATCH)
+COMPRESSION_NONE = 0
+COMPRESSION_LZ4 = 1
+
+# Capture stream encodings (SET_ENCODING flags)
+ENCODING_DELTA = 0x01
+ENCODING_DICTIONARY = 0x02
+
+# Dictionary encoding (DEFINE_SYMBOL kinds, COMPACT_MESSAGE flags)
+SYMBOL_ADDRESS = 0
+SYMBOL_STRING = 1
+COMPACT_STRING_SYMBOL = 0x01
+
+# Flow control policies (GRANT_CREDIT)
+FLOW_CONTROL_OFF = 0
+FLOW_CONTROL_BUFFER = 1
+FLOW_CONTROL_DOWNSAMPLE = 2
+FLOW_CONTROL_DROP_TRACES = 3
+FLOW_CONTROL_SPILL = 4
+
+# Flight recorder dump targets (FLIGHT_DUMP)
+FLIGHT_DUMP_TO_FILE = 0x01
+FLIGHT_DUMP_TO_CLIENT = 0x02
+
+# Filter VM opcodes (FilterOpcode), instructions are (code, size, jt, jf, offset, k) tuples
+MAX_FILTER_INSNS = 64
+(FILTER_LD, FILTER_LDX, FILTER_LD_LEN, FILTER_LD_IMM, FILTER_TAX, FILTER_TXA,
+ FILTER_AND, FILTER_OR, FILTER_XOR, FILTER_ADD, FILTER_SUB, FILTER_LSH, FILTER_RSH,
+ FILTER_JA, FILTER_JEQ, FILTER_JGT, FILTER_JGE, FILTER_JSET,
+ FILTER_ST, FILTER_STX, FILTER_RET_PASS, FILTER_RET_DROP) = range(22)
+
+
+def lz4_block_decompress(src, raw_length):
+    """Decode an LZ4 block (COMPRESSED_BATCH with COMPRESSION_LZ4)"""
+    dst = bytearray()
+    pos = 0
+    while pos < len(src):
+        token = src[pos]
+        pos += 1
+
+        literal_length = token >> 4
+        if literal_length == 15:
+            while True:
+                extra = src[pos]
+                pos += 1
+                literal_length += extra
+                if extra != 255:
+                    break
+        dst += src[pos:pos + literal_length]
+        pos += literal_length
+        if pos >= len(src):
+            break
+
+        offset = src[pos] | (src[pos + 1] << 8)
+        pos += 2
+        match_length = token & 15
+        if match_length == 15:
+            while True:
+                extra = src[pos]
+                pos += 1
+                match_length += extra
+                if extra != 255:
+                    break
+        match_length += 4
+
+        start = len(dst) - offset
+        if offset == 0 or start < 0:
+            raise ValueError('Malformed LZ4 block')
+        if offset >= match_length:
+            dst += dst[start:start + match_length]
+        else:
+            # Overlapping match repeats the last offset bytes
+            for i in range(match_length):
+                dst.append(dst[start + i])
+
+    if len(dst) != raw_length:
+        raise ValueError('LZ4 block decoded to %d bytes, expected %d' % (len(dst), raw_length))
+    return bytes(dst)
+
+
+def unpack_compressed_batch(data):
+    """Decode a CompressedBatchMessage into the payloads of the frames it carries"""
+    _, codec, raw_length, frame_count = struct.unpack('<IIII', data[:16])
+    if codec == COMPRESSION_LZ4:
+        raw = lz4_block_decompress(data[16:], raw_length)
+    elif codec == COMPRESSION_NONE:
+        raw = data[16:16 + raw_length]
+    else:
+        raise ValueError('Unknown codec %d' % codec)
+
+    payloads = []
+    pos = 0
+    while pos + 8 <= len(raw):
+        _, length = struct.unpack('<II', raw[pos:pos + 8])
+        payloads.append(raw[pos + 8:pos + 8 + length])
+        pos += 8 + length
+    return payloads
+
+
+def delta_decode(base, delta, length):
+    """Rebuild a packet from the previous packet of its opcode and a DELTA_PACKET delta"""
+    packet = bytearray(base[:length].ljust(length, b'\x00'))
+    pos = 0
+    out = 0
+    while pos < len(delta):
+        control = delta[pos]
+        pos += 1
+        run = (control & 0x7F) + 1
+        if control & 0x80:
+            for i in range(run):
+                packet[out + i] ^= delta[pos + i]
+            pos += run
+        out += run
+    return bytes(packet)
+
+
+class StreamDecoder:
+    """Decoding state of a capture stream connection, shared by RirePETCPClient and packet_monitor.py
+
+    Frames go through _decode_stream() into pending, _next_pending() returns them one message at a time
+    """
+
+    def __init__(self):
+        self.pending = deque()       # Messages already decoded from a COMPRESSED_BATCH or REPEAT_PACKET
+        self.delta_bases = {}        # (direction, opcode) -> last packet, for DELTA_PACKET/REPEAT_PACKET
+        self.symbols = {}            # (kind, symbol) -> value, for COMPACT_MESSAGE
+        self.sequence = None         # Sequence of the next capture stream message, once RESUME numbered the stream
+        self.last_sequence = None    # Sequence of the last capture stream message returned by _next_pending()
+        self.resuming = False        # Capture messages sent before the RESUME are dropped (they are replayed)
+
+    def reset_stream(self):
+        """Encoding state belongs to the connection, cleared on connect (the sequence is kept for resuming)"""
+        self.pending.clear()
+        self.delta_bases.clear()
+        self.symbols.clear()
+
+    def _decode_stream(self, data):
+        """Expand COMPRESSED_BATCH, DELTA_PACKET, REPEAT_PACKET and COMPACT_MESSAGE into plain messages, in order"""
+        header = struct.unpack('<I', data[:4])[0] if len(data) >= 4 else None
+        if header == COMPRESSED_BATCH:
+            messages = []
+            for payload in unpack_compressed_batch(data):
+                messages.extend(self._decode_stream(payload))
+            return messages
+
+        if header == REPEAT_PACKET:
+            _, direction, first_id, addr, opcode, count = struct.unpack('<IIIQHI', data[:26])
+            packet = self.delta_bases[(direction, opcode)]
+            return [struct.pack('<IIQI', direction, first_id + 2 * i, addr, len(packet)) + packet for i in range(count)]
+
+        if header == DELTA_PACKET:
+            _, direction, packet_id, addr, opcode, length = struct.unpack('<IIIQHI', data[:26])
+            packet = delta_decode(self.delta_bases[(direction, opcode)], data[26:], length)
+            data = struct.pack('<IIQI', direction, packet_id, addr, length) + packet
+            header = direction
+
+        if header == DEFINE_SYMBOL:
+            _, kind, symbol, length = struct.unpack('<IIHI', data[:14])
+            self.symbols[(kind, symbol)] = data[14:14 + length]
+            return []
+
+        if header == COMPACT_MESSAGE:
+            _, header, flags, addr_symbol, packet_id = struct.unpack('<IBBHI', data[:12])
+            addr = struct.unpack('<Q', self.symbols[(SYMBOL_ADDRESS, addr_symbol)])[0]
+            body = data[12:]
+            if flags & COMPACT_STRING_SYMBOL:
+                body = body[:-2] + self.symbols[(SYMBOL_STRING, struct.unpack('<H', body[-2:])[0])]
+            data = struct.pack('<IIQ', header, packet_id, addr) + body
+
+        # Every SEND/RECV packet is the base of the next delta of its opcode
+        if header in (SENDPACKET, RECVPACKET) and len(data) >= 22:
+            length = struct.unpack('<I', data[16:20])[0]
+            packet = data[20:20 + length]
+            if len(packet) == length:
+                self.delta_bases[(header, struct.unpack('<H', packet[:2])[0])] = packet
+        return [data]
+
+    def _next_pending(self):
+        """Next decoded message, None if there is none. STREAM_SEQUENCE is applied to the numbering instead of being returned"""
+        while self.pending:
+            data = self.pending.popleft()
+            header = struct.unpack('<I', data[:4])[0]
+            if header == STREAM_SEQUENCE:
+                self.sequence = struct.unpack('<Q', data[4:12])[0]
+                self.resuming = False
+                continue
+            # Capture stream messages (packets and traces) count up, replies and notices don't
+            if header < REGISTER_QUEUE:
+                if self.resuming:
+                    continue
+                if self.sequence is not None:
+                    self.last_sequence = self.sequence
+                    self.sequence += 1
+            return data
+        return None
+
 
-class RirePETCPClient:
+class RirePETCPClient(StreamDecoder):
     def __init__(self, host='127.0.0.1', port=9999):
+        super().__init__()
         self.host = host
         self.port = port
         self.sock = None
+        self.credit_policy = FLOW_CONTROL_OFF
+        self.credit_window = (0, 0)  # (messages, bytes) granted up front by enable_flow_control()
+        self.credit_used = [0, 0]    # Consumed since the last grant
 
     def connect(self):
-        """Connect to DLL TCP server"""
+        """Connect to DLL TCP server (the sequence is kept, resume() after a reconnect continues from it)"""
         self.sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
         self.sock.connect((self.host, self.port))
+        self.reset_stream()
 
     def recv_message(self, timeout=None):
         """Receive framed TCP message from DLL
@@ -40,7 +309,12 @@ class RirePETCPClient:
 
         Returns:
             Received data bytes or None if timeout/connection closed
+            (COMPRESSED_BATCH, DELTA_PACKET, REPEAT_PACKET and COMPACT_MESSAGE are decoded into plain messages)
         """
+        message = self._next_pending()
+        if message is not None:
+            return message
+
         # Set socket timeout if specified
         old_timeout = self.sock.gettimeout()
         if timeout is not None:
@@ -60,7 +334,16 @@ class RirePETCPClient:
 
             # Read payload
             data = self._recv_exact(length)
-            return data
+            if not data:
+                return data
+            decoded = self._decode_stream(data)
+            self._replenish_credit(len(decoded), 8 + length)
+            self.pending.extend(decoded)
+            message = self._next_pending()
+            if message is None:
+                # DEFINE_SYMBOL and STREAM_SEQUENCE only update state, the message using it follows
+                return self.recv_message(timeout)
+            return message
         except socket.timeout:
             return None
         finally:
@@ -100,6 +383,431 @@ class RirePETCPClient:
 
         self.sock.sendall(frame)
 
+    def register_queue(self, queue_name, packet_count=1, interval_ms=0, timestamp_offsets=(), packet_intervals_ms=()):
+        """
+        Register (or re-register) an injection queue
+
+        Args:
+            queue_name: Queue name (up to 32 characters)
+            packet_count: Packets in every group of this queue (1-8)
+            interval_ms: Delay between groups
+            timestamp_offsets: Per packet of the group, offsets where the DLL writes GetTickCount()
+                               at injection time (PacketTimestampConfig, empty = no rewrite)
+            packet_intervals_ms: Per packet of the group, delay before injecting it
+        """
+        # struct QueueConfigMessage {
+        #     char queue_name[32];
+        #     DWORD injection_interval_ms;
+        #     BYTE packet_count; BYTE padding[3];
+        #     PacketTimestampConfig timestamp_configs[8];   // BYTE needs_update, BYTE count, DWORD offsets[8], BYTE padding[2]
+        #     DWORD packet_intervals_ms[8];
+        # }
+        name = queue_name.encode('ascii')[:MAX_QUEUE_NAME_LENGTH].ljust(MAX_QUEUE_NAME_LENGTH, b'\x00')
+        if struct.unpack('<I', name[:4])[0] in COMMAND_CODES:
+            raise ValueError(f"Queue name {queue_name!r} reads as a command code, the DLL won't register it")
+        parts = [struct.pack('<I', REGISTER_QUEUE), name, struct.pack('<IB3x', interval_ms, packet_count)]
+        for i in range(MAX_PACKETS_PER_QUEUE):
+            offsets = list(timestamp_offsets[i])[:MAX_TIMESTAMP_OFFSETS] if i < len(timestamp_offsets) else []
+            parts.append(struct.pack('<BB', 1 if offsets else 0, len(offsets)))
+            parts.append(struct.pack('<%dI2x' % MAX_TIMESTAMP_OFFSETS, *(offsets + [0] * (MAX_TIMESTAMP_OFFSETS - len(offsets)))))
+        intervals = list(packet_intervals_ms)[:MAX_PACKETS_PER_QUEUE]
+        parts.append(struct.pack('<%dI' % MAX_PACKETS_PER_QUEUE, *(intervals + [0] * (MAX_PACKETS_PER_QUEUE - len(intervals)))))
+        message = b''.join(parts)
+        frame = struct.pack('<II', TCP_MESSAGE_MAGIC, len(message)) + message
+        self.sock.sendall(frame)
+
+    def unregister_queue(self, queue_name):
+        """Remove a queue registration"""
+        name = queue_name.encode('ascii')[:MAX_QUEUE_NAME_LENGTH].ljust(MAX_QUEUE_NAME_LENGTH, b'\x00')
+        message = struct.pack('<I', UNREGISTER_QUEUE) + name
+        frame = struct.pack('<II', TCP_MESSAGE_MAGIC, len(message)) + message
+        self.sock.sendall(frame)
+
+    def send_inject_group(self, queue_name, groups):
+        """
+        Send many packet groups to a registered queue in a single frame
+
+        Args:
+            queue_name: Name of a queue registered with REGISTER_QUEUE
+            groups: List of groups, each a list of (header_type, packet_bytes[, id]) tuples.
+                    Every group must contain the queue's packet_count packets.
+        """
+        # struct InjectGroupMessage {
+        #     DWORD header;           // 4 bytes - INJECT_GROUP
+        #     char queue_name[32];    // 32 bytes - null-padded
+        #     DWORD group_count;      // 4 bytes
+        #     BYTE groups[];          // per group: BYTE packet_count + InjectGroupPacket * packet_count
+        # }
+        # struct InjectGroupPacket {
+        #     DWORD header;           // 4 bytes - SENDPACKET or RECVPACKET
+        #     DWORD id;               // 4 bytes - caller-chosen id
+        #     DWORD length;           // 4 bytes - packet size
+        #     BYTE packet[];          // N bytes - packet data
+        # }
+        name = queue_name.encode('ascii')[:MAX_QUEUE_NAME_LENGTH].ljust(MAX_QUEUE_NAME_LENGTH, b'\x00')
+        parts = [struct.pack('<I', INJECT_GROUP), name, struct.pack('<I', len(groups))]
+        for group in groups:
+            parts.append(struct.pack('<B', len(group)))
+            for packet in group:
+                header_type, packet_bytes = packet[0], packet[1]
+                packet_id = packet[2] if len(packet) > 2 else 0
+                parts.append(struct.pack('<III', header_type, packet_id, len(packet_bytes)))
+                parts.append(packet_bytes)
+        message = b''.join(parts)
+
+        # Wrap in TCPMessage frame
+        frame = struct.pack('<II', TCP_MESSAGE_MAGIC, len(message)) + message
+
+        self.sock.sendall(frame)
+
+    def register_template(self, template_id, header_type, packet_bytes, slots=()):
+        """
+        Register (or replace) a packet template
+
+        Args:
+            template_id: Non-zero id chosen by the client
+            header_type: SENDPACKET (0) or RECVPACKET (1)
+            packet_bytes: Template packet; slot bytes are placeholders
+            slots: List of (slot_type, size, offset, param1, param2) tuples
+        """
+        # struct TemplateSlot { BYTE type; BYTE size; BYTE padding[2]; DWORD offset; ULONGLONG param1; ULONGLONG param2; }
+        slot_data = b''.join(struct.pack('<BBxxIQQ', *slot) for slot in slots)
+        slot_data = slot_data.ljust(MAX_TEMPLATE_SLOTS * 24, b'\x00')
+
+        message = struct.pack('<IIIB3x', REGISTER_TEMPLATE, template_id, header_type, len(slots)) + slot_data
+        message += struct.pack('<I', len(packet_bytes)) + packet_bytes
+
+        frame = struct.pack('<II', TCP_MESSAGE_MAGIC, len(message)) + message
+        self.sock.sendall(frame)
+
+    def unregister_template(self, template_id):
+        """Remove a packet template"""
+        message = struct.pack('<II', UNREGISTER_TEMPLATE, template_id)
+        frame = struct.pack('<II', TCP_MESSAGE_MAGIC, len(message)) + message
+        self.sock.sendall(frame)
+
+    def send_inject_template(self, queue_name, packets):
+        """
+        Inject one group built from templates
+
+        Args:
+            queue_name: Name of a queue registered with REGISTER_QUEUE
+            packets: List of (template_id, args[, id]) tuples, one per packet of the group
+        """
+        name = queue_name.encode('ascii')[:MAX_QUEUE_NAME_LENGTH].ljust(MAX_QUEUE_NAME_LENGTH, b'\x00')
+        parts = [struct.pack('<I', INJECT_TEMPLATE), name, struct.pack('<I', len(packets))]
+        for packet in packets:
+            template_id, args = packet[0], packet[1]
+            packet_id = packet[2] if len(packet) > 2 else 0
+            parts.append(struct.pack('<III', template_id, packet_id, len(args)))
+            parts.append(struct.pack('<%dQ' % len(args), *args))
+        message = b''.join(parts)
+
+        frame = struct.pack('<II', TCP_MESSAGE_MAGIC, len(message)) + message
+        self.sock.sendall(frame)
+
+    def register_rule(self, rule_id, direction, opcode, template_id, queue_name,
+                      predicates=(), extracts=(), cooldown_ms=0):
+        """
+        Register (or replace) a reactive rule evaluated inside the DLL hooks
+
+        Args:
+            rule_id: Non-zero id chosen by the client
+            direction: SENDPACKET (0) or RECVPACKET (1) packets to match
+            opcode: Opcode to match
+            template_id: Template instantiated when the rule fires
+            queue_name: Queue the instantiated packet goes to (packet_count must be 1)
+            predicates: List of (offset, length, mask, value) tuples, all must match
+            extracts: List of (offset, size) tuples, become the template arguments in order
+            cooldown_ms: Minimum time between two firings
+        """
+        # struct RulePredicate { DWORD offset; BYTE length; BYTE padding[3]; ULONGLONG mask; ULONGLONG value; }
+        predicate_data = b''.join(struct.pack('<IB3xQQ', *predicate) for predicate in predicates)
+        predicate_data = predicate_data.ljust(MAX_RULE_PREDICATES * 24, b'\x00')
+        # struct RuleExtract { DWORD offset; BYTE size; BYTE padding[3]; }
+        extract_data = b''.join(struct.pack('<IB3x', *extract) for extract in extracts)
+        extract_data = extract_data.ljust(MAX_TEMPLATE_ARGS * 8, b'\x00')
+
+        name = queue_name.encode('ascii')[:MAX_QUEUE_NAME_LENGTH].ljust(MAX_QUEUE_NAME_LENGTH, b'\x00')
+        message = struct.pack('<IIIHBB', REGISTER_RULE, rule_id, direction, opcode, len(predicates), len(extracts))
+        message += predicate_data + extract_data
+        message += struct.pack('<I', template_id) + name + struct.pack('<I', cooldown_ms)
+
+        frame = struct.pack('<II', TCP_MESSAGE_MAGIC, len(message)) + message
+        self.sock.sendall(frame)
+
+    def unregister_rule(self, rule_id):
+        """Remove a reactive rule"""
+        message = struct.pack('<II', UNREGISTER_RULE, rule_id)
+        frame = struct.pack('<II', TCP_MESSAGE_MAGIC, len(message)) + message
+        self.sock.sendall(frame)
+
+    def set_queue_shaping(self, queue_name, rate_pps, burst=1, priority=1):
+        """
+        Set token bucket and priority class of a registered queue
+
+        Args:
+            queue_name: Registered queue
+            rate_pps: Packets per second (0 = unlimited)
+            burst: Packets that may be injected back to back
+            priority: 0 (highest) to 3 (lowest)
+        """
+        name = queue_name.encode('ascii')[:MAX_QUEUE_NAME_LENGTH].ljust(MAX_QUEUE_NAME_LENGTH, b'\x00')
+        message = struct.pack('<I', SET_QUEUE_SHAPING) + name + struct.pack('<IIB3x', rate_pps, burst, priority)
+        frame = struct.pack('<II', TCP_MESSAGE_MAGIC, len(message)) + message
+        self.sock.sendall(frame)
+
+    def set_global_rate(self, rate_pps, burst=1):
+        """Cap injected packets per second over all queues and clients (0 = unlimited)"""
+        message = struct.pack('<III', SET_GLOBAL_RATE, rate_pps, burst)
+        frame = struct.pack('<II', TCP_MESSAGE_MAGIC, len(message)) + message
+        self.sock.sendall(frame)
+
+    def set_acks(self, enabled=True):
+        """Ask the DLL to send an INJECT_ACK for every injection from this connection"""
+        message = struct.pack('<II', SET_ACKS, 1 if enabled else 0)
+        frame = struct.pack('<II', TCP_MESSAGE_MAGIC, len(message)) + message
+        self.sock.sendall(frame)
+
+    def request_inject_stats(self):
+        """Request latency histograms, the DLL replies with an INJECT_STATS message"""
+        message = struct.pack('<I', GET_INJECT_STATS)
+        frame = struct.pack('<II', TCP_MESSAGE_MAGIC, len(message)) + message
+        self.sock.sendall(frame)
+
+    def parse_inject_ack(self, data):
+        """Parse InjectAckMessage (timestamps in microseconds, 0 = stage not reached)"""
+        _, packet_id, result = struct.unpack('<III', data[0:12])
+        queue_name = data[12:44].rstrip(b'\x00').decode('ascii', 'replace')
+        received_us, scheduled_us, executed_us = struct.unpack('<QQQ', data[44:68])
+        return {
+            'id': packet_id,
+            'result': INJECT_RESULTS[result] if result < len(INJECT_RESULTS) else result,
+            'queue': queue_name,
+            'queue_wait_us': scheduled_us - received_us if scheduled_us else None,
+            'exec_us': executed_us - scheduled_us if executed_us else None,
+        }
+
+    def parse_inject_stats(self, data):
+        """Parse InjectStatsMessage, bucket i counts latencies in [2^i, 2^(i+1)) microseconds"""
+        count = len(INJECT_RESULTS)
+        values = struct.unpack('<%dI' % (count + 2 * INJECT_LATENCY_BUCKETS), data[4:4 + 4 * (count + 2 * INJECT_LATENCY_BUCKETS)])
+        return {
+            'results': dict(zip(INJECT_RESULTS, values[:count])),
+            'queue_wait_us': list(values[count:count + INJECT_LATENCY_BUCKETS]),
+            'exec_us': list(values[count + INJECT_LATENCY_BUCKETS:]),
+        }
+
+    def subscribe(self, flags=SUBSCRIBE_SEND | SUBSCRIBE_RECV, allow=None, deny=None):
+        """
+        Choose which captured messages this connection receives (default before subscribing: everything)
+
+        Args:
+            flags: SUBSCRIBE_SEND / SUBSCRIBE_RECV / SUBSCRIBE_TRACES
+            allow: Only receive SEND/RECV packets with these opcodes
+            deny: Receive every SEND/RECV packet except these opcodes
+        """
+        mode, opcodes = SUBSCRIBE_ALL_OPCODES, ()
+        if allow is not None:
+            mode, opcodes = SUBSCRIBE_ALLOW_OPCODES, allow
+        elif deny is not None:
+            mode, opcodes = SUBSCRIBE_DENY_OPCODES, deny
+        bitmap = bytearray(0x10000 // 8)
+        for opcode in opcodes:
+            bitmap[opcode >> 3] |= 1 << (opcode & 7)
+
+        message = struct.pack('<III', SUBSCRIBE, flags, mode) + bytes(bitmap)
+        frame = struct.pack('<II', TCP_MESSAGE_MAGIC, len(message)) + message
+        self.sock.sendall(frame)
+
+    def set_compression(self, codec=COMPRESSION_LZ4):
+        """
+        Ask the DLL to compress this connection's capture stream
+
+        The DLL replies with a SET_COMPRESSION message carrying the codec it uses
+        (COMPRESSION_NONE if it doesn't know the requested one), see parse_compression_reply().
+        recv_message() decodes COMPRESSED_BATCH messages transparently.
+        """
+        message = struct.pack('<II', SET_COMPRESSION, codec)
+        frame = struct.pack('<II', TCP_MESSAGE_MAGIC, len(message)) + message
+        self.sock.sendall(frame)
+
+    def parse_compression_reply(self, data):
+        """Codec accepted by the DLL (CompressionMessage)"""
+        return struct.unpack('<I', data[4:8])[0]
+
+    def set_encoding(self, flags=ENCODING_DELTA):
+        """
+        Ask the DLL to encode the capture stream
+
+        ENCODING_DELTA sends SEND/RECV packets as deltas against the previous packet of their opcode,
+        ENCODING_DICTIONARY replaces return addresses and format strings with per-connection symbols.
+        The DLL replies with a SET_ENCODING message carrying the flags it uses.
+        recv_message() rebuilds the original messages (without the trailing padding of PacketEditorMessage).
+        """
+        message = struct.pack('<II', SET_ENCODING, flags)
+        frame = struct.pack('<II', TCP_MESSAGE_MAGIC, len(message)) + message
+        self.sock.sendall(frame)
+
+    def grant_credit(self, messages=0, bytes_=0, policy=FLOW_CONTROL_BUFFER):
+        """
+        Allow the DLL to send this many more messages and/or bytes of the capture stream (GRANT_CREDIT, not replied)
+
+        Credit adds up, a unit never granted isn't limited. When credit runs low or out the policy applies:
+        FLOW_CONTROL_BUFFER holds frames back, FLOW_CONTROL_DOWNSAMPLE keeps 1 packet in 4 and no traces,
+        FLOW_CONTROL_DROP_TRACES drops traces first. FLOW_CONTROL_SPILL loses nothing: what doesn't fit goes to an
+        overflow file on the DLL side and is sent from there in order (also without credit, when the connection is slow).
+        FLOW_CONTROL_OFF turns flow control off.
+        """
+        message = struct.pack('<IIII', GRANT_CREDIT, policy, messages, bytes_)
+        frame = struct.pack('<II', TCP_MESSAGE_MAGIC, len(message)) + message
+        self.sock.sendall(frame)
+
+    def enable_flow_control(self, messages=0, bytes_=0, policy=FLOW_CONTROL_BUFFER):
+        """Grant a window of credit and let recv_message() re-grant what was consumed once half of it is used"""
+        self.credit_policy = policy
+        self.credit_window = (messages, bytes_)
+        self.credit_used = [0, 0]
+        self.grant_credit(messages, bytes_, policy)
+
+    def _replenish_credit(self, messages, bytes_):
+        """Count a received frame against the window (replies included, so the DLL never gets less credit than used)"""
+        if self.credit_policy == FLOW_CONTROL_OFF:
+            return
+        self.credit_used[0] += messages
+        self.credit_used[1] += bytes_
+        window_messages, window_bytes = self.credit_window
+        if (window_messages and self.credit_used[0] * 2 >= window_messages) or \
+                (window_bytes and self.credit_used[1] * 2 >= window_bytes):
+            self.grant_credit(self.credit_used[0] if window_messages else 0,
+                              self.credit_used[1] if window_bytes else 0, self.credit_policy)
+            self.credit_used = [0, 0]
+
+    def request_subscriber_stats(self):
+        """Request per-connection stream counters, the DLL replies with a SUBSCRIBER_STATS message"""
+        message = struct.pack('<I', GET_SUBSCRIBER_STATS)
+        frame = struct.pack('<II', TCP_MESSAGE_MAGIC, len(message)) + message
+        self.sock.sendall(frame)
+
+    def parse_subscriber_stats(self, data):
+        """Parse SubscriberStatsMessage into a list of per-connection dicts (with compression ratio)"""
+        count = struct.unpack('<I', data[4:8])[0]
+        subscribers = []
+        for i in range(count):
+            values = struct.unpack('<IIQQQQQQQQIQQIqqQIQQ', data[8 + i * 140:8 + (i + 1) * 140])
+            entry = dict(zip(('client_id', 'codec', 'published', 'dropped', 'batches', 'raw_bytes',
+                              'compressed_bytes', 'compress_ns', 'delta_messages', 'repeated_messages',
+                              'encoding', 'compact_messages', 'symbols_defined', 'flow_policy',
+                              'credit_messages', 'credit_bytes', 'credit_dropped', 'backlog_frames', 'spilled',
+                              'spill_bytes'), values))
+            entry['ratio'] = entry['compressed_bytes'] / entry['raw_bytes'] if entry['raw_bytes'] else None
+            subscribers.append(entry)
+        return subscribers
+
+    def flight_dump(self, target=FLIGHT_DUMP_TO_FILE, seconds=0):
+        """
+        Dump the last seconds of the flight recorder (0 = RECORDER_SECONDS)
+
+        FLIGHT_DUMP_TO_FILE writes flight-<time>-command.rpc in RECORDER_DIR,
+        FLIGHT_DUMP_TO_CLIENT sends it back in FLIGHT_RECORDING parts (see receive_flight_recording)
+        """
+        message = struct.pack('<III', FLIGHT_DUMP, target, seconds)
+        frame = struct.pack('<II', TCP_MESSAGE_MAGIC, len(message)) + message
+        self.sock.sendall(frame)
+
+    def receive_flight_recording(self, timeout=30.0):
+        """
+        Collect the FLIGHT_RECORDING parts of one dump, other messages are skipped
+
+        Returns:
+            The capture segment file image (save it as .rpc for capture_store.py),
+            b'' if the recorder is off, None on timeout
+        """
+        image = None
+        dump_id = None
+        deadline = time.time() + timeout
+        while time.time() < deadline:
+            data = self.recv_message(timeout=max(deadline - time.time(), 0.01))
+            if not data or len(data) < 16 or struct.unpack('<I', data[:4])[0] != FLIGHT_RECORDING:
+                continue
+            part_id, offset, total_size = struct.unpack('<III', data[4:16])
+            if dump_id is None:
+                dump_id = part_id
+                image = bytearray(total_size)
+            elif part_id != dump_id:
+                continue
+            chunk = data[16:]
+            image[offset:offset + len(chunk)] = chunk
+            if offset + len(chunk) >= total_size:
+                return bytes(image)
+        return None
+
+    def resume(self, sequence=None):
+        """
+        Number the capture stream and replay what the DLL retained from sequence on, then continue live
+
+        Args:
+            sequence: First sequence not received yet, defaults to the one after the last received message
+                      (None or 0 before anything was received: numbering only, no replay)
+
+        Messages lost for good arrive as a STREAM_GAP (see parse_stream_gap), then last_sequence tells
+        the sequence of every capture message recv_message() returns
+        """
+        if sequence is None:
+            sequence = self.sequence or 0
+        self.sequence = None
+        self.resuming = True
+        message = struct.pack('<IQ', RESUME, sequence)
+        frame = struct.pack('<II', TCP_MESSAGE_MAGIC, len(message)) + message
+        self.sock.sendall(frame)
+
+    def parse_stream_gap(self, data):
+        """Parse StreamGapMessage into (first, count), the sequences that were no longer retained"""
+        return struct.unpack('<QQ', data[4:20])
+
+    def register_filter(self, program_id, direction, insns):
+        """
+        Upload (or replace) a filter/rewrite program run by the hooks before the original function
+
+        Args:
+            program_id: Non-zero id chosen by the client, programs run in id order
+            direction: SENDPACKET (0) or RECVPACKET (1)
+            insns: List of (code, size, jt, jf, offset, k) tuples ending with FILTER_RET_PASS/FILTER_RET_DROP
+
+        Example (drop SEND opcode 0x0123):
+            [(FILTER_LD, 2, 0, 0, 0, 0),
+             (FILTER_JEQ, 0, 0, 1, 0, 0x0123),
+             (FILTER_RET_DROP, 0, 0, 0, 0, 0),
+             (FILTER_RET_PASS, 0, 0, 0, 0, 0)]
+        """
+        # struct FilterInsn { BYTE code; BYTE size; BYTE jt; BYTE jf; DWORD offset; ULONGLONG k; }
+        message = struct.pack('<IIII', REGISTER_FILTER, program_id, direction, len(insns))
+        message += b''.join(struct.pack('<BBBBIQ', *insn) for insn in insns)
+        frame = struct.pack('<II', TCP_MESSAGE_MAGIC, len(message)) + message
+        self.sock.sendall(frame)
+
+    def unregister_filter(self, program_id):
+        """Remove a filter program"""
+        message = struct.pack('<II', UNREGISTER_FILTER, program_id)
+        frame = struct.pack('<II', TCP_MESSAGE_MAGIC, len(message)) + message
+        self.sock.sendall(frame)
+
+    def request_filter_stats(self):
+        """Request per-program counters, the DLL replies with a FILTER_STATS message"""
+        message = struct.pack('<I', GET_FILTER_STATS)
+        frame = struct.pack('<II', TCP_MESSAGE_MAGIC, len(message)) + message
+        self.sock.sendall(frame)
+
+    def parse_filter_stats(self, data):
+        """Parse FilterStatsMessage into a list of per-program dicts"""
+        count = struct.unpack('<I', data[4:8])[0]
+        programs = []
+        for i in range(count):
+            values = struct.unpack('<IIQQQQQQ', data[8 + i * 56:8 + (i + 1) * 56])
+            programs.append(dict(zip(('program_id', 'direction', 'runs', 'drops', 'rewrites',
+                                      'insns_executed', 'total_ns', 'max_ns'), values)))
+        return programs
+
     def parse_packet_message(self, data):
         """Parse PacketEditorMessage from received data"""
         if len(data) < 16: